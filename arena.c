@@ -0,0 +1,246 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * A bump allocator for memory that lives only as long as one request.
+ *
+ * Allocations are carved from the most recent of a list of chunks, and are
+ * not freed individually; instead, everything allocated since a mark is
+ * released at once.  When an arena is emptied and found to have needed more
+ * than one chunk, the chunks are replaced on next use by a single chunk large
+ * enough for all of them, so that an arena serving a series of similar
+ * requests settles into making no heap calls at all.  An arena that has grown
+ * very large (by serving an unusually large value) gives its memory back
+ * when emptied, rather than holding it for the life of the process.
+ */
+
+#include <sys/types.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "arena.h"
+#include "common.h"
+
+#define	ARENA_ALIGN		16
+#define	ARENA_CHUNK_MIN		4096
+#define	ARENA_RETAIN_MAX	(1024 * 1024)
+
+#define	ARENA_ROUNDUP(x)	\
+	(((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct arena_chunk arena_chunk_t;
+
+struct arena_chunk {
+	arena_chunk_t *ac_next;
+	size_t ac_size;
+	size_t ac_used;
+
+	/*
+	 * The arena's usage when this chunk was started, so that a mark can
+	 * be traced back to the chunk it falls in:
+	 */
+	size_t ac_base;
+};
+
+#define	ARENA_CHUNK_HDR	ARENA_ROUNDUP(sizeof (arena_chunk_t))
+#define	ARENA_CHUNK_DATA(ac)	((char *)(ac) + ARENA_CHUNK_HDR)
+
+struct arena {
+	arena_chunk_t *a_chunk;
+	size_t a_used;
+	size_t a_peak;
+	size_t a_hint;
+	arena_stats_t a_stats;
+};
+
+arena_t *
+arena_new(void)
+{
+	arena_t *a;
+
+	if ((a = calloc(1, sizeof (*a))) == NULL)
+		err(1, "could not allocate memory for arena");
+	a->a_hint = ARENA_CHUNK_MIN;
+
+	return (a);
+}
+
+static void
+arena_free_chunks(arena_t *a)
+{
+	arena_chunk_t *ac;
+
+	while ((ac = a->a_chunk) != NULL) {
+		a->a_chunk = ac->ac_next;
+		a->a_stats.as_reserved -= ac->ac_size;
+		free(ac);
+	}
+}
+
+void
+arena_free(arena_t *a)
+{
+	if (a == NULL)
+		return;
+
+	arena_free_chunks(a);
+	free(a);
+}
+
+void *
+arena_alloc(arena_t *a, size_t size)
+{
+	arena_chunk_t *ac = a->a_chunk;
+	void *p;
+
+	size = ARENA_ROUNDUP(size);
+
+	if (ac == NULL || ac->ac_size - ac->ac_used < size) {
+		size_t csize = a->a_hint;
+
+		if (ac != NULL && csize < ac->ac_size * 2)
+			csize = ac->ac_size * 2;
+		if (csize < size)
+			csize = size;
+
+		if ((ac = malloc(ARENA_CHUNK_HDR + csize)) == NULL)
+			err(1, "could not allocate memory for arena");
+		ac->ac_next = a->a_chunk;
+		ac->ac_size = csize;
+		ac->ac_used = 0;
+		ac->ac_base = a->a_used;
+		a->a_chunk = ac;
+
+		a->a_stats.as_heap_allocs++;
+		a->a_stats.as_reserved += csize;
+	}
+
+	p = ARENA_CHUNK_DATA(ac) + ac->ac_used;
+	ac->ac_used += size;
+	a->a_used += size;
+	if (a->a_used > a->a_peak)
+		a->a_peak = a->a_used;
+
+	return (p);
+}
+
+void *
+arena_zalloc(arena_t *a, size_t size)
+{
+	void *p = arena_alloc(a, size);
+
+	bzero(p, size);
+	return (p);
+}
+
+/*
+ * Resize an allocation.  The most recent allocation is extended in place if
+ * there is room for it; any other is copied, and its old space remains in
+ * use until released.
+ */
+void *
+arena_realloc(arena_t *a, void *p, size_t oldsize, size_t newsize)
+{
+	arena_chunk_t *ac = a->a_chunk;
+	void *np;
+
+	if (p == NULL)
+		return (arena_alloc(a, newsize));
+	if (newsize <= oldsize)
+		return (p);
+
+	oldsize = ARENA_ROUNDUP(oldsize);
+	newsize = ARENA_ROUNDUP(newsize);
+
+	if (ac != NULL && (char *)p + oldsize == ARENA_CHUNK_DATA(ac) +
+	    ac->ac_used && ac->ac_size - ac->ac_used >= newsize - oldsize) {
+		ac->ac_used += newsize - oldsize;
+		a->a_used += newsize - oldsize;
+		if (a->a_used > a->a_peak)
+			a->a_peak = a->a_used;
+		return (p);
+	}
+
+	np = arena_alloc(a, newsize);
+	bcopy(p, np, oldsize);
+	return (np);
+}
+
+/*
+ * Returns a mark to which the arena may later be released, freeing
+ * everything allocated after it.  Marks must be released in the reverse of
+ * the order in which they were taken.
+ */
+size_t
+arena_mark(arena_t *a)
+{
+	return (a->a_used);
+}
+
+void
+arena_release(arena_t *a, size_t mark)
+{
+	arena_chunk_t *ac;
+
+	VERIFY(mark <= a->a_used);
+
+	if (mark == 0) {
+		a->a_stats.as_requests++;
+		a->a_stats.as_peak_total += a->a_peak;
+		if (a->a_peak > a->a_stats.as_peak_max)
+			a->a_stats.as_peak_max = a->a_peak;
+		a->a_peak = 0;
+		a->a_used = 0;
+
+		if (a->a_chunk == NULL)
+			return;
+
+		if (a->a_chunk->ac_next != NULL ||
+		    a->a_stats.as_reserved > ARENA_RETAIN_MAX) {
+			/*
+			 * Start afresh next time, with one chunk large
+			 * enough for all of the memory this request needed
+			 * (unless that is a great deal):
+			 */
+			a->a_hint = a->a_stats.as_reserved > ARENA_RETAIN_MAX ?
+			    ARENA_CHUNK_MIN : (size_t)a->a_stats.as_reserved;
+			arena_free_chunks(a);
+			return;
+		}
+
+		a->a_chunk->ac_used = 0;
+		return;
+	}
+
+	while ((ac = a->a_chunk)->ac_base >= mark && ac->ac_next != NULL) {
+		a->a_chunk = ac->ac_next;
+		a->a_stats.as_reserved -= ac->ac_size;
+		free(ac);
+	}
+
+	a->a_chunk->ac_used = mark - a->a_chunk->ac_base;
+	a->a_used = mark;
+}
+
+void
+arena_stats(arena_t *a, arena_stats_t *stats)
+{
+	*stats = a->a_stats;
+}
+
+void
+arena_stats_add(arena_stats_t *total, const arena_stats_t *stats)
+{
+	total->as_requests += stats->as_requests;
+	total->as_peak_total += stats->as_peak_total;
+	if (stats->as_peak_max > total->as_peak_max)
+		total->as_peak_max = stats->as_peak_max;
+	total->as_heap_allocs += stats->as_heap_allocs;
+	total->as_reserved += stats->as_reserved;
+}
@@ -0,0 +1,55 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+#ifndef _ARENA_H
+#define	_ARENA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+#include <stdint.h>
+
+typedef struct arena arena_t;
+
+typedef struct arena_stats {
+	/*
+	 * The number of times the arena has been emptied, which for an arena
+	 * that serves one request at a time is the number of requests:
+	 */
+	uint64_t as_requests;
+
+	/*
+	 * The most bytes in use at once by any one request, and the sum of
+	 * each request's peak, from which the mean may be found:
+	 */
+	uint64_t as_peak_max;
+	uint64_t as_peak_total;
+
+	/*
+	 * The number of times memory was obtained from the heap, and the
+	 * number of bytes presently held:
+	 */
+	uint64_t as_heap_allocs;
+	uint64_t as_reserved;
+} arena_stats_t;
+
+arena_t *arena_new(void);
+void arena_free(arena_t *);
+void *arena_alloc(arena_t *, size_t);
+void *arena_zalloc(arena_t *, size_t);
+void *arena_realloc(arena_t *, void *, size_t, size_t);
+size_t arena_mark(arena_t *);
+void arena_release(arena_t *, size_t);
+void arena_stats(arena_t *, arena_stats_t *);
+void arena_stats_add(arena_stats_t *, const arena_stats_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ARENA_H */
@@ -68,7 +68,7 @@ base64_decode(const char *input, size_t len, string_t *output)
 {
 	int typ[4];
 	uint8_t buf[4];
-	unsigned int i, j;
+	unsigned int i, j, n;
 
 	buf[3] = '\0';
 	dynstr_append(output, "");
@@ -92,17 +92,18 @@ base64_decode(const char *input, size_t len, string_t *output)
 		if (typ[2] == -1 && typ[3] != -1)
 			return (-1);
 
+		/*
+		 * The decoded bytes are appended by count, not as a string,
+		 * as a payload (such as a compressed one) may contain NULs:
+		 */
+		n = 1;
 		buf[0] = (typ[0] << 2) | (typ[1] >> 4);
 		if (typ[2] != -1)
-			buf[1] = ((typ[1] & 0x0f) << 4) | (typ[2] >>2);
-		else
-			buf[1] = '\0';
+			buf[n++] = ((typ[1] & 0x0f) << 4) | (typ[2] >>2);
 		if (typ[3] != -1)
-			buf[2] = ((typ[2] & 0x03) << 6) | typ[3];
-		else
-			buf[2] = '\0';
+			buf[n++] = ((typ[2] & 0x03) << 6) | typ[3];
 
-		dynstr_append(output, (const char *) buf);
+		dynstr_appendn(output, (const char *) buf, n);
 	}
 
 	return (0);
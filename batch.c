@@ -0,0 +1,468 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * Run a set of requests over a single connection, keeping several of them in
+ * flight at once on a Version 2 host.  The caller submits every request, then
+ * calls batch_run() to drive the asynchronous protocol engine until each has
+ * completed through its callback.
+ *
+ * Requests are held here, rather than in the engine, until there is room in
+ * the window for them.  If the connection fails, requests that were in flight
+ * are put back in the queue, the connection is reset, and they are sent
+ * again; a request that has failed in this way too many times is completed
+ * with an error so that the rest of the batch can proceed.
+ *
+ * As each response on a Version 2 connection arrives whole, in order, a large
+ * request holds up every request sent after it.  Queued requests are
+ * therefore not sent in the order in which they were submitted, but in order
+ * of a deadline: the number of requests submitted before each, plus a delay
+ * that grows with its expected size (that of the request, and of the response
+ * if the caller can estimate it).  Small requests thus overtake large ones,
+ * but a large request is overtaken by no more than a bounded number of those
+ * submitted after it, and so is never starved.  Urgent requests are not
+ * delayed at all, and so overtake all but those that have long been queued.
+ * Requests of the same size are sent in the order in which they were
+ * submitted.
+ *
+ * A request never overtakes one submitted before it for the same key, lest
+ * an older value be written over a newer one (or a read see a write that was
+ * submitted after it).  Each request's deadline is raised, where necessary,
+ * to that of the last request submitted for its key, which is then sent
+ * first as it was submitted first.  Requests that are in flight are answered
+ * in the order in which they were sent, so only the queue need be ordered.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "base64.h"
+#include "batch.h"
+#include "common.h"
+#include "crc32.h"
+#include "dynstr.h"
+#include "proto.h"
+
+/*
+ * The number of times a request is sent before we give up on it:
+ */
+#define	BATCH_MAX_ATTEMPTS	3
+
+/*
+ * Each whole unit of expected size delays a request by one more request, up
+ * to a limit; every request that is not urgent is delayed by a further lead:
+ */
+#define	BATCH_DELAY_UNIT	1024
+#define	BATCH_MAX_DELAY		256
+#define	BATCH_URGENT_LEAD	64
+
+/*
+ * The number of buckets in the table of keys named by requests:
+ */
+#define	BATCH_KEY_BUCKETS	256
+
+typedef struct batch_request batch_request_t;
+typedef struct batch_key batch_key_t;
+
+struct batch_request {
+	mdata_batch_t *br_batch;
+	char *br_command;
+	char *br_argument;
+	batch_cb_t *br_cb;
+	void *br_cbarg;
+	unsigned int br_attempts;
+	uint64_t br_seq;
+	uint64_t br_deadline;
+	batch_request_t *br_next;
+};
+
+/*
+ * The latest deadline of any request submitted for a key:
+ */
+struct batch_key {
+	char *bk_name;
+	uint64_t bk_deadline;
+	batch_key_t *bk_next;
+};
+
+struct mdata_batch {
+	mdata_proto_t *mb_proto;
+	unsigned int mb_window;
+	unsigned int mb_inflight;
+	uint64_t mb_seq;
+
+	/*
+	 * Requests yet to be sent, in a binary heap ordered by deadline:
+	 */
+	batch_request_t **mb_queue;
+	size_t mb_nqueued;
+	size_t mb_queuesz;
+
+	/*
+	 * Requests that were in flight when the connection failed, in the
+	 * order in which they were sent:
+	 */
+	batch_request_t *mb_retry;
+	batch_request_t **mb_rtail;
+
+	batch_key_t *mb_keys[BATCH_KEY_BUCKETS];
+};
+
+static void
+batch_request_free(batch_request_t *br)
+{
+	free(br->br_command);
+	free(br->br_argument);
+	free(br);
+}
+
+/*
+ * Determine the key named by a request, if any.  PUT names it, encoded, as
+ * the first word of its argument; GET and DELETE name it as the argument.
+ */
+static int
+batch_key_name(const char *command, const char *argument, string_t *out)
+{
+	size_t len;
+
+	if (argument == NULL || strcmp(command, "KEYS") == 0)
+		return (-1);
+
+	if (strcmp(command, "PUT") == 0) {
+		len = strcspn(argument, " ");
+		if (base64_decode(argument, len, out) != 0) {
+			dynstr_reset(out);
+			dynstr_appendn(out, argument, len);
+		}
+		return (0);
+	}
+
+	dynstr_append(out, argument);
+	return (0);
+}
+
+/*
+ * Ensure that the request is not sent before any submitted earlier for the
+ * same key.
+ */
+static void
+batch_order(mdata_batch_t *mb, batch_request_t *br)
+{
+	string_t *name = dynstr_new();
+	batch_key_t *bk, **bkp;
+
+	dynstr_append(name, "");
+	if (batch_key_name(br->br_command, br->br_argument, name) != 0)
+		goto out;
+
+	bkp = &mb->mb_keys[crc32_calc(dynstr_cstr(name), dynstr_len(name)) %
+	    BATCH_KEY_BUCKETS];
+	for (bk = *bkp; bk != NULL; bk = bk->bk_next) {
+		if (strcmp(bk->bk_name, dynstr_cstr(name)) == 0)
+			break;
+	}
+
+	if (bk == NULL) {
+		if ((bk = calloc(1, sizeof (*bk))) == NULL ||
+		    (bk->bk_name = strdup(dynstr_cstr(name))) == NULL)
+			ABORT("batch_order: could not allocate memory");
+		bk->bk_next = *bkp;
+		*bkp = bk;
+	} else if (bk->bk_deadline > br->br_deadline) {
+		br->br_deadline = bk->bk_deadline;
+	}
+	bk->bk_deadline = br->br_deadline;
+
+out:
+	dynstr_free(name);
+}
+
+/*
+ * Is request "a" to be sent before request "b"?
+ */
+static boolean_t
+batch_before(const batch_request_t *a, const batch_request_t *b)
+{
+	if (a->br_deadline != b->br_deadline)
+		return (a->br_deadline < b->br_deadline ? B_TRUE : B_FALSE);
+	return (a->br_seq < b->br_seq ? B_TRUE : B_FALSE);
+}
+
+static void
+batch_queue_push(mdata_batch_t *mb, batch_request_t *br)
+{
+	batch_request_t **q;
+	size_t i, parent;
+
+	if (mb->mb_nqueued == mb->mb_queuesz) {
+		size_t sz = mb->mb_queuesz > 0 ? mb->mb_queuesz * 2 : 16;
+
+		if ((q = realloc(mb->mb_queue, sz * sizeof (*q))) == NULL)
+			ABORT("batch_queue_push: could not allocate memory");
+		mb->mb_queue = q;
+		mb->mb_queuesz = sz;
+	}
+
+	q = mb->mb_queue;
+	for (i = mb->mb_nqueued++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (!batch_before(br, q[parent]))
+			break;
+		q[i] = q[parent];
+	}
+	q[i] = br;
+}
+
+static batch_request_t *
+batch_queue_pop(mdata_batch_t *mb)
+{
+	batch_request_t **q = mb->mb_queue, *br, *last;
+	size_t i, child;
+
+	if (mb->mb_nqueued == 0)
+		return (NULL);
+
+	br = q[0];
+	last = q[--mb->mb_nqueued];
+	for (i = 0; (child = 2 * i + 1) < mb->mb_nqueued; i = child) {
+		if (child + 1 < mb->mb_nqueued &&
+		    batch_before(q[child + 1], q[child]))
+			child++;
+		if (!batch_before(q[child], last))
+			break;
+		q[i] = q[child];
+	}
+	q[i] = last;
+
+	return (br);
+}
+
+static void
+batch_finish(batch_request_t *br, int err, mdata_response_t mdr,
+    string_t *data)
+{
+	br->br_cb(err, mdr, data, br->br_cbarg);
+	batch_request_free(br);
+}
+
+static void
+batch_callback(mdata_proto_t *mdp __UNUSED, int err, mdata_response_t mdr,
+    string_t *data, void *arg)
+{
+	batch_request_t *br = arg;
+	mdata_batch_t *mb = br->br_batch;
+
+	mb->mb_inflight--;
+
+	if (err != 0 && br->br_attempts < BATCH_MAX_ATTEMPTS) {
+		*mb->mb_rtail = br;
+		mb->mb_rtail = &br->br_next;
+		return;
+	}
+
+	batch_finish(br, err, mdr, data);
+}
+
+/*
+ * Hand queued requests to the engine while there is room in the window.
+ * Once the connection has failed, nothing more is sent until it has been
+ * reset.
+ */
+static void
+batch_fill(mdata_batch_t *mb)
+{
+	batch_request_t *br;
+
+	while (mb->mb_nqueued > 0 && mb->mb_retry == NULL &&
+	    mb->mb_inflight < mb->mb_window) {
+		br = batch_queue_pop(mb);
+
+		br->br_attempts++;
+		if (proto_async_submit(mb->mb_proto, br->br_command,
+		    br->br_argument, batch_callback, br) != 0) {
+			/*
+			 * The connection has already failed; treat this
+			 * request as though it was lost with it.
+			 */
+			mb->mb_inflight++;
+			batch_callback(mb->mb_proto, -1, MDR_UNKNOWN, NULL, br);
+			continue;
+		}
+		mb->mb_inflight++;
+	}
+}
+
+/*
+ * Reset the connection after a failure, and return the requests that were
+ * lost with it to the queue, where they keep their deadlines (and so are
+ * generally sent again first).  If the connection cannot be re-established,
+ * every remaining request is failed.
+ */
+static int
+batch_recover(mdata_batch_t *mb)
+{
+	batch_request_t *br;
+
+	if (proto_async_reset(mb->mb_proto) == 0) {
+		while ((br = mb->mb_retry) != NULL) {
+			mb->mb_retry = br->br_next;
+			br->br_next = NULL;
+			batch_queue_push(mb, br);
+		}
+		mb->mb_rtail = &mb->mb_retry;
+		return (0);
+	}
+
+	while ((br = batch_queue_pop(mb)) != NULL) {
+		*mb->mb_rtail = br;
+		mb->mb_rtail = &br->br_next;
+	}
+	while ((br = mb->mb_retry) != NULL) {
+		mb->mb_retry = br->br_next;
+		batch_finish(br, -1, MDR_UNKNOWN, NULL);
+	}
+	mb->mb_rtail = &mb->mb_retry;
+	return (-1);
+}
+
+int
+batch_init(mdata_batch_t **out, mdata_proto_t *mdp, unsigned int window)
+{
+	mdata_batch_t *mb;
+
+	if ((mb = calloc(1, sizeof (*mb))) == NULL)
+		return (-1);
+
+	mb->mb_proto = mdp;
+	mb->mb_window = window > 0 ? window : 1;
+	mb->mb_rtail = &mb->mb_retry;
+	proto_async_set_window(mdp, mb->mb_window);
+
+	*out = mb;
+	return (0);
+}
+
+/*
+ * Queue a request.  The command and argument are copied.  The caller may
+ * give the expected size of the response, if it knows it, and may mark the
+ * request urgent with BATCH_F_URGENT.
+ */
+void
+batch_submit_ext(mdata_batch_t *mb, const char *command, const char *argument,
+    size_t respsize, unsigned int flags, batch_cb_t *cb, void *arg)
+{
+	batch_request_t *br;
+	size_t size;
+
+	VERIFY(cb != NULL);
+
+	if ((br = calloc(1, sizeof (*br))) == NULL ||
+	    (br->br_command = strdup(command)) == NULL ||
+	    (argument != NULL && (br->br_argument = strdup(argument)) ==
+	    NULL)) {
+		ABORT("batch_submit: could not allocate memory");
+	}
+	br->br_batch = mb;
+	br->br_cb = cb;
+	br->br_cbarg = arg;
+	br->br_seq = mb->mb_seq++;
+	br->br_deadline = br->br_seq;
+
+	if (!(flags & BATCH_F_URGENT)) {
+		size = strlen(command) + respsize;
+		if (argument != NULL)
+			size += strlen(argument);
+		size /= BATCH_DELAY_UNIT;
+		br->br_deadline += BATCH_URGENT_LEAD +
+		    (size < BATCH_MAX_DELAY ? size : BATCH_MAX_DELAY);
+	}
+	batch_order(mb, br);
+
+	batch_queue_push(mb, br);
+}
+
+void
+batch_submit(mdata_batch_t *mb, const char *command, const char *argument,
+    batch_cb_t *cb, void *arg)
+{
+	batch_submit_ext(mb, command, argument, 0, 0, cb, arg);
+}
+
+/*
+ * Run until every submitted request has completed.  Callbacks may submit
+ * further requests.  Returns -1 if the connection was lost for good, in which
+ * case every request that had not completed has been failed.
+ */
+int
+batch_run(mdata_batch_t *mb)
+{
+	mdata_proto_t *mdp = mb->mb_proto;
+	int ret = 0;
+
+	for (;;) {
+		struct pollfd pfd;
+		int events;
+
+		batch_fill(mb);
+
+		if (mb->mb_retry != NULL && mb->mb_inflight == 0) {
+			if (batch_recover(mb) != 0)
+				ret = -1;
+			continue;
+		}
+
+		if (mb->mb_nqueued == 0 && mb->mb_inflight == 0)
+			break;
+
+		events = proto_async_events(mdp);
+		pfd.fd = proto_async_fd(mdp);
+		pfd.events = ((events & PROTO_EV_READ) ? POLLIN : 0) |
+		    ((events & PROTO_EV_WRITE) ? POLLOUT : 0);
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, proto_async_timeout(mdp)) == -1) {
+			if (errno == EINTR)
+				continue;
+			ABORT("batch_run: poll failure\n");
+		}
+
+		if (pfd.revents & POLLOUT)
+			(void) proto_async_process_writable(mdp);
+		if (pfd.revents & (POLLIN | POLLERR | POLLHUP))
+			(void) proto_async_process_readable(mdp);
+		(void) proto_async_process_timeout(mdp);
+	}
+
+	return (ret);
+}
+
+void
+batch_fini(mdata_batch_t *mb)
+{
+	batch_key_t *bk;
+	size_t i;
+
+	if (mb == NULL)
+		return;
+
+	VERIFY(mb->mb_nqueued == 0 && mb->mb_retry == NULL &&
+	    mb->mb_inflight == 0);
+
+	for (i = 0; i < BATCH_KEY_BUCKETS; i++) {
+		while ((bk = mb->mb_keys[i]) != NULL) {
+			mb->mb_keys[i] = bk->bk_next;
+			free(bk->bk_name);
+			free(bk);
+		}
+	}
+	free(mb->mb_queue);
+	free(mb);
+}
@@ -0,0 +1,49 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+#ifndef _BATCH_H
+#define	_BATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dynstr.h"
+#include "proto.h"
+
+/*
+ * The number of requests a batch keeps in flight by default:
+ */
+#define	BATCH_WINDOW	16
+
+typedef struct mdata_batch mdata_batch_t;
+
+/*
+ * Flags for batch_submit_ext().  An urgent request is sent ahead of queued
+ * requests that are not.
+ */
+#define	BATCH_F_URGENT	0x1
+
+/*
+ * Completion callback for a request in a batch.  The error is non-zero if
+ * the request could not be completed at all; the response data is only valid
+ * for the duration of the call.
+ */
+typedef void batch_cb_t(int, mdata_response_t, string_t *, void *);
+
+int batch_init(mdata_batch_t **, mdata_proto_t *, unsigned int);
+void batch_submit(mdata_batch_t *, const char *, const char *, batch_cb_t *,
+    void *);
+void batch_submit_ext(mdata_batch_t *, const char *, const char *, size_t,
+    unsigned int, batch_cb_t *, void *);
+int batch_run(mdata_batch_t *);
+void batch_fini(mdata_batch_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BATCH_H */
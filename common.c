@@ -5,6 +5,8 @@
  * Copyright (c) 2024 MNX Cloud, Inc.
  */
 
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -20,3 +22,23 @@ print_and_abort(const char *message, const char *file, int line)
 
 	return (0);
 }
+
+/*
+ * Parse a non-negative number of seconds, which may be fractional, into
+ * milliseconds.
+ */
+int
+parse_seconds(const char *str, int *ms)
+{
+	char *end;
+	double secs;
+
+	errno = 0;
+	secs = strtod(str, &end);
+	if (errno != 0 || end == str || *end != '\0' || !(secs >= 0) ||
+	    secs * 1000 > INT_MAX)
+		return (-1);
+
+	*ms = (int)(secs * 1000);
+	return (0);
+}
@@ -25,6 +25,7 @@ typedef enum {
 #define	ABORT(MSG)	print_and_abort((MSG), __FILE__,__LINE__)
 
 int print_and_abort(const char *, const char *, int);
+int parse_seconds(const char *, int *);
 
 #ifdef __cplusplus
 }
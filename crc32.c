@@ -64,8 +64,18 @@ static uint32_t crc32_table[] = {
 uint32_t
 crc32_calc(const char *cstr, size_t len)
 {
-	uint32_t crc = 0xffffffff;
-	unsigned int i;
+	return (crc32_update(0, cstr, len));
+}
+
+/*
+ * Extend the checksum of one buffer, as returned by crc32_calc(), to cover
+ * the bytes that follow it.
+ */
+uint32_t
+crc32_update(uint32_t prev, const char *cstr, size_t len)
+{
+	uint32_t crc = ~prev;
+	size_t i;
 
 	for (i = 0; i < len; i++) {
 		uint8_t b = (uint8_t) cstr[i];
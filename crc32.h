@@ -13,6 +13,7 @@ extern "C" {
 #include <stdint.h>
 
 uint32_t crc32_calc(const char *, size_t);
+uint32_t crc32_update(uint32_t, const char *, size_t);
 
 #ifdef __cplusplus
 }
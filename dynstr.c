@@ -9,16 +9,53 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "dynstr.h"
 
 struct string {
 	size_t str_strlen;
 	size_t str_datalen;
 	char *str_data;
+
+	/*
+	 * The arena from which this string and its buffer were allocated, if
+	 * any; see dynstr_new_arena().
+	 */
+	arena_t *str_arena;
 };
 
 #define	STRING_CHUNK_SIZE	64
 
+/*
+ * Ensure there is room to append "len" more bytes, and the terminating NUL.
+ * The buffer grows by doubling, so that building a string by many small
+ * appends costs a logarithmic number of allocations.
+ */
+static void
+dynstr_reserve(string_t *str, size_t len)
+{
+	size_t need = str->str_strlen + len + 1;
+	size_t datalen = str->str_datalen > 0 ? str->str_datalen :
+	    STRING_CHUNK_SIZE;
+	char *data;
+
+	if (need <= str->str_datalen)
+		return;
+
+	while (datalen < need)
+		datalen *= 2;
+
+	if (str->str_arena != NULL) {
+		data = arena_realloc(str->str_arena, str->str_data,
+		    str->str_datalen, datalen);
+	} else if ((data = realloc(str->str_data, datalen)) == NULL) {
+		err(1, "could not allocate memory for string");
+	}
+
+	str->str_data = data;
+	str->str_datalen = datalen;
+}
+
 void
 dynstr_reset(string_t *str)
 {
@@ -44,14 +81,7 @@ dynstr_cstr(string_t *str)
 void
 dynstr_appendc(string_t *str, char newc)
 {
-	size_t chunksz = STRING_CHUNK_SIZE;
-
-	if (str->str_strlen + 1 >= str->str_datalen) {
-		str->str_datalen += chunksz;
-		str->str_data = realloc(str->str_data, str->str_datalen);
-		if (str->str_data == NULL)
-			err(1, "could not allocate memory for string");
-	}
+	dynstr_reserve(str, 1);
 	str->str_data[str->str_strlen++] = newc;
 	str->str_data[str->str_strlen] = '\0';
 }
@@ -60,21 +90,21 @@ void
 dynstr_append(string_t *str, const char *news)
 {
 	size_t len = strlen(news);
-	size_t chunksz = STRING_CHUNK_SIZE;
-
-	while (chunksz < len)
-		chunksz *= 2;
 
-	if (len + str->str_strlen >= str->str_datalen) {
-		str->str_datalen += chunksz;
-		str->str_data = realloc(str->str_data, str->str_datalen);
-		if (str->str_data == NULL)
-			err(1, "could not allocate memory for string");
-	}
+	dynstr_reserve(str, len);
 	strcpy(str->str_data + str->str_strlen, news);
 	str->str_strlen += len;
 }
 
+void
+dynstr_appendn(string_t *str, const char *news, size_t len)
+{
+	dynstr_reserve(str, len);
+	memcpy(str->str_data + str->str_strlen, news, len);
+	str->str_strlen += len;
+	str->str_data[str->str_strlen] = '\0';
+}
+
 string_t *
 dynstr_new(void)
 {
@@ -86,9 +116,27 @@ dynstr_new(void)
 	return (ret);
 }
 
+/*
+ * Allocate a string, and its buffer as it grows, from an arena.  Such a
+ * string need not be freed: its memory is reclaimed when the arena is
+ * released past the point at which the string was created.
+ */
+string_t *
+dynstr_new_arena(arena_t *a)
+{
+	string_t *ret = arena_zalloc(a, sizeof (string_t));
+
+	ret->str_arena = a;
+
+	return (ret);
+}
+
 void
 dynstr_free(string_t *str)
 {
+	if (str->str_arena != NULL)
+		return;
+
 	free(str->str_data);
 	free(str);
 }
@@ -10,12 +10,16 @@
 extern "C" {
 #endif
 
+#include "arena.h"
+
 typedef struct string string_t;
 
 string_t *dynstr_new(void);
+string_t *dynstr_new_arena(arena_t *);
 void dynstr_free(string_t *str);
 void dynstr_append(string_t *, const char *);
 void dynstr_appendc(string_t *, char);
+void dynstr_appendn(string_t *, const char *, size_t);
 void dynstr_reset(string_t *str);
 size_t dynstr_len(string_t *str);
 const char *dynstr_cstr(string_t *str);
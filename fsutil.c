@@ -0,0 +1,219 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "dynstr.h"
+#include "fsutil.h"
+
+/*
+ * The number of names tried for a temporary file before giving up:
+ */
+#define	FS_TMP_ATTEMPTS		64
+
+/*
+ * Flags for fs_write_common():
+ */
+#define	FS_W_SYNC		0x1	/* flush the data to disk */
+#define	FS_W_EXCL		0x2	/* never replace an existing file */
+
+/*
+ * Construct the path of a file in the run directory, creating the directory
+ * if it does not yet exist.  Unprivileged users will often be unable to
+ * create it, in which case callers simply go without the shared state.
+ */
+int
+fs_rundir_path(const char *name, char *buf, size_t len)
+{
+	const char *dir = getenv(MDATA_RUNDIR_ENV);
+
+	if (dir == NULL || dir[0] == '\0')
+		dir = MDATA_RUNDIR_DEFAULT;
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+		return (-1);
+
+	if (snprintf(buf, len, "%s/%s", dir, name) >= (int)len) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Write a key in hexadecimal, so that any key may be used in the name of a
+ * file.  Fails, with ENAMETOOLONG, if the key is empty or its name will not
+ * fit in the buffer.
+ */
+int
+fs_hex_name(const char *key, char *buf, size_t len)
+{
+	static const char digits[] = "0123456789abcdef";
+	size_t i, klen = strlen(key);
+
+	if (klen == 0 || 2 * klen + 1 > len) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	for (i = 0; i < klen; i++) {
+		buf[2 * i] = digits[(unsigned char)key[i] >> 4];
+		buf[2 * i + 1] = digits[(unsigned char)key[i] & 0xf];
+	}
+	buf[2 * klen] = '\0';
+
+	return (0);
+}
+
+/*
+ * Append the entire contents of a file to the string.
+ */
+int
+fs_read_file(const char *path, string_t *out)
+{
+	char buf[4096];
+	ssize_t sz;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (-1);
+
+	while ((sz = read(fd, buf, sizeof (buf))) != 0) {
+		if (sz == -1) {
+			if (errno == EINTR)
+				continue;
+			(void) close(fd);
+			return (-1);
+		}
+		dynstr_appendn(out, buf, (size_t)sz);
+	}
+
+	(void) close(fd);
+	return (0);
+}
+
+/*
+ * Create a new temporary file beside the target, named for it, a random
+ * suffix and our process ID (last, so that one left behind by a writer that
+ * died can be recognised).  The file must not already exist, so that the
+ * contents of whatever a link planted in its place points to are never
+ * replaced, even if the target is in a directory that others can write.
+ */
+static int
+fs_open_tmp(const char *path, mode_t mode, char *tmp, size_t tmplen)
+{
+	static unsigned int count;
+	struct timespec ts;
+	unsigned int suffix;
+	int attempt, fd;
+
+	for (attempt = 0; attempt < FS_TMP_ATTEMPTS; attempt++) {
+		VERIFY0(clock_gettime(CLOCK_REALTIME, &ts));
+		suffix = (unsigned int)ts.tv_nsec ^ (unsigned int)ts.tv_sec ^
+		    (++count * 0x9e3779b9U);
+
+		if (snprintf(tmp, tmplen, "%s.tmp.%08x.%d", path, suffix,
+		    (int)getpid()) >= (int)tmplen) {
+			errno = ENAMETOOLONG;
+			return (-1);
+		}
+
+		if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW,
+		    mode)) != -1 || errno != EEXIST)
+			return (fd);
+	}
+
+	return (-1);
+}
+
+static int
+fs_write_common(const char *path, const char *data, size_t len, mode_t mode,
+    int flags)
+{
+	char tmp[4096];
+	size_t off = 0;
+	ssize_t sz;
+	int fd, e;
+
+	if ((fd = fs_open_tmp(path, mode, tmp, sizeof (tmp))) == -1)
+		return (-1);
+
+	while (off < len) {
+		if ((sz = write(fd, data + off, len - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			goto bail;
+		}
+		off += (size_t)sz;
+	}
+
+	if ((flags & FS_W_SYNC) && fsync(fd) != 0)
+		goto bail;
+	e = close(fd);
+	fd = -1;
+	if (e != 0)
+		goto bail;
+
+	if (flags & FS_W_EXCL) {
+		if (link(tmp, path) != 0)
+			goto bail;
+		(void) unlink(tmp);
+	} else if (rename(tmp, path) != 0) {
+		goto bail;
+	}
+
+	return (0);
+
+bail:
+	e = errno;
+	if (fd != -1)
+		(void) close(fd);
+	(void) unlink(tmp);
+	errno = e;
+	return (-1);
+}
+
+/*
+ * Replace the contents of a file, such that readers see either the old or
+ * the new contents in full.  The data is written to a temporary file in the
+ * same directory, which is then renamed over the target.
+ */
+int
+fs_write_atomic(const char *path, const char *data, size_t len, mode_t mode)
+{
+	return (fs_write_common(path, data, len, mode, FS_W_SYNC));
+}
+
+/*
+ * As fs_write_atomic(), but without flushing the data to disk, for files
+ * that need only be read by other processes and not survive a crash.
+ */
+int
+fs_write_transient(const char *path, const char *data, size_t len,
+    mode_t mode)
+{
+	return (fs_write_common(path, data, len, mode, 0));
+}
+
+/*
+ * As fs_write_transient(), but create the file only if it does not already
+ * exist, failing with EEXIST if it does.  An existing file is never replaced.
+ */
+int
+fs_write_new(const char *path, const char *data, size_t len, mode_t mode)
+{
+	return (fs_write_common(path, data, len, mode, FS_W_EXCL));
+}
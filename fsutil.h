@@ -0,0 +1,36 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+#ifndef _FSUTIL_H
+#define	_FSUTIL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+#include "dynstr.h"
+
+/*
+ * Directory for state that is shared between invocations of the client
+ * during the current boot.  It may be overridden in the environment.
+ */
+#define	MDATA_RUNDIR_ENV	"MDATA_RUNDIR"
+#define	MDATA_RUNDIR_DEFAULT	"/var/run/mdata-client"
+
+int fs_rundir_path(const char *, char *, size_t);
+int fs_hex_name(const char *, char *, size_t);
+int fs_read_file(const char *, string_t *);
+int fs_write_atomic(const char *, const char *, size_t, mode_t);
+int fs_write_transient(const char *, const char *, size_t, mode_t);
+int fs_write_new(const char *, const char *, size_t, mode_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FSUTIL_H */
@@ -0,0 +1,282 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * A parser for the one kind of JSON document we accept as input: a flat
+ * object whose members all have string values, such as
+ *
+ *	{ "sdc:key": "value", "other": "line one\nline two" }
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "dynstr.h"
+#include "json.h"
+
+typedef struct json_parser {
+	const char *jp_buf;
+	size_t jp_len;
+	size_t jp_pos;
+	const char *jp_errmsg;
+} json_parser_t;
+
+static void
+json_skip_ws(json_parser_t *jp)
+{
+	while (jp->jp_pos < jp->jp_len) {
+		switch (jp->jp_buf[jp->jp_pos]) {
+		case ' ':
+		case '\t':
+		case '\r':
+		case '\n':
+			jp->jp_pos++;
+			break;
+		default:
+			return;
+		}
+	}
+}
+
+static int
+json_expect(json_parser_t *jp, char c)
+{
+	json_skip_ws(jp);
+
+	if (jp->jp_pos >= jp->jp_len || jp->jp_buf[jp->jp_pos] != c)
+		return (-1);
+
+	jp->jp_pos++;
+	return (0);
+}
+
+static int
+json_hex4(json_parser_t *jp, uint32_t *out)
+{
+	uint32_t v = 0;
+	int i;
+
+	if (jp->jp_len - jp->jp_pos < 4)
+		return (-1);
+
+	for (i = 0; i < 4; i++) {
+		char c = jp->jp_buf[jp->jp_pos++];
+
+		v <<= 4;
+		if (c >= '0' && c <= '9')
+			v |= (uint32_t)(c - '0');
+		else if (c >= 'a' && c <= 'f')
+			v |= (uint32_t)(c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F')
+			v |= (uint32_t)(c - 'A' + 10);
+		else
+			return (-1);
+	}
+
+	*out = v;
+	return (0);
+}
+
+static void
+json_append_utf8(string_t *str, uint32_t cp)
+{
+	if (cp < 0x80) {
+		dynstr_appendc(str, (char)cp);
+	} else if (cp < 0x800) {
+		dynstr_appendc(str, (char)(0xc0 | (cp >> 6)));
+		dynstr_appendc(str, (char)(0x80 | (cp & 0x3f)));
+	} else if (cp < 0x10000) {
+		dynstr_appendc(str, (char)(0xe0 | (cp >> 12)));
+		dynstr_appendc(str, (char)(0x80 | ((cp >> 6) & 0x3f)));
+		dynstr_appendc(str, (char)(0x80 | (cp & 0x3f)));
+	} else {
+		dynstr_appendc(str, (char)(0xf0 | (cp >> 18)));
+		dynstr_appendc(str, (char)(0x80 | ((cp >> 12) & 0x3f)));
+		dynstr_appendc(str, (char)(0x80 | ((cp >> 6) & 0x3f)));
+		dynstr_appendc(str, (char)(0x80 | (cp & 0x3f)));
+	}
+}
+
+static int
+json_unicode_escape(json_parser_t *jp, string_t *str)
+{
+	uint32_t cp, lo;
+
+	if (json_hex4(jp, &cp) != 0)
+		return (-1);
+
+	if (cp >= 0xd800 && cp <= 0xdbff) {
+		/*
+		 * A high surrogate must be followed by an escaped low
+		 * surrogate:
+		 */
+		if (jp->jp_len - jp->jp_pos < 2 ||
+		    jp->jp_buf[jp->jp_pos] != '\\' ||
+		    jp->jp_buf[jp->jp_pos + 1] != 'u')
+			return (-1);
+		jp->jp_pos += 2;
+		if (json_hex4(jp, &lo) != 0 || lo < 0xdc00 || lo > 0xdfff)
+			return (-1);
+		cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+	} else if (cp >= 0xdc00 && cp <= 0xdfff) {
+		return (-1);
+	}
+
+	json_append_utf8(str, cp);
+	return (0);
+}
+
+static int
+json_string(json_parser_t *jp, string_t *str)
+{
+	const char *run;
+
+	dynstr_reset(str);
+	dynstr_append(str, "");
+
+	if (json_expect(jp, '"') != 0) {
+		jp->jp_errmsg = "expected a string";
+		return (-1);
+	}
+
+	run = jp->jp_buf + jp->jp_pos;
+	while (jp->jp_pos < jp->jp_len) {
+		char c = jp->jp_buf[jp->jp_pos];
+
+		if (c != '"' && c != '\\' && (unsigned char)c >= 0x20) {
+			jp->jp_pos++;
+			continue;
+		}
+
+		/*
+		 * Copy the run of ordinary characters we have passed over:
+		 */
+		dynstr_appendn(str, run, (size_t)(jp->jp_buf + jp->jp_pos -
+		    run));
+		jp->jp_pos++;
+
+		if (c == '"')
+			return (0);
+
+		if (c != '\\' || jp->jp_pos >= jp->jp_len) {
+			jp->jp_errmsg = "invalid character in string";
+			return (-1);
+		}
+
+		switch (jp->jp_buf[jp->jp_pos++]) {
+		case '"':
+			dynstr_appendc(str, '"');
+			break;
+		case '\\':
+			dynstr_appendc(str, '\\');
+			break;
+		case '/':
+			dynstr_appendc(str, '/');
+			break;
+		case 'b':
+			dynstr_appendc(str, '\b');
+			break;
+		case 'f':
+			dynstr_appendc(str, '\f');
+			break;
+		case 'n':
+			dynstr_appendc(str, '\n');
+			break;
+		case 'r':
+			dynstr_appendc(str, '\r');
+			break;
+		case 't':
+			dynstr_appendc(str, '\t');
+			break;
+		case 'u':
+			if (json_unicode_escape(jp, str) != 0) {
+				jp->jp_errmsg = "invalid unicode escape";
+				return (-1);
+			}
+			break;
+		default:
+			jp->jp_errmsg = "invalid escape in string";
+			return (-1);
+		}
+		run = jp->jp_buf + jp->jp_pos;
+	}
+
+	jp->jp_errmsg = "unterminated string";
+	return (-1);
+}
+
+/*
+ * Parse a flat object of string members from the buffer, calling "cb" for
+ * each member in turn.  Returns 0 on success, or -1 with "errmsg" set if the
+ * document is not such an object, or the callback stopped the parse.
+ */
+int
+json_parse_strings(const char *buf, size_t len, json_member_cb_t *cb,
+    void *arg, const char **errmsg)
+{
+	json_parser_t jp;
+	string_t *name = dynstr_new();
+	string_t *value = dynstr_new();
+	int ret = -1;
+
+	jp.jp_buf = buf;
+	jp.jp_len = len;
+	jp.jp_pos = 0;
+	jp.jp_errmsg = NULL;
+
+	if (json_expect(&jp, '{') != 0) {
+		jp.jp_errmsg = "expected an object";
+		goto out;
+	}
+
+	if (json_expect(&jp, '}') != 0) {
+		for (;;) {
+			if (json_string(&jp, name) != 0)
+				goto out;
+			if (json_expect(&jp, ':') != 0) {
+				jp.jp_errmsg = "expected ':'";
+				goto out;
+			}
+			json_skip_ws(&jp);
+			if (jp.jp_pos < jp.jp_len &&
+			    jp.jp_buf[jp.jp_pos] != '"') {
+				jp.jp_errmsg = "values must be strings";
+				goto out;
+			}
+			if (json_string(&jp, value) != 0)
+				goto out;
+			if (cb(name, value, arg) != 0) {
+				jp.jp_errmsg = "stopped";
+				goto out;
+			}
+
+			if (json_expect(&jp, ',') == 0)
+				continue;
+			if (json_expect(&jp, '}') == 0)
+				break;
+			jp.jp_errmsg = "expected ',' or '}'";
+			goto out;
+		}
+	}
+
+	json_skip_ws(&jp);
+	if (jp.jp_pos != jp.jp_len) {
+		jp.jp_errmsg = "trailing characters after object";
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	dynstr_free(name);
+	dynstr_free(value);
+	if (ret != 0)
+		*errmsg = jp.jp_errmsg;
+	return (ret);
+}
@@ -0,0 +1,31 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+#ifndef _JSON_H
+#define	_JSON_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+#include "dynstr.h"
+
+/*
+ * Called for each member of an object, with its name and (string) value.
+ * Returning non-zero stops the parse.
+ */
+typedef int json_member_cb_t(string_t *, string_t *, void *);
+
+int json_parse_strings(const char *, size_t, json_member_cb_t *, void *,
+    const char **);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _JSON_H */
@@ -0,0 +1,172 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * An index over the response to a KEYS request, which is a list of key names
+ * separated by newlines.  Each entry points at a name within the response
+ * itself, so that a large list of keys can be filtered, sorted and written
+ * out without copying the names.  The buffer must outlive the index.
+ *
+ * Once sorted, the keys that begin with a given prefix form a contiguous run
+ * that is found by binary search.
+ */
+
+#include <sys/types.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "keyidx.h"
+
+static int
+keyidx_compare(const keyidx_ent_t *a, const char *name, size_t len)
+{
+	int r;
+
+	if ((r = memcmp(a->ke_name, name, a->ke_len < len ? a->ke_len :
+	    len)) != 0)
+		return (r);
+
+	return (a->ke_len < len ? -1 : a->ke_len > len ? 1 : 0);
+}
+
+static int
+keyidx_qsort_cmp(const void *l, const void *r)
+{
+	const keyidx_ent_t *b = r;
+
+	return (keyidx_compare(l, b->ke_name, b->ke_len));
+}
+
+static boolean_t
+keyidx_has_prefix(const keyidx_ent_t *ke, const char *prefix, size_t plen)
+{
+	return (ke->ke_len >= plen && memcmp(ke->ke_name, prefix, plen) == 0);
+}
+
+/*
+ * Build an index of the newline-separated names in the buffer.  Empty lines
+ * are ignored.
+ */
+int
+keyidx_init(keyidx_t *ki, const char *buf, size_t len)
+{
+	const char *pos, *end = buf + len, *nl;
+	size_t n = 1;
+
+	bzero(ki, sizeof (*ki));
+
+	for (pos = buf; (nl = memchr(pos, '\n', (size_t)(end - pos))) !=
+	    NULL; pos = nl + 1)
+		n++;
+
+	if ((ki->ki_ents = calloc(n, sizeof (keyidx_ent_t))) == NULL)
+		return (-1);
+
+	for (pos = buf; pos < end; pos = nl + 1) {
+		if ((nl = memchr(pos, '\n', (size_t)(end - pos))) == NULL)
+			nl = end;
+
+		if (nl > pos) {
+			ki->ki_ents[ki->ki_count].ke_name = pos;
+			ki->ki_ents[ki->ki_count].ke_len = (size_t)(nl - pos);
+			ki->ki_count++;
+		}
+	}
+
+	return (0);
+}
+
+void
+keyidx_sort(keyidx_t *ki)
+{
+	if (ki->ki_count > 1) {
+		qsort(ki->ki_ents, ki->ki_count, sizeof (keyidx_ent_t),
+		    keyidx_qsort_cmp);
+	}
+	ki->ki_sorted = B_TRUE;
+}
+
+/*
+ * Return a NUL-terminated copy of the name of an entry.  The copy is valid
+ * until the next call.
+ */
+const char *
+keyidx_cstr(keyidx_t *ki, const keyidx_ent_t *ke)
+{
+	if (ke->ke_len + 1 > ki->ki_scratchsz) {
+		size_t sz = ke->ke_len + 1 > 2 * ki->ki_scratchsz ?
+		    ke->ke_len + 1 : 2 * ki->ki_scratchsz;
+		char *n;
+
+		if ((n = realloc(ki->ki_scratch, sz)) == NULL)
+			ABORT("keyidx_cstr: could not allocate memory");
+		ki->ki_scratch = n;
+		ki->ki_scratchsz = sz;
+	}
+
+	bcopy(ke->ke_name, ki->ki_scratch, ke->ke_len);
+	ki->ki_scratch[ke->ke_len] = '\0';
+	return (ki->ki_scratch);
+}
+
+/*
+ * Call "cb", if it is not NULL, for each key that begins with "prefix" and
+ * matches the fnmatch(3C) pattern "glob", in the order of the index.  Either
+ * filter may be NULL.  Returns the number of keys that matched.
+ */
+size_t
+keyidx_walk(keyidx_t *ki, const char *prefix, const char *glob,
+    keyidx_walk_cb_t *cb, void *arg)
+{
+	size_t plen = prefix != NULL ? strlen(prefix) : 0;
+	size_t i = 0, matched = 0;
+
+	if (plen > 0 && ki->ki_sorted) {
+		size_t hi = ki->ki_count;
+
+		/*
+		 * Find the first key that sorts at or after the prefix; every
+		 * key that begins with it follows immediately.
+		 */
+		while (i < hi) {
+			size_t mid = i + (hi - i) / 2;
+
+			if (keyidx_compare(&ki->ki_ents[mid], prefix, plen) < 0)
+				i = mid + 1;
+			else
+				hi = mid;
+		}
+	}
+
+	for (; i < ki->ki_count; i++) {
+		const keyidx_ent_t *ke = &ki->ki_ents[i];
+
+		if (!keyidx_has_prefix(ke, prefix, plen)) {
+			if (ki->ki_sorted)
+				break;
+			continue;
+		}
+
+		if (glob != NULL && fnmatch(glob, keyidx_cstr(ki, ke), 0) != 0)
+			continue;
+
+		matched++;
+		if (cb != NULL && cb(ki, ke, arg) != 0)
+			break;
+	}
+
+	return (matched);
+}
+
+void
+keyidx_fini(keyidx_t *ki)
+{
+	free(ki->ki_ents);
+	free(ki->ki_scratch);
+	bzero(ki, sizeof (*ki));
+}
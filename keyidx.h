@@ -0,0 +1,52 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+#ifndef _KEYIDX_H
+#define	_KEYIDX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+#include "common.h"
+
+/*
+ * One key name, pointing into the buffer from which the index was built.  The
+ * name is not NUL-terminated; see keyidx_cstr().
+ */
+typedef struct keyidx_ent {
+	const char *ke_name;
+	size_t ke_len;
+} keyidx_ent_t;
+
+typedef struct keyidx {
+	keyidx_ent_t *ki_ents;
+	size_t ki_count;
+	boolean_t ki_sorted;
+	char *ki_scratch;
+	size_t ki_scratchsz;
+} keyidx_t;
+
+/*
+ * Called for each key matched by keyidx_walk().  Returning non-zero stops the
+ * walk.
+ */
+typedef int keyidx_walk_cb_t(keyidx_t *, const keyidx_ent_t *, void *);
+
+int keyidx_init(keyidx_t *, const char *, size_t);
+void keyidx_sort(keyidx_t *);
+size_t keyidx_walk(keyidx_t *, const char *, const char *, keyidx_walk_cb_t *,
+    void *);
+const char *keyidx_cstr(keyidx_t *, const keyidx_ent_t *);
+void keyidx_fini(keyidx_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _KEYIDX_H */
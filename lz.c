@@ -0,0 +1,239 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * A small LZ77 compressor for metadata payloads, which are most often
+ * scripts and other text.  It favours speed and simplicity over ratio, and
+ * needs nothing beyond libc, so that static builds stay self-contained.
+ *
+ * A compressed buffer begins with the length of the original data, as a
+ * 32-bit big-endian integer, and is followed by a series of sequences.
+ * Each sequence copies some bytes literally and then repeats some bytes of
+ * the output seen earlier:
+ *
+ *   token | [literal length] | literals | offset | [match length]
+ *
+ * The high nibble of the token is the number of literals, and the low nibble
+ * the length of the match less LZ_MIN_MATCH.  A nibble of 15 is followed by
+ * further length bytes, each of which is added to it, up to and including
+ * the first that is not 255.  The offset is a 16-bit little-endian distance
+ * back from the end of the output.  The last sequence has only literals, and
+ * ends the buffer.  (This is the LZ4 block format, with a length prefix.)
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dynstr.h"
+#include "lz.h"
+
+#define	LZ_HDR_LEN		4
+#define	LZ_MIN_MATCH		4
+#define	LZ_MAX_OFFSET		65535
+#define	LZ_HASH_BITS		14
+
+static uint32_t
+lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof (v));
+	return (v);
+}
+
+static uint32_t
+lz_hash(uint32_t v)
+{
+	return ((v * 2654435761U) >> (32 - LZ_HASH_BITS));
+}
+
+static void
+lz_put_len(string_t *out, size_t n)
+{
+	while (n >= 255) {
+		dynstr_appendc(out, (char)255);
+		n -= 255;
+	}
+	dynstr_appendc(out, (char)n);
+}
+
+/*
+ * Append one sequence to the output.  A match length of zero marks the last
+ * sequence, which has no offset.
+ */
+static void
+lz_put_seq(string_t *out, const uint8_t *lit, size_t litlen, size_t offset,
+    size_t matchlen)
+{
+	size_t mlen = matchlen > 0 ? matchlen - LZ_MIN_MATCH : 0;
+	uint8_t token;
+
+	token = (uint8_t)((litlen < 15 ? litlen : 15) << 4);
+	token |= (uint8_t)(mlen < 15 ? mlen : 15);
+	dynstr_appendc(out, (char)token);
+	if (litlen >= 15)
+		lz_put_len(out, litlen - 15);
+	dynstr_appendn(out, (const char *)lit, litlen);
+
+	if (matchlen == 0)
+		return;
+
+	dynstr_appendc(out, (char)(offset & 0xff));
+	dynstr_appendc(out, (char)(offset >> 8));
+	if (mlen >= 15)
+		lz_put_len(out, mlen - 15);
+}
+
+/*
+ * Append the compressed form of the input to the output.  Returns -1 if the
+ * input is too large to be described by the header.
+ */
+int
+lz_compress(const char *in, size_t len, string_t *out)
+{
+	const uint8_t *src = (const uint8_t *)in;
+	uint32_t *table;
+	size_t pos = 0, anchor = 0;
+	char hdr[LZ_HDR_LEN];
+
+	if (len > UINT32_MAX)
+		return (-1);
+
+	/*
+	 * The table maps the hash of four bytes of input to the position
+	 * (plus one, so that zero means empty) at which they were last seen:
+	 */
+	if ((table = calloc((size_t)1 << LZ_HASH_BITS,
+	    sizeof (uint32_t))) == NULL)
+		return (-1);
+
+	hdr[0] = (char)(len >> 24);
+	hdr[1] = (char)(len >> 16);
+	hdr[2] = (char)(len >> 8);
+	hdr[3] = (char)len;
+	dynstr_appendn(out, hdr, sizeof (hdr));
+
+	while (pos + LZ_MIN_MATCH <= len) {
+		uint32_t seq = lz_read32(src + pos);
+		uint32_t h = lz_hash(seq);
+		size_t cand = table[h];
+		size_t mlen;
+
+		table[h] = (uint32_t)pos + 1;
+		if (cand == 0 || pos - (cand - 1) > LZ_MAX_OFFSET ||
+		    lz_read32(src + cand - 1) != seq) {
+			pos++;
+			continue;
+		}
+		cand--;
+
+		for (mlen = LZ_MIN_MATCH; pos + mlen < len &&
+		    src[cand + mlen] == src[pos + mlen]; mlen++)
+			continue;
+
+		lz_put_seq(out, src + anchor, pos - anchor, pos - cand, mlen);
+
+		/*
+		 * Remember the positions within the match too, as they are
+		 * as likely as any to begin a later one:
+		 */
+		for (anchor = pos + mlen, pos++; pos < anchor &&
+		    pos + LZ_MIN_MATCH <= len; pos++) {
+			h = lz_hash(lz_read32(src + pos));
+			table[h] = (uint32_t)pos + 1;
+		}
+		pos = anchor;
+	}
+
+	lz_put_seq(out, src + anchor, len - anchor, 0, 0);
+	free(table);
+
+	return (0);
+}
+
+static int
+lz_get_len(const uint8_t *buf, size_t len, size_t *off, size_t *n)
+{
+	uint8_t b;
+
+	do {
+		if (*off >= len)
+			return (-1);
+		b = buf[(*off)++];
+		*n += b;
+	} while (b == 255);
+
+	return (0);
+}
+
+/*
+ * Append the original form of a compressed buffer to the output.  Returns -1
+ * if the buffer is corrupt, or would decompress to more than "max" bytes.
+ */
+int
+lz_decompress(const char *in, size_t len, size_t max, string_t *out)
+{
+	const uint8_t *src = (const uint8_t *)in;
+	uint8_t *dst;
+	size_t off = LZ_HDR_LEN, olen, opos = 0;
+	int ret = -1;
+
+	if (len < LZ_HDR_LEN)
+		return (-1);
+	olen = (size_t)src[0] << 24 | (size_t)src[1] << 16 |
+	    (size_t)src[2] << 8 | (size_t)src[3];
+	if (olen > max || (dst = malloc(olen > 0 ? olen : 1)) == NULL)
+		return (-1);
+
+	for (;;) {
+		size_t litlen, mlen, moff;
+		uint8_t token;
+
+		if (off >= len)
+			goto out;
+		token = src[off++];
+
+		litlen = token >> 4;
+		if (litlen == 15 && lz_get_len(src, len, &off, &litlen) != 0)
+			goto out;
+		if (litlen > len - off || litlen > olen - opos)
+			goto out;
+		memcpy(dst + opos, src + off, litlen);
+		off += litlen;
+		opos += litlen;
+
+		if (off == len)
+			break;
+
+		if (len - off < 2)
+			goto out;
+		moff = (size_t)src[off] | (size_t)src[off + 1] << 8;
+		off += 2;
+		mlen = token & 0xf;
+		if (mlen == 15 && lz_get_len(src, len, &off, &mlen) != 0)
+			goto out;
+		mlen += LZ_MIN_MATCH;
+		if (moff == 0 || moff > opos || mlen > olen - opos)
+			goto out;
+
+		/*
+		 * The match may overlap the bytes it produces, so it is
+		 * copied one byte at a time:
+		 */
+		for (; mlen > 0; mlen--, opos++)
+			dst[opos] = dst[opos - moff];
+	}
+
+	if (opos == olen) {
+		dynstr_appendn(out, (const char *)dst, olen);
+		ret = 0;
+	}
+
+out:
+	free(dst);
+	return (ret);
+}
@@ -0,0 +1,30 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+#ifndef _LZ_H
+#define	_LZ_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+#include "dynstr.h"
+
+/*
+ * The name by which this compression format is negotiated with the host:
+ */
+#define	LZ_NAME		"lz"
+
+int lz_compress(const char *, size_t, string_t *);
+int lz_decompress(const char *, size_t, size_t, string_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LZ_H */
@@ -0,0 +1,94 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * A single program that provides every command.  It is usually installed
+ * under the name of each command, as "mdata-get" and so on, and runs the one
+ * it was invoked as; it may also be run as "mdata <command> ...".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mdata.h"
+
+#define	MDATA_PREFIX	"mdata-"
+
+typedef enum mdata_exit_codes {
+	MDEC_SUCCESS = 0,
+	MDEC_NOTFOUND = 1,
+	MDEC_ERROR = 2,
+	MDEC_USAGE_ERROR = 3,
+	MDEC_TRY_AGAIN = 10
+} mdata_exit_codes_t;
+
+typedef struct mdata_cmd {
+	const char *mc_name;
+	int (*mc_main)(int, char **);
+} mdata_cmd_t;
+
+static const mdata_cmd_t mdata_cmds[] = {
+	{ "delete",	mdata_delete_main },
+	{ "get",	mdata_get_main },
+	{ "list",	mdata_list_main },
+	{ "prefetch",	mdata_prefetch_main },
+	{ "put",	mdata_put_main },
+	{ "sync",	mdata_sync_main },
+	{ "watch",	mdata_watch_main },
+	{ NULL,		NULL }
+};
+
+static const mdata_cmd_t *
+mdata_lookup(const char *name)
+{
+	const mdata_cmd_t *mc;
+
+	for (mc = mdata_cmds; mc->mc_name != NULL; mc++) {
+		if (strcmp(mc->mc_name, name) == 0)
+			return (mc);
+	}
+
+	return (NULL);
+}
+
+static void
+usage(const char *progname)
+{
+	const mdata_cmd_t *mc;
+
+	fprintf(stderr, "Usage: %s <command> [ <arguments> ]\n\n"
+	    "Commands:\n", progname);
+	for (mc = mdata_cmds; mc->mc_name != NULL; mc++)
+		fprintf(stderr, "    %s\n", mc->mc_name);
+	exit(MDEC_USAGE_ERROR);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *name = strrchr(argv[0], '/');
+	const mdata_cmd_t *mc;
+	char progname[64];
+
+	name = name != NULL ? name + 1 : argv[0];
+
+	if (strncmp(name, MDATA_PREFIX, strlen(MDATA_PREFIX)) == 0 &&
+	    (mc = mdata_lookup(name + strlen(MDATA_PREFIX))) != NULL)
+		return (mc->mc_main(argc, argv));
+
+	if (argc < 2 || (mc = mdata_lookup(argv[1])) == NULL)
+		usage(name);
+
+	/*
+	 * Run the command as though it had been invoked under its own name,
+	 * so that its messages refer to it by that name.
+	 */
+	(void) snprintf(progname, sizeof (progname), "%s%s", MDATA_PREFIX,
+	    mc->mc_name);
+	argv[1] = progname;
+	return (mc->mc_main(argc - 1, argv + 1));
+}
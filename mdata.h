@@ -0,0 +1,29 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+#ifndef _MDATA_H
+#define	_MDATA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Entry points for each of the commands in the multi-call "mdata" program:
+ */
+int mdata_delete_main(int, char **);
+int mdata_get_main(int, char **);
+int mdata_list_main(int, char **);
+int mdata_put_main(int, char **);
+int mdata_sync_main(int, char **);
+int mdata_prefetch_main(int, char **);
+int mdata_watch_main(int, char **);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MDATA_H */
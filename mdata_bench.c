@@ -0,0 +1,742 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * Measure what the link to the metadata service sustains, from inside a
+ * guest.
+ *
+ * A mix of GET, KEYS and PUT requests is made against a set of keys that the
+ * benchmark creates for the purpose (and removes afterwards), either over one
+ * session or with a fresh session for every request.  Requests are kept in
+ * flight up to a fixed concurrency or, with --rate, are started on a fixed
+ * schedule; in the latter case, latency is measured from the time at which a
+ * request was due to start, so that a host that falls behind is not flattered
+ * by the requests that were held back while it did.  The time spent setting
+ * up sessions (in proto_init(), including the reset probe and negotiation)
+ * is reported separately from the time spent making requests.
+ *
+ * It is a development tool, and is not installed; a static build may be
+ * copied into a guest to run it.
+ */
+
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base64.h"
+#include "batch.h"
+#include "common.h"
+#include "dynstr.h"
+#include "proto.h"
+
+typedef enum bench_exit_codes {
+	BEC_SUCCESS = 0,
+	BEC_ERROR = 2,
+	BEC_USAGE_ERROR = 3
+} bench_exit_codes_t;
+
+typedef enum bench_op {
+	BOP_GET = 0,
+	BOP_KEYS,
+	BOP_PUT,
+	BOP_NUM
+} bench_op_t;
+
+static const char *bench_op_names[BOP_NUM] = { "GET", "KEYS", "PUT" };
+
+#define	BENCH_KEY_PREFIX	"mdata-bench"
+
+/*
+ * Latencies are also summarised in power-of-two buckets of microseconds:
+ */
+#define	BENCH_NBUCKETS		40
+
+static const struct option long_options[] = {
+	{ "concurrency", required_argument, NULL, 'c' },
+	{ "duration", required_argument, NULL, 'd' },
+	{ "fresh", no_argument, NULL, 'f' },
+	{ "keys", required_argument, NULL, 'k' },
+	{ "mix", required_argument, NULL, 'm' },
+	{ "rate", required_argument, NULL, 'r' },
+	{ "requests", required_argument, NULL, 'n' },
+	{ "size", required_argument, NULL, 's' },
+	{ NULL, 0, NULL, 0 }
+};
+
+typedef struct bench_stats {
+	uint64_t bs_count;
+	uint64_t bs_errors;
+	uint64_t bs_notfound;
+	uint64_t bs_bytes;
+	uint64_t bs_buckets[BENCH_NBUCKETS];
+} bench_stats_t;
+
+typedef struct bench {
+	/*
+	 * Configuration:
+	 */
+	unsigned int b_weights[BOP_NUM];
+	unsigned int b_weight_total;
+	unsigned int b_concurrency;
+	unsigned long b_requests;
+	long long b_duration_us;
+	double b_rate;
+	size_t b_size;
+	unsigned int b_nkeys;
+	boolean_t b_fresh;
+
+	char **b_keys;
+	char *b_payload;
+
+	/*
+	 * The argument to PUT for each key, which is the key and the value,
+	 * each BASE64-encoded:
+	 */
+	char **b_putargs;
+
+	/*
+	 * Progress:
+	 */
+	unsigned long b_issued;
+	unsigned int b_inflight;
+	boolean_t b_failed;
+	long long b_start_us;
+
+	/*
+	 * Results:
+	 */
+	bench_stats_t b_stats[BOP_NUM];
+	uint64_t *b_lat;
+	size_t b_nlat;
+	size_t b_alloclat;
+	uint64_t b_sessions;
+	uint64_t b_resets;
+	long long b_setup_us;
+	long long b_steady_us;
+	int b_version;
+} bench_t;
+
+typedef struct bench_req {
+	bench_t *br_bench;
+	bench_op_t br_op;
+	long long br_start_us;
+} bench_req_t;
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [--requests <count>] [--duration <seconds>] "
+	    "[--fresh]\n"
+	    "           [--concurrency <count>] [--rate <per second>]\n"
+	    "           [--mix get=<n>,keys=<n>,put=<n>] [--size <bytes>] "
+	    "[--keys <count>]\n", progname);
+	exit(BEC_USAGE_ERROR);
+}
+
+static long long
+bench_now_us(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+
+	return ((long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static int
+parse_count(const char *str, unsigned long max, unsigned long *out)
+{
+	char *end;
+
+	errno = 0;
+	*out = strtoul(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || *out < 1 ||
+	    *out > max)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Parse a mix of the form "get=8,keys=1,put=1"; operations not mentioned are
+ * not made.
+ */
+static int
+parse_mix(bench_t *b, const char *str)
+{
+	char *copy, *tok, *lasts = NULL;
+	int i, ret = -1;
+
+	if ((copy = strdup(str)) == NULL)
+		err(BEC_ERROR, "could not allocate memory");
+
+	bzero(b->b_weights, sizeof (b->b_weights));
+	for (tok = strtok_r(copy, ",", &lasts); tok != NULL;
+	    tok = strtok_r(NULL, ",", &lasts)) {
+		char *eq = strchr(tok, '=');
+		unsigned long w;
+
+		if (eq == NULL)
+			goto out;
+		*eq = '\0';
+		for (i = 0; i < BOP_NUM; i++) {
+			if (strcasecmp(tok, bench_op_names[i]) == 0)
+				break;
+		}
+		if (i == BOP_NUM || parse_count(eq + 1, 1000, &w) != 0)
+			goto out;
+		b->b_weights[i] = (unsigned int)w;
+	}
+
+	b->b_weight_total = 0;
+	for (i = 0; i < BOP_NUM; i++)
+		b->b_weight_total += b->b_weights[i];
+	if (b->b_weight_total > 0)
+		ret = 0;
+
+out:
+	free(copy);
+	return (ret);
+}
+
+static bench_op_t
+bench_pick_op(bench_t *b)
+{
+	unsigned int n = (unsigned int)random() % b->b_weight_total;
+	int i;
+
+	for (i = 0; i < BOP_NUM - 1; i++) {
+		if (n < b->b_weights[i])
+			break;
+		n -= b->b_weights[i];
+	}
+
+	return ((bench_op_t)i);
+}
+
+static void
+bench_record(bench_t *b, bench_op_t op, long long lat_us)
+{
+	bench_stats_t *bs = &b->b_stats[op];
+	uint64_t lat = lat_us > 0 ? (uint64_t)lat_us : 0;
+	int bucket = 0;
+
+	while (bucket < BENCH_NBUCKETS - 1 && (lat >> bucket) > 1)
+		bucket++;
+	bs->bs_buckets[bucket]++;
+
+	if (b->b_nlat == b->b_alloclat) {
+		b->b_alloclat = b->b_alloclat == 0 ? 1024 : b->b_alloclat * 2;
+		if ((b->b_lat = realloc(b->b_lat, b->b_alloclat *
+		    sizeof (uint64_t))) == NULL)
+			err(BEC_ERROR, "could not allocate memory");
+	}
+	b->b_lat[b->b_nlat++] = lat;
+}
+
+static void
+bench_done(mdata_proto_t *mdp __UNUSED, int err, mdata_response_t mdr,
+    string_t *data, void *arg)
+{
+	bench_req_t *br = arg;
+	bench_t *b = br->br_bench;
+	bench_stats_t *bs = &b->b_stats[br->br_op];
+
+	b->b_inflight--;
+	bs->bs_count++;
+
+	if (err != 0) {
+		bs->bs_errors++;
+		b->b_failed = B_TRUE;
+	} else if (mdr == MDR_NOTFOUND) {
+		bs->bs_notfound++;
+	} else if (mdr != MDR_SUCCESS) {
+		bs->bs_errors++;
+	} else {
+		if (data != NULL)
+			bs->bs_bytes += dynstr_len(data);
+		if (br->br_op == BOP_PUT)
+			bs->bs_bytes += b->b_size;
+	}
+
+	if (err == 0)
+		bench_record(b, br->br_op, bench_now_us() - br->br_start_us);
+	free(br);
+}
+
+static void
+bench_submit(bench_t *b, mdata_proto_t *mdp, long long start_us)
+{
+	bench_req_t *br;
+	const char *arg = NULL;
+	unsigned int k;
+
+	if ((br = calloc(1, sizeof (*br))) == NULL)
+		err(BEC_ERROR, "could not allocate memory");
+	br->br_bench = b;
+	br->br_op = bench_pick_op(b);
+	br->br_start_us = start_us;
+
+	k = (unsigned int)random() % b->b_nkeys;
+	switch (br->br_op) {
+	case BOP_GET:
+		arg = b->b_keys[k];
+		break;
+	case BOP_KEYS:
+		break;
+	case BOP_PUT:
+		arg = b->b_putargs[k];
+		break;
+	default:
+		ABORT("bench_submit: unknown operation");
+	}
+
+	b->b_issued++;
+	b->b_inflight++;
+	if (proto_async_submit(mdp, bench_op_names[br->br_op], arg,
+	    bench_done, br) != 0)
+		bench_done(mdp, -1, MDR_UNKNOWN, NULL, br);
+}
+
+/*
+ * Whether we have started every request we are going to.
+ */
+static boolean_t
+bench_finished(bench_t *b, long long now)
+{
+	if (b->b_requests > 0 && b->b_issued >= b->b_requests)
+		return (B_TRUE);
+	if (b->b_duration_us > 0 && now - b->b_start_us >= b->b_duration_us)
+		return (B_TRUE);
+
+	return (B_FALSE);
+}
+
+/*
+ * Start requests as the concurrency (or schedule) allows, and process
+ * responses, until every request has been started and has completed or, if
+ * "once" is set, until one request has.  Returns -1 if the connection
+ * failed.
+ */
+static int
+bench_loop(bench_t *b, mdata_proto_t *mdp, boolean_t once)
+{
+	unsigned long first = b->b_issued;
+	unsigned int limit = once ? 1 : b->b_concurrency;
+
+	b->b_failed = B_FALSE;
+
+	for (;;) {
+		struct pollfd pfd;
+		long long now = bench_now_us(), due = 0;
+		int events, timeout;
+
+		while (!b->b_failed && b->b_inflight < limit &&
+		    !(once && b->b_issued > first) &&
+		    !bench_finished(b, now)) {
+			if (b->b_rate > 0) {
+				due = b->b_start_us + (long long)(b->b_issued *
+				    1e6 / b->b_rate);
+				if (due > now)
+					break;
+			}
+			bench_submit(b, mdp, b->b_rate > 0 ? due : now);
+		}
+
+		if (b->b_inflight == 0) {
+			if (b->b_failed)
+				return (-1);
+			if (bench_finished(b, now) ||
+			    (once && b->b_issued > first))
+				return (0);
+		}
+
+		timeout = proto_async_timeout(mdp);
+		if (b->b_rate > 0 && due > now && b->b_inflight < limit) {
+			int wait_ms = (int)((due - now + 999) / 1000);
+
+			if (timeout == -1 || wait_ms < timeout)
+				timeout = wait_ms;
+		}
+		if (b->b_duration_us > 0 && !bench_finished(b, now)) {
+			int left_ms = (int)((b->b_start_us + b->b_duration_us -
+			    now + 999) / 1000);
+
+			if (timeout == -1 || left_ms < timeout)
+				timeout = left_ms;
+		}
+
+		events = proto_async_events(mdp);
+		pfd.fd = proto_async_fd(mdp);
+		pfd.events = ((events & PROTO_EV_READ) ? POLLIN : 0) |
+		    ((events & PROTO_EV_WRITE) ? POLLOUT : 0);
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(BEC_ERROR, "poll");
+		}
+
+		if (pfd.revents & POLLOUT)
+			(void) proto_async_process_writable(mdp);
+		if (pfd.revents & (POLLIN | POLLERR | POLLHUP))
+			(void) proto_async_process_readable(mdp);
+		(void) proto_async_process_timeout(mdp);
+	}
+}
+
+static mdata_proto_t *
+bench_connect(bench_t *b)
+{
+	mdata_proto_t *mdp;
+	const char *errmsg = NULL;
+	long long t0 = bench_now_us();
+
+	if (proto_init(&mdp, &errmsg) != 0)
+		errx(BEC_ERROR, "could not initialise protocol: %s", errmsg);
+	b->b_setup_us += bench_now_us() - t0;
+	b->b_sessions++;
+	b->b_version = proto_version(mdp);
+
+	return (mdp);
+}
+
+static void
+bench_key_done(int err, mdata_response_t mdr, string_t *data __UNUSED,
+    void *arg)
+{
+	unsigned int *failed = arg;
+
+	if (err != 0 || mdr != MDR_SUCCESS)
+		(*failed)++;
+}
+
+/*
+ * Create (or, if "delete" is set, remove) the keys against which the
+ * benchmark is run.
+ */
+static void
+bench_keys(bench_t *b, mdata_proto_t *mdp, boolean_t delete)
+{
+	mdata_batch_t *mb;
+	unsigned int i, failed = 0;
+
+	if (batch_init(&mb, mdp, BATCH_WINDOW) != 0)
+		err(BEC_ERROR, "could not allocate memory");
+
+	for (i = 0; i < b->b_nkeys; i++) {
+		batch_submit(mb, delete ? "DELETE" : "PUT", delete ?
+		    b->b_keys[i] : b->b_putargs[i], bench_key_done, &failed);
+	}
+
+	(void) batch_run(mb);
+	batch_fini(mb);
+
+	if (failed > 0) {
+		warnx("could not %s %u of %u keys", delete ? "remove" :
+		    "create", failed, b->b_nkeys);
+	}
+}
+
+static void
+bench_run(bench_t *b)
+{
+	mdata_proto_t *mdp;
+	long long t0;
+
+	mdp = bench_connect(b);
+	if (b->b_version == 1 && b->b_weights[BOP_PUT] > 0)
+		errx(BEC_ERROR, "host supports only Version 1 of the protocol, "
+		    "which has no PUT");
+	if (b->b_version > 1)
+		bench_keys(b, mdp, B_FALSE);
+
+	b->b_start_us = bench_now_us();
+	if (!b->b_fresh) {
+		proto_async_set_window(mdp, b->b_concurrency);
+		while (bench_loop(b, mdp, B_FALSE) != 0) {
+			t0 = bench_now_us();
+			if (proto_async_reset(mdp) != 0)
+				errx(BEC_ERROR, "could not reconnect");
+			b->b_setup_us += bench_now_us() - t0;
+			b->b_sessions++;
+			b->b_resets++;
+			proto_async_set_window(mdp, b->b_concurrency);
+		}
+	} else {
+		/*
+		 * Each request has a session of its own, so the sessions that
+		 * set up and tear down the keys are not counted:
+		 */
+		b->b_setup_us = 0;
+		b->b_sessions = 0;
+		proto_fini(mdp);
+
+		while (!bench_finished(b, bench_now_us())) {
+			mdp = bench_connect(b);
+			if (bench_loop(b, mdp, B_TRUE) != 0)
+				b->b_resets++;
+			proto_fini(mdp);
+		}
+		mdp = NULL;
+	}
+	b->b_steady_us = bench_now_us() - b->b_start_us - (b->b_fresh ?
+	    b->b_setup_us : 0);
+
+	if (b->b_version > 1) {
+		if (mdp == NULL) {
+			const char *errmsg;
+
+			if (proto_init(&mdp, &errmsg) != 0)
+				errx(BEC_ERROR, "could not initialise "
+				    "protocol: %s", errmsg);
+		}
+		bench_keys(b, mdp, B_TRUE);
+	}
+	if (mdp != NULL)
+		proto_fini(mdp);
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x < y ? -1 : x > y ? 1 : 0);
+}
+
+static uint64_t
+bench_pct(bench_t *b, double pct)
+{
+	size_t i;
+
+	if (b->b_nlat == 0)
+		return (0);
+
+	i = (size_t)(pct / 100.0 * (double)b->b_nlat);
+	if (i >= b->b_nlat)
+		i = b->b_nlat - 1;
+
+	return (b->b_lat[i]);
+}
+
+/*
+ * Print a histogram of latencies in the manner of DTrace's quantize().
+ */
+static void
+bench_quantize(const bench_stats_t *bs)
+{
+	uint64_t total = 0;
+	int i, lo = -1, hi = -1;
+
+	for (i = 0; i < BENCH_NBUCKETS; i++) {
+		if (bs->bs_buckets[i] == 0)
+			continue;
+		if (lo == -1)
+			lo = i;
+		hi = i;
+		total += bs->bs_buckets[i];
+	}
+	if (total == 0)
+		return;
+	if (lo > 0)
+		lo--;
+	if (hi < BENCH_NBUCKETS - 1)
+		hi++;
+
+	printf("  %14s  %s %s\n", "latency (us)",
+	    "------------- Distribution -------------", "count");
+	for (i = lo; i <= hi; i++) {
+		int bars = (int)((bs->bs_buckets[i] * 40 + total / 2) / total);
+
+		printf("  %14llu |%-40.*s %llu\n", i == 0 ? 0ULL :
+		    1ULL << i, bars, "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@",
+		    (unsigned long long)bs->bs_buckets[i]);
+	}
+}
+
+static void
+bench_report(bench_t *b)
+{
+	uint64_t count = 0, errors = 0, bytes = 0;
+	double steady_s = b->b_steady_us / 1e6;
+	int i;
+
+	for (i = 0; i < BOP_NUM; i++) {
+		count += b->b_stats[i].bs_count;
+		errors += b->b_stats[i].bs_errors;
+		bytes += b->b_stats[i].bs_bytes;
+	}
+	qsort(b->b_lat, b->b_nlat, sizeof (uint64_t), bench_cmp);
+
+	printf("protocol:     version %d\n", b->b_version);
+	printf("mode:         %s, %s\n", b->b_fresh ? "fresh session per "
+	    "request" : "one session", b->b_fresh ? "one at a time" :
+	    b->b_rate > 0 ? "fixed rate" : "fixed concurrency");
+	printf("sessions:     %llu (%llu after a reset)\n",
+	    (unsigned long long)b->b_sessions,
+	    (unsigned long long)b->b_resets);
+	printf("setup:        %.3f ms (mean %.3f ms per session)\n",
+	    b->b_setup_us / 1e3, b->b_sessions > 0 ?
+	    b->b_setup_us / 1e3 / b->b_sessions : 0.0);
+	printf("steady state: %.3f ms\n", b->b_steady_us / 1e3);
+	printf("requests:     %llu (%llu errors)\n",
+	    (unsigned long long)count, (unsigned long long)errors);
+	printf("throughput:   %.1f requests/s, %.1f KiB/s\n",
+	    steady_s > 0 ? count / steady_s : 0.0,
+	    steady_s > 0 ? bytes / 1024.0 / steady_s : 0.0);
+	printf("latency (us): p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, "
+	    "max %llu\n", (unsigned long long)bench_pct(b, 50),
+	    (unsigned long long)bench_pct(b, 90),
+	    (unsigned long long)bench_pct(b, 99),
+	    (unsigned long long)bench_pct(b, 99.9),
+	    (unsigned long long)bench_pct(b, 100));
+
+	for (i = 0; i < BOP_NUM; i++) {
+		bench_stats_t *bs = &b->b_stats[i];
+
+		if (bs->bs_count == 0)
+			continue;
+		printf("\n%s: %llu requests, %llu not found, %llu errors, "
+		    "%llu bytes\n", bench_op_names[i],
+		    (unsigned long long)bs->bs_count,
+		    (unsigned long long)bs->bs_notfound,
+		    (unsigned long long)bs->bs_errors,
+		    (unsigned long long)bs->bs_bytes);
+		bench_quantize(bs);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_t b;
+	unsigned long n;
+	unsigned int i;
+	char *endp;
+	int opt, ms;
+
+	bzero(&b, sizeof (b));
+	b.b_weights[BOP_GET] = 8;
+	b.b_weights[BOP_KEYS] = 1;
+	b.b_weights[BOP_PUT] = 1;
+	b.b_weight_total = 10;
+	b.b_concurrency = 1;
+	b.b_size = 64;
+	b.b_nkeys = 16;
+
+	while ((opt = getopt_long(argc, argv, "+", long_options,
+	    NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			if (parse_count(optarg, 4096, &n) != 0)
+				errx(BEC_USAGE_ERROR, "invalid concurrency: %s",
+				    optarg);
+			b.b_concurrency = (unsigned int)n;
+			break;
+		case 'd':
+			if (parse_seconds(optarg, &ms) != 0 || ms < 1)
+				errx(BEC_USAGE_ERROR, "invalid duration: %s",
+				    optarg);
+			b.b_duration_us = (long long)ms * 1000;
+			break;
+		case 'f':
+			b.b_fresh = B_TRUE;
+			break;
+		case 'k':
+			if (parse_count(optarg, 100000, &n) != 0)
+				errx(BEC_USAGE_ERROR, "invalid key count: %s",
+				    optarg);
+			b.b_nkeys = (unsigned int)n;
+			break;
+		case 'm':
+			if (parse_mix(&b, optarg) != 0)
+				errx(BEC_USAGE_ERROR, "invalid mix: %s",
+				    optarg);
+			break;
+		case 'n':
+			if (parse_count(optarg, ULONG_MAX, &b.b_requests) != 0)
+				errx(BEC_USAGE_ERROR, "invalid request count: "
+				    "%s", optarg);
+			break;
+		case 'r':
+			errno = 0;
+			b.b_rate = strtod(optarg, &endp);
+			if (errno != 0 || *endp != '\0' || b.b_rate <= 0)
+				errx(BEC_USAGE_ERROR, "invalid rate: %s",
+				    optarg);
+			break;
+		case 's':
+			if (parse_count(optarg, 16 * 1024 * 1024, &n) != 0)
+				errx(BEC_USAGE_ERROR, "invalid size: %s",
+				    optarg);
+			b.b_size = (size_t)n;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc != optind)
+		usage(argv[0]);
+
+	if (b.b_requests == 0 && b.b_duration_us == 0)
+		b.b_requests = 1000;
+
+	/*
+	 * Under a fixed rate, the concurrency is only a limit, so that a host
+	 * that stops answering does not have requests piled upon it without
+	 * end:
+	 */
+	if (b.b_rate > 0 && b.b_concurrency == 1)
+		b.b_concurrency = 64;
+
+	srandom((unsigned int)(getpid() ^ time(NULL)));
+
+	if ((b.b_payload = malloc(b.b_size + 1)) == NULL ||
+	    (b.b_keys = calloc(b.b_nkeys, sizeof (char *))) == NULL ||
+	    (b.b_putargs = calloc(b.b_nkeys, sizeof (char *))) == NULL)
+		err(BEC_ERROR, "could not allocate memory");
+	for (i = 0; i < b.b_size; i++)
+		b.b_payload[i] = "abcdefghijklmnopqrstuvwxyz0123456789"[
+		    random() % 36];
+	b.b_payload[b.b_size] = '\0';
+	for (i = 0; i < b.b_nkeys; i++) {
+		string_t *arg = dynstr_new();
+		char key[64];
+
+		(void) snprintf(key, sizeof (key), "%s.%d.%u", BENCH_KEY_PREFIX,
+		    (int)getpid(), i);
+		if ((b.b_keys[i] = strdup(key)) == NULL)
+			err(BEC_ERROR, "could not allocate memory");
+
+		base64_encode(b.b_keys[i], strlen(b.b_keys[i]), arg);
+		dynstr_append(arg, " ");
+		base64_encode(b.b_payload, b.b_size, arg);
+		if ((b.b_putargs[i] = strdup(dynstr_cstr(arg))) == NULL)
+			err(BEC_ERROR, "could not allocate memory");
+		dynstr_free(arg);
+	}
+
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	bench_run(&b);
+	bench_report(&b);
+
+	return (BEC_SUCCESS);
+}
@@ -10,16 +10,22 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
 
+#include "batch.h"
 #include "common.h"
 #include "dynstr.h"
+#include "mdata.h"
+#include "keyidx.h"
 #include "plat.h"
+#include "prefetch.h"
 #include "proto.h"
+#include "spool.h"
 
 typedef enum mdata_exit_codes {
 	MDEC_SUCCESS = 0,
@@ -31,6 +37,41 @@ typedef enum mdata_exit_codes {
 
 static char *keyname;
 
+static const struct option long_options[] = {
+	{ "dry-run", no_argument, NULL, 'n' },
+	{ "glob", required_argument, NULL, 'g' },
+	{ "lock-timeout", required_argument, NULL, 'T' },
+	{ "prefix", required_argument, NULL, 'p' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/*
+ * State for the deletion of every key that matches a prefix or pattern:
+ */
+typedef struct delete_match {
+	mdata_batch_t *dm_batch;
+	const char *dm_prefix;
+	const char *dm_glob;
+	boolean_t dm_dry_run;
+	unsigned int dm_matched;
+	unsigned int dm_failed;
+} delete_match_t;
+
+typedef struct delete_item {
+	delete_match_t *di_match;
+	char *di_key;
+} delete_item_t;
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [--lock-timeout <seconds>] <keyname>\n"
+	    "       %s [--lock-timeout <seconds>] [--dry-run] "
+	    "{ --prefix <prefix> | --glob <pattern> }\n",
+	    progname, progname);
+	exit(MDEC_USAGE_ERROR);
+}
+
 static int
 print_response(mdata_response_t mdr, string_t *data)
 {
@@ -53,16 +94,153 @@ print_response(mdata_response_t mdr, string_t *data)
 	}
 }
 
+static void
+delete_match_done(int err, mdata_response_t mdr, string_t *data, void *arg)
+{
+	delete_item_t *di = arg;
+	delete_match_t *dm = di->di_match;
+
+	/*
+	 * A key that has gone away since we listed it is as good as deleted.
+	 */
+	if (err != 0) {
+		fprintf(stderr, "ERROR: could not execute DELETE for key "
+		    "'%s'\n", di->di_key);
+	} else if (mdr != MDR_SUCCESS && mdr != MDR_NOTFOUND) {
+		fprintf(stderr, "Error deleting metadata key '%s': %s\n",
+		    di->di_key, dynstr_len(data) > 0 ? dynstr_cstr(data) :
+		    "unknown error");
+	}
+
+	if (err != 0 || (mdr != MDR_SUCCESS && mdr != MDR_NOTFOUND)) {
+		dm->dm_failed++;
+		printf("error\t%s\n", di->di_key);
+	} else {
+		printf("ok\t%s\n", di->di_key);
+	}
+
+	free(di->di_key);
+	free(di);
+}
+
+static int
+delete_one(keyidx_t *ki, const keyidx_ent_t *ke, void *arg)
+{
+	delete_match_t *dm = arg;
+	delete_item_t *di;
+
+	if (dm->dm_dry_run) {
+		(void) fwrite(ke->ke_name, 1, ke->ke_len, stdout);
+		(void) putchar('\n');
+		return (0);
+	}
+
+	if ((di = calloc(1, sizeof (*di))) == NULL ||
+	    (di->di_key = strdup(keyidx_cstr(ki, ke))) == NULL)
+		ABORT("delete_one: could not allocate memory");
+	di->di_match = dm;
+	prefetch_forget(di->di_key);
+	spool_discard(di->di_key);
+	batch_submit(dm->dm_batch, "DELETE", di->di_key, delete_match_done, di);
+	return (0);
+}
+
+/*
+ * List the keys once, then delete each that matches over the same
+ * connection.  The listing is filtered here, rather than by the host, as the
+ * protocol has no way to ask for a subset of the keys.
+ */
+static int
+delete_matching(mdata_proto_t *mdp, delete_match_t *dm)
+{
+	mdata_response_t mdr;
+	string_t *data;
+	keyidx_t ki;
+
+	if (proto_execute(mdp, "KEYS", NULL, &mdr, &data) != 0) {
+		fprintf(stderr, "ERROR: could not execute KEYS\n");
+		return (MDEC_ERROR);
+	}
+
+	if (mdr != MDR_SUCCESS) {
+		fprintf(stderr, "Error listing metadata keys: %s\n",
+		    dynstr_len(data) > 0 ? dynstr_cstr(data) :
+		    "unknown error");
+		return (MDEC_ERROR);
+	}
+
+	if ((!dm->dm_dry_run && batch_init(&dm->dm_batch, mdp,
+	    BATCH_WINDOW) != 0) || keyidx_init(&ki, dynstr_len(data) > 0 ?
+	    dynstr_cstr(data) : "", dynstr_len(data)) != 0) {
+		fprintf(stderr, "ERROR: could not allocate memory\n");
+		return (MDEC_ERROR);
+	}
+
+	/*
+	 * Every DELETE is queued before any is sent, so the response to KEYS
+	 * remains intact for as long as the index refers to it.
+	 */
+	dm->dm_matched = (unsigned int)keyidx_walk(&ki, dm->dm_prefix,
+	    dm->dm_glob, delete_one, dm);
+	keyidx_fini(&ki);
+
+	if (dm->dm_dry_run) {
+		fprintf(stderr, "%u matching key%s would be deleted\n",
+		    dm->dm_matched, dm->dm_matched == 1 ? "" : "s");
+		return (MDEC_SUCCESS);
+	}
+
+	(void) batch_run(dm->dm_batch);
+	batch_fini(dm->dm_batch);
+
+	fprintf(stderr, "Deleted %u of %u matching key%s\n",
+	    dm->dm_matched - dm->dm_failed, dm->dm_matched,
+	    dm->dm_matched == 1 ? "" : "s");
+
+	return (dm->dm_failed > 0 ? MDEC_ERROR : MDEC_SUCCESS);
+}
+
 int
-main(int argc, char **argv)
+mdata_delete_main(int argc, char **argv)
 {
 	mdata_proto_t *mdp;
 	mdata_response_t mdr;
 	string_t *data;
 	const char *errmsg = NULL;
+	delete_match_t dm;
+	int opt, ms;
+
+	bzero(&dm, sizeof (dm));
+
+	while ((opt = getopt_long(argc, argv, "+", long_options,
+	    NULL)) != -1) {
+		switch (opt) {
+		case 'T':
+			if (parse_seconds(optarg, &ms) != 0) {
+				errx(MDEC_USAGE_ERROR,
+				    "invalid lock timeout: %s", optarg);
+			}
+			plat_set_lock_timeout(ms);
+			break;
+		case 'p':
+			dm.dm_prefix = optarg;
+			break;
+		case 'g':
+			dm.dm_glob = optarg;
+			break;
+		case 'n':
+			dm.dm_dry_run = B_TRUE;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
 
-	if (argc < 2) {
-		errx(MDEC_USAGE_ERROR, "Usage: %s <keyname>", argv[0]);
+	if (dm.dm_prefix != NULL || dm.dm_glob != NULL) {
+		if (argc - optind != 0)
+			usage(argv[0]);
+	} else if (dm.dm_dry_run || argc - optind < 1) {
+		usage(argv[0]);
 	}
 
 	if (proto_init(&mdp, &errmsg) != 0) {
@@ -76,7 +254,17 @@ main(int argc, char **argv)
 		return (MDEC_ERROR);
 	}
 
-	keyname = strdup(argv[1]);
+	if (dm.dm_prefix != NULL || dm.dm_glob != NULL)
+		return (delete_matching(mdp, &dm));
+
+	keyname = strdup(argv[optind]);
+	prefetch_forget(keyname);
+
+	/*
+	 * A write that is still spooled for this key would otherwise bring it
+	 * back once sent:
+	 */
+	spool_discard(keyname);
 
 	if (proto_execute(mdp, "DELETE", keyname, &mdr, &data) != 0) {
 		fprintf(stderr, "ERROR: could not execute GET\n");
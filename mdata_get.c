@@ -10,6 +10,7 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,20 +18,126 @@
 #include <unistd.h>
 
 #include "common.h"
+#include "crc32.h"
 #include "dynstr.h"
+#include "mdata.h"
+#include "fsutil.h"
 #include "plat.h"
+#include "prefetch.h"
 #include "proto.h"
+#include "serve.h"
+#include "sflight.h"
 
 typedef enum mdata_exit_codes {
 	MDEC_SUCCESS = 0,
 	MDEC_NOTFOUND = 1,
 	MDEC_ERROR = 2,
 	MDEC_USAGE_ERROR = 3,
+	MDEC_UNCHANGED = 4,
 	MDEC_TRY_AGAIN = 10
 } mdata_exit_codes_t;
 
 static char *keyname;
 
+/*
+ * Where to write the value, if not to stdout, and whether to leave the file
+ * alone if it already holds the value:
+ */
+static const char *output;
+static const char *digestfile;
+static boolean_t if_changed = B_FALSE;
+
+static const struct option long_options[] = {
+	{ "digest-file", required_argument, NULL, 'd' },
+	{ "if-changed", no_argument, NULL, 'c' },
+	{ "lock-timeout", required_argument, NULL, 'T' },
+	{ "output", required_argument, NULL, 'o' },
+	{ "serve", no_argument, NULL, 's' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [--lock-timeout <seconds>] "
+	    "[--output <file> [--if-changed] [--digest-file <file>]]\n"
+	    "           <keyname>\n"
+	    "       %s [--lock-timeout <seconds>] --serve\n", progname,
+	    progname);
+	exit(MDEC_USAGE_ERROR);
+}
+
+/*
+ * Determine whether the output file already holds the value.  If we keep a
+ * digest of what we last wrote, compare against that rather than reading
+ * the file back.
+ */
+static boolean_t
+output_unchanged(const char *val, size_t len)
+{
+	string_t *cur = dynstr_new();
+	boolean_t same = B_FALSE;
+	unsigned long sz;
+	unsigned int crc;
+	struct stat st;
+
+	if (stat(output, &st) != 0 || !S_ISREG(st.st_mode))
+		goto out;
+
+	if (digestfile != NULL) {
+		if (fs_read_file(digestfile, cur) == 0 && dynstr_len(cur) > 0 &&
+		    sscanf(dynstr_cstr(cur), "%x %lu", &crc, &sz) == 2) {
+			same = (crc == crc32_calc(val, len) && sz == len);
+		}
+	} else if ((size_t)st.st_size == len &&
+	    fs_read_file(output, cur) == 0 && dynstr_len(cur) == len) {
+		same = (len == 0 || memcmp(dynstr_cstr(cur), val, len) == 0);
+	}
+
+out:
+	dynstr_free(cur);
+	return (same);
+}
+
+/*
+ * Replace the output file with the value.  The file keeps its permissions,
+ * if it already exists.
+ */
+static int
+write_output(string_t *data)
+{
+	size_t len = dynstr_len(data);
+	const char *val = len > 0 ? dynstr_cstr(data) : "";
+	mode_t mode = 0644;
+	struct stat st;
+	char digest[32];
+
+	if (if_changed && output_unchanged(val, len))
+		return (MDEC_UNCHANGED);
+
+	if (stat(output, &st) == 0)
+		mode = st.st_mode & 07777;
+
+	if (fs_write_atomic(output, val, len, mode) != 0) {
+		fprintf(stderr, "ERROR: could not write '%s': %s\n", output,
+		    strerror(errno));
+		return (MDEC_ERROR);
+	}
+
+	if (digestfile != NULL) {
+		(void) snprintf(digest, sizeof (digest), "%08x %lu\n",
+		    (unsigned int)crc32_calc(val, len), (unsigned long)len);
+		if (fs_write_atomic(digestfile, digest, strlen(digest),
+		    0644) != 0) {
+			fprintf(stderr, "ERROR: could not write '%s': %s\n",
+			    digestfile, strerror(errno));
+			return (MDEC_ERROR);
+		}
+	}
+
+	return (MDEC_SUCCESS);
+}
+
 static int
 print_response(mdata_response_t mdr, string_t *data)
 {
@@ -39,6 +146,8 @@ print_response(mdata_response_t mdr, string_t *data)
 
 	switch (mdr) {
 	case MDR_SUCCESS:
+		if (output != NULL)
+			return (write_output(data));
 		fprintf(stdout, "%s", cstr);
 		if (len < 1 || cstr[len - 1] != '\n')
 			fprintf(stdout, "\n");
@@ -60,29 +169,92 @@ print_response(mdata_response_t mdr, string_t *data)
 }
 
 int
-main(int argc, char **argv)
+mdata_get_main(int argc, char **argv)
 {
 	mdata_proto_t *mdp;
 	mdata_response_t mdr;
 	string_t *data;
 	const char *errmsg = NULL;
+	sflight_t *sf = NULL;
+	boolean_t serve = B_FALSE;
+	int opt, ms;
+
+	while ((opt = getopt_long(argc, argv, "+", long_options,
+	    NULL)) != -1) {
+		switch (opt) {
+		case 'T':
+			if (parse_seconds(optarg, &ms) != 0) {
+				errx(MDEC_USAGE_ERROR,
+				    "invalid lock timeout: %s", optarg);
+			}
+			plat_set_lock_timeout(ms);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'c':
+			if_changed = B_TRUE;
+			break;
+		case 'd':
+			digestfile = optarg;
+			break;
+		case 's':
+			serve = B_TRUE;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
 
-	if (argc < 2) {
-		errx(MDEC_USAGE_ERROR, "Usage: %s <keyname>", argv[0]);
+	/*
+	 * Serve requests of every kind, read from stdin, over one connection
+	 * for as long as stdin stays open:
+	 */
+	if (serve) {
+		if (argc != optind || output != NULL || if_changed ||
+		    digestfile != NULL)
+			usage(argv[0]);
+		return (serve_run(stdin, stdout) == 0 ? MDEC_SUCCESS :
+		    MDEC_ERROR);
 	}
 
+	if (argc - optind < 1 || (output == NULL && (if_changed ||
+	    digestfile != NULL)))
+		usage(argv[0]);
+
+	keyname = strdup(argv[optind]);
+
+	/*
+	 * Early in boot, the key may have been fetched already by
+	 * mdata-prefetch:
+	 */
+	if (prefetch_lookup(keyname, &mdr, &data) == 0)
+		return (print_response(mdr, data));
+
+	/*
+	 * If another process is already fetching this key, wait for and
+	 * share its result rather than making our own request:
+	 */
+	if (sflight_begin(keyname, &sf, &mdr, &data) == SFR_FOLLOWER)
+		return (print_response(mdr, data));
+
 	if (proto_init(&mdp, &errmsg) != 0) {
 		fprintf(stderr, "ERROR: could not initialise protocol: %s\n",
 		    errmsg);
+		if (sf != NULL)
+			sflight_abandon(sf);
 		return (MDEC_ERROR);
 	}
 
-	keyname = strdup(argv[1]);
-
 	if (proto_execute(mdp, "GET", keyname, &mdr, &data) != 0) {
 		fprintf(stderr, "ERROR: could not execute GET\n");
+		if (sf != NULL)
+			sflight_abandon(sf);
 		return (MDEC_ERROR);
 	}
 
+	if (sf != NULL)
+		sflight_publish(sf, mdr, data);
+
 	return (print_response(mdr, data));
 }
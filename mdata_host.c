@@ -0,0 +1,745 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * A reference implementation of the host side of the metadata protocol,
+ * serving an in-memory key store on a UNIX domain socket.  It speaks
+ * Versions 1, 2 and 3 of the protocol, so that the client may be exercised
+ * (by pointing MDATA_SOCKET at the socket) without a hypervisor.  It is a
+ * development tool, and is not installed.
+ *
+ * Responses to Version 3 requests that arrive together are sent with their
+ * chunks interleaved, as a host is entitled to do, so that the client's
+ * reassembly of chunked responses is exercised as well.
+ *
+ * Unless started with --no-compress, it agrees to a client's request to
+ * compress payloads, and then compresses any response of HOST_COMPRESS_MIN
+ * bytes or more that is made smaller by it.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "base64.h"
+#include "common.h"
+#include "crc32.h"
+#include "dynstr.h"
+#include "lz.h"
+
+#define	HOST_MAX_CLIENTS	256
+#define	HOST_COMPRESS_MIN	1024
+#define	HOST_LZ_MAX		(64 * 1024 * 1024)
+
+#define	V2_LZ_MARK		'~'
+
+#define	V3_HDR_LEN		16
+#define	V3_FLAG_MORE		0x01
+#define	V3_FLAG_LZ		0x02
+#define	V3_FRAME_MAX		(16 * 1024 * 1024)
+
+static const struct option long_options[] = {
+	{ "chunk", required_argument, NULL, 'c' },
+	{ "max-version", required_argument, NULL, 'v' },
+	{ "no-compress", no_argument, NULL, 'n' },
+	{ NULL, 0, NULL, 0 }
+};
+
+typedef struct host_key host_key_t;
+
+struct host_key {
+	string_t *hk_name;
+	string_t *hk_value;
+	host_key_t *hk_next;
+};
+
+/*
+ * A Version 3 request of which only some chunks have arrived, or a response
+ * of which only some chunks have been sent:
+ */
+typedef struct host_msg host_msg_t;
+
+struct host_msg {
+	uint32_t hm_id;
+	unsigned char hm_flags;
+	string_t *hm_cmd;
+	string_t *hm_payload;
+	size_t hm_off;
+	host_msg_t *hm_next;
+};
+
+typedef struct host_client {
+	int hc_fd;
+	int hc_version;
+	boolean_t hc_compress;
+	string_t *hc_rx;
+	size_t hc_rxoff;
+	string_t *hc_tx;
+	size_t hc_txoff;
+	host_msg_t *hc_partial;
+	host_msg_t *hc_replies;
+	host_msg_t **hc_rtail;
+} host_client_t;
+
+static host_key_t *keys;
+static int max_version = 3;
+static size_t chunk_size = 64 * 1024;
+static boolean_t allow_compress = B_TRUE;
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [--max-version <1|2|3>] "
+	    "[--chunk <bytes>] [--no-compress] <socket>\n", progname);
+	exit(3);
+}
+
+static host_key_t *
+key_find(const char *name, size_t len, host_key_t ***prevp)
+{
+	host_key_t **hkp, *hk;
+
+	for (hkp = &keys; (hk = *hkp) != NULL; hkp = &hk->hk_next) {
+		if (dynstr_len(hk->hk_name) == len &&
+		    memcmp(dynstr_cstr(hk->hk_name), name, len) == 0)
+			break;
+	}
+
+	if (prevp != NULL)
+		*prevp = hkp;
+	return (hk);
+}
+
+static void
+key_put(const char *name, size_t nlen, const char *val, size_t vlen)
+{
+	host_key_t **prevp, *hk;
+
+	if ((hk = key_find(name, nlen, &prevp)) == NULL) {
+		if ((hk = calloc(1, sizeof (*hk))) == NULL)
+			err(1, "could not allocate memory");
+		hk->hk_name = dynstr_new();
+		hk->hk_value = dynstr_new();
+		dynstr_appendn(hk->hk_name, name, nlen);
+		*prevp = hk;
+	}
+
+	dynstr_reset(hk->hk_value);
+	dynstr_appendn(hk->hk_value, val, vlen);
+}
+
+static void
+key_delete(const char *name, size_t len)
+{
+	host_key_t **prevp, *hk;
+
+	if ((hk = key_find(name, len, &prevp)) == NULL)
+		return;
+
+	*prevp = hk->hk_next;
+	dynstr_free(hk->hk_name);
+	dynstr_free(hk->hk_value);
+	free(hk);
+}
+
+static void
+key_list(string_t *out)
+{
+	host_key_t *hk;
+
+	for (hk = keys; hk != NULL; hk = hk->hk_next) {
+		if (hk != keys)
+			dynstr_appendc(out, '\n');
+		dynstr_appendn(out, dynstr_cstr(hk->hk_name),
+		    dynstr_len(hk->hk_name));
+	}
+}
+
+/*
+ * Carry out a Version 2 or Version 3 request, returning the response code
+ * and filling in the response payload.
+ */
+static const char *
+host_command(host_client_t *hc, const char *cmd, const char *arg,
+    size_t alen, string_t *out)
+{
+	host_key_t *hk;
+
+	if (strcmp(cmd, "COMPRESS") == 0) {
+		const char *p = arg, *end = arg + alen, *sp;
+
+		/*
+		 * The client lists the formats it supports; we pick the
+		 * first we know, if we are allowed to:
+		 */
+		while (allow_compress && p < end) {
+			if ((sp = memchr(p, ' ', (size_t)(end - p))) == NULL)
+				sp = end;
+			if ((size_t)(sp - p) == strlen(LZ_NAME) &&
+			    memcmp(p, LZ_NAME, (size_t)(sp - p)) == 0) {
+				hc->hc_compress = B_TRUE;
+				dynstr_append(out, LZ_NAME);
+				return ("SUCCESS");
+			}
+			p = sp + 1;
+		}
+		return ("FAILURE");
+
+	} else if (strcmp(cmd, "GET") == 0) {
+		if ((hk = key_find(arg, alen, NULL)) == NULL)
+			return ("NOTFOUND");
+		dynstr_appendn(out, dynstr_cstr(hk->hk_value),
+		    dynstr_len(hk->hk_value));
+		return ("SUCCESS");
+
+	} else if (strcmp(cmd, "KEYS") == 0) {
+		key_list(out);
+		return ("SUCCESS");
+
+	} else if (strcmp(cmd, "DELETE") == 0) {
+		key_delete(arg, alen);
+		return ("SUCCESS");
+
+	} else if (strcmp(cmd, "PUT") == 0) {
+		const char *sp = memchr(arg, ' ', alen);
+		string_t *name, *val;
+		const char *code = "SUCCESS";
+
+		if (sp == NULL)
+			return ("FAILURE");
+
+		name = dynstr_new();
+		val = dynstr_new();
+		if (base64_decode(arg, (size_t)(sp - arg), name) == -1 ||
+		    base64_decode(sp + 1, alen - (size_t)(sp - arg) - 1,
+		    val) == -1) {
+			code = "FAILURE";
+		} else {
+			key_put(dynstr_cstr(name), dynstr_len(name),
+			    dynstr_cstr(val), dynstr_len(val));
+		}
+		dynstr_free(name);
+		dynstr_free(val);
+		return (code);
+	}
+
+	return ("FAILURE");
+}
+
+/*
+ * Compress a response payload in place, if compression has been agreed with
+ * the client, the payload is large enough, and it is made smaller by it.
+ */
+static boolean_t
+host_compress(host_client_t *hc, string_t **outp)
+{
+	string_t *packed;
+
+	if (!hc->hc_compress || dynstr_len(*outp) < HOST_COMPRESS_MIN)
+		return (B_FALSE);
+
+	packed = dynstr_new();
+	if (lz_compress(dynstr_cstr(*outp), dynstr_len(*outp), packed) != 0 ||
+	    dynstr_len(packed) >= dynstr_len(*outp)) {
+		dynstr_free(packed);
+		return (B_FALSE);
+	}
+
+	dynstr_free(*outp);
+	*outp = packed;
+	return (B_TRUE);
+}
+
+static void
+host_v1(host_client_t *hc, const char *line)
+{
+	host_key_t *hk;
+
+	if (strcmp(line, "NEGOTIATE V2") == 0 && max_version >= 2) {
+		hc->hc_version = 2;
+		dynstr_append(hc->hc_tx, "V2_OK\n");
+
+	} else if (strcmp(line, "NEGOTIATE V3") == 0 && max_version >= 3) {
+		hc->hc_version = 3;
+		dynstr_append(hc->hc_tx, "V3_OK\n");
+
+	} else if (strncmp(line, "GET ", 4) == 0 || strcmp(line, "KEYS") == 0) {
+		string_t *val = dynstr_new();
+		const char *p, *nl;
+
+		if (line[0] == 'K') {
+			key_list(val);
+		} else if ((hk = key_find(line + 4, strlen(line + 4),
+		    NULL)) != NULL) {
+			dynstr_appendn(val, dynstr_cstr(hk->hk_value),
+			    dynstr_len(hk->hk_value));
+		} else {
+			dynstr_append(hc->hc_tx, "NOTFOUND\n");
+			dynstr_free(val);
+			return;
+		}
+
+		/*
+		 * The value is sent one line at a time, with a leading "."
+		 * escaped by another, and terminated by a line with only a
+		 * "." on it:
+		 */
+		dynstr_append(hc->hc_tx, "SUCCESS\n");
+		for (p = dynstr_len(val) > 0 ? dynstr_cstr(val) : "";
+		    *p != '\0'; p = nl + 1) {
+			if ((nl = strchr(p, '\n')) == NULL)
+				nl = p + strlen(p);
+			if (*p == '.')
+				dynstr_appendc(hc->hc_tx, '.');
+			dynstr_appendn(hc->hc_tx, p, (size_t)(nl - p));
+			dynstr_appendc(hc->hc_tx, '\n');
+			if (*nl == '\0')
+				break;
+		}
+		dynstr_append(hc->hc_tx, ".\n");
+		dynstr_free(val);
+
+	} else {
+		dynstr_append(hc->hc_tx, "invalid command\n");
+	}
+}
+
+static void
+host_v2(host_client_t *hc, const char *line)
+{
+	char reqid[9], cmd[32], hdr[64];
+	string_t *arg = dynstr_new();
+	string_t *out = dynstr_new();
+	string_t *body = dynstr_new();
+	const char *code, *p;
+	unsigned long clen;
+	char *endp;
+
+	/*
+	 * "V2 <clen> <crc32> <reqid> <command>[ <base64 payload>]"
+	 */
+	clen = strtoul(line + 3, &endp, 10);
+	if (*endp != ' ' || strtoul(endp, &endp, 16) == 0 || *endp != ' ')
+		goto out;
+	p = endp + 1;
+	if (strlen(p) != clen || crc32_calc(p, clen) !=
+	    strtoul(strchr(line + 3, ' ') + 1, NULL, 16))
+		goto out;
+
+	if (sscanf(p, "%8s %31s", reqid, cmd) != 2)
+		goto out;
+	if ((p = strchr(strchr(p, ' ') + 1, ' ')) != NULL) {
+		if (p[1] != V2_LZ_MARK) {
+			if (base64_decode(p + 1, strlen(p + 1), arg) == -1)
+				goto out;
+		} else {
+			string_t *packed = dynstr_new();
+			int r;
+
+			r = base64_decode(p + 2, strlen(p + 2), packed);
+			if (r == 0)
+				r = lz_decompress(dynstr_cstr(packed),
+				    dynstr_len(packed), HOST_LZ_MAX, arg);
+			dynstr_free(packed);
+			if (r != 0)
+				goto out;
+		}
+	}
+
+	code = host_command(hc, cmd, dynstr_cstr(arg), dynstr_len(arg), out);
+
+	dynstr_append(body, reqid);
+	dynstr_append(body, " ");
+	dynstr_append(body, code);
+	if (dynstr_len(out) > 0) {
+		dynstr_append(body, " ");
+		if (host_compress(hc, &out))
+			dynstr_appendc(body, V2_LZ_MARK);
+		base64_encode(dynstr_cstr(out), dynstr_len(out), body);
+	}
+	(void) snprintf(hdr, sizeof (hdr), "V2 %u %08x ",
+	    (unsigned int)dynstr_len(body),
+	    crc32_calc(dynstr_cstr(body), dynstr_len(body)));
+	dynstr_append(hc->hc_tx, hdr);
+	dynstr_append(hc->hc_tx, dynstr_cstr(body));
+	dynstr_append(hc->hc_tx, "\n");
+
+out:
+	dynstr_free(arg);
+	dynstr_free(out);
+	dynstr_free(body);
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | (uint32_t)p[3]);
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static host_msg_t *
+msg_new(uint32_t id)
+{
+	host_msg_t *hm;
+
+	if ((hm = calloc(1, sizeof (*hm))) == NULL)
+		err(1, "could not allocate memory");
+	hm->hm_id = id;
+	hm->hm_cmd = dynstr_new();
+	hm->hm_payload = dynstr_new();
+
+	return (hm);
+}
+
+static void
+msg_free(host_msg_t *hm)
+{
+	dynstr_free(hm->hm_cmd);
+	dynstr_free(hm->hm_payload);
+	free(hm);
+}
+
+/*
+ * Handle one Version 3 frame.  Returns the number of bytes consumed, 0 if
+ * the frame is incomplete, or -1 if it is corrupt.
+ */
+static ssize_t
+host_v3(host_client_t *hc, const unsigned char *buf, size_t len)
+{
+	host_msg_t **hmp, *hm;
+	size_t clen, plen;
+	uint32_t id;
+
+	if (len < V3_HDR_LEN)
+		return (0);
+	if (buf[0] != 'V' || buf[1] != '3' || buf[3] == 0 ||
+	    get32(buf + 8) > V3_FRAME_MAX)
+		return (-1);
+
+	clen = buf[3];
+	plen = get32(buf + 8);
+	if (len < V3_HDR_LEN + clen + plen)
+		return (0);
+	if (crc32_calc((const char *)buf + V3_HDR_LEN, clen + plen) !=
+	    get32(buf + 12))
+		return (-1);
+
+	/*
+	 * Find the earlier chunks of this request, if any:
+	 */
+	id = get32(buf + 4);
+	for (hmp = &hc->hc_partial; (hm = *hmp) != NULL; hmp = &hm->hm_next) {
+		if (hm->hm_id == id)
+			break;
+	}
+	if (hm == NULL) {
+		hm = msg_new(id);
+		dynstr_appendn(hm->hm_cmd, (const char *)buf + V3_HDR_LEN,
+		    clen);
+		*hmp = hm;
+	}
+	dynstr_appendn(hm->hm_payload, (const char *)buf + V3_HDR_LEN + clen,
+	    plen);
+
+	if (!(buf[2] & V3_FLAG_MORE)) {
+		string_t *out = dynstr_new();
+		const char *code;
+
+		*hmp = hm->hm_next;
+		if (buf[2] & V3_FLAG_LZ) {
+			string_t *arg = dynstr_new();
+
+			if (lz_decompress(dynstr_cstr(hm->hm_payload),
+			    dynstr_len(hm->hm_payload), HOST_LZ_MAX,
+			    arg) != 0) {
+				dynstr_free(arg);
+				dynstr_free(out);
+				msg_free(hm);
+				return (-1);
+			}
+			dynstr_free(hm->hm_payload);
+			hm->hm_payload = arg;
+		}
+		code = host_command(hc, dynstr_cstr(hm->hm_cmd),
+		    dynstr_cstr(hm->hm_payload), dynstr_len(hm->hm_payload),
+		    out);
+
+		dynstr_reset(hm->hm_cmd);
+		dynstr_append(hm->hm_cmd, code);
+		dynstr_free(hm->hm_payload);
+		hm->hm_flags = host_compress(hc, &out) ? V3_FLAG_LZ : 0;
+		hm->hm_payload = out;
+		hm->hm_next = NULL;
+		*hc->hc_rtail = hm;
+		hc->hc_rtail = &hm->hm_next;
+	}
+
+	return ((ssize_t)(V3_HDR_LEN + clen + plen));
+}
+
+/*
+ * Send the queued Version 3 responses, one chunk from each in turn.
+ */
+static void
+host_v3_flush(host_client_t *hc)
+{
+	host_msg_t **hmp, *hm;
+	unsigned char hdr[V3_HDR_LEN];
+
+	while (hc->hc_replies != NULL) {
+		for (hmp = &hc->hc_replies; (hm = *hmp) != NULL; ) {
+			size_t clen = dynstr_len(hm->hm_cmd);
+			size_t n = dynstr_len(hm->hm_payload) - hm->hm_off;
+			uint32_t crc;
+
+			if (n > chunk_size)
+				n = chunk_size;
+
+			crc = crc32_update(crc32_calc(dynstr_cstr(hm->hm_cmd),
+			    clen), dynstr_cstr(hm->hm_payload) + hm->hm_off, n);
+
+			hdr[0] = 'V';
+			hdr[1] = '3';
+			hdr[2] = hm->hm_off + n < dynstr_len(hm->hm_payload) ?
+			    V3_FLAG_MORE : 0;
+			hdr[2] |= hm->hm_flags;
+			hdr[3] = (unsigned char)clen;
+			put32(hdr + 4, hm->hm_id);
+			put32(hdr + 8, (uint32_t)n);
+			put32(hdr + 12, crc);
+			dynstr_appendn(hc->hc_tx, (const char *)hdr,
+			    sizeof (hdr));
+			dynstr_appendn(hc->hc_tx, dynstr_cstr(hm->hm_cmd),
+			    clen);
+			dynstr_appendn(hc->hc_tx, dynstr_cstr(hm->hm_payload) +
+			    hm->hm_off, n);
+			hm->hm_off += n;
+
+			if (hdr[2] & V3_FLAG_MORE) {
+				hmp = &hm->hm_next;
+				continue;
+			}
+			*hmp = hm->hm_next;
+			msg_free(hm);
+		}
+	}
+	hc->hc_rtail = &hc->hc_replies;
+}
+
+/*
+ * Process whatever complete requests have arrived from a client.  Returns
+ * -1 if the client should be disconnected.
+ */
+static int
+host_input(host_client_t *hc)
+{
+	const char *buf = dynstr_cstr(hc->hc_rx);
+	size_t len = dynstr_len(hc->hc_rx);
+	string_t *rest;
+
+	while (hc->hc_rxoff < len) {
+		const char *p = buf + hc->hc_rxoff;
+		const char *nl;
+		ssize_t n;
+
+		if (hc->hc_version == 3) {
+			if ((n = host_v3(hc, (const unsigned char *)p,
+			    len - hc->hc_rxoff)) == -1)
+				return (-1);
+			if (n == 0)
+				break;
+			hc->hc_rxoff += (size_t)n;
+			continue;
+		}
+
+		if ((nl = memchr(p, '\n', len - hc->hc_rxoff)) == NULL)
+			break;
+		hc->hc_rxoff += (size_t)(nl - p) + 1;
+
+		/*
+		 * The line is NUL-terminated in place, which is safe as the
+		 * buffer is rebuilt below:
+		 */
+		*(char *)nl = '\0';
+		if (hc->hc_version >= 2 && strncmp(p, "V2 ", 3) == 0)
+			host_v2(hc, p);
+		else
+			host_v1(hc, p);
+	}
+
+	host_v3_flush(hc);
+
+	rest = dynstr_new();
+	dynstr_appendn(rest, buf + hc->hc_rxoff, len - hc->hc_rxoff);
+	dynstr_free(hc->hc_rx);
+	hc->hc_rx = rest;
+	hc->hc_rxoff = 0;
+
+	return (0);
+}
+
+static void
+host_close(host_client_t *hc)
+{
+	host_msg_t *hm;
+
+	(void) close(hc->hc_fd);
+	hc->hc_fd = -1;
+	dynstr_free(hc->hc_rx);
+	dynstr_free(hc->hc_tx);
+	while ((hm = hc->hc_partial) != NULL) {
+		hc->hc_partial = hm->hm_next;
+		msg_free(hm);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	host_client_t clients[HOST_MAX_CLIENTS];
+	struct pollfd pfd[HOST_MAX_CLIENTS + 1];
+	struct sockaddr_un sun;
+	int lfd, opt, i;
+	char *endp;
+
+	while ((opt = getopt_long(argc, argv, "+", long_options,
+	    NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			chunk_size = strtoul(optarg, &endp, 10);
+			if (*endp != '\0' || chunk_size < 1 ||
+			    chunk_size > V3_FRAME_MAX)
+				errx(3, "invalid chunk size: %s", optarg);
+			break;
+		case 'n':
+			allow_compress = B_FALSE;
+			break;
+		case 'v':
+			max_version = atoi(optarg);
+			if (max_version < 1 || max_version > 3)
+				errx(3, "invalid version: %s", optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 1)
+		usage(argv[0]);
+
+	bzero(&sun, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(argv[optind]) >= sizeof (sun.sun_path))
+		errx(3, "socket path too long: %s", argv[optind]);
+	(void) strcpy(sun.sun_path, argv[optind]);
+
+	(void) signal(SIGPIPE, SIG_IGN);
+	(void) unlink(sun.sun_path);
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	    bind(lfd, (struct sockaddr *)&sun, sizeof (sun)) != 0 ||
+	    listen(lfd, HOST_MAX_CLIENTS) != 0)
+		err(1, "could not listen on %s", sun.sun_path);
+
+	for (i = 0; i < HOST_MAX_CLIENTS; i++)
+		clients[i].hc_fd = -1;
+
+	for (;;) {
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < HOST_MAX_CLIENTS; i++) {
+			host_client_t *hc = &clients[i];
+
+			pfd[i + 1].fd = hc->hc_fd;
+			pfd[i + 1].events = POLLIN;
+			if (hc->hc_fd != -1 &&
+			    hc->hc_txoff < dynstr_len(hc->hc_tx))
+				pfd[i + 1].events |= POLLOUT;
+		}
+
+		if (poll(pfd, HOST_MAX_CLIENTS + 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			int fd = accept(lfd, NULL, NULL);
+
+			for (i = 0; fd != -1 && i < HOST_MAX_CLIENTS; i++) {
+				host_client_t *hc = &clients[i];
+
+				if (hc->hc_fd != -1)
+					continue;
+				bzero(hc, sizeof (*hc));
+				hc->hc_fd = fd;
+				hc->hc_version = 1;
+				hc->hc_rx = dynstr_new();
+				hc->hc_tx = dynstr_new();
+				hc->hc_rtail = &hc->hc_replies;
+				fd = -1;
+			}
+			if (fd != -1)
+				(void) close(fd);
+		}
+
+		for (i = 0; i < HOST_MAX_CLIENTS; i++) {
+			host_client_t *hc = &clients[i];
+			char buf[65536];
+			ssize_t n;
+
+			if (hc->hc_fd == -1 || pfd[i + 1].fd != hc->hc_fd)
+				continue;
+
+			if (pfd[i + 1].revents & POLLOUT) {
+				if ((n = write(hc->hc_fd,
+				    dynstr_cstr(hc->hc_tx) + hc->hc_txoff,
+				    dynstr_len(hc->hc_tx) - hc->hc_txoff)) ==
+				    -1) {
+					host_close(hc);
+					continue;
+				}
+				hc->hc_txoff += (size_t)n;
+				if (hc->hc_txoff == dynstr_len(hc->hc_tx)) {
+					dynstr_reset(hc->hc_tx);
+					hc->hc_txoff = 0;
+				}
+			}
+
+			if (pfd[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+				if ((n = read(hc->hc_fd, buf,
+				    sizeof (buf))) <= 0) {
+					host_close(hc);
+					continue;
+				}
+				dynstr_appendn(hc->hc_rx, buf, (size_t)n);
+				if (host_input(hc) != 0) {
+					warnx("framing error; disconnecting");
+					host_close(hc);
+				}
+			}
+		}
+	}
+}
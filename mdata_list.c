@@ -10,6 +10,7 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,6 +19,8 @@
 
 #include "common.h"
 #include "dynstr.h"
+#include "mdata.h"
+#include "keyidx.h"
 #include "plat.h"
 #include "proto.h"
 
@@ -29,18 +32,88 @@ typedef enum mdata_exit_codes {
 	MDEC_TRY_AGAIN = 10
 } mdata_exit_codes_t;
 
+static const struct option long_options[] = {
+	{ "count", no_argument, NULL, 'c' },
+	{ "glob", required_argument, NULL, 'g' },
+	{ "lock-timeout", required_argument, NULL, 'T' },
+	{ "null", no_argument, NULL, '0' },
+	{ "prefix", required_argument, NULL, 'p' },
+	{ "sort", no_argument, NULL, 's' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/*
+ * How the list of keys is to be filtered and written out:
+ */
+typedef struct list_opts {
+	const char *lo_prefix;
+	const char *lo_glob;
+	boolean_t lo_count;
+	boolean_t lo_sort;
+	char lo_sep;
+} list_opts_t;
+
+static void
+usage(const char *progname)
+{
+	errx(MDEC_USAGE_ERROR, "Usage: %s [--lock-timeout <seconds>] "
+	    "[--sort] [--prefix <prefix>] [--glob <pattern>] [--count | -0]",
+	    progname);
+}
+
+static int
+list_print(keyidx_t *ki __UNUSED, const keyidx_ent_t *ke, void *arg)
+{
+	list_opts_t *lo = arg;
+
+	(void) fwrite(ke->ke_name, 1, ke->ke_len, stdout);
+	(void) putchar(lo->lo_sep);
+	return (0);
+}
+
+/*
+ * Write out the keys directly from the response, in the order the host sent
+ * them unless we are asked to sort them.
+ */
+static int
+list_keys(list_opts_t *lo, string_t *data)
+{
+	keyidx_t ki;
+	size_t n;
+
+	if (keyidx_init(&ki, dynstr_len(data) > 0 ? dynstr_cstr(data) : "",
+	    dynstr_len(data)) != 0) {
+		fprintf(stderr, "ERROR: could not allocate memory\n");
+		return (MDEC_ERROR);
+	}
+
+	if (lo->lo_sort)
+		keyidx_sort(&ki);
+
+	n = keyidx_walk(&ki, lo->lo_prefix, lo->lo_glob,
+	    lo->lo_count ? NULL : list_print, lo);
+	if (lo->lo_count)
+		printf("%lu\n", (unsigned long)n);
+
+	keyidx_fini(&ki);
+
+	if (fflush(stdout) != 0 || ferror(stdout)) {
+		fprintf(stderr, "ERROR: could not write keys: %s\n",
+		    strerror(errno));
+		return (MDEC_ERROR);
+	}
+
+	return (MDEC_SUCCESS);
+}
+
 static int
-print_response(mdata_response_t mdr, string_t *data)
+print_response(list_opts_t *lo, mdata_response_t mdr, string_t *data)
 {
 	const char *cstr = dynstr_cstr(data);
-	size_t len = dynstr_len(data);
 
 	switch (mdr) {
 	case MDR_SUCCESS:
-		fprintf(stdout, "%s", cstr);
-		if (len >= 1 && cstr[len - 1] != '\n')
-			fprintf(stdout, "\n");
-		return (MDEC_SUCCESS);
+		return (list_keys(lo, data));
 	case MDR_NOTFOUND:
 		fprintf(stderr, "No metadata\n");
 		return (MDEC_NOTFOUND);
@@ -57,12 +130,50 @@ print_response(mdata_response_t mdr, string_t *data)
 }
 
 int
-main(int argc __UNUSED, char **argv __UNUSED)
+mdata_list_main(int argc, char **argv)
 {
 	mdata_proto_t *mdp;
 	mdata_response_t mdr;
 	string_t *data;
 	const char *errmsg = NULL;
+	list_opts_t lo;
+	int opt, ms;
+
+	bzero(&lo, sizeof (lo));
+	lo.lo_sep = '\n';
+
+	while ((opt = getopt_long(argc, argv, "+0", long_options,
+	    NULL)) != -1) {
+		switch (opt) {
+		case 'T':
+			if (parse_seconds(optarg, &ms) != 0) {
+				errx(MDEC_USAGE_ERROR,
+				    "invalid lock timeout: %s", optarg);
+			}
+			plat_set_lock_timeout(ms);
+			break;
+		case 'c':
+			lo.lo_count = B_TRUE;
+			break;
+		case 'g':
+			lo.lo_glob = optarg;
+			break;
+		case '0':
+			lo.lo_sep = '\0';
+			break;
+		case 'p':
+			lo.lo_prefix = optarg;
+			break;
+		case 's':
+			lo.lo_sort = B_TRUE;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (lo.lo_count && lo.lo_sep != '\n')
+		usage(argv[0]);
 
 	if (proto_init(&mdp, &errmsg) != 0) {
 		fprintf(stderr, "ERROR: could not initialise protocol: %s\n",
@@ -75,5 +186,5 @@ main(int argc __UNUSED, char **argv __UNUSED)
 		return (MDEC_ERROR);
 	}
 
-	return (print_response(mdr, data));
+	return (print_response(&lo, mdr, data));
 }
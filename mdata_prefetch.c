@@ -0,0 +1,176 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * Fetch, early in boot, the keys that were read during the last boot, so that
+ * mdata-get may answer from the cache rather than each waiting its turn for
+ * the metadata service.  See prefetch.c.
+ */
+
+#include <sys/types.h>
+#include <err.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "batch.h"
+#include "common.h"
+#include "dynstr.h"
+#include "keyidx.h"
+#include "mdata.h"
+#include "plat.h"
+#include "prefetch.h"
+#include "proto.h"
+
+typedef enum mdata_exit_codes {
+	MDEC_SUCCESS = 0,
+	MDEC_NOTFOUND = 1,
+	MDEC_ERROR = 2,
+	MDEC_USAGE_ERROR = 3,
+	MDEC_TRY_AGAIN = 10
+} mdata_exit_codes_t;
+
+static const struct option long_options[] = {
+	{ "lock-timeout", required_argument, NULL, 'T' },
+	{ "window", required_argument, NULL, 'w' },
+	{ NULL, 0, NULL, 0 }
+};
+
+typedef struct prefetch_state {
+	unsigned int ps_fetched;
+	unsigned int ps_failed;
+} prefetch_state_t;
+
+typedef struct prefetch_key {
+	prefetch_state_t *pk_state;
+	char *pk_name;
+} prefetch_key_t;
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [--lock-timeout <seconds>] "
+	    "[--window <seconds>]\n", progname);
+	exit(MDEC_USAGE_ERROR);
+}
+
+static void
+prefetch_get_done(int err, mdata_response_t mdr, string_t *data, void *arg)
+{
+	prefetch_key_t *pk = arg;
+	prefetch_state_t *ps = pk->pk_state;
+	int ret;
+
+	if (err != 0 || (mdr != MDR_SUCCESS && mdr != MDR_NOTFOUND)) {
+		if (err == 0) {
+			fprintf(stderr, "Error getting metadata for key '%s': "
+			    "%s\n", pk->pk_name, mdr == MDR_INVALID_COMMAND ?
+			    "host does not support GET" : dynstr_len(data) > 0 ?
+			    dynstr_cstr(data) : "unknown error");
+		}
+		ps->ps_failed++;
+	} else if ((ret = prefetch_store(pk->pk_name, mdr, data)) == -1) {
+		warn("could not cache key '%s'", pk->pk_name);
+		ps->ps_failed++;
+	} else if (ret == 0) {
+		ps->ps_fetched++;
+	}
+
+	free(pk->pk_name);
+	free(pk);
+}
+
+int
+mdata_prefetch_main(int argc, char **argv)
+{
+	mdata_proto_t *mdp;
+	mdata_batch_t *mb;
+	prefetch_state_t ps;
+	string_t *keys = dynstr_new();
+	const char *errmsg = NULL;
+	int opt, ms, window = PREFETCH_WINDOW_DEFAULT * 1000;
+	keyidx_t ki;
+	size_t i;
+
+	bzero(&ps, sizeof (ps));
+
+	while ((opt = getopt_long(argc, argv, "+", long_options,
+	    NULL)) != -1) {
+		switch (opt) {
+		case 'T':
+			if (parse_seconds(optarg, &ms) != 0) {
+				errx(MDEC_USAGE_ERROR,
+				    "invalid lock timeout: %s", optarg);
+			}
+			plat_set_lock_timeout(ms);
+			break;
+		case 'w':
+			if (parse_seconds(optarg, &window) != 0) {
+				errx(MDEC_USAGE_ERROR,
+				    "invalid window: %s", optarg);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc != optind)
+		usage(argv[0]);
+
+	/*
+	 * The keys to fetch must be read before the window opens, as keys read
+	 * from then on are recorded for the next boot.
+	 */
+	if (prefetch_history(keys) != 0)
+		warn("could not read prefetch history");
+
+	if (prefetch_open(window) != 0) {
+		warn("could not create prefetch cache");
+		return (MDEC_ERROR);
+	}
+
+	if (dynstr_len(keys) == 0)
+		return (MDEC_SUCCESS);
+
+	if (proto_init(&mdp, &errmsg) != 0) {
+		fprintf(stderr, "ERROR: could not initialise protocol: %s\n",
+		    errmsg);
+		return (MDEC_ERROR);
+	}
+
+	if (keyidx_init(&ki, dynstr_cstr(keys), dynstr_len(keys)) != 0 ||
+	    batch_init(&mb, mdp, BATCH_WINDOW) != 0)
+		err(MDEC_ERROR, "could not allocate memory");
+
+	for (i = 0; i < ki.ki_count; i++) {
+		prefetch_key_t *pk;
+
+		if ((pk = calloc(1, sizeof (*pk))) == NULL ||
+		    (pk->pk_name = strdup(keyidx_cstr(&ki,
+		    &ki.ki_ents[i]))) == NULL)
+			err(MDEC_ERROR, "could not allocate memory");
+		pk->pk_state = &ps;
+
+		batch_submit(mb, "GET", pk->pk_name, prefetch_get_done, pk);
+	}
+	keyidx_fini(&ki);
+
+	(void) batch_run(mb);
+	batch_fini(mb);
+	proto_fini(mdp);
+	dynstr_free(keys);
+
+	if (ps.ps_failed > 0) {
+		fprintf(stderr, "ERROR: %u of %u keys could not be "
+		    "prefetched\n", ps.ps_failed, ps.ps_failed + ps.ps_fetched);
+		return (MDEC_ERROR);
+	}
+
+	return (MDEC_SUCCESS);
+}
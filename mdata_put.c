@@ -10,6 +10,7 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,10 +18,15 @@
 #include <unistd.h>
 
 #include "base64.h"
+#include "batch.h"
 #include "common.h"
 #include "dynstr.h"
+#include "mdata.h"
+#include "json.h"
 #include "plat.h"
+#include "prefetch.h"
 #include "proto.h"
+#include "spool.h"
 
 typedef enum mdata_exit_codes {
 	MDEC_SUCCESS = 0,
@@ -32,6 +38,51 @@ typedef enum mdata_exit_codes {
 
 static char *keyname;
 
+static const struct option long_options[] = {
+	{ "async", no_argument, NULL, 'a' },
+	{ "batch", no_argument, NULL, 'b' },
+	{ "flush", no_argument, NULL, 'F' },
+	{ "lock-timeout", required_argument, NULL, 'T' },
+	{ "null", no_argument, NULL, '0' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/*
+ * State for a batch of PUTs read from a stream:
+ */
+typedef struct put_batch {
+	mdata_batch_t *pb_batch;
+	unsigned int pb_line;
+	unsigned int pb_total;
+	unsigned int pb_failed;
+	unsigned int pb_malformed;
+
+	/*
+	 * The names and values of the members of the line being parsed, in
+	 * turn.  They are only written once the whole line is known to be
+	 * valid.
+	 */
+	string_t **pb_members;
+	size_t pb_nmembers;
+	size_t pb_membersz;
+} put_batch_t;
+
+typedef struct put_item {
+	put_batch_t *pi_batch;
+	char *pi_key;
+} put_item_t;
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [--lock-timeout <seconds>] [--async] "
+	    "<keyname> [ <value> ]\n"
+	    "       %s [--lock-timeout <seconds>] --batch [-0] [ <file> ]\n"
+	    "       %s [--lock-timeout <seconds>] --flush\n",
+	    progname, progname, progname);
+	exit(MDEC_USAGE_ERROR);
+}
+
 static int
 print_response(mdata_response_t mdr, string_t *data)
 {
@@ -54,20 +105,270 @@ print_response(mdata_response_t mdr, string_t *data)
 	}
 }
 
-int
-main(int argc, char **argv)
+static int
+read_stream(FILE *fp, string_t *str)
 {
-	mdata_proto_t *mdp;
-	mdata_response_t mdr;
-	string_t *data;
-	const char *errmsg = NULL;
+	char buf[8192];
+	size_t sz;
+
+	while ((sz = fread(buf, 1, sizeof (buf), fp)) > 0)
+		dynstr_appendn(str, buf, sz);
+
+	return (ferror(fp) ? -1 : 0);
+}
+
+static void
+batch_put_done(int err, mdata_response_t mdr, string_t *data, void *arg)
+{
+	put_item_t *pi = arg;
+	put_batch_t *pb = pi->pi_batch;
+
+	if (err != 0) {
+		fprintf(stderr, "ERROR: could not execute PUT for key '%s'\n",
+		    pi->pi_key);
+	} else if (mdr != MDR_SUCCESS) {
+		fprintf(stderr, "Error putting metadata for key '%s': %s\n",
+		    pi->pi_key, dynstr_len(data) > 0 ? dynstr_cstr(data) :
+		    "unknown error");
+	}
+
+	if (err != 0 || mdr != MDR_SUCCESS) {
+		pb->pb_failed++;
+		printf("error\t%s\n", pi->pi_key);
+	} else {
+		printf("ok\t%s\n", pi->pi_key);
+	}
+
+	free(pi->pi_key);
+	free(pi);
+}
+
+static void
+batch_put_submit(put_batch_t *pb, const char *key, size_t keylen,
+    const char *value, size_t valuelen)
+{
+	put_item_t *pi;
 	string_t *req = dynstr_new();
 
-	if (argc < 2) {
-		errx(MDEC_USAGE_ERROR, "Usage: %s <keyname> [ <value> ]",
-		    argv[0]);
+	if ((pi = calloc(1, sizeof (*pi))) == NULL ||
+	    (pi->pi_key = strndup(key, keylen)) == NULL)
+		err(MDEC_ERROR, "could not allocate memory");
+	pi->pi_batch = pb;
+	pb->pb_total++;
+	spool_discard(pi->pi_key);
+	prefetch_forget(pi->pi_key);
+
+	base64_encode(key, keylen, req);
+	dynstr_appendc(req, ' ');
+	base64_encode(value, valuelen, req);
+
+	batch_submit(pb->pb_batch, "PUT", dynstr_cstr(req), batch_put_done,
+	    pi);
+	dynstr_free(req);
+}
+
+static string_t *
+batch_put_copy(string_t *str)
+{
+	string_t *copy = dynstr_new();
+
+	dynstr_append(copy, "");
+	if (dynstr_len(str) > 0)
+		dynstr_appendn(copy, dynstr_cstr(str), dynstr_len(str));
+
+	return (copy);
+}
+
+static int
+batch_put_member(string_t *name, string_t *value, void *arg)
+{
+	put_batch_t *pb = arg;
+
+	if (pb->pb_nmembers + 2 > pb->pb_membersz) {
+		pb->pb_membersz = pb->pb_membersz > 0 ?
+		    pb->pb_membersz * 2 : 16;
+		if ((pb->pb_members = realloc(pb->pb_members,
+		    pb->pb_membersz * sizeof (string_t *))) == NULL)
+			err(MDEC_ERROR, "could not allocate memory");
+	}
+	pb->pb_members[pb->pb_nmembers++] = batch_put_copy(name);
+	pb->pb_members[pb->pb_nmembers++] = batch_put_copy(value);
+
+	return (0);
+}
+
+/*
+ * Write the members of a line that was parsed in full, or else discard them.
+ */
+static void
+batch_put_members(put_batch_t *pb, boolean_t valid)
+{
+	size_t i;
+
+	for (i = 0; i < pb->pb_nmembers; i += 2) {
+		string_t *name = pb->pb_members[i];
+		string_t *value = pb->pb_members[i + 1];
+
+		if (valid) {
+			batch_put_submit(pb, dynstr_cstr(name),
+			    dynstr_len(name), dynstr_cstr(value),
+			    dynstr_len(value));
+		}
+		dynstr_free(name);
+		dynstr_free(value);
+	}
+	pb->pb_nmembers = 0;
+}
+
+/*
+ * Queue a PUT for each key/value pair in the input.  In NUL-delimited input,
+ * keys and values alternate, each followed by a NUL byte.  Otherwise, each
+ * line is a JSON object whose members are keys and their (string) values.
+ * Malformed input is reported, and counted apart from keys that could not be
+ * written.  None of the members of a malformed line are written, but the
+ * pairs on other lines are.
+ */
+static void
+batch_put_parse(put_batch_t *pb, const char *buf, size_t len,
+    boolean_t nul)
+{
+	const char *end = buf + len;
+	const char *eol, *key = NULL;
+	size_t keylen = 0;
+	const char *errmsg;
+
+	while (buf < end) {
+		if ((eol = memchr(buf, nul ? '\0' : '\n',
+		    (size_t)(end - buf))) == NULL)
+			eol = end;
+		pb->pb_line++;
+
+		if (nul) {
+			if (key == NULL) {
+				key = buf;
+				keylen = (size_t)(eol - buf);
+			} else {
+				batch_put_submit(pb, key, keylen, buf,
+				    (size_t)(eol - buf));
+				key = NULL;
+			}
+		} else if (strspn(buf, " \t\r") < (size_t)(eol - buf)) {
+			if (json_parse_strings(buf, (size_t)(eol - buf),
+			    batch_put_member, pb, &errmsg) == 0) {
+				batch_put_members(pb, B_TRUE);
+			} else {
+				fprintf(stderr, "ERROR: line %u: %s\n",
+				    pb->pb_line, errmsg);
+				batch_put_members(pb, B_FALSE);
+				pb->pb_malformed++;
+			}
+		}
+
+		buf = eol + 1;
 	}
 
+	if (key != NULL) {
+		fprintf(stderr, "ERROR: no value for key '%.*s'\n",
+		    (int)keylen, key);
+		pb->pb_malformed++;
+	}
+}
+
+static int
+batch_put(mdata_proto_t *mdp, const char *path, boolean_t nul)
+{
+	put_batch_t pb;
+	string_t *input = dynstr_new();
+	FILE *fp = stdin;
+
+	bzero(&pb, sizeof (pb));
+
+	if (path != NULL && strcmp(path, "-") != 0 &&
+	    (fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "ERROR: could not open \"%s\": %s\n", path,
+		    strerror(errno));
+		return (MDEC_ERROR);
+	}
+	if (fp == stdin && plat_is_interactive()) {
+		fprintf(stderr, "ERROR: either specify a file of key/value "
+		    "pairs, or pipe them to stdin.\n");
+		return (MDEC_ERROR);
+	}
+	if (read_stream(fp, input) != 0) {
+		fprintf(stderr, "ERROR: could not read input: %s\n",
+		    strerror(errno));
+		return (MDEC_ERROR);
+	}
+	if (fp != stdin)
+		(void) fclose(fp);
+
+	if (batch_init(&pb.pb_batch, mdp, BATCH_WINDOW) != 0) {
+		fprintf(stderr, "ERROR: could not allocate memory\n");
+		return (MDEC_ERROR);
+	}
+
+	batch_put_parse(&pb, dynstr_len(input) > 0 ? dynstr_cstr(input) : "",
+	    dynstr_len(input), nul);
+	dynstr_free(input);
+
+	(void) batch_run(pb.pb_batch);
+	batch_fini(pb.pb_batch);
+	free(pb.pb_members);
+
+	if (pb.pb_failed > 0) {
+		fprintf(stderr, "ERROR: %u of %u keys could not be written\n",
+		    pb.pb_failed, pb.pb_total);
+	}
+	if (pb.pb_malformed > 0) {
+		fprintf(stderr, "ERROR: %u malformed %s of input skipped\n",
+		    pb.pb_malformed, nul ? "entry" : pb.pb_malformed == 1 ?
+		    "line" : "lines");
+	}
+
+	return (pb.pb_failed > 0 || pb.pb_malformed > 0 ? MDEC_ERROR :
+	    MDEC_SUCCESS);
+}
+
+/*
+ * Get the value to put: from the command line, if it was given there, or
+ * else from stdin.
+ */
+static int
+read_value(const char *arg, string_t *value)
+{
+	if (arg != NULL) {
+		dynstr_append(value, arg);
+		return (0);
+	}
+
+	if (plat_is_interactive()) {
+		fprintf(stderr, "ERROR: either specify the metadata value as "
+		    "the second command-line argument, or pipe content to "
+		    "stdin.\n");
+		return (-1);
+	}
+
+	if (read_stream(stdin, value) != 0) {
+		fprintf(stderr, "ERROR: could not read from stdin: %s\n",
+		    strerror(errno));
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Send every write that is waiting in the spool now, rather than leaving it
+ * to the background flusher.
+ */
+static int
+flush_spool(void)
+{
+	mdata_proto_t *mdp;
+	const char *errmsg = NULL;
+	unsigned int sent = 0, failed = 0;
+	int ret, e;
+
 	if (proto_init(&mdp, &errmsg) != 0) {
 		fprintf(stderr, "ERROR: could not initialise protocol: %s\n",
 		    errmsg);
@@ -79,42 +380,140 @@ main(int argc, char **argv)
 		return (MDEC_ERROR);
 	}
 
-	keyname = strdup(argv[1]);
+	/*
+	 * As in the background flusher, the lock is taken only once we are
+	 * connected, as a writer may wait for it while connected itself:
+	 */
+	if (spool_lock(B_TRUE) != 0) {
+		e = errno;
+		proto_fini(mdp);
+		if (e == ENOENT)
+			return (MDEC_SUCCESS);
+		fprintf(stderr, "ERROR: could not lock spool: %s\n",
+		    strerror(e));
+		return (MDEC_ERROR);
+	}
 
-	base64_encode(argv[1], strlen(argv[1]), req);
-	dynstr_appendc(req, ' ');
-	if (argc >= 3) {
-		/*
-		 * Use second argument as the value to put.
-		 */
-		base64_encode(argv[2], strlen(argv[2]), req);
-	} else {
-		int c;
-		string_t *stdinstr = dynstr_new();
+	ret = spool_flush(mdp, &sent, &failed);
+	proto_fini(mdp);
+	spool_unlock();
 
-		dynstr_append(stdinstr, "");
+	if (ret != 0) {
+		fprintf(stderr, "ERROR: lost connection to metadata service; "
+		    "unsent writes remain spooled\n");
+		return (MDEC_ERROR);
+	}
 
-		if (plat_is_interactive()) {
-			fprintf(stderr, "ERROR: either specify the metadata "
-			    "value as the second command-line argument, or "
-			    "pipe content to stdin.\n");
-			return (MDEC_ERROR);
-		}
+	if (failed > 0) {
+		fprintf(stderr, "ERROR: %u of %u spooled writes were "
+		    "rejected\n", failed, sent + failed);
+		return (MDEC_ERROR);
+	}
 
-		while ((c = fgetc(stdin)) != EOF) {
-			dynstr_appendc(stdinstr, (char) c);
+	return (MDEC_SUCCESS);
+}
+
+int
+mdata_put_main(int argc, char **argv)
+{
+	mdata_proto_t *mdp;
+	mdata_response_t mdr;
+	string_t *data;
+	const char *errmsg = NULL;
+	string_t *req = dynstr_new();
+	string_t *value = dynstr_new();
+	boolean_t batch = B_FALSE, nul = B_FALSE;
+	boolean_t async = B_FALSE, flush = B_FALSE;
+	int opt, ms;
+
+	while ((opt = getopt_long(argc, argv, "+0", long_options,
+	    NULL)) != -1) {
+		switch (opt) {
+		case 'T':
+			if (parse_seconds(optarg, &ms) != 0) {
+				errx(MDEC_USAGE_ERROR,
+				    "invalid lock timeout: %s", optarg);
+			}
+			plat_set_lock_timeout(ms);
+			break;
+		case 'b':
+			batch = B_TRUE;
+			break;
+		case '0':
+			nul = B_TRUE;
+			break;
+		case 'a':
+			async = B_TRUE;
+			break;
+		case 'F':
+			flush = B_TRUE;
+			break;
+		default:
+			usage(argv[0]);
 		}
-		if (ferror(stdin)) {
-			fprintf(stderr, "ERROR: could not read from stdin: "
-			    "%s\n", strerror(errno));
+	}
+
+	if (flush) {
+		if (batch || nul || async || argc - optind != 0)
+			usage(argv[0]);
+		return (flush_spool());
+	}
+
+	if ((batch && (async || argc - optind > 1)) || (!batch && (nul ||
+	    argc - optind < 1)))
+		usage(argv[0]);
+
+	if (!batch) {
+		keyname = strdup(argv[optind]);
+		prefetch_forget(keyname);
+		if (read_value(argc - optind >= 2 ? argv[optind + 1] : NULL,
+		    value) != 0)
 			return (MDEC_ERROR);
+
+		if (async) {
+			if (spool_put(keyname, dynstr_len(value) > 0 ?
+			    dynstr_cstr(value) : "", dynstr_len(value)) == 0) {
+				spool_kick();
+				return (MDEC_SUCCESS);
+			}
+			if (errno != ENAMETOOLONG) {
+				fprintf(stderr, "ERROR: could not spool write: "
+				    "%s\n", strerror(errno));
+				return (MDEC_ERROR);
+			}
+			/*
+			 * The key is too long to be named in the spool, so
+			 * write it now instead.
+			 */
 		}
 
-		base64_encode(dynstr_cstr(stdinstr), dynstr_len(stdinstr),
-		    req);
-		dynstr_free(stdinstr);
+		/*
+		 * A write that is still spooled for this key is older than
+		 * this one, and must not be sent after it.
+		 */
+		spool_discard(keyname);
+	}
+
+	if (proto_init(&mdp, &errmsg) != 0) {
+		fprintf(stderr, "ERROR: could not initialise protocol: %s\n",
+		    errmsg);
+		return (MDEC_ERROR);
+	}
+
+	if (proto_version(mdp) < 2) {
+		fprintf(stderr, "ERROR: host does not support PUT\n");
+		return (MDEC_ERROR);
 	}
 
+	if (batch)
+		return (batch_put(mdp, argv[optind], nul));
+
+	base64_encode(keyname, strlen(keyname), req);
+	dynstr_appendc(req, ' ');
+	base64_encode(dynstr_len(value) > 0 ? dynstr_cstr(value) : "",
+	    dynstr_len(value), req);
+	dynstr_free(value);
+
 	if (proto_execute(mdp, "PUT", dynstr_cstr(req), &mdr, &data) != 0) {
 		fprintf(stderr, "ERROR: could not execute GET\n");
 		return (MDEC_ERROR);
@@ -0,0 +1,861 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * Replay a trace recorded with MDATA_CAPTURE through the protocol engine.
+ *
+ * The trace is divided into sessions, one for each connection the client
+ * made.  The requests of each session are recovered from the bytes that were
+ * sent, and submitted again, with the same request IDs, through the
+ * asynchronous interface.  A child process stands in for the metadata
+ * service on a UNIX domain socket: for each session it accepts a connection,
+ * checks that the client sends the same bytes as were recorded, and answers
+ * with the bytes that were received.  Requests are made and answered as fast
+ * as possible or, with --realtime, at the pace at which they originally
+ * were.  A problem seen in the field may thus be reproduced as often as
+ * necessary, and the parser exercised under a debugger or a profiler.
+ *
+ * It is a development tool, and is not installed.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base64.h"
+#include "common.h"
+#include "crc32.h"
+#include "dynstr.h"
+#include "lz.h"
+#include "plat/unix_common.h"
+#include "proto.h"
+#include "reqid.h"
+#include "trace.h"
+
+typedef enum replay_exit_codes {
+	REC_SUCCESS = 0,
+	REC_DIVERGED = 1,
+	REC_ERROR = 2,
+	REC_USAGE_ERROR = 3
+} replay_exit_codes_t;
+
+#define	V3_HDR_LEN		16
+#define	V3_FLAG_MORE		0x01
+#define	V3_FLAG_LZ		0x02
+
+#define	V2_LZ_MARK		'~'
+#define	REPLAY_LZ_MAX		(64 * 1024 * 1024)
+
+/*
+ * How long the stand-in host waits for the client to connect, and for each
+ * recorded write to arrive, before deciding that the client has diverged
+ * from the trace:
+ */
+#define	REPLAY_ACCEPT_TIMEOUT_MS	10000
+#define	REPLAY_READ_TIMEOUT_MS		5000
+
+static const struct option long_options[] = {
+	{ "realtime", no_argument, NULL, 'r' },
+	{ NULL, 0, NULL, 0 }
+};
+
+typedef struct replay_req {
+	char *rr_command;
+	string_t *rr_argument;
+	char rr_reqid[REQID_LEN];
+
+	/*
+	 * Where the request begins in the bytes sent in its session, and
+	 * when (in microseconds since the session began) it was sent:
+	 */
+	size_t rr_offset;
+	uint64_t rr_time_us;
+
+	/*
+	 * For a Version 3 request, its ID and whether more chunks are to
+	 * come:
+	 */
+	boolean_t rr_v3;
+	uint32_t rr_v3_id;
+	boolean_t rr_v3_open;
+
+	/*
+	 * Whether the argument was sent compressed:
+	 */
+	boolean_t rr_lz;
+} replay_req_t;
+
+typedef struct replay_session {
+	/*
+	 * The records that follow the connection record for this session:
+	 */
+	size_t rs_first;
+	size_t rs_end;
+
+	replay_req_t *rs_reqs;
+	size_t rs_nreqs;
+	size_t rs_alloc;
+
+	boolean_t rs_v3;
+
+	/*
+	 * The ID of the request by which compression was negotiated, if it
+	 * was; that request is made by the engine itself, not by us:
+	 */
+	char rs_compress_reqid[REQID_LEN];
+} replay_session_t;
+
+typedef struct replay {
+	trace_t r_trace;
+	boolean_t r_realtime;
+
+	replay_session_t *r_sessions;
+	size_t r_nsessions;
+
+	const char **r_ids;
+	size_t r_nids;
+
+	uint64_t r_completed;
+	uint64_t r_success;
+	uint64_t r_notfound;
+	uint64_t r_other;
+	uint64_t r_lost;
+	uint64_t r_rxbytes;
+	uint32_t r_digest;
+} replay_t;
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [--realtime] <trace>\n", progname);
+	exit(REC_USAGE_ERROR);
+}
+
+static long long
+replay_now_us(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+
+	return ((long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	    ((uint32_t)p[2] << 8) | (uint32_t)p[3]);
+}
+
+static replay_req_t *
+replay_req_new(replay_session_t *rs, size_t offset, const char *cmd,
+    size_t cmdlen)
+{
+	replay_req_t *rr;
+
+	if (rs->rs_nreqs == rs->rs_alloc) {
+		rs->rs_alloc = rs->rs_alloc == 0 ? 16 : rs->rs_alloc * 2;
+		if ((rs->rs_reqs = realloc(rs->rs_reqs, rs->rs_alloc *
+		    sizeof (replay_req_t))) == NULL)
+			err(REC_ERROR, "could not allocate memory");
+	}
+
+	rr = &rs->rs_reqs[rs->rs_nreqs++];
+	bzero(rr, sizeof (*rr));
+	rr->rr_offset = offset;
+	if ((rr->rr_command = strndup(cmd, cmdlen)) == NULL)
+		err(REC_ERROR, "could not allocate memory");
+
+	return (rr);
+}
+
+/*
+ * Recover a Version 2 request from its frame, which is a line of the form
+ * "V2 <clen> <crc32> <reqid> <command> [<BASE64 argument>]".
+ */
+static int
+replay_parse_v2(replay_session_t *rs, size_t offset, const char *line,
+    size_t len)
+{
+	const char *f[6];
+	size_t flen[6];
+	replay_req_t *rr;
+	int n = 0;
+
+	while (len > 0 && n < 6) {
+		const char *sp = n < 5 ? memchr(line, ' ', len) : NULL;
+
+		f[n] = line;
+		flen[n] = sp != NULL ? (size_t)(sp - line) : len;
+		n++;
+		if (sp == NULL)
+			break;
+		len -= flen[n - 1] + 1;
+		line = sp + 1;
+	}
+
+	if (n < 5 || flen[3] != REQID_LEN - 1)
+		return (-1);
+
+	rr = replay_req_new(rs, offset, f[4], flen[4]);
+	bcopy(f[3], rr->rr_reqid, REQID_LEN - 1);
+	rr->rr_reqid[REQID_LEN - 1] = '\0';
+	if (n == 6) {
+		rr->rr_argument = dynstr_new();
+		if (flen[5] > 0 && f[5][0] == V2_LZ_MARK) {
+			string_t *packed = dynstr_new();
+			int ret;
+
+			rr->rr_lz = B_TRUE;
+			ret = base64_decode(f[5] + 1, flen[5] - 1, packed);
+			if (ret == 0)
+				ret = lz_decompress(dynstr_cstr(packed),
+				    dynstr_len(packed), REPLAY_LZ_MAX,
+				    rr->rr_argument);
+			dynstr_free(packed);
+			return (ret);
+		}
+		if (base64_decode(f[5], flen[5], rr->rr_argument) != 0)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Recover the requests made in a session from the bytes that were sent,
+ * which may be Version 1 lines, Version 2 frames or Version 3 frames.
+ * Requests whose bytes were cut short by the end of the session are not
+ * replayed.
+ */
+static int
+replay_parse(replay_session_t *rs, const char *buf, size_t len)
+{
+	const unsigned char *p;
+	const char *line, *nl, *sp;
+	size_t off = 0, start, linelen, i;
+	replay_req_t *rr;
+
+	while (off < len) {
+		p = (const unsigned char *)buf + off;
+
+		if (len - off >= V3_HDR_LEN && p[0] == 'V' && p[1] == '3' &&
+		    (p[2] & ~(V3_FLAG_MORE | V3_FLAG_LZ)) == 0) {
+			size_t clen = p[3];
+			uint32_t id = get32(p + 4);
+			size_t plen = get32(p + 8);
+
+			if (clen == 0 || len - off - V3_HDR_LEN < clen + plen)
+				break;
+
+			rr = NULL;
+			for (i = 0; i < rs->rs_nreqs; i++) {
+				if (rs->rs_reqs[i].rr_v3_open &&
+				    rs->rs_reqs[i].rr_v3_id == id) {
+					rr = &rs->rs_reqs[i];
+					break;
+				}
+			}
+			if (rr == NULL) {
+				rr = replay_req_new(rs, off, (const char *)p +
+				    V3_HDR_LEN, clen);
+				(void) snprintf(rr->rr_reqid, REQID_LEN,
+				    "%08x", id);
+				rr->rr_v3 = B_TRUE;
+				rr->rr_v3_id = id;
+				rr->rr_argument = dynstr_new();
+			}
+			dynstr_appendn(rr->rr_argument, (const char *)p +
+			    V3_HDR_LEN + clen, plen);
+			rr->rr_v3_open = (p[2] & V3_FLAG_MORE) != 0;
+			rr->rr_lz = (p[2] & V3_FLAG_LZ) != 0;
+
+			if (rr->rr_lz && !rr->rr_v3_open) {
+				string_t *packed = rr->rr_argument;
+
+				rr->rr_argument = dynstr_new();
+				if (lz_decompress(dynstr_cstr(packed),
+				    dynstr_len(packed), REPLAY_LZ_MAX,
+				    rr->rr_argument) != 0) {
+					dynstr_free(packed);
+					return (-1);
+				}
+				dynstr_free(packed);
+			}
+
+			off += V3_HDR_LEN + clen + plen;
+			continue;
+		}
+
+		line = buf + off;
+		if ((nl = memchr(line, '\n', len - off)) == NULL)
+			break;
+		linelen = (size_t)(nl - line);
+		start = off;
+		off += linelen + 1;
+
+		if (linelen == 0)
+			continue;
+
+		if (linelen >= 10 && strncmp(line, "NEGOTIATE ", 10) == 0) {
+			if (linelen == 12 && strncmp(line, "NEGOTIATE V3",
+			    12) == 0)
+				rs->rs_v3 = B_TRUE;
+			continue;
+		}
+
+		if (linelen >= 3 && strncmp(line, "V2 ", 3) == 0) {
+			if (replay_parse_v2(rs, start, line, linelen) != 0)
+				return (-1);
+			continue;
+		}
+
+		/*
+		 * A Version 1 request is a command and its argument,
+		 * separated by a space:
+		 */
+		sp = memchr(line, ' ', linelen);
+		rr = replay_req_new(rs, start, line, sp != NULL ?
+		    (size_t)(sp - line) : linelen);
+		if (sp != NULL) {
+			rr->rr_argument = dynstr_new();
+			dynstr_appendn(rr->rr_argument, sp + 1,
+			    linelen - (size_t)(sp - line) - 1);
+		}
+	}
+
+	/*
+	 * A request to negotiate compression comes before any other in the
+	 * session.  It is made again by the engine, so we keep only its ID:
+	 */
+	if (rs->rs_nreqs > 0 && strcmp(rs->rs_reqs[0].rr_command,
+	    "COMPRESS") == 0) {
+		rr = &rs->rs_reqs[0];
+		(void) strcpy(rs->rs_compress_reqid, rr->rr_reqid);
+		free(rr->rr_command);
+		if (rr->rr_argument != NULL)
+			dynstr_free(rr->rr_argument);
+		rs->rs_nreqs--;
+		bcopy(&rs->rs_reqs[1], &rs->rs_reqs[0], rs->rs_nreqs *
+		    sizeof (replay_req_t));
+	}
+
+	/*
+	 * Version 3 requests without an argument carry an empty payload:
+	 */
+	for (i = 0; i < rs->rs_nreqs; i++) {
+		rr = &rs->rs_reqs[i];
+		if (rr->rr_v3 && rr->rr_argument != NULL &&
+		    dynstr_len(rr->rr_argument) == 0) {
+			dynstr_free(rr->rr_argument);
+			rr->rr_argument = NULL;
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Divide the trace into sessions, and recover the requests of each.
+ */
+static int
+replay_load(replay_t *r, const char *path, const char **errmsg)
+{
+	trace_t *t = &r->r_trace;
+	string_t *sent;
+	size_t i, j;
+
+	if (trace_load(path, t, errmsg) != 0)
+		return (-1);
+
+	for (i = 0; i < t->t_nrecs; i++) {
+		if (t->t_recs[i].tr_type == TRT_CONNECT)
+			r->r_nsessions++;
+	}
+	if (r->r_nsessions == 0) {
+		*errmsg = "trace holds no connections";
+		return (-1);
+	}
+	if ((r->r_sessions = calloc(r->r_nsessions,
+	    sizeof (replay_session_t))) == NULL)
+		err(REC_ERROR, "could not allocate memory");
+
+	sent = dynstr_new();
+	for (i = 0, j = 0; i < t->t_nrecs; i++) {
+		replay_session_t *rs;
+		size_t k, n, off;
+		uint64_t us;
+
+		if (t->t_recs[i].tr_type != TRT_CONNECT)
+			continue;
+
+		rs = &r->r_sessions[j++];
+		rs->rs_first = i + 1;
+		for (rs->rs_end = rs->rs_first; rs->rs_end < t->t_nrecs &&
+		    t->t_recs[rs->rs_end].tr_type != TRT_CONNECT; rs->rs_end++)
+			continue;
+
+		dynstr_reset(sent);
+		for (k = rs->rs_first; k < rs->rs_end; k++) {
+			if (t->t_recs[k].tr_type == TRT_SEND) {
+				dynstr_appendn(sent, t->t_recs[k].tr_data,
+				    t->t_recs[k].tr_len);
+			}
+		}
+
+		if (replay_parse(rs, dynstr_cstr(sent), dynstr_len(sent)) !=
+		    0) {
+			*errmsg = "could not parse requests in trace";
+			dynstr_free(sent);
+			return (-1);
+		}
+		r->r_nids += rs->rs_nreqs + 1;
+
+		/*
+		 * Each request was sent at the time of the write that carried
+		 * its first byte:
+		 */
+		for (k = rs->rs_first, n = 0, off = 0, us = 0; k < rs->rs_end;
+		    k++) {
+			const trace_rec_t *tr = &t->t_recs[k];
+
+			us += tr->tr_delta_us;
+			if (tr->tr_type != TRT_SEND)
+				continue;
+			off += tr->tr_len;
+			while (n < rs->rs_nreqs &&
+			    rs->rs_reqs[n].rr_offset < off)
+				rs->rs_reqs[n++].rr_time_us = us;
+		}
+	}
+	dynstr_free(sent);
+
+	/*
+	 * The request IDs, in the order in which the requests will be made:
+	 */
+	if ((r->r_ids = calloc(r->r_nids + 1, sizeof (char *))) == NULL)
+		err(REC_ERROR, "could not allocate memory");
+	r->r_nids = 0;
+	for (i = 0; i < r->r_nsessions; i++) {
+		replay_session_t *rs = &r->r_sessions[i];
+
+		if (rs->rs_compress_reqid[0] != '\0')
+			r->r_ids[r->r_nids++] = rs->rs_compress_reqid;
+		for (j = 0; j < rs->rs_nreqs; j++) {
+			if (rs->rs_reqs[j].rr_reqid[0] != '\0')
+				r->r_ids[r->r_nids++] = rs->rs_reqs[j].rr_reqid;
+		}
+	}
+
+	return (0);
+}
+
+static int
+host_write(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		buf += n;
+		len -= (size_t)n;
+	}
+
+	return (0);
+}
+
+/*
+ * Read exactly as many bytes as the client originally sent in one write, and
+ * report the offset of the first that differs.  Returns -1 if they do not
+ * arrive.
+ */
+static int
+host_expect(int fd, const char *want, size_t len, size_t *mismatch)
+{
+	char buf[4096];
+	size_t off = 0;
+	ssize_t n;
+
+	*mismatch = SIZE_MAX;
+	while (off < len) {
+		struct pollfd pfd;
+		size_t want_now = len - off > sizeof (buf) ? sizeof (buf) :
+		    len - off;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, REPLAY_READ_TIMEOUT_MS) != 1)
+			return (-1);
+
+		if ((n = read(fd, buf, want_now)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		} else if (n == 0) {
+			return (-1);
+		}
+
+		if (*mismatch == SIZE_MAX) {
+			ssize_t i;
+
+			for (i = 0; i < n; i++) {
+				if (buf[i] != want[off + (size_t)i]) {
+					*mismatch = off + (size_t)i;
+					break;
+				}
+			}
+		}
+		off += (size_t)n;
+	}
+
+	return (0);
+}
+
+/*
+ * Play the part of the metadata service, as recorded in the trace.  Returns
+ * the number of sessions in which the client diverged from the trace.
+ */
+static int
+replay_host(replay_t *r, int lfd)
+{
+	trace_t *t = &r->r_trace;
+	int diverged = 0;
+	size_t s, i, sent;
+
+	for (s = 0; s < r->r_nsessions; s++) {
+		replay_session_t *rs = &r->r_sessions[s];
+		struct pollfd pfd;
+		size_t mismatch;
+		boolean_t differs = B_FALSE;
+		int fd;
+
+		pfd.fd = lfd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, REPLAY_ACCEPT_TIMEOUT_MS) != 1 ||
+		    (fd = accept(lfd, NULL, NULL)) == -1) {
+			warnx("session %zu: client did not connect", s + 1);
+			return (diverged + 1);
+		}
+
+		/*
+		 * The reset probe precedes the trace of each connection:
+		 */
+		if (host_expect(fd, "\n", 1, &mismatch) != 0 ||
+		    mismatch != SIZE_MAX ||
+		    host_write(fd, "invalid command\n", 16) != 0) {
+			warnx("session %zu: client did not probe", s + 1);
+			(void) close(fd);
+			diverged++;
+			continue;
+		}
+
+		sent = 0;
+		for (i = rs->rs_first; i < rs->rs_end; i++) {
+			const trace_rec_t *tr = &t->t_recs[i];
+
+			if (tr->tr_type == TRT_SEND) {
+				if (host_expect(fd, tr->tr_data, tr->tr_len,
+				    &mismatch) != 0) {
+					warnx("session %zu: client stopped "
+					    "after %zu bytes", s + 1, sent);
+					differs = B_TRUE;
+					break;
+				}
+				if (mismatch != SIZE_MAX && !differs) {
+					warnx("session %zu: client sent "
+					    "different bytes from offset %zu",
+					    s + 1, sent + mismatch);
+					differs = B_TRUE;
+				}
+				sent += tr->tr_len;
+				continue;
+			}
+
+			if (r->r_realtime && tr->tr_delta_us > 0) {
+				struct timespec ts;
+
+				ts.tv_sec = (time_t)(tr->tr_delta_us / 1000000);
+				ts.tv_nsec = (long)(tr->tr_delta_us % 1000000) *
+				    1000;
+				while (nanosleep(&ts, &ts) == -1 &&
+				    errno == EINTR)
+					continue;
+			}
+
+			if (host_write(fd, tr->tr_data, tr->tr_len) != 0 ||
+			    (tr->tr_type == TRT_RECV_LINE &&
+			    host_write(fd, "\n", 1) != 0)) {
+				warnx("session %zu: client hung up", s + 1);
+				differs = B_TRUE;
+				break;
+			}
+		}
+
+		(void) close(fd);
+		if (differs)
+			diverged++;
+	}
+
+	return (diverged);
+}
+
+static void
+replay_done(mdata_proto_t *mdp __UNUSED, int err, mdata_response_t mdr,
+    string_t *data, void *arg)
+{
+	replay_t *r = arg;
+	uint32_t code = (uint32_t)mdr;
+
+	r->r_completed++;
+
+	if (err != 0) {
+		r->r_lost++;
+		return;
+	}
+
+	switch (mdr) {
+	case MDR_SUCCESS:
+		r->r_success++;
+		break;
+	case MDR_NOTFOUND:
+		r->r_notfound++;
+		break;
+	default:
+		r->r_other++;
+		break;
+	}
+
+	/*
+	 * A digest of the responses, by which replays may be compared:
+	 */
+	r->r_digest = crc32_update(r->r_digest, (const char *)&code,
+	    sizeof (code));
+	if (data != NULL && dynstr_len(data) > 0) {
+		r->r_rxbytes += dynstr_len(data);
+		r->r_digest = crc32_update(r->r_digest, dynstr_cstr(data),
+		    dynstr_len(data));
+	}
+}
+
+/*
+ * Make the requests of one session, and wait for every one to complete.  In
+ * real time, each request is made as long after the session began as it was
+ * in the trace; otherwise, they are made all at once.
+ */
+static void
+replay_session(replay_t *r, mdata_proto_t *mdp, replay_session_t *rs,
+    long long start_us)
+{
+	uint64_t target = r->r_completed + rs->rs_nreqs;
+	size_t next = 0;
+
+	proto_async_set_window(mdp, (unsigned int)rs->rs_nreqs);
+
+	for (;;) {
+		struct pollfd pfd;
+		long long now = replay_now_us();
+		int events, timeout;
+
+		while (next < rs->rs_nreqs && (!r->r_realtime || start_us +
+		    (long long)rs->rs_reqs[next].rr_time_us <= now)) {
+			replay_req_t *rr = &rs->rs_reqs[next++];
+
+			if (proto_async_submit(mdp, rr->rr_command,
+			    rr->rr_argument != NULL ?
+			    dynstr_cstr(rr->rr_argument) : NULL, replay_done,
+			    r) != 0)
+				replay_done(mdp, -1, MDR_UNKNOWN, NULL, r);
+		}
+
+		if (next == rs->rs_nreqs && r->r_completed >= target)
+			break;
+
+		timeout = proto_async_timeout(mdp);
+		if (next < rs->rs_nreqs) {
+			int wait_ms = (int)((start_us + (long long)
+			    rs->rs_reqs[next].rr_time_us - now + 999) / 1000);
+
+			if (timeout == -1 || wait_ms < timeout)
+				timeout = wait_ms;
+		}
+
+		events = proto_async_events(mdp);
+		pfd.fd = proto_async_fd(mdp);
+		pfd.events = ((events & PROTO_EV_READ) ? POLLIN : 0) |
+		    ((events & PROTO_EV_WRITE) ? POLLOUT : 0);
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(REC_ERROR, "poll");
+		}
+
+		if (pfd.revents & POLLOUT)
+			(void) proto_async_process_writable(mdp);
+		if (pfd.revents & (POLLIN | POLLERR | POLLHUP))
+			(void) proto_async_process_readable(mdp);
+		(void) proto_async_process_timeout(mdp);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	replay_t r;
+	mdata_proto_t *mdp;
+	const char *errmsg = NULL;
+	char dir[] = "/tmp/mdata-replay.XXXXXX";
+	struct sockaddr_un sun;
+	long long start, elapsed;
+	int opt, lfd, status, diverged;
+	size_t i, nreqs = 0;
+	size_t lzmin = SIZE_MAX, maxplain = 1;
+	boolean_t compress = B_FALSE;
+	pid_t pid;
+
+	bzero(&r, sizeof (r));
+
+	while ((opt = getopt_long(argc, argv, "+", long_options,
+	    NULL)) != -1) {
+		switch (opt) {
+		case 'r':
+			r.r_realtime = B_TRUE;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 1)
+		usage(argv[0]);
+
+	if (replay_load(&r, argv[optind], &errmsg) != 0)
+		errx(REC_ERROR, "%s: %s", argv[optind], errmsg);
+
+	/*
+	 * The client asks for Version 3, and for compression, only if told
+	 * to; ask as it did.  The threshold above which it compressed is not
+	 * recorded, so we take the smallest payload that it compressed (or,
+	 * if it compressed none, one larger than any it sent):
+	 */
+	(void) unsetenv(MDATA_PROTO_V3_ENV);
+	(void) unsetenv(MDATA_PROTO_COMPRESS_ENV);
+	for (i = 0; i < r.r_nsessions; i++) {
+		replay_session_t *rs = &r.r_sessions[i];
+		size_t j;
+
+		nreqs += rs->rs_nreqs;
+		if (rs->rs_v3)
+			(void) setenv(MDATA_PROTO_V3_ENV, "1", 1);
+		if (rs->rs_compress_reqid[0] != '\0')
+			compress = B_TRUE;
+		for (j = 0; j < rs->rs_nreqs; j++) {
+			size_t alen = rs->rs_reqs[j].rr_argument != NULL ?
+			    dynstr_len(rs->rs_reqs[j].rr_argument) : 0;
+
+			if (rs->rs_reqs[j].rr_lz && alen < lzmin)
+				lzmin = alen;
+			else if (!rs->rs_reqs[j].rr_lz && alen >= maxplain)
+				maxplain = alen + 1;
+		}
+	}
+	if (compress) {
+		char buf[32];
+
+		(void) snprintf(buf, sizeof (buf), "%zu",
+		    lzmin != SIZE_MAX ? lzmin : maxplain);
+		(void) setenv(MDATA_PROTO_COMPRESS_ENV, buf, 1);
+	}
+
+	if (mkdtemp(dir) == NULL)
+		err(REC_ERROR, "could not create temporary directory");
+	bzero(&sun, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	(void) snprintf(sun.sun_path, sizeof (sun.sun_path), "%s/sock", dir);
+
+	(void) signal(SIGPIPE, SIG_IGN);
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	    bind(lfd, (struct sockaddr *)&sun, sizeof (sun)) != 0 ||
+	    listen(lfd, 1) != 0)
+		err(REC_ERROR, "could not listen on %s", sun.sun_path);
+
+	if ((pid = fork()) == -1)
+		err(REC_ERROR, "could not fork");
+	if (pid == 0) {
+		diverged = replay_host(&r, lfd);
+		_exit(diverged > 0 ? REC_DIVERGED : REC_SUCCESS);
+	}
+	VERIFY0(close(lfd));
+
+	(void) setenv(MDATA_SOCKET_ENV, sun.sun_path, 1);
+	reqid_replay(r.r_ids, r.r_nids);
+
+	start = replay_now_us();
+	if (proto_init(&mdp, &errmsg) != 0) {
+		(void) kill(pid, SIGTERM);
+		errx(REC_ERROR, "could not initialise protocol: %s", errmsg);
+	}
+	for (i = 0; i < r.r_nsessions; i++) {
+		long long session_start = replay_now_us();
+
+		if (i > 0 && proto_async_reset(mdp) != 0) {
+			(void) kill(pid, SIGTERM);
+			errx(REC_ERROR, "could not reconnect for session %zu",
+			    i + 1);
+		}
+		replay_session(&r, mdp, &r.r_sessions[i],
+		    i > 0 ? session_start : start);
+	}
+	elapsed = replay_now_us() - start;
+	proto_fini(mdp);
+
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR)
+			err(REC_ERROR, "waitpid");
+	}
+	(void) unlink(sun.sun_path);
+	(void) rmdir(dir);
+
+	printf("sessions:  %zu\n", r.r_nsessions);
+	printf("requests:  %zu (%llu success, %llu not found, %llu other, "
+	    "%llu lost)\n", nreqs, (unsigned long long)r.r_success,
+	    (unsigned long long)r.r_notfound, (unsigned long long)r.r_other,
+	    (unsigned long long)r.r_lost);
+	printf("received:  %llu bytes of values\n",
+	    (unsigned long long)r.r_rxbytes);
+	printf("elapsed:   %.3f ms (%.0f requests/s)\n", elapsed / 1e3,
+	    elapsed > 0 ? nreqs * 1e6 / elapsed : 0.0);
+	printf("digest:    %08x\n", r.r_digest);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != REC_SUCCESS) {
+		fprintf(stderr, "mdata-replay: client diverged from trace\n");
+		return (REC_DIVERGED);
+	}
+
+	return (REC_SUCCESS);
+}
@@ -0,0 +1,977 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * Measure how the commands scale when many of them run at once, as they do
+ * during boot.
+ *
+ * For each of a list of concurrency levels, the given number of mdata-get and
+ * mdata-put processes are kept running at once (each new one started as soon
+ * as another exits), against a stand-in for the metadata service: an
+ * mdata-host serving a private key store.  By default the commands reach it
+ * through a pty, which they open as they would a virtio-serial port (and so
+ * queue for, one at a time, on the device lock); with --socket they connect
+ * to its UNIX domain socket instead, on which there is no lock.  The latency
+ * of each process is measured from fork(2) to exit, and the time each spent
+ * waiting for the device lock is collected from the report made on stderr
+ * under MDATA_LOCK_STATS, so that it may be set apart from the rest.
+ *
+ * The throughput and latency percentiles at each level are printed as a
+ * table and as plots against concurrency, or with --csv, as rows for another
+ * program to plot.
+ *
+ * It is a development tool, and is not installed.
+ */
+
+/*
+ * The pty interfaces (posix_openpt(3C) and the like) are XSI extensions,
+ * which glibc leaves out unless asked:
+ */
+#if defined(__linux__)
+#define	_GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "dynstr.h"
+#include "fsutil.h"
+#include "proto.h"
+#include "plat/unix_common.h"
+
+typedef enum stress_exit_codes {
+	SEC_SUCCESS = 0,
+	SEC_ERROR = 2,
+	SEC_USAGE_ERROR = 3
+} stress_exit_codes_t;
+
+#define	STRESS_KEY_PREFIX	"mdata-stress"
+
+/*
+ * The stand-in host serves at most this many connections at once (see
+ * HOST_MAX_CLIENTS in mdata_host.c), which bounds the concurrency of a run
+ * over its socket:
+ */
+#define	STRESS_MAX_CLIENTS	256
+
+#define	STRESS_MAX_LEVELS	32
+#define	STRESS_MAX_SIZE		(64 * 1024)
+#define	STRESS_HOST_WAIT_MS	5000
+#define	STRESS_PLOT_WIDTH	40
+
+static const char *stress_default_levels = "1,10,50,200";
+
+static const struct option long_options[] = {
+	{ "clients", required_argument, NULL, 'c' },
+	{ "csv", no_argument, NULL, 'C' },
+	{ "duration", required_argument, NULL, 'd' },
+	{ "host", required_argument, NULL, 'H' },
+	{ "keys", required_argument, NULL, 'k' },
+	{ "mdata", required_argument, NULL, 'M' },
+	{ "mix", required_argument, NULL, 'm' },
+	{ "requests", required_argument, NULL, 'n' },
+	{ "size", required_argument, NULL, 's' },
+	{ "socket", no_argument, NULL, 'S' },
+	{ NULL, 0, NULL, 0 }
+};
+
+typedef struct stress_proc {
+	pid_t sp_pid;
+	long long sp_start_us;
+} stress_proc_t;
+
+typedef struct stress_samples {
+	uint64_t *ss_vals;
+	size_t ss_count;
+	size_t ss_alloc;
+} stress_samples_t;
+
+typedef struct stress_level {
+	unsigned int sl_clients;
+	uint64_t sl_count;
+	uint64_t sl_errors;
+	long long sl_elapsed_us;
+	double sl_total_ms;
+
+	/*
+	 * The latency of each process, in microseconds, and the time spent
+	 * waiting for each acquisition of the device lock, in milliseconds:
+	 */
+	stress_samples_t sl_lat;
+	stress_samples_t sl_wait;
+} stress_level_t;
+
+typedef struct stress {
+	/*
+	 * Configuration:
+	 */
+	stress_level_t s_levels[STRESS_MAX_LEVELS];
+	unsigned int s_nlevels;
+	unsigned int s_get_weight;
+	unsigned int s_put_weight;
+	long long s_duration_us;
+	unsigned long s_requests;
+	size_t s_size;
+	unsigned int s_nkeys;
+	boolean_t s_socket;
+	boolean_t s_csv;
+	const char *s_mdata;
+	const char *s_host;
+
+	char **s_keys;
+	char *s_payload;
+
+	/*
+	 * The stand-in host, and the relay between it and the pty:
+	 */
+	char s_dir[PATH_MAX - 64];
+	char s_sock[PATH_MAX];
+	char s_pty[PATH_MAX];
+	pid_t s_host_pid;
+	pid_t s_relay_pid;
+	int s_pty_fd;
+
+	/*
+	 * Commands write to s_errfd, and we read what they wrote from
+	 * s_errpipe; the SIGCHLD handler writes to s_sigpipe[1]:
+	 */
+	int s_errpipe;
+	int s_errfd;
+	int s_sigpipe[2];
+	string_t *s_errbuf;
+
+	stress_proc_t *s_procs;
+	unsigned int s_running;
+} stress_t;
+
+static stress_t stress;
+static volatile sig_atomic_t stress_interrupted;
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [--clients <count>,...] "
+	    "[--requests <count>] [--duration <seconds>]\n"
+	    "           [--mix get=<n>,put=<n>] [--size <bytes>] "
+	    "[--keys <count>] [--socket]\n"
+	    "           [--mdata <path>] [--host <path>] [--csv]\n",
+	    progname);
+	exit(SEC_USAGE_ERROR);
+}
+
+static long long
+stress_now_us(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+
+	return ((long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static int
+parse_count(const char *str, unsigned long max, unsigned long *out)
+{
+	char *end;
+
+	errno = 0;
+	*out = strtoul(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || *out < 1 ||
+	    *out > max)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Parse a list of concurrency levels of the form "1,10,50,200".
+ */
+static int
+parse_levels(stress_t *s, const char *str)
+{
+	char *copy, *tok, *lasts = NULL;
+	int ret = -1;
+
+	if ((copy = strdup(str)) == NULL)
+		err(SEC_ERROR, "could not allocate memory");
+
+	s->s_nlevels = 0;
+	for (tok = strtok_r(copy, ",", &lasts); tok != NULL;
+	    tok = strtok_r(NULL, ",", &lasts)) {
+		unsigned long n;
+
+		if (s->s_nlevels == STRESS_MAX_LEVELS ||
+		    parse_count(tok, STRESS_MAX_CLIENTS, &n) != 0)
+			goto out;
+		s->s_levels[s->s_nlevels++].sl_clients = (unsigned int)n;
+	}
+	if (s->s_nlevels > 0)
+		ret = 0;
+
+out:
+	free(copy);
+	return (ret);
+}
+
+/*
+ * Parse a mix of the form "get=9,put=1"; commands not mentioned are not run.
+ */
+static int
+parse_mix(stress_t *s, const char *str)
+{
+	char *copy, *tok, *lasts = NULL;
+	int ret = -1;
+
+	if ((copy = strdup(str)) == NULL)
+		err(SEC_ERROR, "could not allocate memory");
+
+	s->s_get_weight = s->s_put_weight = 0;
+	for (tok = strtok_r(copy, ",", &lasts); tok != NULL;
+	    tok = strtok_r(NULL, ",", &lasts)) {
+		char *eq = strchr(tok, '=');
+		unsigned long w;
+
+		if (eq == NULL)
+			goto out;
+		*eq = '\0';
+		if (parse_count(eq + 1, 1000, &w) != 0)
+			goto out;
+		if (strcasecmp(tok, "get") == 0)
+			s->s_get_weight = (unsigned int)w;
+		else if (strcasecmp(tok, "put") == 0)
+			s->s_put_weight = (unsigned int)w;
+		else
+			goto out;
+	}
+	if (s->s_get_weight + s->s_put_weight > 0)
+		ret = 0;
+
+out:
+	free(copy);
+	return (ret);
+}
+
+static void
+stress_sample(stress_samples_t *ss, uint64_t val)
+{
+	if (ss->ss_count == ss->ss_alloc) {
+		ss->ss_alloc = ss->ss_alloc == 0 ? 1024 : ss->ss_alloc * 2;
+		if ((ss->ss_vals = realloc(ss->ss_vals, ss->ss_alloc *
+		    sizeof (uint64_t))) == NULL)
+			err(SEC_ERROR, "could not allocate memory");
+	}
+	ss->ss_vals[ss->ss_count++] = val;
+}
+
+static int
+stress_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x < y ? -1 : x > y ? 1 : 0);
+}
+
+/*
+ * Return a percentile of a set of samples, which must have been sorted.
+ */
+static uint64_t
+stress_pct(const stress_samples_t *ss, double pct)
+{
+	size_t i;
+
+	if (ss->ss_count == 0)
+		return (0);
+
+	i = (size_t)(pct / 100.0 * (double)ss->ss_count);
+	if (i >= ss->ss_count)
+		i = ss->ss_count - 1;
+
+	return (ss->ss_vals[i]);
+}
+
+static void
+stress_sigchld(int sig __UNUSED)
+{
+	int e = errno;
+
+	(void) write(stress.s_sigpipe[1], "", 1);
+	errno = e;
+}
+
+static void
+stress_sigint(int sig __UNUSED)
+{
+	stress_interrupted = 1;
+}
+
+static void
+stress_cloexec(int fd)
+{
+	VERIFY(fcntl(fd, F_SETFD, FD_CLOEXEC) != -1);
+}
+
+static void
+stress_nonblock(int fd)
+{
+	int flags;
+
+	VERIFY((flags = fcntl(fd, F_GETFL)) != -1);
+	VERIFY(fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1);
+}
+
+static int
+stress_rm(const char *path, const struct stat *st __UNUSED,
+    int type __UNUSED, struct FTW *ftw __UNUSED)
+{
+	(void) remove(path);
+	return (0);
+}
+
+/*
+ * Stop the stand-in and remove its directory.  This is run at exit, so that
+ * an error part way through a run does not leave the host behind.
+ */
+static void
+stress_cleanup(void)
+{
+	stress_t *s = &stress;
+
+	if (s->s_relay_pid > 0) {
+		(void) kill(s->s_relay_pid, SIGTERM);
+		(void) waitpid(s->s_relay_pid, NULL, 0);
+		s->s_relay_pid = 0;
+	}
+	if (s->s_host_pid > 0) {
+		(void) kill(s->s_host_pid, SIGTERM);
+		(void) waitpid(s->s_host_pid, NULL, 0);
+		s->s_host_pid = 0;
+	}
+	if (s->s_dir[0] != '\0') {
+		(void) nftw(s->s_dir, stress_rm, 16, FTW_DEPTH | FTW_PHYS);
+		s->s_dir[0] = '\0';
+	}
+}
+
+static int
+stress_connect(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	bzero(&sun, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	(void) snprintf(sun.sun_path, sizeof (sun.sun_path), "%s", path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return (-1);
+	if (connect(fd, (struct sockaddr *)&sun, sizeof (sun)) != 0) {
+		(void) close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+static int
+stress_write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		buf += n;
+		len -= (size_t)n;
+	}
+
+	return (0);
+}
+
+/*
+ * Copy bytes between the pty and a connection to the stand-in host, for as
+ * long as both remain open.  This runs in a child process of its own.
+ */
+static void
+stress_relay(int ptyfd, int sockfd)
+{
+	struct pollfd pfd[2];
+	char buf[65536];
+
+	(void) signal(SIGINT, SIG_DFL);
+	(void) signal(SIGTERM, SIG_DFL);
+
+	pfd[0].fd = ptyfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = sockfd;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		int i;
+
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			_exit(SEC_ERROR);
+		}
+
+		for (i = 0; i < 2; i++) {
+			ssize_t n;
+
+			if (pfd[i].revents == 0)
+				continue;
+			if ((n = read(pfd[i].fd, buf, sizeof (buf))) <= 0 ||
+			    stress_write_all(pfd[1 - i].fd, buf,
+			    (size_t)n) != 0)
+				_exit(n == 0 ? SEC_SUCCESS : SEC_ERROR);
+		}
+	}
+}
+
+/*
+ * Start the stand-in host in a private directory and wait for it to listen.
+ * Unless the commands are to use its socket, also open a pty in raw mode and
+ * start a process to relay between the pty and the host, and leave a note in
+ * the run directory so that the commands go straight to the pty, as they
+ * would to the device that answered them at boot.
+ */
+static void
+stress_start(stress_t *s)
+{
+	char path[PATH_MAX];
+	struct termios tios;
+	long long deadline;
+	const char *tmp;
+	int fd = -1, master;
+
+	if ((tmp = getenv("TMPDIR")) == NULL || tmp[0] == '\0')
+		tmp = "/tmp";
+	(void) snprintf(s->s_dir, sizeof (s->s_dir), "%s/%s.XXXXXX", tmp,
+	    STRESS_KEY_PREFIX);
+	if (mkdtemp(s->s_dir) == NULL) {
+		s->s_dir[0] = '\0';
+		err(SEC_ERROR, "could not create directory in %s", tmp);
+	}
+	(void) snprintf(s->s_sock, sizeof (s->s_sock), "%s/host.sock",
+	    s->s_dir);
+	(void) snprintf(path, sizeof (path), "%s/run", s->s_dir);
+	if (mkdir(path, 0755) != 0)
+		err(SEC_ERROR, "could not create %s", path);
+	VERIFY0(setenv(MDATA_RUNDIR_ENV, path, 1));
+
+	if ((s->s_host_pid = fork()) == -1)
+		err(SEC_ERROR, "could not fork");
+	if (s->s_host_pid == 0) {
+		(void) execl(s->s_host, s->s_host, s->s_sock, (char *)NULL);
+		warn("could not run %s", s->s_host);
+		_exit(SEC_ERROR);
+	}
+
+	deadline = stress_now_us() + STRESS_HOST_WAIT_MS * 1000LL;
+	while ((fd = stress_connect(s->s_sock)) == -1) {
+		if (stress_interrupted)
+			errx(SEC_ERROR, "interrupted");
+		if (stress_now_us() > deadline ||
+		    waitpid(s->s_host_pid, NULL, WNOHANG) != 0) {
+			s->s_host_pid = 0;
+			errx(SEC_ERROR, "host %s did not start", s->s_host);
+		}
+		(void) usleep(10000);
+	}
+
+	if (s->s_socket) {
+		(void) close(fd);
+		VERIFY0(setenv(MDATA_SOCKET_ENV, s->s_sock, 1));
+		return;
+	}
+
+	if ((master = posix_openpt(O_RDWR | O_NOCTTY)) == -1 ||
+	    grantpt(master) != 0 || unlockpt(master) != 0)
+		err(SEC_ERROR, "could not allocate a pty");
+	(void) snprintf(s->s_pty, sizeof (s->s_pty), "%s", ptsname(master));
+
+	/*
+	 * The slave is held open for the duration, so that the pty is not hung
+	 * up each time a command closes it:
+	 */
+	if ((s->s_pty_fd = open(s->s_pty, O_RDWR | O_NOCTTY)) == -1 ||
+	    tcgetattr(s->s_pty_fd, &tios) != 0)
+		err(SEC_ERROR, "could not open %s", s->s_pty);
+	cfmakeraw(&tios);
+	if (tcsetattr(s->s_pty_fd, TCSANOW, &tios) != 0)
+		err(SEC_ERROR, "could not set raw mode on %s", s->s_pty);
+	stress_cloexec(s->s_pty_fd);
+
+	if ((s->s_relay_pid = fork()) == -1)
+		err(SEC_ERROR, "could not fork");
+	if (s->s_relay_pid == 0)
+		stress_relay(master, fd);
+	(void) close(master);
+	(void) close(fd);
+
+	/*
+	 * The commands are told to use the pty as a virtio-serial port.  The
+	 * stand-in host is not reset between commands, so each must speak
+	 * Version 2 (or 1) of the protocol, as it would over a serial link:
+	 */
+	VERIFY0(unsetenv(MDATA_SOCKET_ENV));
+	VERIFY0(unsetenv(MDATA_PROTO_V3_ENV));
+	VERIFY0(setenv(MDATA_VIRTIO_PORT_ENV, s->s_pty, 1));
+
+	(void) snprintf(path, sizeof (path), "%s/run/%s", s->s_dir,
+	    UNIX_TRANSPORT_CACHE);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+	    dprintf(fd, "virtio %s\n", s->s_pty) < 0 || close(fd) != 0)
+		err(SEC_ERROR, "could not write %s", path);
+}
+
+/*
+ * Start one command against a randomly chosen key.
+ */
+static void
+stress_spawn(stress_t *s, stress_proc_t *sp, boolean_t put, unsigned int key)
+{
+	int nullfd;
+
+	sp->sp_start_us = stress_now_us();
+	if ((sp->sp_pid = fork()) == -1)
+		err(SEC_ERROR, "could not fork");
+	if (sp->sp_pid > 0) {
+		s->s_running++;
+		return;
+	}
+
+	(void) signal(SIGCHLD, SIG_DFL);
+	if ((nullfd = open("/dev/null", O_RDWR)) == -1 ||
+	    dup2(nullfd, STDIN_FILENO) == -1 ||
+	    dup2(nullfd, STDOUT_FILENO) == -1 ||
+	    dup2(s->s_errfd, STDERR_FILENO) == -1)
+		_exit(SEC_ERROR);
+
+	if (put) {
+		(void) execl(s->s_mdata, s->s_mdata, "put", s->s_keys[key],
+		    s->s_payload, (char *)NULL);
+	} else {
+		(void) execl(s->s_mdata, s->s_mdata, "get", s->s_keys[key],
+		    (char *)NULL);
+	}
+	_exit(127);
+}
+
+/*
+ * Read what the commands have written to stderr.  The lock report made for
+ * each acquisition of the device is recorded; anything else is passed on.
+ */
+static void
+stress_read_errors(stress_t *s, stress_level_t *sl)
+{
+	const char *buf, *p, *nl;
+	char chunk[4096];
+	string_t *rest;
+	ssize_t n;
+
+	while ((n = read(s->s_errpipe, chunk, sizeof (chunk))) > 0)
+		dynstr_appendn(s->s_errbuf, chunk, (size_t)n);
+	if (dynstr_len(s->s_errbuf) == 0)
+		return;
+
+	buf = dynstr_cstr(s->s_errbuf);
+	for (p = buf; (nl = strchr(p, '\n')) != NULL; p = nl + 1) {
+		const char *w;
+		long long waited;
+
+		if (strncmp(p, "mdata: lock ", 12) == 0 &&
+		    (w = strstr(p, ": waited ")) != NULL && w < nl &&
+		    sscanf(w, ": waited %lld ms", &waited) == 1) {
+			if (sl != NULL)
+				stress_sample(&sl->sl_wait,
+				    waited > 0 ? (uint64_t)waited : 0);
+			continue;
+		}
+		(void) fwrite(p, 1, (size_t)(nl - p) + 1, stderr);
+	}
+
+	rest = dynstr_new();
+	dynstr_append(rest, p);
+	dynstr_free(s->s_errbuf);
+	s->s_errbuf = rest;
+}
+
+/*
+ * Reap any commands that have exited, recording their latency.  Returns the
+ * number reaped.
+ */
+static unsigned int
+stress_reap(stress_t *s, stress_level_t *sl)
+{
+	unsigned int reaped = 0, i;
+	char c;
+	pid_t pid;
+	int status;
+
+	while (read(s->s_sigpipe[0], &c, 1) == 1)
+		continue;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		long long now = stress_now_us();
+
+		if (pid == s->s_host_pid || pid == s->s_relay_pid) {
+			if (pid == s->s_host_pid)
+				s->s_host_pid = 0;
+			else
+				s->s_relay_pid = 0;
+			errx(SEC_ERROR, "the stand-in host exited");
+		}
+
+		for (i = 0; i < s->s_running; i++) {
+			if (s->s_procs[i].sp_pid == pid)
+				break;
+		}
+		if (i == s->s_running)
+			continue;
+
+		if (sl != NULL) {
+			long long lat = now - s->s_procs[i].sp_start_us;
+
+			sl->sl_count++;
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				sl->sl_errors++;
+			stress_sample(&sl->sl_lat, lat > 0 ? (uint64_t)lat : 0);
+			sl->sl_total_ms += lat / 1e3;
+		} else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			errx(SEC_ERROR, "could not store values with %s",
+			    s->s_mdata);
+		}
+
+		s->s_procs[i] = s->s_procs[--s->s_running];
+		reaped++;
+	}
+
+	return (reaped);
+}
+
+/*
+ * Wait for something to happen: a command to exit, or to write to stderr.
+ */
+static void
+stress_wait(stress_t *s, stress_level_t *sl, int timeout)
+{
+	struct pollfd pfd[2];
+
+	pfd[0].fd = s->s_sigpipe[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = s->s_errpipe;
+	pfd[1].events = POLLIN;
+
+	if (poll(pfd, 2, timeout) == -1 && errno != EINTR)
+		err(SEC_ERROR, "poll");
+	if (stress_interrupted)
+		errx(SEC_ERROR, "interrupted");
+
+	stress_read_errors(s, sl);
+	(void) stress_reap(s, sl);
+}
+
+/*
+ * Store a value for each of the keys, one at a time, so that every GET
+ * finds one.
+ */
+static void
+stress_populate(stress_t *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->s_nkeys; i++) {
+		stress_spawn(s, &s->s_procs[0], B_TRUE, i);
+		while (s->s_running > 0)
+			stress_wait(s, NULL, -1);
+	}
+	stress_read_errors(s, NULL);
+}
+
+static void
+stress_level(stress_t *s, stress_level_t *sl)
+{
+	long long start = stress_now_us(), deadline = 0;
+	unsigned int weight = s->s_get_weight + s->s_put_weight;
+	unsigned long issued = 0;
+
+	if (s->s_duration_us > 0)
+		deadline = start + s->s_duration_us;
+
+	for (;;) {
+		long long now = stress_now_us();
+		boolean_t more = B_TRUE;
+		int timeout = -1;
+
+		if (s->s_requests > 0 && issued >= s->s_requests)
+			more = B_FALSE;
+		if (deadline > 0 && now >= deadline)
+			more = B_FALSE;
+
+		while (more && s->s_running < sl->sl_clients &&
+		    (s->s_requests == 0 || issued < s->s_requests)) {
+			unsigned int n = (unsigned int)random() % weight;
+
+			stress_spawn(s, &s->s_procs[s->s_running],
+			    n >= s->s_get_weight ? B_TRUE : B_FALSE,
+			    (unsigned int)random() % s->s_nkeys);
+			issued++;
+		}
+
+		if (!more && s->s_running == 0)
+			break;
+		if (more && deadline > 0)
+			timeout = (int)((deadline - now + 999) / 1000);
+
+		stress_wait(s, sl, timeout);
+	}
+
+	stress_read_errors(s, sl);
+	sl->sl_elapsed_us = stress_now_us() - start;
+}
+
+static void
+stress_plot(const stress_t *s, const char *title, const double *vals)
+{
+	double max = 0;
+	unsigned int i;
+
+	for (i = 0; i < s->s_nlevels; i++) {
+		if (vals[i] > max)
+			max = vals[i];
+	}
+
+	printf("\n  %s\n", title);
+	printf("  %7s  %.*s\n", "clients", STRESS_PLOT_WIDTH,
+	    "----------------------------------------");
+	for (i = 0; i < s->s_nlevels; i++) {
+		int bars = max > 0 ?
+		    (int)(vals[i] * STRESS_PLOT_WIDTH / max + 0.5) : 0;
+
+		printf("  %7u |%-40.*s %.1f\n", s->s_levels[i].sl_clients,
+		    bars, "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@", vals[i]);
+	}
+}
+
+static void
+stress_report(stress_t *s)
+{
+	double tput[STRESS_MAX_LEVELS], p99[STRESS_MAX_LEVELS];
+	double wait99[STRESS_MAX_LEVELS];
+	unsigned int i;
+
+	if (s->s_csv) {
+		printf("clients,requests,errors,requests_per_s,p50_ms,p90_ms,"
+		    "p99_ms,max_ms,locks,wait_p50_ms,wait_p99_ms,wait_max_ms,"
+		    "wait_share\n");
+	} else {
+		printf("transport:  %s %s\n", s->s_socket ? "socket" : "pty",
+		    s->s_socket ? s->s_sock : s->s_pty);
+		printf("commands:   get=%u,put=%u, %zu byte values, %u keys\n",
+		    s->s_get_weight, s->s_put_weight, s->s_size, s->s_nkeys);
+		printf("\n%7s %8s %6s %8s %8s %8s %8s %8s %6s %9s %9s %9s "
+		    "%5s\n", "clients", "requests", "errors", "req/s",
+		    "p50 ms", "p90 ms", "p99 ms", "max ms", "locks",
+		    "wait p50", "wait p99", "wait max", "wait%");
+	}
+
+	for (i = 0; i < s->s_nlevels; i++) {
+		stress_level_t *sl = &s->s_levels[i];
+		double secs = sl->sl_elapsed_us / 1e6;
+		double waited = 0;
+		size_t j;
+
+		qsort(sl->sl_lat.ss_vals, sl->sl_lat.ss_count,
+		    sizeof (uint64_t), stress_cmp);
+		qsort(sl->sl_wait.ss_vals, sl->sl_wait.ss_count,
+		    sizeof (uint64_t), stress_cmp);
+		for (j = 0; j < sl->sl_wait.ss_count; j++)
+			waited += (double)sl->sl_wait.ss_vals[j];
+
+		tput[i] = secs > 0 ? sl->sl_count / secs : 0;
+		p99[i] = stress_pct(&sl->sl_lat, 99) / 1e3;
+		wait99[i] = (double)stress_pct(&sl->sl_wait, 99);
+
+		printf(s->s_csv ? "%u,%llu,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%zu,"
+		    "%llu,%llu,%llu,%.2f\n" : "%7u %8llu %6llu %8.1f %8.1f "
+		    "%8.1f %8.1f %8.1f %6zu %9llu %9llu %9llu %4.0f%%\n",
+		    sl->sl_clients, (unsigned long long)sl->sl_count,
+		    (unsigned long long)sl->sl_errors, tput[i],
+		    stress_pct(&sl->sl_lat, 50) / 1e3,
+		    stress_pct(&sl->sl_lat, 90) / 1e3, p99[i],
+		    stress_pct(&sl->sl_lat, 100) / 1e3,
+		    sl->sl_wait.ss_count,
+		    (unsigned long long)stress_pct(&sl->sl_wait, 50),
+		    (unsigned long long)stress_pct(&sl->sl_wait, 99),
+		    (unsigned long long)stress_pct(&sl->sl_wait, 100),
+		    sl->sl_total_ms > 0 ? waited / sl->sl_total_ms *
+		    (s->s_csv ? 1 : 100) : 0.0);
+	}
+
+	if (s->s_csv)
+		return;
+
+	stress_plot(s, "throughput (requests/s)", tput);
+	stress_plot(s, "p99 latency (ms)", p99);
+	if (!s->s_socket)
+		stress_plot(s, "p99 lock wait (ms)", wait99);
+}
+
+int
+main(int argc, char **argv)
+{
+	stress_t *s = &stress;
+	unsigned int i, most = 0;
+	unsigned long n;
+	int opt, ms, fds[2];
+
+	bzero(s, sizeof (*s));
+	s->s_get_weight = 9;
+	s->s_put_weight = 1;
+	s->s_size = 64;
+	s->s_nkeys = 16;
+	s->s_mdata = "./mdata";
+	s->s_host = "./mdata-host";
+	s->s_pty_fd = -1;
+	VERIFY0(parse_levels(s, stress_default_levels));
+
+	while ((opt = getopt_long(argc, argv, "+", long_options,
+	    NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			if (parse_levels(s, optarg) != 0)
+				errx(SEC_USAGE_ERROR, "invalid client counts: "
+				    "%s (at most %d levels of 1 to %d)", optarg,
+				    STRESS_MAX_LEVELS, STRESS_MAX_CLIENTS);
+			break;
+		case 'C':
+			s->s_csv = B_TRUE;
+			break;
+		case 'd':
+			if (parse_seconds(optarg, &ms) != 0 || ms < 1)
+				errx(SEC_USAGE_ERROR, "invalid duration: %s",
+				    optarg);
+			s->s_duration_us = (long long)ms * 1000;
+			break;
+		case 'H':
+			s->s_host = optarg;
+			break;
+		case 'k':
+			if (parse_count(optarg, 100000, &n) != 0)
+				errx(SEC_USAGE_ERROR, "invalid key count: %s",
+				    optarg);
+			s->s_nkeys = (unsigned int)n;
+			break;
+		case 'M':
+			s->s_mdata = optarg;
+			break;
+		case 'm':
+			if (parse_mix(s, optarg) != 0)
+				errx(SEC_USAGE_ERROR, "invalid mix: %s",
+				    optarg);
+			break;
+		case 'n':
+			if (parse_count(optarg, ULONG_MAX, &s->s_requests) != 0)
+				errx(SEC_USAGE_ERROR, "invalid request count: "
+				    "%s", optarg);
+			break;
+		case 's':
+			if (parse_count(optarg, STRESS_MAX_SIZE, &n) != 0)
+				errx(SEC_USAGE_ERROR, "invalid size: %s",
+				    optarg);
+			s->s_size = (size_t)n;
+			break;
+		case 'S':
+			s->s_socket = B_TRUE;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc != optind)
+		usage(argv[0]);
+
+	if (s->s_requests == 0 && s->s_duration_us == 0)
+		s->s_duration_us = 5 * 1000000LL;
+
+	srandom((unsigned int)(getpid() ^ time(NULL)));
+
+	for (i = 0; i < s->s_nlevels; i++) {
+		if (s->s_levels[i].sl_clients > most)
+			most = s->s_levels[i].sl_clients;
+	}
+	if ((s->s_payload = malloc(s->s_size + 1)) == NULL ||
+	    (s->s_keys = calloc(s->s_nkeys, sizeof (char *))) == NULL ||
+	    (s->s_procs = calloc(most, sizeof (stress_proc_t))) == NULL)
+		err(SEC_ERROR, "could not allocate memory");
+	for (i = 0; i < s->s_size; i++)
+		s->s_payload[i] = "abcdefghijklmnopqrstuvwxyz0123456789"[
+		    random() % 36];
+	s->s_payload[s->s_size] = '\0';
+	for (i = 0; i < s->s_nkeys; i++) {
+		char key[64];
+
+		(void) snprintf(key, sizeof (key), "%s.%u", STRESS_KEY_PREFIX,
+		    i);
+		if ((s->s_keys[i] = strdup(key)) == NULL)
+			err(SEC_ERROR, "could not allocate memory");
+	}
+
+	/*
+	 * Every command reports its waits for the device lock on stderr, which
+	 * all of them share:
+	 */
+	if (pipe(fds) != 0 || pipe(s->s_sigpipe) != 0)
+		err(SEC_ERROR, "could not create pipe");
+	s->s_errpipe = fds[0];
+	s->s_errfd = fds[1];
+	for (i = 0; i < 2; i++) {
+		stress_cloexec(fds[i]);
+		stress_cloexec(s->s_sigpipe[i]);
+		stress_nonblock(s->s_sigpipe[i]);
+	}
+	stress_nonblock(s->s_errpipe);
+	s->s_errbuf = dynstr_new();
+	VERIFY0(setenv(MDATA_LOCK_STATS_ENV, "1", 1));
+
+	(void) signal(SIGPIPE, SIG_IGN);
+	(void) signal(SIGCHLD, stress_sigchld);
+	(void) signal(SIGINT, stress_sigint);
+	(void) signal(SIGTERM, stress_sigint);
+	VERIFY0(atexit(stress_cleanup));
+
+	stress_start(s);
+	stress_populate(s);
+	for (i = 0; i < s->s_nlevels; i++)
+		stress_level(s, &s->s_levels[i]);
+	stress_report(s);
+
+	return (SEC_SUCCESS);
+}
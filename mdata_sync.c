@@ -0,0 +1,566 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * Copy the metadata into a directory, with one file for each key, so that
+ * programs may read it as they would any other file: with no lock to take
+ * and no request to make.
+ *
+ * Every key is fetched over one connection.  The name of each file is that
+ * of its key, with any byte that is unsafe in a file name (or a leading ".")
+ * written as "%" and two hexadecimal digits.  Each file is replaced
+ * atomically, so that readers see either its old or its new contents in
+ * full.
+ *
+ * The size and CRC32 of the value in each file are recorded in a manifest in
+ * the directory (which, as its name begins with ".", cannot be mistaken for
+ * a key).  On later runs, only files whose values have changed are written
+ * again, and only files that the manifest records as ours are removed when
+ * their keys go away; anything else in the directory is left alone.
+ *
+ * The metadata includes secrets (user-script, keys and the like) that only
+ * root can otherwise read from the device, so by default the files can be
+ * read only by their owner, as can a directory that we create.  The mode of
+ * the files may be given with --mode.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "common.h"
+#include "crc32.h"
+#include "dynstr.h"
+#include "fsutil.h"
+#include "keyidx.h"
+#include "mdata.h"
+#include "plat.h"
+#include "proto.h"
+
+typedef enum mdata_exit_codes {
+	MDEC_SUCCESS = 0,
+	MDEC_NOTFOUND = 1,
+	MDEC_ERROR = 2,
+	MDEC_USAGE_ERROR = 3,
+	MDEC_TRY_AGAIN = 10
+} mdata_exit_codes_t;
+
+#define	SYNC_MANIFEST		".mdata-sync"
+#define	SYNC_SAFE_CHARS		"-_.,+=@:"
+#define	SYNC_MODE_DEFAULT	0600
+
+static const struct option long_options[] = {
+	{ "dir", required_argument, NULL, 'd' },
+	{ "lock-timeout", required_argument, NULL, 'T' },
+	{ "mode", required_argument, NULL, 'm' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/*
+ * A file recorded in the manifest, with the size and CRC32 of the value it
+ * holds.  Each run reads the manifest left by the last, and writes one
+ * describing the files as it leaves them.
+ */
+typedef struct sync_file {
+	char *sf_name;
+	uint32_t sf_crc;
+	size_t sf_len;
+	boolean_t sf_keep;
+	boolean_t sf_current;
+} sync_file_t;
+
+typedef struct sync sync_t;
+
+typedef struct sync_key {
+	sync_t *sk_sync;
+	char *sk_name;
+	char *sk_file;
+
+	/*
+	 * Whether the value is now in the file, and if so, its digest:
+	 */
+	boolean_t sk_written;
+	uint32_t sk_crc;
+	size_t sk_len;
+} sync_key_t;
+
+struct sync {
+	const char *s_dir;
+	mode_t s_mode;
+	sync_file_t *s_old;
+	size_t s_nold;
+	sync_key_t *s_keys;
+	size_t s_nkeys;
+	unsigned int s_failed;
+};
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [--lock-timeout <seconds>] [--mode <mode>] "
+	    "--dir <directory>\n", progname);
+	exit(MDEC_USAGE_ERROR);
+}
+
+static int
+sync_file_cmp(const void *l, const void *r)
+{
+	const sync_file_t *a = l, *b = r;
+
+	return (strcmp(a->sf_name, b->sf_name));
+}
+
+static sync_file_t *
+sync_find_old(sync_t *s, const char *name)
+{
+	sync_file_t key;
+
+	key.sf_name = (char *)name;
+	return (bsearch(&key, s->s_old, s->s_nold, sizeof (sync_file_t),
+	    sync_file_cmp));
+}
+
+/*
+ * Encode a key name as a file name.  Returns NULL if the result would be too
+ * long for a file name.
+ */
+static char *
+sync_encode(const char *name, size_t len)
+{
+	string_t *str = dynstr_new();
+	char *out = NULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = (unsigned char)name[i];
+		char hex[4];
+
+		if ((isalnum(c) || strchr(SYNC_SAFE_CHARS, c) != NULL) &&
+		    c != '\0' && !(i == 0 && c == '.')) {
+			dynstr_appendc(str, (char)c);
+			continue;
+		}
+		(void) snprintf(hex, sizeof (hex), "%%%02X", c);
+		dynstr_append(str, hex);
+	}
+
+	if (dynstr_len(str) <= NAME_MAX &&
+	    (out = strdup(dynstr_cstr(str))) == NULL)
+		err(MDEC_ERROR, "could not allocate memory");
+	dynstr_free(str);
+
+	return (out);
+}
+
+/*
+ * Recover the key name from a file name, for the report of its removal.
+ */
+static void
+sync_decode(const char *file, string_t *out)
+{
+	unsigned int c;
+
+	for (; *file != '\0'; file++) {
+		if (file[0] == '%' && isxdigit((unsigned char)file[1]) &&
+		    isxdigit((unsigned char)file[2]) &&
+		    sscanf(file + 1, "%2x", &c) == 1) {
+			dynstr_appendc(out, (char)c);
+			file += 2;
+			continue;
+		}
+		dynstr_appendc(out, *file);
+	}
+}
+
+static int
+sync_path(sync_t *s, const char *name, char *buf, size_t len)
+{
+	if (snprintf(buf, len, "%s/%s", s->s_dir, name) >= (int)len) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Read the manifest left by the last run, if there is one.  Each line holds
+ * the CRC32 and size of a value, and the name of the file that holds it.
+ */
+static void
+sync_read_manifest(sync_t *s)
+{
+	char path[PATH_MAX];
+	string_t *str = dynstr_new();
+	const char *p, *nl;
+	size_t alloc = 0;
+
+	if (sync_path(s, SYNC_MANIFEST, path, sizeof (path)) != 0 ||
+	    fs_read_file(path, str) != 0 || dynstr_len(str) == 0)
+		goto out;
+
+	for (p = dynstr_cstr(str); (nl = strchr(p, '\n')) != NULL;
+	    p = nl + 1) {
+		char name[NAME_MAX + 1];
+		unsigned int crc;
+		unsigned long len;
+
+		if (sscanf(p, "%x %lu %255s", &crc, &len, name) != 3 ||
+		    name[0] == '.' || strchr(name, '/') != NULL)
+			continue;
+
+		if (s->s_nold == alloc) {
+			alloc = alloc == 0 ? 64 : alloc * 2;
+			if ((s->s_old = realloc(s->s_old, alloc *
+			    sizeof (sync_file_t))) == NULL)
+				err(MDEC_ERROR, "could not allocate memory");
+		}
+		if ((s->s_old[s->s_nold].sf_name = strdup(name)) == NULL)
+			err(MDEC_ERROR, "could not allocate memory");
+		s->s_old[s->s_nold].sf_crc = (uint32_t)crc;
+		s->s_old[s->s_nold].sf_len = (size_t)len;
+		s->s_old[s->s_nold].sf_keep = B_FALSE;
+		s->s_old[s->s_nold].sf_current = B_FALSE;
+		s->s_nold++;
+	}
+
+	if (s->s_nold > 1) {
+		qsort(s->s_old, s->s_nold, sizeof (sync_file_t),
+		    sync_file_cmp);
+	}
+
+out:
+	dynstr_free(str);
+}
+
+static void
+sync_get_done(int err, mdata_response_t mdr, string_t *data, void *arg)
+{
+	sync_key_t *sk = arg;
+	sync_t *s = sk->sk_sync;
+	sync_file_t *sf = sync_find_old(s, sk->sk_file);
+	char path[PATH_MAX];
+	const char *val;
+	struct stat st;
+
+	if (err != 0 || (mdr != MDR_SUCCESS && mdr != MDR_NOTFOUND)) {
+		if (err == 0) {
+			fprintf(stderr, "Error getting metadata for key '%s': "
+			    "%s\n", sk->sk_name, mdr == MDR_INVALID_COMMAND ?
+			    "host does not support GET" : dynstr_len(data) > 0 ?
+			    dynstr_cstr(data) : "unknown error");
+		}
+		s->s_failed++;
+		goto keep;
+	}
+
+	/*
+	 * A key that has gone away since we listed it is removed with the
+	 * others that have:
+	 */
+	if (mdr == MDR_NOTFOUND)
+		return;
+
+	sk->sk_len = dynstr_len(data);
+	val = sk->sk_len > 0 ? dynstr_cstr(data) : "";
+	sk->sk_crc = crc32_calc(val, sk->sk_len);
+
+	if (sync_path(s, sk->sk_file, path, sizeof (path)) != 0) {
+		warn("could not write key '%s'", sk->sk_name);
+		s->s_failed++;
+		goto keep;
+	}
+
+	if (sf != NULL && sf->sf_crc == sk->sk_crc &&
+	    sf->sf_len == sk->sk_len && stat(path, &st) == 0 &&
+	    S_ISREG(st.st_mode) && (size_t)st.st_size == sk->sk_len) {
+		/*
+		 * The file may have been written with another mode, such as
+		 * by an earlier version that made every file readable:
+		 */
+		if ((st.st_mode & 07777) != s->s_mode &&
+		    chmod(path, s->s_mode) != 0) {
+			warn("could not change the mode of '%s'", path);
+			s->s_failed++;
+		}
+		sk->sk_written = B_TRUE;
+		return;
+	}
+
+	if (fs_write_atomic(path, val, sk->sk_len, s->s_mode) != 0) {
+		warn("could not write '%s'", path);
+		s->s_failed++;
+		goto keep;
+	}
+	sk->sk_written = B_TRUE;
+	printf("changed\t%s\n", sk->sk_name);
+	return;
+
+keep:
+	/*
+	 * The file, if there is one, holds what it did before, as the
+	 * manifest still says:
+	 */
+	if (sf != NULL)
+		sf->sf_keep = B_TRUE;
+}
+
+/*
+ * Remove the files of keys that are gone, which are those the manifest
+ * records that no key now holds or has kept.
+ */
+static void
+sync_remove(sync_t *s)
+{
+	char path[PATH_MAX];
+	size_t i;
+
+	for (i = 0; i < s->s_nkeys; i++) {
+		sync_file_t *sf;
+
+		if (s->s_keys[i].sk_written &&
+		    (sf = sync_find_old(s, s->s_keys[i].sk_file)) != NULL)
+			sf->sf_keep = sf->sf_current = B_TRUE;
+	}
+
+	for (i = 0; i < s->s_nold; i++) {
+		sync_file_t *sf = &s->s_old[i];
+		string_t *name;
+
+		if (sf->sf_keep)
+			continue;
+
+		if (sync_path(s, sf->sf_name, path, sizeof (path)) != 0 ||
+		    (unlink(path) != 0 && errno != ENOENT)) {
+			warn("could not remove '%s'", path);
+			s->s_failed++;
+			sf->sf_keep = B_TRUE;
+			continue;
+		}
+
+		name = dynstr_new();
+		sync_decode(sf->sf_name, name);
+		printf("deleted\t%s\n", dynstr_cstr(name));
+		dynstr_free(name);
+	}
+}
+
+/*
+ * Record the files as we leave them: those written (or found up to date) in
+ * this run, and those of an earlier run that could not be replaced or
+ * removed.
+ */
+static int
+sync_write_manifest(sync_t *s)
+{
+	char path[PATH_MAX], line[NAME_MAX + 32];
+	string_t *str = dynstr_new();
+	size_t i;
+	int ret;
+
+	for (i = 0; i < s->s_nkeys; i++) {
+		sync_key_t *sk = &s->s_keys[i];
+
+		if (!sk->sk_written)
+			continue;
+		(void) snprintf(line, sizeof (line), "%08x %lu %s\n",
+		    (unsigned int)sk->sk_crc, (unsigned long)sk->sk_len,
+		    sk->sk_file);
+		dynstr_append(str, line);
+	}
+
+	for (i = 0; i < s->s_nold; i++) {
+		sync_file_t *sf = &s->s_old[i];
+
+		if (!sf->sf_keep || sf->sf_current)
+			continue;
+		(void) snprintf(line, sizeof (line), "%08x %lu %s\n",
+		    (unsigned int)sf->sf_crc, (unsigned long)sf->sf_len,
+		    sf->sf_name);
+		dynstr_append(str, line);
+	}
+
+	if ((ret = sync_path(s, SYNC_MANIFEST, path, sizeof (path))) == 0) {
+		ret = fs_write_atomic(path, dynstr_len(str) > 0 ?
+		    dynstr_cstr(str) : "", dynstr_len(str), 0600);
+	}
+	if (ret != 0)
+		warn("could not write '%s'", path);
+	dynstr_free(str);
+
+	return (ret);
+}
+
+/*
+ * Fetch every key, over one connection, into its file.
+ */
+static int
+sync_keys(sync_t *s, mdata_proto_t *mdp, string_t *list)
+{
+	mdata_batch_t *mb;
+	sync_file_t *sf;
+	keyidx_t ki;
+	size_t i;
+
+	if (keyidx_init(&ki, dynstr_len(list) > 0 ? dynstr_cstr(list) : "",
+	    dynstr_len(list)) != 0 || (s->s_keys = calloc(ki.ki_count + 1,
+	    sizeof (sync_key_t))) == NULL ||
+	    batch_init(&mb, mdp, BATCH_WINDOW) != 0)
+		err(MDEC_ERROR, "could not allocate memory");
+
+	for (i = 0; i < ki.ki_count; i++) {
+		const keyidx_ent_t *ke = &ki.ki_ents[i];
+		sync_key_t *sk = &s->s_keys[s->s_nkeys];
+
+		if ((sk->sk_file = sync_encode(ke->ke_name,
+		    ke->ke_len)) == NULL) {
+			fprintf(stderr, "WARNING: key '%s' is too long to be "
+			    "a file name\n", keyidx_cstr(&ki, ke));
+			continue;
+		}
+		if ((sk->sk_name = strdup(keyidx_cstr(&ki, ke))) == NULL)
+			err(MDEC_ERROR, "could not allocate memory");
+		sk->sk_sync = s;
+		s->s_nkeys++;
+
+		/*
+		 * Values are expected to be the size that they were on the
+		 * last run, so that large values are fetched after small ones:
+		 */
+		sf = sync_find_old(s, sk->sk_file);
+		batch_submit_ext(mb, "GET", sk->sk_name, sf != NULL ?
+		    sf->sf_len : 0, 0, sync_get_done, sk);
+	}
+	keyidx_fini(&ki);
+
+	(void) batch_run(mb);
+	batch_fini(mb);
+
+	return (s->s_failed > 0 ? -1 : 0);
+}
+
+int
+mdata_sync_main(int argc, char **argv)
+{
+	mdata_proto_t *mdp;
+	mdata_response_t mdr;
+	string_t *data;
+	const char *errmsg = NULL;
+	sync_t s;
+	mode_t mask, dirmode;
+	unsigned long mode = SYNC_MODE_DEFAULT;
+	char *end;
+	int opt, ms;
+
+	bzero(&s, sizeof (s));
+
+	while ((opt = getopt_long(argc, argv, "+", long_options,
+	    NULL)) != -1) {
+		switch (opt) {
+		case 'T':
+			if (parse_seconds(optarg, &ms) != 0) {
+				errx(MDEC_USAGE_ERROR,
+				    "invalid lock timeout: %s", optarg);
+			}
+			plat_set_lock_timeout(ms);
+			break;
+		case 'd':
+			s.s_dir = optarg;
+			break;
+		case 'm':
+			errno = 0;
+			mode = strtoul(optarg, &end, 8);
+			if (errno != 0 || end == optarg || *end != '\0' ||
+			    mode > 0777) {
+				errx(MDEC_USAGE_ERROR, "invalid mode: %s",
+				    optarg);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc != optind || s.s_dir == NULL || s.s_dir[0] == '\0')
+		usage(argv[0]);
+
+	/*
+	 * Files are created with the mode as the umask leaves it, and files
+	 * already there are brought into line.  A directory that we create
+	 * may be searched by those who may read the files:
+	 */
+	mask = umask(0);
+	(void) umask(mask);
+	s.s_mode = (mode_t)mode & ~mask;
+
+	dirmode = 0700;
+	if (mode & 0040)
+		dirmode |= 0050;
+	if (mode & 0004)
+		dirmode |= 0005;
+
+	if (mkdir(s.s_dir, dirmode) != 0 && errno != EEXIST) {
+		fprintf(stderr, "ERROR: could not create '%s': %s\n", s.s_dir,
+		    strerror(errno));
+		return (MDEC_ERROR);
+	}
+	sync_read_manifest(&s);
+
+	/*
+	 * Changes are reported as they are made:
+	 */
+	(void) setvbuf(stdout, NULL, _IOLBF, 0);
+
+	if (proto_init(&mdp, &errmsg) != 0) {
+		fprintf(stderr, "ERROR: could not initialise protocol: %s\n",
+		    errmsg);
+		return (MDEC_ERROR);
+	}
+
+	if (proto_execute(mdp, "KEYS", NULL, &mdr, &data) != 0) {
+		fprintf(stderr, "ERROR: could not execute KEYS\n");
+		return (MDEC_ERROR);
+	}
+
+	switch (mdr) {
+	case MDR_SUCCESS:
+		break;
+	case MDR_NOTFOUND:
+		dynstr_reset(data);
+		break;
+	case MDR_UNKNOWN:
+		fprintf(stderr, "Error listing metadata keys: %s\n",
+		    dynstr_cstr(data));
+		return (MDEC_ERROR);
+	case MDR_INVALID_COMMAND:
+		fprintf(stderr, "ERROR: host does not support KEYS\n");
+		return (MDEC_ERROR);
+	default:
+		ABORT("mdata_sync_main: UNKNOWN RESPONSE\n");
+		return (MDEC_ERROR);
+	}
+
+	if (sync_keys(&s, mdp, data) != 0)
+		fprintf(stderr, "ERROR: some keys could not be copied\n");
+	proto_fini(mdp);
+
+	sync_remove(&s);
+	if (sync_write_manifest(&s) != 0)
+		s.s_failed++;
+
+	return (s.s_failed > 0 ? MDEC_ERROR : MDEC_SUCCESS);
+}
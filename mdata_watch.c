@@ -0,0 +1,400 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * Report changes to the values of a set of metadata keys.
+ *
+ * The protocol offers no way for the host to tell us that a value has
+ * changed, so we poll.  Each round fetches every key over one connection and
+ * compares a digest of each value with the one from the previous round.  The
+ * interval between rounds doubles, up to a limit, each time nothing has
+ * changed, and drops back to the minimum as soon as something does.
+ *
+ * A connection to a UNIX domain socket is held for the life of the process.
+ * A serial or virtio-serial device, on the other hand, is locked for as long
+ * as we have it open and other clients queue behind us; it is released at
+ * the end of each round, before any hook is run, as the hook may well wish to
+ * use it.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "common.h"
+#include "crc32.h"
+#include "dynstr.h"
+#include "mdata.h"
+#include "plat.h"
+#include "proto.h"
+
+typedef enum mdata_exit_codes {
+	MDEC_SUCCESS = 0,
+	MDEC_NOTFOUND = 1,
+	MDEC_ERROR = 2,
+	MDEC_USAGE_ERROR = 3,
+	MDEC_TRY_AGAIN = 10
+} mdata_exit_codes_t;
+
+/*
+ * Default bounds on the interval between polls, in milliseconds:
+ */
+#define	WATCH_MIN_INTERVAL	1000
+#define	WATCH_MAX_INTERVAL	60000
+
+static const struct option long_options[] = {
+	{ "exec", required_argument, NULL, 'e' },
+	{ "initial", no_argument, NULL, 'i' },
+	{ "interval", required_argument, NULL, 'n' },
+	{ "lock-timeout", required_argument, NULL, 'T' },
+	{ "max-interval", required_argument, NULL, 'm' },
+	{ NULL, 0, NULL, 0 }
+};
+
+typedef struct watch watch_t;
+
+typedef struct watch_key {
+	watch_t *wk_watch;
+	const char *wk_name;
+
+	/*
+	 * What we know of the value as of the last successful fetch:
+	 */
+	boolean_t wk_known;
+	boolean_t wk_present;
+	uint32_t wk_crc;
+	size_t wk_len;
+
+	/*
+	 * Whether the value changed in the current round and, if so, its new
+	 * value:
+	 */
+	boolean_t wk_changed;
+	string_t *wk_value;
+} watch_key_t;
+
+struct watch {
+	watch_key_t *w_keys;
+	int w_nkeys;
+	const char *w_exec;
+	boolean_t w_initial;
+	unsigned int w_failed;
+};
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [--lock-timeout <seconds>] "
+	    "[--interval <seconds>] [--max-interval <seconds>]\n"
+	    "           [--exec <command>] [--initial] <keyname> ...\n",
+	    progname);
+	exit(MDEC_USAGE_ERROR);
+}
+
+static void
+watch_get_done(int err, mdata_response_t mdr, string_t *data, void *arg)
+{
+	watch_key_t *wk = arg;
+	watch_t *w = wk->wk_watch;
+	const char *val;
+	size_t len;
+	uint32_t crc;
+	boolean_t present;
+
+	wk->wk_changed = B_FALSE;
+
+	if (err != 0) {
+		w->w_failed++;
+		return;
+	}
+
+	if (mdr != MDR_SUCCESS && mdr != MDR_NOTFOUND) {
+		fprintf(stderr, "Error getting metadata for key '%s': %s\n",
+		    wk->wk_name, mdr == MDR_INVALID_COMMAND ? "host does not "
+		    "support GET" : dynstr_len(data) > 0 ? dynstr_cstr(data) :
+		    "unknown error");
+		return;
+	}
+
+	present = (mdr == MDR_SUCCESS);
+	len = present ? dynstr_len(data) : 0;
+	val = len > 0 ? dynstr_cstr(data) : "";
+	crc = crc32_calc(val, len);
+
+	if (!wk->wk_known) {
+		wk->wk_changed = w->w_initial && present;
+	} else if (present != wk->wk_present || crc != wk->wk_crc ||
+	    len != wk->wk_len) {
+		wk->wk_changed = B_TRUE;
+	}
+
+	wk->wk_known = B_TRUE;
+	wk->wk_present = present;
+	wk->wk_crc = crc;
+	wk->wk_len = len;
+
+	if (wk->wk_changed) {
+		dynstr_reset(wk->wk_value);
+		dynstr_appendn(wk->wk_value, val, len);
+	}
+}
+
+/*
+ * Fetch every key once.  Returns -1 if the connection failed before every
+ * key could be fetched.
+ */
+static int
+watch_round(mdata_proto_t *mdp, watch_t *w)
+{
+	mdata_batch_t *mb;
+	int i;
+
+	if (batch_init(&mb, mdp, BATCH_WINDOW) != 0)
+		ABORT("watch_round: could not allocate memory");
+
+	/*
+	 * Each value is expected to be as large as it was in the last round,
+	 * so that large values are fetched after small ones:
+	 */
+	w->w_failed = 0;
+	for (i = 0; i < w->w_nkeys; i++) {
+		batch_submit_ext(mb, "GET", w->w_keys[i].wk_name,
+		    w->w_keys[i].wk_len, 0, watch_get_done, &w->w_keys[i]);
+	}
+
+	(void) batch_run(mb);
+	batch_fini(mb);
+
+	return (w->w_failed > 0 ? -1 : 0);
+}
+
+/*
+ * Run the hook for a changed key, with the new value (if any) on its
+ * standard input, and wait for it to finish.
+ */
+static void
+watch_hook(watch_t *w, watch_key_t *wk)
+{
+	const char *val = dynstr_len(wk->wk_value) > 0 ?
+	    dynstr_cstr(wk->wk_value) : "";
+	size_t len = wk->wk_present ? dynstr_len(wk->wk_value) : 0;
+	size_t off = 0;
+	int fds[2], status;
+	pid_t pid;
+
+	if (pipe(fds) != 0) {
+		warn("could not create pipe for hook");
+		return;
+	}
+
+	if ((pid = fork()) == -1) {
+		warn("could not fork hook");
+		VERIFY0(close(fds[0]));
+		VERIFY0(close(fds[1]));
+		return;
+	}
+
+	if (pid == 0) {
+		if (dup2(fds[0], STDIN_FILENO) == -1)
+			_exit(127);
+		(void) close(fds[0]);
+		(void) close(fds[1]);
+		/*
+		 * We ignore SIGPIPE, which would otherwise be inherited across
+		 * exec, and break pipelines in the hook:
+		 */
+		(void) signal(SIGPIPE, SIG_DFL);
+		(void) setenv("MDATA_WATCH_KEY", wk->wk_name, 1);
+		(void) setenv("MDATA_WATCH_EVENT", wk->wk_present ?
+		    "changed" : "deleted", 1);
+		(void) execl("/bin/sh", "sh", "-c", w->w_exec, (char *)NULL);
+		_exit(127);
+	}
+
+	VERIFY0(close(fds[0]));
+
+	/*
+	 * A hook that does not want the value may exit without reading it,
+	 * which is not an error.
+	 */
+	while (off < len) {
+		ssize_t n = write(fds[1], val + off, len - off);
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		off += (size_t)n;
+	}
+	VERIFY0(close(fds[1]));
+
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR)
+			return;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "WARNING: hook for key '%s' failed\n",
+		    wk->wk_name);
+	}
+}
+
+/*
+ * Report the keys that changed in the last round, returning how many did.
+ */
+static int
+watch_report(watch_t *w)
+{
+	int i, changed = 0;
+
+	for (i = 0; i < w->w_nkeys; i++) {
+		watch_key_t *wk = &w->w_keys[i];
+
+		if (!wk->wk_changed)
+			continue;
+
+		changed++;
+		printf("%s\t%s\n", wk->wk_present ? "changed" : "deleted",
+		    wk->wk_name);
+		if (w->w_exec != NULL)
+			watch_hook(w, wk);
+		wk->wk_changed = B_FALSE;
+	}
+
+	return (changed);
+}
+
+/*
+ * Whether the connection may be held between rounds without keeping other
+ * clients from the metadata service; only a socket may.
+ */
+static boolean_t
+watch_shared(mdata_proto_t *mdp)
+{
+	struct stat st;
+
+	return (fstat(proto_async_fd(mdp), &st) == 0 && S_ISSOCK(st.st_mode));
+}
+
+int
+mdata_watch_main(int argc, char **argv)
+{
+	mdata_proto_t *mdp = NULL;
+	const char *errmsg = NULL;
+	int min_ms = WATCH_MIN_INTERVAL, max_ms = WATCH_MAX_INTERVAL;
+	int interval, opt, ms, i;
+	boolean_t started = B_FALSE;
+	watch_t w;
+
+	bzero(&w, sizeof (w));
+
+	while ((opt = getopt_long(argc, argv, "+", long_options,
+	    NULL)) != -1) {
+		switch (opt) {
+		case 'T':
+			if (parse_seconds(optarg, &ms) != 0) {
+				errx(MDEC_USAGE_ERROR,
+				    "invalid lock timeout: %s", optarg);
+			}
+			plat_set_lock_timeout(ms);
+			break;
+		case 'e':
+			w.w_exec = optarg;
+			break;
+		case 'i':
+			w.w_initial = B_TRUE;
+			break;
+		case 'n':
+			if (parse_seconds(optarg, &min_ms) != 0 ||
+			    min_ms < 1) {
+				errx(MDEC_USAGE_ERROR,
+				    "invalid interval: %s", optarg);
+			}
+			break;
+		case 'm':
+			if (parse_seconds(optarg, &max_ms) != 0 ||
+			    max_ms < 1) {
+				errx(MDEC_USAGE_ERROR,
+				    "invalid maximum interval: %s", optarg);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind < 1)
+		usage(argv[0]);
+
+	if (max_ms < min_ms)
+		max_ms = min_ms;
+
+	w.w_nkeys = argc - optind;
+	if ((w.w_keys = calloc((size_t)w.w_nkeys, sizeof (watch_key_t))) ==
+	    NULL)
+		err(MDEC_ERROR, "could not allocate memory");
+	for (i = 0; i < w.w_nkeys; i++) {
+		w.w_keys[i].wk_watch = &w;
+		w.w_keys[i].wk_name = argv[optind + i];
+		w.w_keys[i].wk_value = dynstr_new();
+	}
+
+	/*
+	 * Events are consumed as they happen, not when a buffer fills:
+	 */
+	(void) setvbuf(stdout, NULL, _IOLBF, 0);
+	if (w.w_exec != NULL)
+		(void) signal(SIGPIPE, SIG_IGN);
+
+	interval = min_ms;
+	for (;;) {
+		if (mdp == NULL && proto_init(&mdp, &errmsg) != 0) {
+			if (!started) {
+				fprintf(stderr, "ERROR: could not initialise "
+				    "protocol: %s\n", errmsg);
+				return (MDEC_ERROR);
+			}
+			fprintf(stderr, "WARNING: could not initialise "
+			    "protocol: %s\n", errmsg);
+			mdp = NULL;
+		}
+		started = B_TRUE;
+
+		if (mdp != NULL) {
+			if (watch_round(mdp, &w) != 0) {
+				fprintf(stderr, "WARNING: lost connection to "
+				    "metadata service\n");
+			}
+
+			if (w.w_failed > 0 || !watch_shared(mdp)) {
+				proto_fini(mdp);
+				mdp = NULL;
+			}
+		}
+
+		if (watch_report(&w) > 0) {
+			interval = min_ms;
+		} else {
+			interval = interval > max_ms / 2 ? max_ms :
+			    interval * 2;
+		}
+
+		(void) poll(NULL, 0, interval);
+	}
+}
@@ -0,0 +1,385 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * A thread-safe handle over a single metadata connection.  Any number of
+ * threads may call mux_execute() concurrently.  A dedicated I/O thread owns
+ * the connection and drives the asynchronous protocol engine, which tags each
+ * Version 2 frame with its request ID so that several requests may be in
+ * flight at once.  On a Version 1 host the engine only permits one request in
+ * flight, so callers are simply serialised.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "dynstr.h"
+#include "mux.h"
+#include "proto.h"
+
+/*
+ * The number of Version 2 requests we allow in flight at once:
+ */
+#define	MUX_WINDOW	8
+
+typedef struct mux_request mux_request_t;
+
+struct mux_request {
+	mdata_mux_t *mxr_mux;
+	const char *mxr_command;
+	const char *mxr_argument;
+	mdata_response_t mxr_response;
+	string_t *mxr_response_data;
+	int mxr_err;
+	boolean_t mxr_done;
+	pthread_cond_t mxr_cv;
+	mux_request_t *mxr_next;
+};
+
+struct mdata_mux {
+	mdata_proto_t *mx_proto;
+	pthread_t mx_thread;
+	int mx_wakefd[2];
+	int mx_version;
+
+	/*
+	 * Protected by mx_lock:
+	 */
+	pthread_mutex_t mx_lock;
+	mux_request_t *mx_pending;
+	mux_request_t **mx_ptail;
+	boolean_t mx_shutdown;
+	boolean_t mx_broken;
+
+	/*
+	 * Owned by the I/O thread; requests that failed with the connection
+	 * and will be resubmitted once it has been reset:
+	 */
+	mux_request_t *mx_retry;
+	mux_request_t **mx_rtail;
+	boolean_t mx_exiting;
+
+	/*
+	 * Owned by the I/O thread; set when the connection failed with
+	 * nothing outstanding.  It is left alone until the next request,
+	 * whose submission fails and so resets it:
+	 */
+	boolean_t mx_failed;
+};
+
+static void
+mux_finish(mdata_mux_t *mx, mux_request_t *mxr, int err,
+    mdata_response_t mdr, string_t *data)
+{
+	VERIFY0(pthread_mutex_lock(&mx->mx_lock));
+	mxr->mxr_err = err;
+	if (err == 0) {
+		/*
+		 * The response buffer belongs to the protocol engine, so
+		 * take a copy for the waiting thread:
+		 */
+		mxr->mxr_response = mdr;
+		mxr->mxr_response_data = dynstr_new();
+		dynstr_append(mxr->mxr_response_data, "");
+		if (dynstr_len(data) > 0) {
+			dynstr_appendn(mxr->mxr_response_data,
+			    dynstr_cstr(data), dynstr_len(data));
+		}
+	}
+	mxr->mxr_done = B_TRUE;
+	VERIFY0(pthread_cond_signal(&mxr->mxr_cv));
+	VERIFY0(pthread_mutex_unlock(&mx->mx_lock));
+}
+
+static void
+mux_callback(mdata_proto_t *mdp __UNUSED, int err, mdata_response_t mdr,
+    string_t *data, void *arg)
+{
+	mux_request_t *mxr = arg;
+	mdata_mux_t *mx = mxr->mxr_mux;
+
+	if (err != 0 && !mx->mx_exiting) {
+		/*
+		 * The connection failed underneath this request.  Hold it
+		 * until the connection has been reset:
+		 */
+		*mx->mx_rtail = mxr;
+		mx->mx_rtail = &mxr->mxr_next;
+		return;
+	}
+
+	mux_finish(mx, mxr, err, mdr, data);
+}
+
+static void
+mux_submit(mdata_mux_t *mx, mux_request_t *list)
+{
+	mux_request_t *mxr;
+
+	while ((mxr = list) != NULL) {
+		list = mxr->mxr_next;
+		mxr->mxr_next = NULL;
+
+		if (proto_async_submit(mx->mx_proto, mxr->mxr_command,
+		    mxr->mxr_argument, mux_callback, mxr) != 0) {
+			mux_callback(mx->mx_proto, -1, MDR_UNKNOWN, NULL, mxr);
+		}
+	}
+}
+
+static void
+mux_fail_all(mdata_mux_t *mx, mux_request_t *list)
+{
+	mux_request_t *mxr;
+
+	while ((mxr = list) != NULL) {
+		list = mxr->mxr_next;
+		mux_finish(mx, mxr, -1, MDR_UNKNOWN, NULL);
+	}
+}
+
+/*
+ * Reset the connection after a failure and resubmit the requests that were
+ * outstanding at the time, in their original order.
+ */
+static void
+mux_recover(mdata_mux_t *mx)
+{
+	mux_request_t *list = mx->mx_retry;
+
+	mx->mx_retry = NULL;
+	mx->mx_rtail = &mx->mx_retry;
+	mx->mx_failed = B_FALSE;
+
+	if (proto_async_reset(mx->mx_proto) != 0) {
+		/*
+		 * The connection could not be re-established, so there is
+		 * no point accepting any further requests:
+		 */
+		VERIFY0(pthread_mutex_lock(&mx->mx_lock));
+		mx->mx_broken = B_TRUE;
+		VERIFY0(pthread_mutex_unlock(&mx->mx_lock));
+
+		mux_fail_all(mx, list);
+		return;
+	}
+
+	mux_submit(mx, list);
+}
+
+static void *
+mux_thread(void *arg)
+{
+	mdata_mux_t *mx = arg;
+	mux_request_t *list;
+	char scrap[64];
+
+	for (;;) {
+		struct pollfd pfd[2];
+		int events;
+
+		VERIFY0(pthread_mutex_lock(&mx->mx_lock));
+		list = mx->mx_pending;
+		mx->mx_pending = NULL;
+		mx->mx_ptail = &mx->mx_pending;
+		if (mx->mx_shutdown || mx->mx_broken) {
+			VERIFY0(pthread_mutex_unlock(&mx->mx_lock));
+			mux_fail_all(mx, list);
+			break;
+		}
+		VERIFY0(pthread_mutex_unlock(&mx->mx_lock));
+
+		mux_submit(mx, list);
+
+		if (mx->mx_retry != NULL) {
+			mux_recover(mx);
+			continue;
+		}
+
+		/*
+		 * A connection that has failed still polls as readable (or
+		 * hung up), so only the wake pipe is polled until there is
+		 * another request:
+		 */
+		events = proto_async_events(mx->mx_proto);
+		pfd[0].fd = mx->mx_failed ? -1 : proto_async_fd(mx->mx_proto);
+		pfd[0].events = ((events & PROTO_EV_READ) ? POLLIN : 0) |
+		    ((events & PROTO_EV_WRITE) ? POLLOUT : 0);
+		pfd[0].revents = 0;
+		pfd[1].fd = mx->mx_wakefd[0];
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+
+		if (poll(pfd, 2, proto_async_timeout(mx->mx_proto)) == -1) {
+			if (errno == EINTR)
+				continue;
+			ABORT("mux_thread: poll failure\n");
+		}
+
+		if (pfd[1].revents != 0) {
+			while (read(mx->mx_wakefd[0], scrap, sizeof (scrap)) > 0)
+				continue;
+		}
+
+		if ((pfd[0].revents & POLLOUT) &&
+		    proto_async_process_writable(mx->mx_proto) != 0)
+			mx->mx_failed = B_TRUE;
+		if ((pfd[0].revents & (POLLIN | POLLERR | POLLHUP)) &&
+		    proto_async_process_readable(mx->mx_proto) != 0)
+			mx->mx_failed = B_TRUE;
+		if (proto_async_process_timeout(mx->mx_proto) != 0)
+			mx->mx_failed = B_TRUE;
+	}
+
+	/*
+	 * Anything still outstanding is failed as the engine is torn down:
+	 */
+	mx->mx_exiting = B_TRUE;
+	proto_fini(mx->mx_proto);
+	mx->mx_proto = NULL;
+	mux_fail_all(mx, mx->mx_retry);
+	mx->mx_retry = NULL;
+
+	return (NULL);
+}
+
+static void
+mux_wake(mdata_mux_t *mx)
+{
+	char c = 0;
+
+	/*
+	 * If the pipe is full, the I/O thread has a wakeup pending already:
+	 */
+	(void) write(mx->mx_wakefd[1], &c, 1);
+}
+
+int
+mux_execute(mdata_mux_t *mx, const char *command, const char *argument,
+    mdata_response_t *response, string_t **response_data)
+{
+	mux_request_t mxr;
+
+	bzero(&mxr, sizeof (mxr));
+	mxr.mxr_mux = mx;
+	mxr.mxr_command = command;
+	mxr.mxr_argument = argument;
+	mxr.mxr_response = MDR_PENDING;
+	VERIFY0(pthread_cond_init(&mxr.mxr_cv, NULL));
+
+	VERIFY0(pthread_mutex_lock(&mx->mx_lock));
+	if (mx->mx_shutdown || mx->mx_broken) {
+		VERIFY0(pthread_mutex_unlock(&mx->mx_lock));
+		VERIFY0(pthread_cond_destroy(&mxr.mxr_cv));
+		return (-1);
+	}
+	*mx->mx_ptail = &mxr;
+	mx->mx_ptail = &mxr.mxr_next;
+	VERIFY0(pthread_mutex_unlock(&mx->mx_lock));
+
+	mux_wake(mx);
+
+	VERIFY0(pthread_mutex_lock(&mx->mx_lock));
+	while (!mxr.mxr_done)
+		VERIFY0(pthread_cond_wait(&mxr.mxr_cv, &mx->mx_lock));
+	VERIFY0(pthread_mutex_unlock(&mx->mx_lock));
+	VERIFY0(pthread_cond_destroy(&mxr.mxr_cv));
+
+	if (mxr.mxr_err != 0)
+		return (-1);
+
+	*response = mxr.mxr_response;
+	*response_data = mxr.mxr_response_data;
+	return (0);
+}
+
+/*
+ * Returns the protocol version negotiated when the handle was created.
+ */
+int
+mux_version(mdata_mux_t *mx)
+{
+	return (mx->mx_version);
+}
+
+int
+mux_init(mdata_mux_t **out, const char **errmsg)
+{
+	mdata_mux_t *mx;
+	int i;
+
+	if ((mx = calloc(1, sizeof (*mx))) == NULL) {
+		*errmsg = "Could not allocate memory.";
+		return (-1);
+	}
+	mx->mx_wakefd[0] = mx->mx_wakefd[1] = -1;
+	mx->mx_ptail = &mx->mx_pending;
+	mx->mx_rtail = &mx->mx_retry;
+
+	if (proto_init(&mx->mx_proto, errmsg) != 0)
+		goto bail;
+	proto_async_set_window(mx->mx_proto, MUX_WINDOW);
+	mx->mx_version = proto_version(mx->mx_proto);
+
+	if (pipe(mx->mx_wakefd) != 0) {
+		*errmsg = "Could not create wakeup pipe.";
+		goto bail;
+	}
+	for (i = 0; i < 2; i++) {
+		if (fcntl(mx->mx_wakefd[i], F_SETFL, O_NONBLOCK) == -1) {
+			*errmsg = "Could not set non-blocking I/O on pipe.";
+			goto bail;
+		}
+	}
+
+	VERIFY0(pthread_mutex_init(&mx->mx_lock, NULL));
+	if (pthread_create(&mx->mx_thread, NULL, mux_thread, mx) != 0) {
+		*errmsg = "Could not create I/O thread.";
+		VERIFY0(pthread_mutex_destroy(&mx->mx_lock));
+		goto bail;
+	}
+
+	*out = mx;
+	return (0);
+
+bail:
+	if (mx->mx_proto != NULL)
+		proto_fini(mx->mx_proto);
+	for (i = 0; i < 2; i++) {
+		if (mx->mx_wakefd[i] != -1)
+			(void) close(mx->mx_wakefd[i]);
+	}
+	free(mx);
+	return (-1);
+}
+
+void
+mux_fini(mdata_mux_t *mx)
+{
+	if (mx == NULL)
+		return;
+
+	VERIFY0(pthread_mutex_lock(&mx->mx_lock));
+	mx->mx_shutdown = B_TRUE;
+	VERIFY0(pthread_mutex_unlock(&mx->mx_lock));
+
+	mux_wake(mx);
+	VERIFY0(pthread_join(mx->mx_thread, NULL));
+
+	(void) close(mx->mx_wakefd[0]);
+	(void) close(mx->mx_wakefd[1]);
+	VERIFY0(pthread_mutex_destroy(&mx->mx_lock));
+	free(mx);
+}
@@ -0,0 +1,29 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+#ifndef _MUX_H
+#define	_MUX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dynstr.h"
+#include "proto.h"
+
+typedef struct mdata_mux mdata_mux_t;
+
+int mux_init(mdata_mux_t **, const char **);
+int mux_execute(mdata_mux_t *, const char *, const char *, mdata_response_t *,
+    string_t **);
+int mux_version(mdata_mux_t *);
+void mux_fini(mdata_mux_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MUX_H */
@@ -21,6 +21,15 @@ int plat_init(mdata_plat_t **, const char **, int *);
 int plat_recv(mdata_plat_t *, string_t *, time_t);
 int plat_send(mdata_plat_t *, string_t *);
 void plat_fini(mdata_plat_t *);
+void plat_set_lock_timeout(int);
+
+/*
+ * Raw access to the underlying connection, for callers (such as the
+ * asynchronous protocol engine) that drive their own event loop:
+ */
+int plat_fd(mdata_plat_t *);
+ssize_t plat_read(mdata_plat_t *, char *, size_t);
+ssize_t plat_write(mdata_plat_t *, const char *, size_t);
 
 #ifdef __cplusplus
 }
@@ -24,6 +24,7 @@
 #include "dynstr.h"
 #include "plat.h"
 #include "plat/unix_common.h"
+#include "trace.h"
 
 #if defined(__NetBSD__)
 #define	SERIAL_DEVICE	"/dev/tty01"
@@ -36,6 +37,7 @@
 typedef struct mdata_plat {
 	int mpl_kq;
 	int mpl_conn;
+	unix_rbuf_t mpl_rbuf;
 
 	struct kevent mpl_ev;
 } mdata_plat_t;
@@ -56,6 +58,7 @@ plat_send(mdata_plat_t *mpl, string_t *data)
 		}
 		nwritten += n;
 	}
+	trace_capture(TRT_SEND, dynstr_cstr(data), len);
 
 	return (0);
 }
@@ -65,6 +68,9 @@ plat_recv(mdata_plat_t *mpl, string_t *data, time_t timeout_ms)
 {
 	struct timespec timeout = { (timeout_ms/1000), 0 };
 
+	if (unix_rbuf_line(&mpl->mpl_rbuf, data) == 1)
+		goto line;
+
 	for (;;) {
 		struct kevent mpl_ch;
 		int nch;
@@ -93,57 +99,61 @@ plat_recv(mdata_plat_t *mpl, string_t *data, time_t timeout_ms)
 			return (-1);
 		}
 		if (nch > 0) {
-			char buf[2];
-			ssize_t sz;
-
-			if ((sz = read(mpl->mpl_conn, buf, 1)) > 0) {
-				if (buf[0] == '\n') {
-					return (0);
-				} else {
-					buf[1] = '\0';
-					dynstr_append(data, buf);
-				}
-			}
+			if (unix_rbuf_fill(&mpl->mpl_rbuf, mpl->mpl_conn) > 0 &&
+			    unix_rbuf_line(&mpl->mpl_rbuf, data) == 1)
+				goto line;
 		}
 	}
 
 	return (-1);
+
+line:
+	trace_capture(TRT_RECV_LINE, dynstr_cstr(data), dynstr_len(data));
+	return (0);
 }
 
-void
-plat_fini(mdata_plat_t *mpl)
+int
+plat_fd(mdata_plat_t *mpl)
 {
-	if (mpl != NULL) {
-		if (mpl->mpl_kq != -1)
-			(void) close(mpl->mpl_kq);
-		if (mpl->mpl_conn != -1)
-			(void) close(mpl->mpl_conn);
-		free(mpl);
-	}
+	return (mpl->mpl_conn);
 }
 
-static int
-plat_send_reset(mdata_plat_t *mpl)
+ssize_t
+plat_read(mdata_plat_t *mpl, char *buf, size_t len)
 {
-	int ret = -1;
-	string_t *str = dynstr_new();
+	size_t sz;
+	ssize_t n;
 
-	dynstr_append(str, "\n");
-	if (plat_send(mpl, str) != 0)
-		goto bail;
-	dynstr_reset(str);
+	if ((sz = unix_rbuf_drain(&mpl->mpl_rbuf, buf, len)) > 0) {
+		trace_capture(TRT_RECV, buf, sz);
+		return ((ssize_t)sz);
+	}
 
-	if (plat_recv(mpl, str, 2000) != 0)
-		goto bail;
+	if ((n = read(mpl->mpl_conn, buf, len)) > 0)
+		trace_capture(TRT_RECV, buf, (size_t)n);
+	return (n);
+}
 
-	if (strcmp(dynstr_cstr(str), "invalid command") != 0)
-		goto bail;
+ssize_t
+plat_write(mdata_plat_t *mpl, const char *buf, size_t len)
+{
+	ssize_t n;
 
-	ret = 0;
+	if ((n = write(mpl->mpl_conn, buf, len)) > 0)
+		trace_capture(TRT_SEND, buf, (size_t)n);
+	return (n);
+}
 
-bail:
-	dynstr_free(str);
-	return (ret);
+void
+plat_fini(mdata_plat_t *mpl)
+{
+	if (mpl != NULL) {
+		if (mpl->mpl_kq != -1)
+			(void) close(mpl->mpl_kq);
+		if (mpl->mpl_conn != -1)
+			unix_close(mpl->mpl_conn);
+		free(mpl);
+	}
 }
 
 int
@@ -156,6 +166,8 @@ int
 plat_init(mdata_plat_t **mplout, const char **errmsg, int *permfail)
 {
 	mdata_plat_t *mpl = NULL;
+	mdata_transport_t mdt;
+	int winner;
 
 	if ((mpl = calloc(1, sizeof (*mpl))) == NULL) {
 		*errmsg = "Could not allocate memory.";
@@ -171,18 +183,18 @@ plat_init(mdata_plat_t **mplout, const char **errmsg, int *permfail)
 		goto bail;
 	}
 
-	if (unix_open_serial(SERIAL_DEVICE, &mpl->mpl_conn, errmsg,
-	    permfail) != 0) {
-		goto bail;
+	if (unix_socket_override(&mdt) != 0) {
+		mdt.mdt_type = MDTT_SERIAL;
+		mdt.mdt_path = SERIAL_DEVICE;
 	}
 
-	EV_SET(&mpl->mpl_ev, mpl->mpl_conn, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, 0);
-
-	if (plat_send_reset(mpl) == -1) {
-		*errmsg = "Could not do active reset.";
+	if (unix_connect(&mdt, 1, &winner, &mpl->mpl_conn, &mpl->mpl_rbuf,
+	    errmsg, permfail) != 0) {
 		goto bail;
 	}
 
+	EV_SET(&mpl->mpl_ev, mpl->mpl_conn, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, 0);
+
 	*mplout = mpl;
 
 	return (0);
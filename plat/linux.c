@@ -10,9 +10,11 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,12 +26,37 @@
 #include "dynstr.h"
 #include "plat.h"
 #include "plat/unix_common.h"
+#include "trace.h"
 
 #define	SERIAL_DEVICE	"/dev/ttyS1"
 
+/*
+ * A hypervisor may offer a virtio-serial port for metadata, which is not
+ * subject to the bandwidth limits of an emulated UART.  Named ports appear
+ * under VIRTIO_PORTS_DIR; we use the first whose name mentions metadata,
+ * unless MDATA_VIRTIO_PORT names a port (or, for testing against a stand-in
+ * such as a pty, provides the full path of a device).
+ */
+#define	VIRTIO_PORTS_DIR	"/dev/virtio-ports"
+
+/*
+ * If we are running in an environment that exposes the metadata socket of a
+ * SmartOS zone (e.g. an LX branded zone, or a container with the socket
+ * bind-mounted in), prefer it to the serial port:
+ */
+static const char *linux_md_socket_paths[] = {
+	"/native/.zonecontrol/metadata.sock",	/* LX */
+	"/.zonecontrol/metadata.sock",		/* SDC7 */
+	"/var/run/smartdc/metadata.sock",	/* SDC6 */
+	NULL
+};
+
 struct mdata_plat {
 	int mpl_epoll;
 	int mpl_conn;
+	mdata_transport_t mpl_transport;
+	unix_rbuf_t mpl_rbuf;
+	char mpl_virtio_path[PATH_MAX];
 };
 
 
@@ -48,6 +75,7 @@ plat_send(mdata_plat_t *mpl, string_t *data)
 		}
 		nwritten += n;
 	}
+	trace_capture(TRT_SEND, dynstr_cstr(data), len);
 
 	return (0);
 }
@@ -55,6 +83,9 @@ plat_send(mdata_plat_t *mpl, string_t *data)
 int
 plat_recv(mdata_plat_t *mpl, string_t *data, time_t timeout_ms)
 {
+	if (unix_rbuf_line(&mpl->mpl_rbuf, data) == 1)
+		goto line;
+
 	for (;;) {
 		struct epoll_event event;
 
@@ -72,17 +103,9 @@ plat_recv(mdata_plat_t *mpl, string_t *data, time_t timeout_ms)
 		}
 
 		if (event.events & EPOLLIN) {
-			char buf[2];
-			ssize_t sz;
-
-			if ((sz = read(mpl->mpl_conn, buf, 1)) > 0) {
-				if (buf[0] == '\n') {
-					return (0);
-				} else {
-					buf[1] = '\0';
-					dynstr_append(data, buf);
-				}
-			}
+			if (unix_rbuf_fill(&mpl->mpl_rbuf, mpl->mpl_conn) > 0 &&
+			    unix_rbuf_line(&mpl->mpl_rbuf, data) == 1)
+				goto line;
 		}
 		if (event.events & EPOLLERR) {
 			fprintf(stderr, "POLLERR\n");
@@ -95,6 +118,42 @@ plat_recv(mdata_plat_t *mpl, string_t *data, time_t timeout_ms)
 	}
 
 	return (-1);
+
+line:
+	trace_capture(TRT_RECV_LINE, dynstr_cstr(data), dynstr_len(data));
+	return (0);
+}
+
+int
+plat_fd(mdata_plat_t *mpl)
+{
+	return (mpl->mpl_conn);
+}
+
+ssize_t
+plat_read(mdata_plat_t *mpl, char *buf, size_t len)
+{
+	size_t sz;
+	ssize_t n;
+
+	if ((sz = unix_rbuf_drain(&mpl->mpl_rbuf, buf, len)) > 0) {
+		trace_capture(TRT_RECV, buf, sz);
+		return ((ssize_t)sz);
+	}
+
+	if ((n = read(mpl->mpl_conn, buf, len)) > 0)
+		trace_capture(TRT_RECV, buf, (size_t)n);
+	return (n);
+}
+
+ssize_t
+plat_write(mdata_plat_t *mpl, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	if ((n = write(mpl->mpl_conn, buf, len)) > 0)
+		trace_capture(TRT_SEND, buf, (size_t)n);
+	return (n);
 }
 
 void
@@ -104,46 +163,96 @@ plat_fini(mdata_plat_t *mpl)
 		if (mpl->mpl_epoll != -1)
 			(void) close(mpl->mpl_epoll);
 		if (mpl->mpl_conn != -1)
-			(void) close(mpl->mpl_conn);
+			unix_close(mpl->mpl_conn);
 		free(mpl);
 	}
 }
 
-static int
-plat_send_reset(mdata_plat_t *mpl)
+int
+plat_is_interactive(void)
 {
-	int ret = -1;
-	string_t *str = dynstr_new();
-
-	dynstr_append(str, "\n");
-	if (plat_send(mpl, str) != 0)
-		goto bail;
-	dynstr_reset(str);
+	return (unix_is_interactive());
+}
 
-	if (plat_recv(mpl, str, 2000) != 0)
-		goto bail;
+static int
+find_virtio_port(char *path, size_t len)
+{
+	const char *port = getenv(MDATA_VIRTIO_PORT_ENV);
+	DIR *dir;
+	struct dirent *de;
+	char best[NAME_MAX + 1] = "";
+
+	if (port != NULL && port[0] != '\0') {
+		if (port[0] == '/') {
+			(void) snprintf(path, len, "%s", port);
+		} else {
+			(void) snprintf(path, len, "%s/%s", VIRTIO_PORTS_DIR,
+			    port);
+		}
+		return (0);
+	}
 
-	if (strcmp(dynstr_cstr(str), "invalid command") != 0)
-		goto bail;
+	if ((dir = opendir(VIRTIO_PORTS_DIR)) == NULL)
+		return (-1);
+
+	/*
+	 * Choose the lowest matching name, so that our choice does not
+	 * depend on directory order:
+	 */
+	while ((de = readdir(dir)) != NULL) {
+		if (strstr(de->d_name, "metadata") != NULL &&
+		    (best[0] == '\0' || strcmp(de->d_name, best) < 0))
+			(void) snprintf(best, sizeof (best), "%s", de->d_name);
+	}
+	(void) closedir(dir);
 
-	ret = 0;
+	if (best[0] == '\0')
+		return (-1);
 
-bail:
-	dynstr_free(str);
-	return (ret);
+	(void) snprintf(path, len, "%s/%s", VIRTIO_PORTS_DIR, best);
+	return (0);
 }
 
-int
-plat_is_interactive(void)
+/*
+ * Assemble the list of transports over which the metadata service might be
+ * reached, to be probed concurrently by unix_connect().
+ */
+static int
+plat_find_transports(mdata_plat_t *mpl, mdata_transport_t *mdts)
 {
-	return (unix_is_interactive());
+	int n, permfail = 0;
+
+	if (unix_socket_override(&mdts[0]) == 0)
+		return (1);
+
+	n = unix_find_sockets(linux_md_socket_paths, mdts,
+	    UNIX_MAX_TRANSPORTS - 2, &permfail);
+
+	/*
+	 * In a virtual machine, we may have a virtio-serial port in
+	 * addition to the serial port:
+	 */
+	if (find_virtio_port(mpl->mpl_virtio_path,
+	    sizeof (mpl->mpl_virtio_path)) == 0) {
+		mdts[n].mdt_type = MDTT_VIRTIO;
+		mdts[n].mdt_path = mpl->mpl_virtio_path;
+		n++;
+	}
+
+	mdts[n].mdt_type = MDTT_SERIAL;
+	mdts[n].mdt_path = SERIAL_DEVICE;
+	n++;
+
+	return (n);
 }
 
 int
 plat_init(mdata_plat_t **mplout, const char **errmsg, int *permfail)
 {
 	mdata_plat_t *mpl = NULL;
+	mdata_transport_t mdts[UNIX_MAX_TRANSPORTS];
 	struct epoll_event event;
+	int n, winner;
 
 	if ((mpl = calloc(1, sizeof (*mpl))) == NULL) {
 		*errmsg = "Could not allocate memory.";
@@ -159,10 +268,12 @@ plat_init(mdata_plat_t **mplout, const char **errmsg, int *permfail)
 		goto bail;
 	}
 
-	if (unix_open_serial(SERIAL_DEVICE, &mpl->mpl_conn, errmsg,
-	    permfail) != 0) {
+	n = plat_find_transports(mpl, mdts);
+	if (unix_connect(mdts, n, &winner, &mpl->mpl_conn, &mpl->mpl_rbuf,
+	    errmsg, permfail) != 0) {
 		goto bail;
 	}
+	mpl->mpl_transport = mdts[winner];
 
 	event.data.fd = mpl->mpl_conn;
 	event.events = EPOLLIN | EPOLLERR | EPOLLHUP;
@@ -174,11 +285,6 @@ plat_init(mdata_plat_t **mplout, const char **errmsg, int *permfail)
 		goto bail;
 	}
 
-	if (plat_send_reset(mpl) == -1) {
-		*errmsg = "Could not do active reset.";
-		goto bail;
-	}
-
 	*mplout = mpl;
 
 	return (0);
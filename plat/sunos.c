@@ -4,7 +4,6 @@
  */
 
 #include <sys/types.h>
-#include <sys/filio.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
@@ -24,6 +23,7 @@
 #include "dynstr.h"
 #include "plat.h"
 #include "plat/unix_common.h"
+#include "trace.h"
 
 #define	IN_GLOBAL_DEVICE	"/dev/term/b"
 
@@ -37,6 +37,7 @@ static const char *zone_md_socket_paths[] = {
 struct mdata_plat {
 	int mpl_port;
 	int mpl_conn;
+	unix_rbuf_t mpl_rbuf;
 };
 
 static int
@@ -76,101 +77,6 @@ get_product_string(void)
 	return (output);
 }
 
-static int
-find_md_ngz(const char **out, int *permfail)
-{
-	int i;
-	struct stat st;
-
-	/*
-	 * The location of the metadata socket has changed between SDC6
-	 * and SDC7.  Attempt to locate the one that exists in this instance:
-	 */
-	for (i = 0; zone_md_socket_paths[i] != NULL; i++) {
-		if (lstat(zone_md_socket_paths[i], &st) == 0 &&
-		    S_ISSOCK(st.st_mode)) {
-			*out = zone_md_socket_paths[i];
-			return (0);
-		} else {
-			/*
-			 * If we're not root, and we get an EACCES, it's
-			 * often a permissions problem.  Don't retry
-			 * forever:
-			 */
-			if (geteuid() != 0 && (errno == EPERM ||
-			    errno == EACCES))
-				*permfail = 1;
-		}
-	}
-
-	return (-1);
-}
-
-static int
-open_md_ngz(int *outfd, const char **errmsg, int *permfail)
-{
-	/*
-	 * We're in a non-global zone, so try and connect to the
-	 * metadata socket:
-	 */
-	long on = 1L;
-	int fd;
-	const char *sockpath;
-	struct sockaddr_un ua;
-
-	/*
-	 * This is not always a permanent failure, because the metadata
-	 * socket might not exist yet.  Keep trying and wait for it to
-	 * appear.
-	 */
-	if (find_md_ngz(&sockpath, permfail) == -1) {
-		*errmsg = "Could not find metadata socket.";
-		return (-1);
-	}
-
-	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-		*errmsg = "Could not open metadata socket.";
-		*permfail = 1;
-		return (-1);
-	}
-
-	/*
-	 * Enable non-blocking I/O on the socket so that we can time-out
-	 * when we want to:
-	 */
-	if (ioctl(fd, (int)FIONBIO, &on) != 0) {
-		*errmsg = "Could not set non-blocking I/O on socket.";
-		(void) close(fd);
-		*permfail = 1;
-		return (-1);
-	}
-
-	bzero(&ua, sizeof (ua));
-	ua.sun_family = AF_UNIX;
-	strcpy(ua.sun_path, sockpath);
-
-	if (connect(fd, (struct sockaddr *)&ua, sizeof (ua)) == -1) {
-		(void) close(fd);
-		*errmsg = "Could not connect metadata socket.";
-		return (-1);
-	}
-
-	*outfd = fd;
-
-	return (0);
-}
-
-static int
-open_md_gz(int *outfd, const char **errmsg, int *permfail)
-{
-	/*
-	 * We're in a global zone in a SmartOS KVM/QEMU instance, so
-	 * try to use /dev/term/b for metadata.
-	 */
-
-	return (unix_open_serial(IN_GLOBAL_DEVICE, outfd, errmsg, permfail));
-}
-
 int
 plat_send(mdata_plat_t *mpl, string_t *data)
 {
@@ -186,6 +92,7 @@ plat_send(mdata_plat_t *mpl, string_t *data)
 		}
 		nwritten += n;
 	}
+	trace_capture(TRT_SEND, dynstr_cstr(data), len);
 
 	return (0);
 }
@@ -196,6 +103,9 @@ plat_recv(mdata_plat_t *mpl, string_t *data, time_t timeout_ms)
 	port_event_t pev;
 	timespec_t tv;
 
+	if (unix_rbuf_line(&mpl->mpl_rbuf, data) == 1)
+		goto line;
+
 	for (;;) {
 		if (port_associate(mpl->mpl_port, PORT_SOURCE_FD,
 		    (uintptr_t)mpl->mpl_conn, POLLIN | POLLERR | POLLHUP,
@@ -220,17 +130,9 @@ plat_recv(mdata_plat_t *mpl, string_t *data, time_t timeout_ms)
 		}
 
 		if (pev.portev_events & POLLIN) {
-			char buf[2];
-			ssize_t sz;
-
-			if ((sz = read(mpl->mpl_conn, buf, 1)) > 0) {
-				if (buf[0] == '\n') {
-					return (0);
-				} else {
-					buf[1] = '\0';
-					dynstr_append(data, buf);
-				}
-			}
+			if (unix_rbuf_fill(&mpl->mpl_rbuf, mpl->mpl_conn) > 0 &&
+			    unix_rbuf_line(&mpl->mpl_rbuf, data) == 1)
+				goto line;
 		}
 		if (pev.portev_events & POLLERR) {
 			fprintf(stderr, "POLLERR\n");
@@ -243,43 +145,54 @@ plat_recv(mdata_plat_t *mpl, string_t *data, time_t timeout_ms)
 	}
 
 	return (-1);
+
+line:
+	trace_capture(TRT_RECV_LINE, dynstr_cstr(data), dynstr_len(data));
+	return (0);
 }
 
-void
-plat_fini(mdata_plat_t *mpl)
+int
+plat_fd(mdata_plat_t *mpl)
 {
-	if (mpl != NULL) {
-		if (mpl->mpl_port != -1)
-			(void) close(mpl->mpl_port);
-		if (mpl->mpl_conn != -1)
-			(void) close(mpl->mpl_conn);
-		free(mpl);
-	}
+	return (mpl->mpl_conn);
 }
 
-static int
-plat_send_reset(mdata_plat_t *mpl)
+ssize_t
+plat_read(mdata_plat_t *mpl, char *buf, size_t len)
 {
-	int ret = -1;
-	string_t *str = dynstr_new();
-
-	dynstr_append(str, "\n");
+	size_t sz;
+	ssize_t n;
 
-	if (plat_send(mpl, str) != 0)
-		goto bail;
-	dynstr_reset(str);
+	if ((sz = unix_rbuf_drain(&mpl->mpl_rbuf, buf, len)) > 0) {
+		trace_capture(TRT_RECV, buf, sz);
+		return ((ssize_t)sz);
+	}
 
-	if (plat_recv(mpl, str, 2000) != 0)
-		goto bail;
+	if ((n = read(mpl->mpl_conn, buf, len)) > 0)
+		trace_capture(TRT_RECV, buf, (size_t)n);
+	return (n);
+}
 
-	if (strcmp(dynstr_cstr(str), "invalid command") != 0)
-		goto bail;
+ssize_t
+plat_write(mdata_plat_t *mpl, const char *buf, size_t len)
+{
+	ssize_t n;
 
-	ret = 0;
+	if ((n = write(mpl->mpl_conn, buf, len)) > 0)
+		trace_capture(TRT_SEND, buf, (size_t)n);
+	return (n);
+}
 
-bail:
-	dynstr_free(str);
-	return (ret);
+void
+plat_fini(mdata_plat_t *mpl)
+{
+	if (mpl != NULL) {
+		if (mpl->mpl_port != -1)
+			(void) close(mpl->mpl_port);
+		if (mpl->mpl_conn != -1)
+			unix_close(mpl->mpl_conn);
+		free(mpl);
+	}
 }
 
 int
@@ -294,6 +207,8 @@ plat_init(mdata_plat_t **mplout, const char **errmsg, int *permfail)
 	char *product;
 	boolean_t smartdc_hvm_guest = B_FALSE;
 	mdata_plat_t *mpl = NULL;
+	mdata_transport_t mdts[UNIX_MAX_TRANSPORTS];
+	int n, winner;
 
 	if ((mpl = calloc(1, sizeof (*mpl))) == NULL) {
 		*errmsg = "Could not allocate memory.";
@@ -309,10 +224,28 @@ plat_init(mdata_plat_t **mplout, const char **errmsg, int *permfail)
 		goto bail;
 	}
 
+	if (unix_socket_override(&mdts[0]) == 0) {
+		n = 1;
+		goto connect;
+	}
+
 	if (getzoneid() != GLOBAL_ZONEID) {
-		if (open_md_ngz(&mpl->mpl_conn, errmsg, permfail) != 0)
+		/*
+		 * We're in a non-global zone, so try and connect to the
+		 * metadata socket.  The location of the socket has changed
+		 * between SDC6 and SDC7, so we probe each that exists in
+		 * this instance.
+		 *
+		 * This is not always a permanent failure, because the
+		 * metadata socket might not exist yet.  Keep trying and
+		 * wait for it to appear.
+		 */
+		if ((n = unix_find_sockets(zone_md_socket_paths, mdts,
+		    UNIX_MAX_TRANSPORTS, permfail)) == 0) {
+			*errmsg = "Could not find metadata socket.";
 			goto bail;
-		goto wrapfd;
+		}
+		goto connect;
 	}
 
 	/*
@@ -325,9 +258,14 @@ plat_init(mdata_plat_t **mplout, const char **errmsg, int *permfail)
 	free(product);
 
 	if (smartdc_hvm_guest) {
-		if (open_md_gz(&mpl->mpl_conn, errmsg, permfail) != 0)
-			goto bail;
-		goto wrapfd;
+		/*
+		 * We're in a global zone in a SmartOS KVM/QEMU instance, so
+		 * try to use /dev/term/b for metadata.
+		 */
+		mdts[0].mdt_type = MDTT_SERIAL;
+		mdts[0].mdt_path = IN_GLOBAL_DEVICE;
+		n = 1;
+		goto connect;
 	}
 
 	/*
@@ -337,9 +275,9 @@ plat_init(mdata_plat_t **mplout, const char **errmsg, int *permfail)
 	*permfail = 1;
 	goto bail;
 
-wrapfd:
-	if (plat_send_reset(mpl) == -1) {
-		*errmsg = "Could not do active reset.";
+connect:
+	if (unix_connect(mdts, n, &winner, &mpl->mpl_conn, &mpl->mpl_rbuf,
+	    errmsg, permfail) != 0) {
 		goto bail;
 	}
 
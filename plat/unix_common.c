@@ -6,67 +6,309 @@
  */
 
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <linux/serial.h>
+#endif
 
 #include "common.h"
 #include "dynstr.h"
+#include "fsutil.h"
 #include "plat.h"
+#include "trace.h"
 #include "unix_common.h"
 
+/*
+ * Flags for unix_open_device():
+ */
+#define	UNIX_DEV_TTY		0x1
+#define	UNIX_DEV_TRYLOCK	0x2
+#define	UNIX_DEV_PLAIN		0x4
+
+/*
+ * How long we wait for the metadata service to answer a reset probe:
+ */
+#define	UNIX_PROBE_TIMEOUT_MS	2000
+
+/*
+ * When flushing a tuned serial port, whose reads do not wait, the line must
+ * be quiet for this long before we consider the flush complete:
+ */
+#define	UNIX_FLUSH_QUIET_MS	20
+
+/*
+ * If a serial port only answered once its link tuning was undone, this file
+ * is left in the run directory so that subsequent invocations do not tune it:
+ */
+#define	UNIX_SERIAL_CACHE	"serial-plain"
+
 int
 unix_is_interactive(void)
 {
 	return (isatty(STDIN_FILENO) == 1);
 }
 
+/*
+ * Link tuning for serial ports.  Unless disabled, or found not to work, we
+ * ask for low-latency handling of received characters from the UART driver
+ * (where the platform offers it), along with any line speed and flow control
+ * nominated in the environment.  We also set VMIN and VTIME to zero, so that
+ * each read(2) returns at once with whatever has been received: the reader
+ * only reads once poll(2) has reported input, and then takes as much as is
+ * available (see unix_rbuf_fill()), so the inter-character timer of the
+ * untuned configuration can only add latency.
+ *
+ * The settings found on the device before we first tuned it are kept, so
+ * that they can be put back if the metadata service does not answer.
+ */
+typedef struct unix_serial_orig {
+	boolean_t uso_valid;
+	speed_t uso_ispeed;
+	speed_t uso_ospeed;
+	tcflag_t uso_cflag;
+	boolean_t uso_low_latency;
+} unix_serial_orig_t;
+
+static unix_serial_orig_t unix_serial_orig;
+
+typedef struct unix_serial_speed {
+	unsigned long uss_baud;
+	speed_t uss_speed;
+} unix_serial_speed_t;
+
+/*
+ * The line speeds we can select, from the fastest down:
+ */
+static const unix_serial_speed_t unix_serial_speeds[] = {
+#ifdef B4000000
+	{ 4000000, B4000000 },
+#endif
+#ifdef B3000000
+	{ 3000000, B3000000 },
+#endif
+#ifdef B2000000
+	{ 2000000, B2000000 },
+#endif
+#ifdef B1500000
+	{ 1500000, B1500000 },
+#endif
+#ifdef B1000000
+	{ 1000000, B1000000 },
+#endif
+#ifdef B921600
+	{ 921600, B921600 },
+#endif
+#ifdef B460800
+	{ 460800, B460800 },
+#endif
+#ifdef B230400
+	{ 230400, B230400 },
+#endif
+	{ 115200, B115200 },
+	{ 57600, B57600 },
+	{ 38400, B38400 },
+	{ 19200, B19200 },
+	{ 9600, B9600 },
+	{ 0, 0 }
+};
+
+/*
+ * Determine the line speed requested in the environment.  Returns -1 if the
+ * speed is to be left alone.
+ */
+static int
+unix_serial_env_speed(speed_t *speed)
+{
+	const char *env = getenv(MDATA_SERIAL_SPEED_ENV);
+	unsigned long baud;
+	char *end;
+	int i;
+
+	if (env == NULL || env[0] == '\0')
+		return (-1);
+
+	if (strcmp(env, "max") == 0) {
+		*speed = unix_serial_speeds[0].uss_speed;
+		return (0);
+	}
+
+	errno = 0;
+	baud = strtoul(env, &end, 10);
+	if (errno != 0 || *end != '\0')
+		return (-1);
+
+	for (i = 0; unix_serial_speeds[i].uss_baud != 0; i++) {
+		if (unix_serial_speeds[i].uss_baud == baud) {
+			*speed = unix_serial_speeds[i].uss_speed;
+			return (0);
+		}
+	}
+
+	return (-1);
+}
+
+static boolean_t
+unix_serial_env_flow(void)
+{
+	const char *env = getenv(MDATA_SERIAL_FLOW_ENV);
+
+	return (env != NULL && strcmp(env, "rtscts") == 0 ? B_TRUE : B_FALSE);
+}
+
+static boolean_t
+unix_serial_env_low_latency(void)
+{
+	const char *env = getenv(MDATA_SERIAL_LOW_LATENCY_ENV);
+
+	return (env != NULL && strcmp(env, "0") == 0 ? B_FALSE : B_TRUE);
+}
+
+/*
+ * Get or set the low-latency flag of the UART driver.  Not every driver (and
+ * not every platform) has one, so failure here is not an error: we carry on
+ * with the driver as we found it.
+ */
+static boolean_t
+unix_serial_get_low_latency(int fd)
+{
+#if defined(TIOCGSERIAL) && defined(ASYNC_LOW_LATENCY)
+	struct serial_struct ss;
+
+	if (ioctl(fd, TIOCGSERIAL, &ss) == 0)
+		return ((ss.flags & ASYNC_LOW_LATENCY) ? B_TRUE : B_FALSE);
+#else
+	(void) fd;
+#endif
+	return (B_FALSE);
+}
+
+static void
+unix_serial_set_low_latency(int fd, boolean_t on)
+{
+#if defined(TIOCSSERIAL) && defined(ASYNC_LOW_LATENCY)
+	struct serial_struct ss;
+
+	if (ioctl(fd, TIOCGSERIAL, &ss) != 0)
+		return;
+	if (on)
+		ss.flags |= ASYNC_LOW_LATENCY;
+	else
+		ss.flags &= ~ASYNC_LOW_LATENCY;
+	(void) ioctl(fd, TIOCSSERIAL, &ss);
+#else
+	(void) fd;
+	(void) on;
+#endif
+}
+
 static int
-unix_raw_mode(int fd, const char **errmsg)
+unix_raw_mode(int fd, boolean_t tune, const char **errmsg)
 {
+	unix_serial_orig_t *uso = &unix_serial_orig;
 	struct termios tios;
+	speed_t speed;
 
 	if (tcgetattr(fd, &tios) == -1) {
-		*errmsg = "could not set raw mode on serial device";
+		*errmsg = "could not get attributes from serial device";
 		return (-1);
 	}
 
+	if (tune && !uso->uso_valid) {
+		uso->uso_valid = B_TRUE;
+		uso->uso_ispeed = cfgetispeed(&tios);
+		uso->uso_ospeed = cfgetospeed(&tios);
+		uso->uso_cflag = tios.c_cflag;
+		uso->uso_low_latency = unix_serial_get_low_latency(fd);
+	}
+
 	tios.c_iflag &= (tcflag_t)~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
 	tios.c_oflag &= (tcflag_t)~(OPOST);
 	tios.c_cflag |= (tcflag_t)(CS8);
 	tios.c_cflag &= (tcflag_t)~(HUPCL);
 	tios.c_lflag &= (tcflag_t)~(ECHO | ICANON | IEXTEN | ISIG);
 
-	/*
-	 * As described in "Case C: MIN = 0, TIME > 0" of termio(7I), this
-	 * configuration will block waiting for at least one character, or
-	 * the expiry of a 100 millisecond timeout:
-	 */
-	tios.c_cc[VMIN] = 0;
-	tios.c_cc[VTIME] = 1;
+	if (tune) {
+		/*
+		 * As described in "Case D: MIN = 0, TIME = 0" of termio(7I),
+		 * a read returns immediately with whatever is available:
+		 */
+		tios.c_cc[VMIN] = 0;
+		tios.c_cc[VTIME] = 0;
+
+		if (unix_serial_env_speed(&speed) == 0) {
+			(void) cfsetispeed(&tios, speed);
+			(void) cfsetospeed(&tios, speed);
+		}
+#ifdef CRTSCTS
+		if (unix_serial_env_flow())
+			tios.c_cflag |= (tcflag_t)CRTSCTS;
+#endif
+	} else {
+		/*
+		 * As described in "Case C: MIN = 0, TIME > 0" of termio(7I),
+		 * this configuration will block waiting for at least one
+		 * character, or the expiry of a 100 millisecond timeout:
+		 */
+		tios.c_cc[VMIN] = 0;
+		tios.c_cc[VTIME] = 1;
+
+		/*
+		 * Put back any line settings we changed on a previous attempt:
+		 */
+		if (uso->uso_valid) {
+			(void) cfsetispeed(&tios, uso->uso_ispeed);
+			(void) cfsetospeed(&tios, uso->uso_ospeed);
+#ifdef CRTSCTS
+			tios.c_cflag &= (tcflag_t)~CRTSCTS;
+			tios.c_cflag |= uso->uso_cflag & (tcflag_t)CRTSCTS;
+#endif
+		}
+	}
 
 	if (tcsetattr(fd, TCSAFLUSH, &tios) == -1) {
-		*errmsg = "could not get attributes from serial device";
+		*errmsg = "could not set raw mode on serial device";
 		return (-1);
 	}
 
+	if (tune && unix_serial_env_low_latency())
+		unix_serial_set_low_latency(fd, B_TRUE);
+	else if (!tune && uso->uso_valid)
+		unix_serial_set_low_latency(fd, uso->uso_low_latency);
+
 	return (0);
 }
 
-int
-unix_open_serial(const char *devpath, int *outfd, const char **errmsg, int *permfail)
+/*
+ * Open a character device that is shared with other metadata clients.  A
+ * serial port needs to be placed in raw mode; a paravirtualised port, such as
+ * a virtio-serial port, carries bytes unmodified and has no termios state.
+ */
+static int
+unix_open_device(const char *devpath, int devflags, int *outfd,
+    const char **errmsg, int *permfail)
 {
+	boolean_t is_tty = (devflags & UNIX_DEV_TTY) ? B_TRUE : B_FALSE;
+	boolean_t tune = (devflags & UNIX_DEV_PLAIN) ? B_FALSE : B_TRUE;
 	int fd;
 	char scrap[100];
 	ssize_t sz;
-	struct flock l;
+	int flags = 0;
+	int r;
 
 	if ((fd = open(devpath, O_RDWR | O_EXCL |
 	    O_NOCTTY)) == -1) {
@@ -77,21 +319,29 @@ unix_open_serial(const char *devpath, int *outfd, const char **errmsg, int *perm
 	}
 
 	/*
-	 * Lock the serial port for exclusive access:
+	 * Wait our turn, then lock the serial port for exclusive access:
 	 */
-	l.l_type = F_WRLCK;
-	l.l_whence = SEEK_SET;
-	l.l_start = l.l_len = 0;
-	if (fcntl(fd, F_SETLKW, &l) == -1) {
-		*errmsg = "Could not lock serial device.";
-		return (-1);
+	if ((r = unix_lock_device(fd, devpath, (devflags & UNIX_DEV_TRYLOCK) ?
+	    B_TRUE : B_FALSE, errmsg, permfail)) != 0) {
+		(void) close(fd);
+		return (r);
 	}
 
 	/*
-	 * Set raw mode on the serial port:
+	 * Set raw mode on the serial port.  Without termios, there is no
+	 * read timeout to end the flush below, so we use non-blocking I/O
+	 * for its duration instead:
 	 */
-	if (unix_raw_mode(fd, errmsg) == -1) {
-		(void) close(fd);
+	if (is_tty) {
+		if (unix_raw_mode(fd, tune, errmsg) == -1) {
+			unix_close(fd);
+			*permfail = 1;
+			return (-1);
+		}
+	} else if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+	    fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		*errmsg = "Could not set non-blocking I/O on device.";
+		unix_close(fd);
 		*permfail = 1;
 		return (-1);
 	}
@@ -99,20 +349,524 @@ unix_open_serial(const char *devpath, int *outfd, const char **errmsg, int *perm
 	/*
 	 * Because this is a shared serial line, we may be part way through
 	 * a response from the remote peer.  Read (and discard) data until we
-	 * cannot do so anymore:
+	 * cannot do so anymore.  The reads of a tuned serial port do not wait
+	 * for more to arrive, so we do that here instead:
 	 */
-	do {
+	for (;;) {
+		struct pollfd pfd;
+
 		sz = read(fd, &scrap, sizeof (scrap));
 
 		if (sz == -1 && errno != EAGAIN) {
 			*errmsg = "Failed to flush serial port before use.";
-			(void) close(fd);
+			unix_close(fd);
 			return (-1);
 		}
 
-	} while (sz > 0);
+		if (sz > 0)
+			continue;
+		if (!is_tty || !tune)
+			break;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, UNIX_FLUSH_QUIET_MS) <= 0)
+			break;
+	}
+
+	if (!is_tty && fcntl(fd, F_SETFL, flags) == -1) {
+		*errmsg = "Could not restore blocking I/O on device.";
+		unix_close(fd);
+		return (-1);
+	}
 
 	*outfd = fd;
 
 	return (0);
 }
+
+int
+unix_open_serial(const char *devpath, int *outfd, const char **errmsg, int *permfail)
+{
+	return (unix_open_device(devpath, UNIX_DEV_TTY, outfd, errmsg,
+	    permfail));
+}
+
+int
+unix_open_virtio(const char *devpath, int *outfd, const char **errmsg,
+    int *permfail)
+{
+	return (unix_open_device(devpath, 0, outfd, errmsg, permfail));
+}
+
+/*
+ * Add a socket transport for each of the listed paths that exists in this
+ * instance, returning the number added.
+ */
+int
+unix_find_sockets(const char **paths, mdata_transport_t *mdts, int max,
+    int *permfail)
+{
+	int i, n = 0;
+	struct stat st;
+
+	for (i = 0; paths[i] != NULL && n < max; i++) {
+		if (lstat(paths[i], &st) == 0 && S_ISSOCK(st.st_mode)) {
+			mdts[n].mdt_type = MDTT_SOCKET;
+			mdts[n].mdt_path = paths[i];
+			n++;
+		} else {
+			/*
+			 * If we're not root, and we get an EACCES, it's
+			 * often a permissions problem.  Don't retry
+			 * forever:
+			 */
+			if (geteuid() != 0 && (errno == EPERM ||
+			    errno == EACCES))
+				*permfail = 1;
+		}
+	}
+
+	return (n);
+}
+
+int
+unix_open_socket(const char *sockpath, int *outfd, const char **errmsg,
+    int *permfail)
+{
+	int fd;
+	struct sockaddr_un ua;
+
+	if (strlen(sockpath) >= sizeof (ua.sun_path)) {
+		*errmsg = "Metadata socket path is too long.";
+		*permfail = 1;
+		return (-1);
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		*errmsg = "Could not open metadata socket.";
+		*permfail = 1;
+		return (-1);
+	}
+
+	/*
+	 * Enable non-blocking I/O on the socket so that we can time-out
+	 * when we want to:
+	 */
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+		*errmsg = "Could not set non-blocking I/O on socket.";
+		(void) close(fd);
+		*permfail = 1;
+		return (-1);
+	}
+
+	bzero(&ua, sizeof (ua));
+	ua.sun_family = AF_UNIX;
+	strcpy(ua.sun_path, sockpath);
+
+	if (connect(fd, (struct sockaddr *)&ua, sizeof (ua)) == -1) {
+		(void) close(fd);
+		*errmsg = "Could not connect metadata socket.";
+		return (-1);
+	}
+
+	*outfd = fd;
+
+	return (0);
+}
+
+/*
+ * If the user has nominated a metadata socket in the environment, we use it
+ * regardless of what the platform would otherwise choose.
+ */
+int
+unix_socket_override(mdata_transport_t *mdt)
+{
+	const char *path = getenv(MDATA_SOCKET_ENV);
+
+	if (path == NULL || path[0] == '\0')
+		return (-1);
+
+	mdt->mdt_type = MDTT_SOCKET;
+	mdt->mdt_path = path;
+	return (0);
+}
+
+static int
+unix_open_transport_flags(const mdata_transport_t *mdt, int devflags,
+    int *outfd, const char **errmsg, int *permfail)
+{
+	switch (mdt->mdt_type) {
+	case MDTT_SERIAL:
+		return (unix_open_device(mdt->mdt_path,
+		    devflags | UNIX_DEV_TTY, outfd, errmsg, permfail));
+	case MDTT_SOCKET:
+		return (unix_open_socket(mdt->mdt_path, outfd, errmsg,
+		    permfail));
+	case MDTT_VIRTIO:
+		return (unix_open_device(mdt->mdt_path, devflags, outfd,
+		    errmsg, permfail));
+	default:
+		ABORT("unknown transport type");
+		return (-1);
+	}
+}
+
+int
+unix_open_transport(const mdata_transport_t *mdt, int *outfd,
+    const char **errmsg, int *permfail)
+{
+	return (unix_open_transport_flags(mdt, 0, outfd, errmsg, permfail));
+}
+
+const char *
+unix_transport_name(mdata_transport_type_t type)
+{
+	switch (type) {
+	case MDTT_SERIAL:
+		return ("serial");
+	case MDTT_SOCKET:
+		return ("socket");
+	case MDTT_VIRTIO:
+		return ("virtio");
+	default:
+		return ("unknown");
+	}
+}
+
+static long long
+unix_now_ms(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+
+	return ((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Open each of the candidate transports at once, send the reset probe (a
+ * bare LF, to which the metadata service answers "invalid command") down
+ * each, and keep whichever answers first.  The others are closed.
+ *
+ * If UNIX_DEV_TRYLOCK is set, we do not wait for the lock on a device that is
+ * in use by another process.  If no other candidate answers, we then wait our
+ * turn for the first such device, on the basis that someone else is already
+ * using it successfully.
+ */
+static int
+unix_probe(const mdata_transport_t *mdts, int n, int devflags,
+    int *winner, int *outfd, unix_rbuf_t *rbuf, const char **errmsg,
+    int *permfail)
+{
+	struct pollfd pfd[UNIX_MAX_TRANSPORTS];
+	unix_rbuf_t *rbufs;
+	string_t *lines[UNIX_MAX_TRANSPORTS];
+	int i, r, nopen = 0, nperm = 0, busy = -1, win = -1;
+	boolean_t opened = B_FALSE;
+	long long deadline;
+
+	VERIFY(n > 0 && n <= UNIX_MAX_TRANSPORTS);
+
+	if ((rbufs = calloc((size_t)n, sizeof (*rbufs))) == NULL) {
+		*errmsg = "Could not allocate memory.";
+		*permfail = 1;
+		return (-1);
+	}
+
+	for (i = 0; i < n; i++) {
+		int pf = 0;
+
+		lines[i] = dynstr_new();
+		pfd[i].fd = -1;
+		pfd[i].events = POLLIN;
+		pfd[i].revents = 0;
+
+		r = unix_open_transport_flags(&mdts[i], devflags, &pfd[i].fd,
+		    errmsg, &pf);
+		if (r == UNIX_OPEN_BUSY) {
+			pfd[i].fd = -1;
+			if (busy == -1)
+				busy = i;
+			continue;
+		} else if (r != 0) {
+			pfd[i].fd = -1;
+			if (pf)
+				nperm++;
+			continue;
+		}
+
+		opened = B_TRUE;
+		if (write(pfd[i].fd, "\n", 1) != 1) {
+			unix_close(pfd[i].fd);
+			pfd[i].fd = -1;
+			continue;
+		}
+		nopen++;
+	}
+
+	deadline = unix_now_ms() + UNIX_PROBE_TIMEOUT_MS;
+	while (nopen > 0 && win == -1) {
+		long long now = unix_now_ms();
+
+		if (now >= deadline)
+			break;
+
+		if (poll(pfd, (nfds_t)n, (int)(deadline - now)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (i = 0; i < n && win == -1; i++) {
+			if (pfd[i].fd == -1 || pfd[i].revents == 0)
+				continue;
+
+			if ((pfd[i].revents & POLLIN) &&
+			    unix_rbuf_fill(&rbufs[i], pfd[i].fd) > 0) {
+				if (unix_rbuf_line(&rbufs[i], lines[i]) == 0)
+					continue;
+				if (strcmp(dynstr_cstr(lines[i]),
+				    "invalid command") == 0) {
+					win = i;
+					continue;
+				}
+			}
+
+			/*
+			 * This candidate hung up, or did not answer as the
+			 * metadata service would:
+			 */
+			unix_close(pfd[i].fd);
+			pfd[i].fd = -1;
+			nopen--;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (i == win) {
+			*outfd = pfd[i].fd;
+			*rbuf = rbufs[i];
+		} else if (pfd[i].fd != -1) {
+			unix_close(pfd[i].fd);
+		}
+		dynstr_free(lines[i]);
+	}
+	free(rbufs);
+
+	if (win != -1) {
+		*winner = win;
+		return (0);
+	}
+
+	if (busy != -1) {
+		if (unix_probe(&mdts[busy], 1, devflags & ~UNIX_DEV_TRYLOCK,
+		    &win, outfd, rbuf, errmsg, permfail) != 0)
+			return (-1);
+		*winner = busy;
+		return (0);
+	}
+
+	if (opened)
+		*errmsg = "Could not do active reset.";
+	else if (nperm == n)
+		*permfail = 1;
+	return (-1);
+}
+
+static int
+unix_transport_lookup(const mdata_transport_t *mdts, int n, const char *cache)
+{
+	char buf[PATH_MAX + 32];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		(void) snprintf(buf, sizeof (buf), "%s %s\n",
+		    unix_transport_name(mdts[i].mdt_type), mdts[i].mdt_path);
+		if (strcmp(buf, cache) == 0)
+			return (i);
+	}
+
+	return (-1);
+}
+
+/*
+ * Mark the start of a new session in the capture trace, if there is one.
+ */
+static void
+unix_trace_connect(const mdata_transport_t *mdt)
+{
+	char buf[PATH_MAX + 32];
+	int len;
+
+	len = snprintf(buf, sizeof (buf), "%s %s",
+	    unix_transport_name(mdt->mdt_type), mdt->mdt_path);
+	if (len > 0 && (size_t)len < sizeof (buf))
+		trace_capture(TRT_CONNECT, buf, (size_t)len);
+}
+
+/*
+ * Connect to the metadata service over whichever of the candidate transports
+ * answers first.  The winner is remembered in the run directory, and tried on
+ * its own next time; only if it no longer works do we probe them all again.
+ */
+static int
+unix_connect_flags(const mdata_transport_t *mdts, int n, int devflags,
+    int *winner, int *outfd, unix_rbuf_t *rbuf, const char **errmsg,
+    int *permfail)
+{
+	char path[PATH_MAX];
+	char buf[PATH_MAX + 32];
+	boolean_t have_cache = B_FALSE;
+	int cached = -1;
+	int w;
+
+	if (n > 1 && fs_rundir_path(UNIX_TRANSPORT_CACHE, path,
+	    sizeof (path)) == 0) {
+		string_t *str = dynstr_new();
+
+		have_cache = B_TRUE;
+		if (fs_read_file(path, str) == 0 && dynstr_len(str) > 0)
+			cached = unix_transport_lookup(mdts, n,
+			    dynstr_cstr(str));
+		dynstr_free(str);
+	}
+
+	if (cached != -1) {
+		int pf = 0;
+
+		if (unix_probe(&mdts[cached], 1, devflags, &w, outfd, rbuf,
+		    errmsg, &pf) == 0) {
+			*winner = cached;
+			return (0);
+		}
+		(void) unlink(path);
+	}
+
+	if (unix_probe(mdts, n, n == 1 ? devflags : devflags |
+	    UNIX_DEV_TRYLOCK, winner, outfd, rbuf, errmsg, permfail) != 0)
+		return (-1);
+
+	if (have_cache && *winner != cached) {
+		(void) snprintf(buf, sizeof (buf), "%s %s\n",
+		    unix_transport_name(mdts[*winner].mdt_type),
+		    mdts[*winner].mdt_path);
+		(void) fs_write_atomic(path, buf, strlen(buf), 0644);
+	}
+
+	return (0);
+}
+
+/*
+ * Connect to the metadata service.  If a serial port is among the candidates
+ * and nothing answers, the link tuning may be at fault (the far end may not
+ * follow a change of speed, or may never assert CTS), so we try again with
+ * the port as we found it.  If that works, the tuning is not tried again.
+ */
+int
+unix_connect(const mdata_transport_t *mdts, int n, int *winner, int *outfd,
+    unix_rbuf_t *rbuf, const char **errmsg, int *permfail)
+{
+	char path[PATH_MAX];
+	boolean_t have_path = B_FALSE;
+	int devflags = 0;
+	int i;
+
+	if (n == 0) {
+		*errmsg = "No metadata transport available.";
+		return (-1);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (mdts[i].mdt_type == MDTT_SERIAL)
+			break;
+	}
+	if (i < n && fs_rundir_path(UNIX_SERIAL_CACHE, path,
+	    sizeof (path)) == 0) {
+		have_path = B_TRUE;
+		if (access(path, F_OK) == 0)
+			devflags |= UNIX_DEV_PLAIN;
+	}
+
+	if (unix_connect_flags(mdts, n, devflags, winner, outfd, rbuf, errmsg,
+	    permfail) != 0) {
+		if (i == n || (devflags & UNIX_DEV_PLAIN) || *permfail)
+			return (-1);
+		if (unix_connect_flags(mdts, n, devflags | UNIX_DEV_PLAIN,
+		    winner, outfd, rbuf, errmsg, permfail) != 0)
+			return (-1);
+		if (have_path && mdts[*winner].mdt_type == MDTT_SERIAL)
+			(void) fs_write_atomic(path, "", 0, 0644);
+	}
+	unix_trace_connect(&mdts[*winner]);
+
+	return (0);
+}
+
+/*
+ * Read whatever is available from the connection into the buffer.  This is
+ * only called once the descriptor has polled readable, so a single read(2)
+ * of up to a buffer's worth replaces what would otherwise be one read (and
+ * one poll) per byte.
+ */
+ssize_t
+unix_rbuf_fill(unix_rbuf_t *urb, int fd)
+{
+	ssize_t sz;
+
+	if (urb->urb_off == urb->urb_len)
+		urb->urb_off = urb->urb_len = 0;
+
+	if (urb->urb_len == sizeof (urb->urb_data))
+		return (0);
+
+	if ((sz = read(fd, urb->urb_data + urb->urb_len,
+	    sizeof (urb->urb_data) - urb->urb_len)) > 0)
+		urb->urb_len += (size_t)sz;
+
+	return (sz);
+}
+
+/*
+ * Move buffered data into the string, up to the end of the current line.
+ * Returns 1 if the terminating LF was found (and consumed), or 0 if the
+ * buffer was exhausted first.
+ */
+int
+unix_rbuf_line(unix_rbuf_t *urb, string_t *data)
+{
+	const char *start = urb->urb_data + urb->urb_off;
+	size_t avail = urb->urb_len - urb->urb_off;
+	const char *nl;
+
+	if (avail == 0)
+		return (0);
+
+	if ((nl = memchr(start, '\n', avail)) == NULL) {
+		dynstr_appendn(data, start, avail);
+		urb->urb_off = urb->urb_len = 0;
+		return (0);
+	}
+
+	dynstr_appendn(data, start, (size_t)(nl - start));
+	urb->urb_off += (size_t)(nl - start) + 1;
+	return (1);
+}
+
+/*
+ * Copy out any data that has been read ahead, for callers that read the
+ * connection directly.
+ */
+size_t
+unix_rbuf_drain(unix_rbuf_t *urb, char *buf, size_t len)
+{
+	size_t avail = urb->urb_len - urb->urb_off;
+
+	if (len > avail)
+		len = avail;
+
+	memcpy(buf, urb->urb_data + urb->urb_off, len);
+	urb->urb_off += len;
+	return (len);
+}
@@ -10,14 +10,102 @@
 extern "C" {
 #endif
 
+#include "common.h"
 #include "plat.h"
 #include "dynstr.h"
 
+/*
+ * The kinds of connection over which we can reach the metadata service:
+ */
+typedef enum mdata_transport_type {
+	MDTT_SERIAL = 1,
+	MDTT_SOCKET,
+	MDTT_VIRTIO
+} mdata_transport_type_t;
+
+typedef struct mdata_transport {
+	mdata_transport_type_t mdt_type;
+	const char *mdt_path;
+} mdata_transport_t;
+
+/*
+ * The largest number of candidate transports a platform may offer:
+ */
+#define	UNIX_MAX_TRANSPORTS	8
+
+/*
+ * Environment variable which, when set, names a UNIX domain socket to use in
+ * preference to any platform-specific transport:
+ */
+#define	MDATA_SOCKET_ENV	"MDATA_SOCKET"
+
+/*
+ * Environment variable which names the virtio-serial port to use on Linux, or
+ * gives the full path of a character device to use in its place:
+ */
+#define	MDATA_VIRTIO_PORT_ENV	"MDATA_VIRTIO_PORT"
+
+/*
+ * The transport that answered first is remembered in this file in the run
+ * directory, as "<transport name> <path>\n", and tried on its own by
+ * subsequent invocations:
+ */
+#define	UNIX_TRANSPORT_CACHE	"transport"
+
+/*
+ * How long, in seconds, to wait for a shared metadata device before giving
+ * up; and, if set, a request to report lock wait times and queue depth:
+ */
+#define	MDATA_LOCK_TIMEOUT_ENV	"MDATA_LOCK_TIMEOUT"
+#define	MDATA_LOCK_STATS_ENV	"MDATA_LOCK_STATS"
+
+/*
+ * Link tuning for serial ports: a line speed (in bits per second, or "max"
+ * for the fastest the platform can select), "rtscts" to enable hardware flow
+ * control, and "0" to leave the low-latency flag of the UART driver alone:
+ */
+#define	MDATA_SERIAL_SPEED_ENV		"MDATA_SERIAL_SPEED"
+#define	MDATA_SERIAL_FLOW_ENV		"MDATA_SERIAL_FLOW"
+#define	MDATA_SERIAL_LOW_LATENCY_ENV	"MDATA_SERIAL_LOW_LATENCY"
+
+/*
+ * Returned when a device lock was only tried for, and another process holds
+ * or is waiting for the device:
+ */
+#define	UNIX_OPEN_BUSY		(-2)
+
+/*
+ * Buffered reader for the metadata connection:
+ */
+#define	UNIX_RBUF_SIZE		4096
+
+typedef struct unix_rbuf {
+	char urb_data[UNIX_RBUF_SIZE];
+	size_t urb_off;
+	size_t urb_len;
+} unix_rbuf_t;
+
 /*int unix_raw_mode(int fd, char **errmsg);*/
 int unix_open_serial(const char *, int *, const char **, int *);
+int unix_open_virtio(const char *, int *, const char **, int *);
+int unix_open_socket(const char *, int *, const char **, int *);
+int unix_find_sockets(const char **, mdata_transport_t *, int, int *);
+int unix_socket_override(mdata_transport_t *);
+int unix_open_transport(const mdata_transport_t *, int *, const char **,
+    int *);
+int unix_connect(const mdata_transport_t *, int, int *, int *, unix_rbuf_t *,
+    const char **, int *);
+const char *unix_transport_name(mdata_transport_type_t);
 int unix_send_reset(mdata_plat_t *mpl);
 int unix_is_interactive(void);
 
+int unix_lock_device(int, const char *, boolean_t, const char **, int *);
+void unix_close(int);
+
+ssize_t unix_rbuf_fill(unix_rbuf_t *, int);
+int unix_rbuf_line(unix_rbuf_t *, string_t *);
+size_t unix_rbuf_drain(unix_rbuf_t *, char *, size_t);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,610 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * Fair, first-come first-served locking of a shared metadata device.
+ *
+ * Clients have always taken an fcntl(2) write lock over the whole device
+ * before using it.  Waiters for such a lock are woken in no particular order,
+ * so under heavy contention some invocations starve while others jump ahead.
+ * We now queue for a ticket before taking that lock.  The queue lives in a
+ * file in the run directory, one per device, which every client maps shared:
+ *
+ *	- A client takes the next ticket, and waits until the ticket being
+ *	  served is its own.  Waiters poll at an interval proportional to
+ *	  their position in the queue, so the client at the head notices its
+ *	  turn promptly without the whole queue spinning.
+ *
+ *	- Each ticket has a slot, recording the owning process, and a byte in
+ *	  the file that the owner holds a record lock over for as long as it
+ *	  is queued or holding the device.  The kernel releases the record
+ *	  lock when the owner exits, so if the ticket being served belongs to
+ *	  a process that has gone away, the next waiter skips past it.
+ *
+ *	- Once its turn arrives, the client takes the fcntl(2) lock on the
+ *	  device as before.  Only older clients, which do not queue, can
+ *	  contend with it there.
+ *
+ * The table itself is protected by a record lock on its first byte, held
+ * only briefly.  If the queue file cannot be used, or the queue is longer
+ * than there are slots, we fall back to the device lock alone.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "fsutil.h"
+#include "plat.h"
+#include "unix_common.h"
+
+#define	UL_MAGIC	0x6d646c31	/* "mdl1" */
+#define	UL_NSLOTS	128
+
+/*
+ * Waiters poll for their turn every UL_POLL_MS for each client ahead of them
+ * in the queue, up to a limit:
+ */
+#define	UL_POLL_MS	2
+#define	UL_POLL_MAX_MS	50
+
+typedef enum ul_state {
+	ULS_FREE = 0,
+	ULS_WAITING,
+	ULS_HELD,
+	ULS_ABANDONED
+} ul_state_t;
+
+typedef struct ul_slot {
+	uint64_t uls_ticket;
+	int32_t uls_pid;
+	uint32_t uls_state;
+} ul_slot_t;
+
+typedef struct ul_table {
+	uint32_t ult_magic;
+	uint32_t ult_nslots;
+	uint64_t ult_next;
+	uint64_t ult_serving;
+
+	/*
+	 * Statistics, accumulated across all clients since the table was
+	 * created:
+	 */
+	uint64_t ult_acquired;
+	uint64_t ult_timeouts;
+	uint64_t ult_skipped;
+	uint64_t ult_wait_total_ms;
+	uint64_t ult_wait_max_ms;
+	uint64_t ult_depth_max;
+
+	ul_slot_t ult_slots[UL_NSLOTS];
+} ul_table_t;
+
+#define	UL_TABLE_LOCK_OFF	0
+#define	UL_SLOT_LOCK_OFF(i)	((off_t)sizeof (ul_table_t) + (i))
+
+/*
+ * Closing any descriptor for a file releases every record lock this process
+ * holds on it, so each queue file is opened once and kept open for the life
+ * of the process:
+ */
+typedef struct ul_file ul_file_t;
+
+struct ul_file {
+	char ulf_path[PATH_MAX];
+	int ulf_fd;
+	ul_table_t *ulf_table;
+	ul_file_t *ulf_next;
+};
+
+/*
+ * A ticket held for an open device:
+ */
+typedef struct ul_ticket ul_ticket_t;
+
+struct ul_ticket {
+	int ult_devfd;
+	ul_file_t *ult_file;
+	uint64_t ult_ticket;
+	ul_ticket_t *ult_next;
+};
+
+static pthread_mutex_t unix_lock_mtx = PTHREAD_MUTEX_INITIALIZER;
+static ul_file_t *unix_lock_files;
+static ul_ticket_t *unix_lock_tickets;
+static int unix_lock_timeout_ms = -1;
+static boolean_t unix_lock_timeout_set = B_FALSE;
+static boolean_t unix_lock_atexit = B_FALSE;
+
+/*
+ * A connection attempt may open the same device more than once, as when a
+ * cached transport fails and we probe them all again.  The timeout applies
+ * to the attempt as a whole, so the deadline stands until a lock is taken:
+ */
+static long long unix_lock_deadline = -1;
+
+static void ul_release_all(void);
+
+static long long
+ul_now_ms(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+
+	return ((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static int
+ul_lock(int fd, short type, off_t off, boolean_t wait)
+{
+	struct flock l;
+
+	bzero(&l, sizeof (l));
+	l.l_type = type;
+	l.l_whence = SEEK_SET;
+	l.l_start = off;
+	l.l_len = 1;
+
+	while (fcntl(fd, wait ? F_SETLKW : F_SETLK, &l) == -1) {
+		if (errno != EINTR)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Take the table lock.  Record locks are held by the process rather than the
+ * thread, so the mutex is also needed to exclude other threads:
+ */
+static void
+ul_enter(ul_file_t *ulf)
+{
+	VERIFY0(pthread_mutex_lock(&unix_lock_mtx));
+	(void) ul_lock(ulf->ulf_fd, F_WRLCK, UL_TABLE_LOCK_OFF, B_TRUE);
+}
+
+static void
+ul_exit(ul_file_t *ulf)
+{
+	(void) ul_lock(ulf->ulf_fd, F_UNLCK, UL_TABLE_LOCK_OFF, B_FALSE);
+	VERIFY0(pthread_mutex_unlock(&unix_lock_mtx));
+}
+
+/*
+ * Is the owner of the given slot still alive?
+ */
+static boolean_t
+ul_slot_live(ul_file_t *ulf, int slot)
+{
+	struct flock l;
+
+	if (ulf->ulf_table->ult_slots[slot].uls_pid == (int32_t)getpid())
+		return (B_TRUE);
+
+	bzero(&l, sizeof (l));
+	l.l_type = F_WRLCK;
+	l.l_whence = SEEK_SET;
+	l.l_start = UL_SLOT_LOCK_OFF(slot);
+	l.l_len = 1;
+
+	if (fcntl(ulf->ulf_fd, F_GETLK, &l) == -1)
+		return (B_TRUE);
+
+	return (l.l_type != F_UNLCK ? B_TRUE : B_FALSE);
+}
+
+/*
+ * Find, or open, the queue file for the given device.  Must be called with
+ * unix_lock_mtx held.
+ */
+static ul_file_t *
+ul_file_get(const char *devpath)
+{
+	char name[PATH_MAX];
+	char path[PATH_MAX];
+	ul_file_t *ulf;
+	struct stat st;
+	void *addr;
+	char *c;
+	int fd;
+
+	(void) snprintf(name, sizeof (name), "lock%s", devpath);
+	for (c = name; *c != '\0'; c++) {
+		if (*c == '/')
+			*c = '.';
+	}
+	if (fs_rundir_path(name, path, sizeof (path)) != 0)
+		return (NULL);
+
+	for (ulf = unix_lock_files; ulf != NULL; ulf = ulf->ulf_next) {
+		if (strcmp(ulf->ulf_path, path) == 0)
+			return (ulf);
+	}
+
+	if ((fd = open(path, O_RDWR | O_CREAT, 0644)) == -1)
+		return (NULL);
+	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if (ul_lock(fd, F_WRLCK, UL_TABLE_LOCK_OFF, B_TRUE) != 0)
+		goto bail;
+
+	if (fstat(fd, &st) != 0 ||
+	    (st.st_size < (off_t)sizeof (ul_table_t) &&
+	    ftruncate(fd, (off_t)sizeof (ul_table_t)) != 0))
+		goto bail;
+
+	if ((addr = mmap(NULL, sizeof (ul_table_t), PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0)) == MAP_FAILED)
+		goto bail;
+
+	if ((ulf = calloc(1, sizeof (*ulf))) == NULL) {
+		(void) munmap(addr, sizeof (ul_table_t));
+		goto bail;
+	}
+	(void) strcpy(ulf->ulf_path, path);
+	ulf->ulf_fd = fd;
+	ulf->ulf_table = addr;
+
+	if (ulf->ulf_table->ult_magic != UL_MAGIC ||
+	    ulf->ulf_table->ult_nslots != UL_NSLOTS) {
+		bzero(ulf->ulf_table, sizeof (ul_table_t));
+		ulf->ulf_table->ult_magic = UL_MAGIC;
+		ulf->ulf_table->ult_nslots = UL_NSLOTS;
+	}
+
+	(void) ul_lock(fd, F_UNLCK, UL_TABLE_LOCK_OFF, B_FALSE);
+
+	ulf->ulf_next = unix_lock_files;
+	unix_lock_files = ulf;
+	return (ulf);
+
+bail:
+	(void) close(fd);
+	return (NULL);
+}
+
+static int
+ul_timeout_ms(void)
+{
+	const char *env;
+	int ms;
+
+	if (unix_lock_timeout_set)
+		return (unix_lock_timeout_ms);
+
+	/*
+	 * The value is checked as --lock-timeout is, and an invalid one is
+	 * ignored:
+	 */
+	if ((env = getenv(MDATA_LOCK_TIMEOUT_ENV)) == NULL ||
+	    parse_seconds(env, &ms) != 0)
+		return (-1);
+
+	return (ms);
+}
+
+static long long
+ul_deadline(long long now)
+{
+	int timeout = ul_timeout_ms();
+	long long deadline;
+
+	VERIFY0(pthread_mutex_lock(&unix_lock_mtx));
+	if (timeout < 0)
+		unix_lock_deadline = -1;
+	else if (unix_lock_deadline == -1)
+		unix_lock_deadline = now + timeout;
+	deadline = unix_lock_deadline;
+	VERIFY0(pthread_mutex_unlock(&unix_lock_mtx));
+
+	return (deadline);
+}
+
+static void
+ul_locked(void)
+{
+	VERIFY0(pthread_mutex_lock(&unix_lock_mtx));
+	unix_lock_deadline = -1;
+	VERIFY0(pthread_mutex_unlock(&unix_lock_mtx));
+}
+
+static void
+ul_report(ul_table_t *ult, const char *devpath, long long waited,
+    uint64_t position)
+{
+	if (getenv(MDATA_LOCK_STATS_ENV) == NULL)
+		return;
+
+	(void) fprintf(stderr, "mdata: lock %s: waited %lld ms at queue "
+	    "position %llu; %llu acquired, mean wait %llu ms, max wait "
+	    "%llu ms, max queue depth %llu, %llu timed out, %llu dead "
+	    "owners skipped\n", devpath, waited, (unsigned long long)position,
+	    (unsigned long long)ult->ult_acquired,
+	    (unsigned long long)(ult->ult_acquired > 0 ?
+	    ult->ult_wait_total_ms / ult->ult_acquired : 0),
+	    (unsigned long long)ult->ult_wait_max_ms,
+	    (unsigned long long)ult->ult_depth_max,
+	    (unsigned long long)ult->ult_timeouts,
+	    (unsigned long long)ult->ult_skipped);
+}
+
+/*
+ * Give up our place in the queue, or our turn if it has arrived.  Must be
+ * called with the table lock held.
+ */
+static void
+ul_leave(ul_file_t *ulf, uint64_t ticket, boolean_t timedout)
+{
+	ul_table_t *ult = ulf->ulf_table;
+	int slot = (int)(ticket % UL_NSLOTS);
+
+	if (ult->ult_serving == ticket) {
+		ult->ult_serving++;
+		ult->ult_slots[slot].uls_state = ULS_FREE;
+	} else {
+		/*
+		 * Our turn has not yet come; whoever reaches it will skip us:
+		 */
+		ult->ult_slots[slot].uls_state = ULS_ABANDONED;
+	}
+	if (timedout)
+		ult->ult_timeouts++;
+
+	(void) ul_lock(ulf->ulf_fd, F_UNLCK, UL_SLOT_LOCK_OFF(slot), B_FALSE);
+}
+
+/*
+ * Take the device lock on an open descriptor, waiting until the deadline (or
+ * indefinitely if it is -1).
+ */
+static int
+ul_device_lock(int devfd, boolean_t trylock, long long deadline)
+{
+	struct flock l;
+
+	bzero(&l, sizeof (l));
+	l.l_type = F_WRLCK;
+	l.l_whence = SEEK_SET;
+	l.l_start = l.l_len = 0;
+
+	for (;;) {
+		if (fcntl(devfd, (trylock || deadline != -1) ? F_SETLK :
+		    F_SETLKW, &l) == 0)
+			return (0);
+		if (errno == EINTR)
+			continue;
+		if (trylock || (errno != EAGAIN && errno != EACCES))
+			return (-1);
+		if (ul_now_ms() >= deadline) {
+			errno = ETIMEDOUT;
+			return (-1);
+		}
+		(void) poll(NULL, 0, UL_POLL_MAX_MS);
+	}
+}
+
+/*
+ * Wait our turn for exclusive use of a shared device, which is open on
+ * "devfd".  If "trylock" is set, we do not wait: UNIX_OPEN_BUSY is returned
+ * if anyone else is using or waiting for the device.
+ */
+int
+unix_lock_device(int devfd, const char *devpath, boolean_t trylock,
+    const char **errmsg, int *permfail)
+{
+	ul_file_t *ulf;
+	ul_table_t *ult;
+	ul_ticket_t *tkt;
+	uint64_t ticket, position;
+	long long start = ul_now_ms(), waited;
+	long long deadline = ul_deadline(start);
+	boolean_t timedout;
+	int slot;
+
+	VERIFY0(pthread_mutex_lock(&unix_lock_mtx));
+	ulf = ul_file_get(devpath);
+	VERIFY0(pthread_mutex_unlock(&unix_lock_mtx));
+	if (ulf == NULL || (tkt = calloc(1, sizeof (*tkt))) == NULL)
+		goto device;
+	ult = ulf->ulf_table;
+
+	ul_enter(ulf);
+	ticket = ult->ult_next;
+	position = ticket - ult->ult_serving;
+	slot = (int)(ticket % UL_NSLOTS);
+
+	if (trylock && position > 0) {
+		ul_exit(ulf);
+		free(tkt);
+		return (UNIX_OPEN_BUSY);
+	}
+
+	/*
+	 * Claim the slot for our ticket.  If its previous owner is still
+	 * around, the queue is longer than the table.
+	 */
+	if (position >= UL_NSLOTS || ul_lock(ulf->ulf_fd, F_WRLCK,
+	    UL_SLOT_LOCK_OFF(slot), B_FALSE) != 0) {
+		ul_exit(ulf);
+		free(tkt);
+		goto device;
+	}
+
+	ult->ult_next++;
+	ult->ult_slots[slot].uls_ticket = ticket;
+	ult->ult_slots[slot].uls_pid = (int32_t)getpid();
+	ult->ult_slots[slot].uls_state = ULS_WAITING;
+	if (position + 1 > ult->ult_depth_max)
+		ult->ult_depth_max = position + 1;
+
+	for (;;) {
+		uint64_t serving = ult->ult_serving;
+		int sslot = (int)(serving % UL_NSLOTS);
+		ul_slot_t *uls = &ult->ult_slots[sslot];
+		int interval;
+
+		if (serving == ticket) {
+			ult->ult_slots[slot].uls_state = ULS_HELD;
+			break;
+		}
+
+		if (uls->uls_ticket != serving ||
+		    uls->uls_state == ULS_ABANDONED ||
+		    !ul_slot_live(ulf, sslot)) {
+			/*
+			 * The client whose turn it is has given up, or has
+			 * gone away:
+			 */
+			if (uls->uls_state != ULS_ABANDONED)
+				ult->ult_skipped++;
+			uls->uls_state = ULS_FREE;
+			ult->ult_serving++;
+			continue;
+		}
+
+		if (deadline != -1 && ul_now_ms() >= deadline) {
+			ul_leave(ulf, ticket, B_TRUE);
+			ul_exit(ulf);
+			free(tkt);
+			*errmsg = "Timed out waiting for metadata device lock.";
+			*permfail = 1;
+			return (-1);
+		}
+
+		interval = (int)(ticket - serving) * UL_POLL_MS;
+		if (interval > UL_POLL_MAX_MS)
+			interval = UL_POLL_MAX_MS;
+
+		ul_exit(ulf);
+		(void) poll(NULL, 0, interval);
+		ul_enter(ulf);
+	}
+	ul_exit(ulf);
+
+	if (ul_device_lock(devfd, trylock, deadline) != 0) {
+		timedout = (errno == ETIMEDOUT) ? B_TRUE : B_FALSE;
+
+		ul_enter(ulf);
+		ul_leave(ulf, ticket, timedout);
+		ul_exit(ulf);
+		free(tkt);
+		goto fail;
+	}
+
+	ul_locked();
+	waited = ul_now_ms() - start;
+	ul_enter(ulf);
+	ult->ult_acquired++;
+	ult->ult_wait_total_ms += (uint64_t)waited;
+	if ((uint64_t)waited > ult->ult_wait_max_ms)
+		ult->ult_wait_max_ms = (uint64_t)waited;
+	ul_report(ult, devpath, waited, position);
+
+	tkt->ult_devfd = devfd;
+	tkt->ult_file = ulf;
+	tkt->ult_ticket = ticket;
+	tkt->ult_next = unix_lock_tickets;
+	unix_lock_tickets = tkt;
+	if (!unix_lock_atexit) {
+		/*
+		 * The tools do not close their connection before exiting.
+		 * Pass our turn on promptly, rather than leaving the next
+		 * client to notice that we have gone:
+		 */
+		unix_lock_atexit = B_TRUE;
+		(void) atexit(ul_release_all);
+	}
+	ul_exit(ulf);
+
+	return (0);
+
+device:
+	/*
+	 * We cannot queue, so fall back to the device lock alone:
+	 */
+	if (ul_device_lock(devfd, trylock, deadline) == 0) {
+		ul_locked();
+		return (0);
+	}
+	timedout = (errno == ETIMEDOUT) ? B_TRUE : B_FALSE;
+
+fail:
+	if (trylock && !timedout)
+		return (UNIX_OPEN_BUSY);
+	if (timedout) {
+		*errmsg = "Timed out waiting for metadata device lock.";
+		*permfail = 1;
+	} else {
+		*errmsg = "Could not lock serial device.";
+	}
+	return (-1);
+}
+
+/*
+ * Close a descriptor for the metadata connection, passing our turn with the
+ * device (if any) to the next client in the queue.
+ */
+void
+unix_close(int fd)
+{
+	ul_ticket_t **tp, *tkt = NULL;
+
+	VERIFY0(pthread_mutex_lock(&unix_lock_mtx));
+	for (tp = &unix_lock_tickets; *tp != NULL; tp = &(*tp)->ult_next) {
+		if ((*tp)->ult_devfd == fd) {
+			tkt = *tp;
+			*tp = tkt->ult_next;
+			break;
+		}
+	}
+	VERIFY0(pthread_mutex_unlock(&unix_lock_mtx));
+
+	/*
+	 * Release the device before the next client is told it may take it:
+	 */
+	(void) close(fd);
+
+	if (tkt != NULL) {
+		ul_enter(tkt->ult_file);
+		ul_leave(tkt->ult_file, tkt->ult_ticket, B_FALSE);
+		ul_exit(tkt->ult_file);
+		free(tkt);
+	}
+}
+
+static void
+ul_release_all(void)
+{
+	while (unix_lock_tickets != NULL)
+		unix_close(unix_lock_tickets->ult_devfd);
+}
+
+/*
+ * Set how long, in milliseconds, to wait for the metadata device before
+ * giving up; -1 waits indefinitely.  This overrides MDATA_LOCK_TIMEOUT.
+ */
+void
+plat_set_lock_timeout(int ms)
+{
+	unix_lock_timeout_ms = ms;
+	unix_lock_timeout_set = B_TRUE;
+}
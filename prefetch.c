@@ -0,0 +1,395 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * Prefetching of the keys that are read during boot.
+ *
+ * Much the same keys are read early in every boot, in much the same order, by
+ * services that each make their own request (and, over a serial device, wait
+ * their turn to do so).  mdata-prefetch, run early in boot, opens a window of
+ * some seconds during which mdata-get records each key it reads in a history
+ * that is kept across boots.  It then fetches the keys recorded during the
+ * previous boot, over one connection, into a cache in the run directory, from
+ * which mdata-get answers for as long as the window is open.
+ *
+ * The cache holds a file for each key, named for the key in hexadecimal,
+ * whose first byte is the response to GET ("S" or "N") and the rest the
+ * value:
+ *
+ *	window		when the window opened, and its length, in ms
+ *	v.<hex key>	response to GET of the key
+ *	f.<hex key>	the key has been written or removed
+ *
+ * A key written or removed by this client is dropped from the cache, and a
+ * tombstone is left in its place before the request is sent.  A response
+ * that mdata-prefetch received before the write may still be on its way into
+ * the cache, so an entry is only ever created, never replaced, and is removed
+ * again if a tombstone is found for its key once it is in place.  Tombstones
+ * last for the rest of the boot.  A key changed in any other way may be
+ * served stale, but only until the window closes, after which every request
+ * goes to the metadata service as usual.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "dynstr.h"
+#include "fsutil.h"
+#include "keyidx.h"
+#include "prefetch.h"
+#include "proto.h"
+
+#define	PREFETCH_DIR		"prefetch"
+#define	PREFETCH_WINDOW_FILE	"window"
+#define	PREFETCH_ENTRY_PREFIX	"v."
+#define	PREFETCH_TOMB_PREFIX	"f."
+
+/*
+ * Keys are recorded in a file beside the history, which replaces it at the
+ * start of the next boot:
+ */
+#define	PREFETCH_NEW_SUFFIX	".new"
+
+#define	PREFETCH_SUCCESS	'S'
+#define	PREFETCH_NOTFOUND	'N'
+
+static long long
+prefetch_now_ms(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+
+	return ((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static const char *
+prefetch_history_path(void)
+{
+	const char *path = getenv(MDATA_PREFETCH_HISTORY_ENV);
+
+	return (path != NULL && path[0] != '\0' ? path :
+	    MDATA_PREFETCH_HISTORY_DEFAULT);
+}
+
+static int
+prefetch_path(const char *name, char *buf, size_t len)
+{
+	char rel[PATH_MAX];
+
+	if (snprintf(rel, sizeof (rel), "%s/%s", PREFETCH_DIR, name) >=
+	    (int)sizeof (rel)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	return (fs_rundir_path(rel, buf, len));
+}
+
+/*
+ * Keys too long to be named in the cache are neither cached nor recorded.
+ */
+static int
+prefetch_key_path(const char *prefix, const char *key, char *buf, size_t len)
+{
+	char hex[NAME_MAX - 1], name[NAME_MAX + 1];
+
+	if (fs_hex_name(key, hex, sizeof (hex)) != 0)
+		return (-1);
+	(void) snprintf(name, sizeof (name), "%s%s", prefix, hex);
+
+	return (prefetch_path(name, buf, len));
+}
+
+static boolean_t
+prefetch_window_open(void)
+{
+	char path[PATH_MAX];
+	string_t *str = dynstr_new();
+	boolean_t isopen = B_FALSE;
+	long long opened, now;
+	int window;
+
+	if (prefetch_path(PREFETCH_WINDOW_FILE, path, sizeof (path)) == 0 &&
+	    fs_read_file(path, str) == 0 && dynstr_len(str) > 0 &&
+	    sscanf(dynstr_cstr(str), "%lld %d", &opened, &window) == 2) {
+		now = prefetch_now_ms();
+		isopen = (now >= opened && now - opened < window);
+	}
+
+	dynstr_free(str);
+	return (isopen);
+}
+
+/*
+ * Append the key to the keys recorded during this boot.  Each is written
+ * with a single write to a file opened for appending, so that the records of
+ * concurrent processes are not interleaved.
+ */
+static void
+prefetch_record(const char *key)
+{
+	char path[PATH_MAX];
+	string_t *line;
+	int fd;
+
+	if (strchr(key, '\n') != NULL || snprintf(path, sizeof (path),
+	    "%s%s", prefetch_history_path(), PREFETCH_NEW_SUFFIX) >=
+	    (int)sizeof (path))
+		return;
+
+	if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600)) == -1)
+		return;
+
+	line = dynstr_new();
+	dynstr_append(line, key);
+	dynstr_appendc(line, '\n');
+	while (write(fd, dynstr_cstr(line), dynstr_len(line)) == -1 &&
+	    errno == EINTR)
+		continue;
+
+	dynstr_free(line);
+	(void) close(fd);
+}
+
+/*
+ * Determine the keys to prefetch, which are those recorded during the last
+ * boot in which any were, in the order in which they were first read.  The
+ * keys are appended to the string, one per line.
+ */
+int
+prefetch_history(string_t *out)
+{
+	const char *hist = prefetch_history_path();
+	char newpath[PATH_MAX], dir[PATH_MAX], *slash;
+	string_t *raw = dynstr_new();
+	boolean_t rotate = B_FALSE;
+	keyidx_t ki;
+	size_t i, j, n = 0;
+	int ret = -1;
+
+	if (snprintf(newpath, sizeof (newpath), "%s%s", hist,
+	    PREFETCH_NEW_SUFFIX) >= (int)sizeof (newpath)) {
+		errno = ENAMETOOLONG;
+		goto out;
+	}
+
+	/*
+	 * The directory is created here, as this is run before any key is
+	 * recorded.  Its parent must already exist.
+	 */
+	(void) snprintf(dir, sizeof (dir), "%s", hist);
+	if ((slash = strrchr(dir, '/')) != NULL && slash != dir) {
+		*slash = '\0';
+		(void) mkdir(dir, 0755);
+	}
+
+	if (fs_read_file(newpath, raw) == 0 && dynstr_len(raw) > 0) {
+		rotate = B_TRUE;
+	} else {
+		dynstr_reset(raw);
+		if (fs_read_file(hist, raw) != 0 && errno != ENOENT)
+			goto out;
+	}
+
+	if (keyidx_init(&ki, dynstr_len(raw) > 0 ? dynstr_cstr(raw) : "",
+	    dynstr_len(raw)) != 0)
+		goto out;
+
+	for (i = 0; i < ki.ki_count && n < PREFETCH_MAX_KEYS; i++) {
+		const keyidx_ent_t *ke = &ki.ki_ents[i];
+
+		for (j = 0; j < i; j++) {
+			if (ki.ki_ents[j].ke_len == ke->ke_len &&
+			    memcmp(ki.ki_ents[j].ke_name, ke->ke_name,
+			    ke->ke_len) == 0)
+				break;
+		}
+		if (j < i)
+			continue;
+
+		dynstr_appendn(out, ke->ke_name, ke->ke_len);
+		dynstr_appendc(out, '\n');
+		n++;
+	}
+	keyidx_fini(&ki);
+
+	/*
+	 * Keep what was recorded, without duplicates, as the history for
+	 * boots to come, and begin recording afresh:
+	 */
+	if (rotate && fs_write_atomic(hist, dynstr_len(out) > 0 ?
+	    dynstr_cstr(out) : "", dynstr_len(out), 0600) == 0)
+		(void) unlink(newpath);
+
+	ret = 0;
+
+out:
+	dynstr_free(raw);
+	return (ret);
+}
+
+/*
+ * Empty the cache, and open the window, of the given length in ms, during
+ * which it is used and keys are recorded.
+ */
+int
+prefetch_open(int window)
+{
+	char dir[PATH_MAX], path[PATH_MAX], buf[64];
+	struct dirent *de;
+	DIR *d;
+
+	if (fs_rundir_path(PREFETCH_DIR, dir, sizeof (dir)) != 0 ||
+	    (mkdir(dir, 0700) != 0 && errno != EEXIST))
+		return (-1);
+
+	if ((d = opendir(dir)) == NULL)
+		return (-1);
+	while ((de = readdir(d)) != NULL) {
+		if (strncmp(de->d_name, PREFETCH_ENTRY_PREFIX,
+		    strlen(PREFETCH_ENTRY_PREFIX)) != 0)
+			continue;
+		if (snprintf(path, sizeof (path), "%s/%s", dir, de->d_name) <
+		    (int)sizeof (path))
+			(void) unlink(path);
+	}
+	(void) closedir(d);
+
+	(void) snprintf(buf, sizeof (buf), "%lld %d\n", prefetch_now_ms(),
+	    window);
+	if (prefetch_path(PREFETCH_WINDOW_FILE, path, sizeof (path)) != 0)
+		return (-1);
+
+	return (fs_write_atomic(path, buf, strlen(buf), 0600));
+}
+
+/*
+ * Cache the response to GET of a key, which must be either MDR_SUCCESS or
+ * MDR_NOTFOUND.  Returns 1, and caches nothing, if the key has been written
+ * or removed (or already cached) since the window opened.
+ */
+int
+prefetch_store(const char *key, mdata_response_t mdr, string_t *data)
+{
+	char path[PATH_MAX], tomb[PATH_MAX];
+	string_t *str;
+	int ret;
+
+	VERIFY(mdr == MDR_SUCCESS || mdr == MDR_NOTFOUND);
+
+	if (prefetch_key_path(PREFETCH_ENTRY_PREFIX, key, path,
+	    sizeof (path)) != 0 || prefetch_key_path(PREFETCH_TOMB_PREFIX, key,
+	    tomb, sizeof (tomb)) != 0)
+		return (-1);
+
+	str = dynstr_new();
+	if (mdr == MDR_SUCCESS) {
+		dynstr_appendc(str, PREFETCH_SUCCESS);
+		if (dynstr_len(data) > 0) {
+			dynstr_appendn(str, dynstr_cstr(data),
+			    dynstr_len(data));
+		}
+	} else {
+		dynstr_appendc(str, PREFETCH_NOTFOUND);
+	}
+
+	if (access(tomb, F_OK) == 0) {
+		ret = 1;
+	} else if ((ret = fs_write_new(path, dynstr_cstr(str),
+	    dynstr_len(str), 0600)) != 0) {
+		ret = errno == EEXIST ? 1 : -1;
+	} else if (access(tomb, F_OK) == 0) {
+		/*
+		 * The key was written while we cached it.  Either we see its
+		 * tombstone now, or it was left after this entry was created,
+		 * and prefetch_forget() removes the entry:
+		 */
+		(void) unlink(path);
+		ret = 1;
+	}
+	dynstr_free(str);
+
+	return (ret);
+}
+
+/*
+ * While the window is open, record that the key was read, and return its
+ * value from the cache if it is there.  Returns -1 if the request must be
+ * made of the metadata service instead.
+ */
+int
+prefetch_lookup(const char *key, mdata_response_t *mdr, string_t **data)
+{
+	char path[PATH_MAX], tomb[PATH_MAX];
+	string_t *str;
+	const char *buf;
+	int ret = -1;
+
+	if (getenv(PREFETCH_DISABLE_ENV) != NULL ||
+	    prefetch_key_path(PREFETCH_ENTRY_PREFIX, key, path,
+	    sizeof (path)) != 0 || prefetch_key_path(PREFETCH_TOMB_PREFIX, key,
+	    tomb, sizeof (tomb)) != 0 || !prefetch_window_open())
+		return (-1);
+
+	prefetch_record(key);
+
+	str = dynstr_new();
+	if (access(tomb, F_OK) == 0 || fs_read_file(path, str) != 0 ||
+	    dynstr_len(str) < 1)
+		goto out;
+
+	buf = dynstr_cstr(str);
+	if (buf[0] != PREFETCH_SUCCESS && buf[0] != PREFETCH_NOTFOUND)
+		goto out;
+
+	*mdr = buf[0] == PREFETCH_SUCCESS ? MDR_SUCCESS : MDR_NOTFOUND;
+	*data = dynstr_new();
+	dynstr_append(*data, "");
+	dynstr_appendn(*data, buf + 1, dynstr_len(str) - 1);
+	ret = 0;
+
+out:
+	dynstr_free(str);
+	return (ret);
+}
+
+/*
+ * Drop the key from the cache, as it is about to be written or removed, and
+ * leave a tombstone so that it is not cached again.  The tombstone is left
+ * first, for the sake of prefetch_store().  The directory is created if need
+ * be, as mdata-prefetch may be about to start.
+ */
+void
+prefetch_forget(const char *key)
+{
+	char dir[PATH_MAX], path[PATH_MAX], tomb[PATH_MAX];
+	int fd;
+
+	if (prefetch_key_path(PREFETCH_ENTRY_PREFIX, key, path,
+	    sizeof (path)) != 0 || prefetch_key_path(PREFETCH_TOMB_PREFIX, key,
+	    tomb, sizeof (tomb)) != 0)
+		return;
+
+	if (fs_rundir_path(PREFETCH_DIR, dir, sizeof (dir)) == 0)
+		(void) mkdir(dir, 0700);
+	if ((fd = open(tomb, O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+	    0600)) != -1)
+		(void) close(fd);
+
+	(void) unlink(path);
+}
@@ -0,0 +1,47 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+#ifndef _PREFETCH_H
+#define	_PREFETCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dynstr.h"
+#include "proto.h"
+
+/*
+ * The keys read during each boot are recorded in a file that is kept across
+ * boots.  It may be overridden in the environment.
+ */
+#define	MDATA_PREFETCH_HISTORY_ENV	"MDATA_PREFETCH_HISTORY"
+#define	MDATA_PREFETCH_HISTORY_DEFAULT	"/var/lib/mdata-client/prefetch"
+
+/*
+ * Setting this environment variable stops mdata-get from using, or adding
+ * to, the prefetched keys:
+ */
+#define	PREFETCH_DISABLE_ENV		"MDATA_NO_PREFETCH"
+
+/*
+ * How long after mdata-prefetch runs keys are recorded and served from the
+ * cache, by default, in seconds; and the most keys that are prefetched:
+ */
+#define	PREFETCH_WINDOW_DEFAULT		60
+#define	PREFETCH_MAX_KEYS		256
+
+int prefetch_history(string_t *);
+int prefetch_open(int);
+int prefetch_store(const char *, mdata_response_t, string_t *);
+int prefetch_lookup(const char *, mdata_response_t *, string_t **);
+void prefetch_forget(const char *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PREFETCH_H */
@@ -10,16 +10,20 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "base64.h"
 #include "common.h"
 #include "crc32.h"
 #include "dynstr.h"
+#include "lz.h"
 #include "plat.h"
 #include "proto.h"
 #include "reqid.h"
@@ -35,39 +39,162 @@
  */
 #define	RECV_TIMEOUT_MS_V2	45000
 
+/*
+ * Version 3 framing; see proto_make_request_v3() for the layout.  Payloads
+ * larger than V3_CHUNK_SIZE are sent as a series of frames, and we refuse a
+ * frame from the host larger than V3_FRAME_MAX, which is most likely the
+ * result of having lost our place in the stream.
+ */
+#define	V3_HDR_LEN		16
+#define	V3_FLAG_MORE		0x01
+#define	V3_FLAG_LZ		0x02
+#define	V3_CHUNK_SIZE		(64 * 1024)
+#define	V3_FRAME_MAX		(16 * 1024 * 1024)
+
+/*
+ * Once compression has been negotiated with the host (see
+ * proto_negotiate_compress()), request payloads of at least this many bytes
+ * are compressed unless MDATA_PROTO_COMPRESS names another threshold; smaller
+ * payloads gain too little to be worth it.  A Version 2 payload that is
+ * compressed begins with V2_LZ_MARK, which is not in the BASE64 alphabet.
+ * We refuse to decompress a payload to more than PROTO_LZ_MAX bytes.
+ */
+#define	PROTO_COMPRESS_MIN	1024
+#define	PROTO_LZ_MAX		(64 * 1024 * 1024)
+#define	V2_LZ_MARK		'~'
+
+/*
+ * The most per-request arenas kept for reuse by the asynchronous engine:
+ */
+#define	PROTO_ARENA_POOL_MAX	64
+
 typedef enum mdata_proto_state {
 	MDPS_MESSAGE_HEADER = 1,
 	MDPS_MESSAGE_DATA,
 	MDPS_MESSAGE_V2,
+	MDPS_MESSAGE_V3,
 	MDPS_READY,
 	MDPS_ERROR
 } mdata_proto_state_t;
 
 typedef enum mdata_proto_version {
 	MDPV_VERSION_1 = 1,
-	MDPV_VERSION_2 = 2
+	MDPV_VERSION_2 = 2,
+	MDPV_VERSION_3 = 3
 } mdata_proto_version_t;
 
-typedef struct mdata_command {
+typedef struct mdata_command mdata_command_t;
+
+struct mdata_command {
 	char mdc_reqid[REQID_LEN];
+	arena_t *mdc_arena;
 	string_t *mdc_request;
 	string_t *mdc_response_data;
 	mdata_response_t mdc_response;
 	int mdc_done;
-} mdata_command_t;
+
+	/*
+	 * Asynchronous requests only:
+	 */
+	proto_async_cb_t *mdc_cb;
+	void *mdc_cbarg;
+	long long mdc_deadline;
+	mdata_command_t *mdc_next;
+};
 
 struct mdata_proto {
 	mdata_plat_t *mdp_plat;
 	mdata_command_t *mdp_command;
 	mdata_proto_state_t mdp_state;
 	mdata_proto_version_t mdp_version;
+	size_t mdp_compress_min;
 	boolean_t mdp_in_reset;
 	const char *mdp_errmsg;
 	const char *mdp_parse_errmsg;
+
+	/*
+	 * Asynchronous engine state.  Requests wait on the queue until the
+	 * in-flight window has room, at which point they are appended to the
+	 * transmit buffer and moved to the in-flight list.
+	 */
+	mdata_command_t *mdp_async_queue;
+	mdata_command_t **mdp_async_qtail;
+	mdata_command_t *mdp_async_inflight;
+	mdata_command_t **mdp_async_itail;
+	unsigned int mdp_async_ninflight;
+	unsigned int mdp_async_window;
+	string_t *mdp_async_tx;
+	size_t mdp_async_txoff;
+	string_t *mdp_async_rx;
+	boolean_t mdp_async_nonblock;
+	int mdp_async_oflags;
+
+	/*
+	 * Version 3 receive state, used by both the synchronous and the
+	 * asynchronous paths.  The fixed-size header of the current frame is
+	 * collected first, then its body (the response code and payload).
+	 */
+	unsigned char mdp_v3_hdr[V3_HDR_LEN];
+	size_t mdp_v3_hdrlen;
+	size_t mdp_v3_bodylen;
+	string_t *mdp_v3_body;
+
+	/*
+	 * Strings built while carrying out a synchronous request come from
+	 * mdp_arena, which is released when the request completes.  Each
+	 * asynchronous request has an arena of its own, taken from (and
+	 * returned to) the pool; the command structure itself lives there.
+	 */
+	arena_t *mdp_arena;
+	arena_t *mdp_arena_pool[PROTO_ARENA_POOL_MAX];
+	unsigned int mdp_arena_npool;
+	arena_stats_t mdp_arena_retired;
+	mdata_proto_t *mdp_stats_next;
 };
 
+/*
+ * Connections whose memory use is to be reported at exit, if they have not
+ * been closed by then; see MDATA_ARENA_STATS_ENV.
+ */
+static mdata_proto_t *proto_stats_list;
+
 static int proto_send(mdata_proto_t *mdp);
 static int proto_recv(mdata_proto_t *mdp);
+static void proto_arena_report_all(void);
+
+/*
+ * Ask a Version 2 or Version 3 host whether it will accept, and send,
+ * compressed payloads.  The request names the formats we support; a host
+ * that supports one of them answers SUCCESS, naming it, and any other answer
+ * leaves compression off.  As this costs a round trip, we only ask when
+ * MDATA_PROTO_COMPRESS is set.
+ */
+static int
+proto_negotiate_compress(mdata_proto_t *mdp)
+{
+	const char *env = getenv(MDATA_PROTO_COMPRESS_ENV);
+	mdata_response_t mdr;
+	string_t *rdata;
+	unsigned long min;
+	char *endp;
+
+	mdp->mdp_compress_min = 0;
+	if (env == NULL || mdp->mdp_version == MDPV_VERSION_1)
+		return (0);
+
+	if (proto_execute(mdp, "COMPRESS", LZ_NAME, &mdr, &rdata) != 0)
+		return (-1);
+
+	if (mdr == MDR_SUCCESS && strcmp(dynstr_cstr(rdata), LZ_NAME) == 0) {
+		errno = 0;
+		min = strtoul(env, &endp, 10);
+		mdp->mdp_compress_min = (errno != 0 || *endp != '\0' ||
+		    min == 0) ? PROTO_COMPRESS_MIN : (size_t)min;
+	}
+	dynstr_free(rdata);
+
+	return (0);
+}
 
 static int
 proto_negotiate(mdata_proto_t *mdp)
@@ -81,17 +208,39 @@ proto_negotiate(mdata_proto_t *mdp)
 	mdp->mdp_command = NULL;
 
 	/*
-	 * Assume Protocol Version 1 until we negotiate up to Version 2.
+	 * Assume Protocol Version 1, without compression, until we negotiate
+	 * up to Version 2.
 	 */
 	mdp->mdp_version = MDPV_VERSION_1;
+	mdp->mdp_compress_min = 0;
+
+	/*
+	 * Version 3 costs an extra round trip to discover on a host that
+	 * does not support it, so we only ask for it when requested.  A host
+	 * that does not understand the request answers as it would any
+	 * other unknown command, and we fall back to asking for Version 2.
+	 */
+	if (getenv(MDATA_PROTO_V3_ENV) != NULL) {
+		if (proto_execute(mdp, "NEGOTIATE", "V3", &mdr, &rdata) != 0)
+			goto out;
+		dynstr_free(rdata);
+		rdata = NULL;
+
+		if (mdr == MDR_V3_OK) {
+			mdp->mdp_version = MDPV_VERSION_3;
+			ret = proto_negotiate_compress(mdp);
+			goto out;
+		}
+	}
 
 	if (proto_execute(mdp, "NEGOTIATE", "V2", &mdr, &rdata) == 0) {
 		if (mdr == MDR_V2_OK)
 			mdp->mdp_version = MDPV_VERSION_2;
 
-		ret = 0;
+		ret = proto_negotiate_compress(mdp);
 	}
 
+out:
 	mdp->mdp_command = mdcsave;
 	if (rdata != NULL)
 		dynstr_free(rdata);
@@ -122,6 +271,12 @@ retry:
 	}
 
 	mdp->mdp_state = MDPS_READY;
+	mdp->mdp_async_nonblock = B_FALSE;
+	dynstr_reset(mdp->mdp_async_tx);
+	mdp->mdp_async_txoff = 0;
+	dynstr_reset(mdp->mdp_async_rx);
+	mdp->mdp_v3_hdrlen = 0;
+	dynstr_reset(mdp->mdp_v3_body);
 
 	/*
 	 * Initialise the platform-specific code:
@@ -148,13 +303,23 @@ retry:
 	return (0);
 }
 
+/*
+ * The longest response code we expect in a V2 frame:
+ */
+#define	V2_CODE_MAX	32
+
+/*
+ * Parse the header of a V2 frame, leaving the BASE64-encoded payload to be
+ * decoded once we know which request it belongs to.
+ */
 static int
-proto_parse_v2(mdata_proto_t *mdp, string_t *input, string_t *request_id,
-    string_t *command, string_t *response_data)
+proto_parse_v2(mdata_proto_t *mdp, string_t *input, char *request_id,
+    char *command, const char **payload)
 {
 	const char *endp = dynstr_cstr(input);
 	char *endp2;
 	unsigned long clen, crc32;
+	size_t n;
 
 	mdp->mdp_parse_errmsg = NULL;
 
@@ -206,10 +371,15 @@ proto_parse_v2(mdata_proto_t *mdp, string_t *input, string_t *request_id,
 	/*
 	 * Read Request ID:
 	 */
-	while (*endp != ' ' && *endp != '\0') {
-		dynstr_appendc(request_id, *endp++);
+	for (n = 0; *endp != ' ' && *endp != '\0'; n++) {
+		if (n == REQID_LEN - 1) {
+			mdp->mdp_parse_errmsg = "request id too long";
+			return (-1);
+		}
+		request_id[n] = *endp++;
 	}
-	if (dynstr_len(request_id) == 0) {
+	request_id[n] = '\0';
+	if (n == 0) {
 		mdp->mdp_parse_errmsg = "missing request id";
 		return (-1);
 	}
@@ -223,10 +393,15 @@ proto_parse_v2(mdata_proto_t *mdp, string_t *input, string_t *request_id,
 	/*
 	 * Read Command/Code:
 	 */
-	while (*endp != ' ' && *endp != '\0') {
-		dynstr_appendc(command, *endp++);
+	for (n = 0; *endp != ' ' && *endp != '\0'; n++) {
+		if (n == V2_CODE_MAX - 1) {
+			mdp->mdp_parse_errmsg = "command/code too long";
+			return (-1);
+		}
+		command[n] = *endp++;
 	}
-	if (dynstr_len(command) == 0) {
+	command[n] = '\0';
+	if (n == 0) {
 		mdp->mdp_parse_errmsg = "missing command/code";
 		return (-1);
 	}
@@ -238,10 +413,202 @@ proto_parse_v2(mdata_proto_t *mdp, string_t *input, string_t *request_id,
 		endp++;
 
 	/*
-	 * Read the Response Data:
+	 * The Response Data follows:
 	 */
-	if (base64_decode(endp, strlen(endp), response_data) == -1) {
-		mdp->mdp_parse_errmsg = "base64 error";
+	*payload = endp;
+
+	return (0);
+}
+
+/*
+ * Locate the outstanding request to which a V2 response frame belongs.  This
+ * is either the single synchronous request, or one of the requests in flight
+ * on the asynchronous engine.
+ */
+static mdata_command_t *
+proto_lookup(mdata_proto_t *mdp, const char *request_id)
+{
+	mdata_command_t *mdc;
+
+	if (mdp->mdp_command != NULL) {
+		if (strcmp(request_id, mdp->mdp_command->mdc_reqid) == 0)
+			return (mdp->mdp_command);
+		return (NULL);
+	}
+
+	for (mdc = mdp->mdp_async_inflight; mdc != NULL; mdc = mdc->mdc_next) {
+		if (!mdc->mdc_done && strcmp(request_id, mdc->mdc_reqid) == 0)
+			return (mdc);
+	}
+
+	return (NULL);
+}
+
+static uint32_t
+proto_get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | (uint32_t)p[3]);
+}
+
+static void
+proto_put32(unsigned char *p, uint32_t v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+/*
+ * Deliver a complete Version 3 frame, the header of which is in mdp_v3_hdr
+ * and the body of which is in mdp_v3_body, to the request it belongs to.
+ * Returns -1 if the frame is corrupt.
+ */
+static int
+proto_v3_frame(mdata_proto_t *mdp)
+{
+	const unsigned char *hdr = mdp->mdp_v3_hdr;
+	const char *body = dynstr_cstr(mdp->mdp_v3_body);
+	size_t codelen = hdr[3];
+	char reqidbuf[REQID_LEN];
+	char code[256];
+	mdata_command_t *mdc;
+
+	mdp->mdp_parse_errmsg = NULL;
+
+	if (crc32_calc(body, mdp->mdp_v3_bodylen) != proto_get32(hdr + 12)) {
+		/*
+		 * Unlike a Version 2 frame, this cannot simply be dropped:
+		 * it may be one chunk of a larger response, and the request
+		 * ID is as suspect as the rest of it.
+		 */
+		mdp->mdp_parse_errmsg = "crc32 mismatch";
+		return (-1);
+	}
+
+	(void) snprintf(reqidbuf, sizeof (reqidbuf), "%08x",
+	    (unsigned int)proto_get32(hdr + 4));
+	if ((mdc = proto_lookup(mdp, reqidbuf)) == NULL) {
+		/*
+		 * As with Version 2, drop frames that are not for an
+		 * outstanding request.
+		 */
+		return (0);
+	}
+
+	dynstr_appendn(mdc->mdc_response_data, body + codelen,
+	    mdp->mdp_v3_bodylen - codelen);
+	if (hdr[2] & V3_FLAG_MORE)
+		return (0);
+
+	if (hdr[2] & V3_FLAG_LZ) {
+		string_t *packed = dynstr_new_arena(mdc->mdc_arena);
+
+		dynstr_appendn(packed, dynstr_cstr(mdc->mdc_response_data),
+		    dynstr_len(mdc->mdc_response_data));
+		dynstr_reset(mdc->mdc_response_data);
+		if (lz_decompress(dynstr_cstr(packed), dynstr_len(packed),
+		    PROTO_LZ_MAX, mdc->mdc_response_data) != 0) {
+			mdp->mdp_parse_errmsg = "could not decompress payload";
+			return (-1);
+		}
+	}
+
+	bcopy(body, code, codelen);
+	code[codelen] = '\0';
+	if (strcmp(code, "NOTFOUND") == 0) {
+		mdc->mdc_response = MDR_NOTFOUND;
+	} else if (strcmp(code, "SUCCESS") == 0) {
+		mdc->mdc_response = MDR_SUCCESS;
+	} else {
+		mdc->mdc_response = MDR_UNKNOWN;
+	}
+	mdp->mdp_state = MDPS_READY;
+	mdc->mdc_done = 1;
+
+	return (0);
+}
+
+/*
+ * Consume bytes received from a Version 3 host, delivering each frame as it
+ * is completed.  Returns -1 if we have lost our place in the stream.
+ */
+static int
+proto_v3_input(mdata_proto_t *mdp, const char *buf, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		if (mdp->mdp_v3_hdrlen < V3_HDR_LEN) {
+			n = V3_HDR_LEN - mdp->mdp_v3_hdrlen;
+			if (n > len)
+				n = len;
+			bcopy(buf, mdp->mdp_v3_hdr + mdp->mdp_v3_hdrlen, n);
+			mdp->mdp_v3_hdrlen += n;
+			buf += n;
+			len -= n;
+
+			if (mdp->mdp_v3_hdrlen < V3_HDR_LEN)
+				return (0);
+
+			if (mdp->mdp_v3_hdr[0] != 'V' ||
+			    mdp->mdp_v3_hdr[1] != '3') {
+				mdp->mdp_parse_errmsg = "frame did not start "
+				    "with V3";
+				return (-1);
+			}
+			if (mdp->mdp_v3_hdr[3] == 0 ||
+			    proto_get32(mdp->mdp_v3_hdr + 8) > V3_FRAME_MAX) {
+				mdp->mdp_parse_errmsg = "invalid frame length";
+				return (-1);
+			}
+			mdp->mdp_v3_bodylen = mdp->mdp_v3_hdr[3] +
+			    (size_t)proto_get32(mdp->mdp_v3_hdr + 8);
+			dynstr_reset(mdp->mdp_v3_body);
+		}
+
+		n = mdp->mdp_v3_bodylen - dynstr_len(mdp->mdp_v3_body);
+		if (n > len)
+			n = len;
+		dynstr_appendn(mdp->mdp_v3_body, buf, n);
+		buf += n;
+		len -= n;
+
+		if (dynstr_len(mdp->mdp_v3_body) < mdp->mdp_v3_bodylen)
+			return (0);
+
+		mdp->mdp_v3_hdrlen = 0;
+		if (proto_v3_frame(mdp) != 0)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Decode the payload of a Version 2 response into the response buffer of the
+ * request to which it belongs.
+ */
+static int
+proto_decode_v2(mdata_proto_t *mdp, mdata_command_t *mdc, const char *payload)
+{
+	string_t *packed;
+
+	if (payload[0] != V2_LZ_MARK) {
+		if (base64_decode(payload, strlen(payload),
+		    mdc->mdc_response_data) == -1) {
+			mdp->mdp_parse_errmsg = "base64 error";
+			return (-1);
+		}
+		return (0);
+	}
+
+	packed = dynstr_new_arena(mdc->mdc_arena);
+	if (base64_decode(payload + 1, strlen(payload + 1), packed) == -1 ||
+	    lz_decompress(dynstr_cstr(packed), dynstr_len(packed),
+	    PROTO_LZ_MAX, mdc->mdc_response_data) == -1) {
+		mdp->mdp_parse_errmsg = "could not decompress payload";
 		return (-1);
 	}
 
@@ -252,47 +619,50 @@ static void
 process_input(mdata_proto_t *mdp, string_t *input)
 {
 	const char *cstr = dynstr_cstr(input);
-	string_t *command, *request_id;
+	char request_id[REQID_LEN], command[V2_CODE_MAX];
+	const char *payload;
+	mdata_command_t *mdc;
 
 	switch (mdp->mdp_state) {
 	case MDPS_MESSAGE_V2:
-		command = dynstr_new();
-		request_id = dynstr_new();
-
-		dynstr_reset(mdp->mdp_command->mdc_response_data);
-
 		if (proto_parse_v2(mdp, input, request_id, command,
-		    mdp->mdp_command->mdc_response_data) == -1) {
+		    &payload) == -1) {
 			/*
 			 * XXX Presently, drop frames that we can't
 			 * parse.
 			 */
 
-		} else if (strcmp(dynstr_cstr(request_id),
-		    mdp->mdp_command->mdc_reqid) != 0) {
+		} else if ((mdc = proto_lookup(mdp, request_id)) == NULL) {
 			/*
 			 * XXX Presently, drop frames that are not for
-			 * the currently outstanding request.
+			 * an outstanding request.
 			 */
 
-		} else if (strcmp(dynstr_cstr(command), "NOTFOUND") == 0) {
-			mdp->mdp_state = MDPS_READY;
-			mdp->mdp_command->mdc_response = MDR_NOTFOUND;
-			mdp->mdp_command->mdc_done = 1;
-
-		} else if (strcmp(dynstr_cstr(command), "SUCCESS") == 0) {
-			mdp->mdp_state = MDPS_READY;
-			mdp->mdp_command->mdc_response = MDR_SUCCESS;
-			mdp->mdp_command->mdc_done = 1;
-
 		} else {
+			/*
+			 * Decode the payload straight into the request's
+			 * response buffer:
+			 */
+			dynstr_reset(mdc->mdc_response_data);
+			if (proto_decode_v2(mdp, mdc, payload) == -1) {
+				/*
+				 * XXX As with any other frame we can't
+				 * parse, drop it.
+				 */
+				dynstr_reset(mdc->mdc_response_data);
+				break;
+			}
+
+			if (strcmp(command, "NOTFOUND") == 0) {
+				mdc->mdc_response = MDR_NOTFOUND;
+			} else if (strcmp(command, "SUCCESS") == 0) {
+				mdc->mdc_response = MDR_SUCCESS;
+			} else {
+				mdc->mdc_response = MDR_UNKNOWN;
+			}
 			mdp->mdp_state = MDPS_READY;
-			mdp->mdp_command->mdc_response = MDR_UNKNOWN;
-			mdp->mdp_command->mdc_done = 1;
+			mdc->mdc_done = 1;
 		}
-
-		dynstr_free(command);
-		dynstr_free(request_id);
 		break;
 
 	case MDPS_MESSAGE_HEADER:
@@ -310,6 +680,11 @@ process_input(mdata_proto_t *mdp, string_t *input)
 			mdp->mdp_command->mdc_response = MDR_V2_OK;
 			mdp->mdp_command->mdc_done = 1;
 
+		} else if (strcmp(cstr, "V3_OK") == 0) {
+			mdp->mdp_state = MDPS_READY;
+			mdp->mdp_command->mdc_response = MDR_V3_OK;
+			mdp->mdp_command->mdc_done = 1;
+
 		} else if (strcmp(cstr, "invalid command") == 0) {
 			mdp->mdp_state = MDPS_READY;
 			mdp->mdp_command->mdc_response = MDR_INVALID_COMMAND;
@@ -346,6 +721,32 @@ process_input(mdata_proto_t *mdp, string_t *input)
 	}
 }
 
+/*
+ * The state in which we wait for the response to a request:
+ */
+static mdata_proto_state_t
+proto_wait_state(mdata_proto_t *mdp)
+{
+	switch (mdp->mdp_version) {
+	case MDPV_VERSION_1:
+		return (MDPS_MESSAGE_HEADER);
+	case MDPV_VERSION_2:
+		return (MDPS_MESSAGE_V2);
+	case MDPV_VERSION_3:
+		return (MDPS_MESSAGE_V3);
+	default:
+		ABORT("unknown protocol version");
+		return (MDPS_ERROR);
+	}
+}
+
+static int
+proto_recv_timeout(mdata_proto_t *mdp)
+{
+	return (mdp->mdp_version == MDPV_VERSION_1 ? RECV_TIMEOUT_MS :
+	    RECV_TIMEOUT_MS_V2);
+}
+
 static int
 proto_send(mdata_proto_t *mdp)
 {
@@ -359,29 +760,69 @@ proto_send(mdata_proto_t *mdp)
 	/*
 	 * Wait for response header from remote peer:
 	 */
-	switch (mdp->mdp_version) {
-	case MDPV_VERSION_1:
-		mdp->mdp_state = MDPS_MESSAGE_HEADER;
-		break;
-	case MDPV_VERSION_2:
-		mdp->mdp_state = MDPS_MESSAGE_V2;
-		break;
-	default:
-		ABORT("unknown protocol version");
+	mdp->mdp_state = proto_wait_state(mdp);
+
+	return (0);
+}
+
+/*
+ * Version 3 frames are not lines, so we read whatever the host has sent
+ * and feed it to the frame parser until our request is complete.
+ */
+static int
+proto_recv_v3(mdata_proto_t *mdp)
+{
+	char buf[4096];
+	struct pollfd pfd;
+	ssize_t sz;
+
+	while (!mdp->mdp_command->mdc_done) {
+		pfd.fd = plat_fd(mdp->mdp_plat);
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		switch (poll(&pfd, 1, proto_recv_timeout(mdp))) {
+		case -1:
+			if (errno == EINTR)
+				continue;
+			goto bail;
+		case 0:
+			fprintf(stderr, "plat_recv timeout\n");
+			goto bail;
+		}
+
+		if ((sz = plat_read(mdp->mdp_plat, buf, sizeof (buf))) <= 0) {
+			if (sz == -1 && errno == EINTR)
+				continue;
+			goto bail;
+		}
+
+		if (proto_v3_input(mdp, buf, (size_t)sz) != 0) {
+			fprintf(stderr, "V3 framing error: %s\n",
+			    mdp->mdp_parse_errmsg);
+			goto bail;
+		}
 	}
 
 	return (0);
+
+bail:
+	mdp->mdp_state = MDPS_ERROR;
+	return (-1);
 }
 
 static int
 proto_recv(mdata_proto_t *mdp)
 {
 	int ret = -1;
-	string_t *line = dynstr_new();
+	string_t *line;
+
+	if (mdp->mdp_version == MDPV_VERSION_3)
+		return (proto_recv_v3(mdp));
 
+	line = dynstr_new_arena(mdp->mdp_arena);
 	for (;;) {
-		int recv_timeout_ms = mdp->mdp_version == MDPV_VERSION_2 ?
-		    RECV_TIMEOUT_MS_V2 : RECV_TIMEOUT_MS;
+		int recv_timeout_ms = proto_recv_timeout(mdp);
 
 		if (plat_recv(mdp->mdp_plat, line, recv_timeout_ms) == -1) {
 			mdp->mdp_state = MDPS_ERROR;
@@ -424,13 +865,16 @@ bail:
  *                                            This will be a FAILURE on a
  *                                            host that only supports the
  *                                            V1 protocol.
+ *
+ * If compression has been negotiated, a compressed payload is BASE64-encoded
+ * in the same way, and preceded by V2_LZ_MARK.
  */
 static void
-proto_make_request_v2(const char *command, const char *argument,
-    string_t *output, char *reqidbuf)
+proto_make_request_v2(const char *command, const char *argument, size_t alen,
+    boolean_t lz, string_t *output, char *reqidbuf, arena_t *arena)
 {
 	char strbuf[23 + 1 + 8 + 1]; /* strlen(UINT64_MAX) + ' ' + %08x + \0 */
-	string_t *body = dynstr_new();
+	string_t *body = dynstr_new_arena(arena);
 
 	/*
 	 * Generate the BODY of the V2 message, which is the portion we
@@ -442,7 +886,9 @@ proto_make_request_v2(const char *command, const char *argument,
 	dynstr_append(body, command);
 	if (argument != NULL) {
 		dynstr_append(body, " ");
-		base64_encode(argument, strlen(argument), body);
+		if (lz)
+			dynstr_appendc(body, V2_LZ_MARK);
+		base64_encode(argument, alen, body);
 	}
 
 	/*
@@ -457,7 +903,70 @@ proto_make_request_v2(const char *command, const char *argument,
 	dynstr_append(output, dynstr_cstr(body));
 	dynstr_append(output, "\n");
 
-	dynstr_free(body);
+}
+
+/*
+ * Version 3 of the Metadata Protocol is a binary framed protocol.  Payloads
+ * are carried as they are, rather than BASE64-encoded, and are delimited by
+ * length rather than by a linefeed.  Each frame is a fixed-size header
+ * followed by a body, with all integers in network byte order:
+ *
+ *    0      2      3      4             8             12            16
+ *   +------+------+------+-------------+-------------+-------------+
+ *   | "V3" | flag | clen | request ID  | payload len | CRC32       |
+ *   +------+------+------+-------------+-------------+-------------+
+ *   | request command or response code (clen bytes) | payload ... |
+ *   +-----------------------------------------------+-------------+
+ *
+ * The CRC32 covers the body: the command (or code) and the payload.  A
+ * payload of more than V3_CHUNK_SIZE bytes is split across several frames
+ * with the same request ID and command, each but the last of which has the
+ * V3_FLAG_MORE flag set; the host may do the same for a large response.
+ * Frames for different requests may be interleaved, so any number of
+ * requests may be in flight at once.  If compression has been negotiated,
+ * each frame of a compressed payload has the V3_FLAG_LZ flag set, and the
+ * payload is decompressed once all of its frames have arrived.
+ *
+ * Version 3 is negotiated with a "NEGOTIATE V3" request, to which a host
+ * that supports it answers "V3_OK".
+ */
+static void
+proto_make_request_v3(const char *command, const char *argument, size_t alen,
+    boolean_t lz, string_t *output, char *reqidbuf)
+{
+	unsigned char hdr[V3_HDR_LEN];
+	size_t clen = strlen(command);
+	size_t off = 0;
+	uint32_t crc, id;
+
+	VERIFY(clen > 0 && clen <= 255);
+
+	id = (uint32_t)strtoul(reqid(reqidbuf), NULL, 16);
+
+	do {
+		size_t n = alen - off > V3_CHUNK_SIZE ? V3_CHUNK_SIZE :
+		    alen - off;
+
+		crc = crc32_calc(command, clen);
+		if (n > 0)
+			crc = crc32_update(crc, argument + off, n);
+
+		hdr[0] = 'V';
+		hdr[1] = '3';
+		hdr[2] = off + n < alen ? V3_FLAG_MORE : 0;
+		if (lz)
+			hdr[2] |= V3_FLAG_LZ;
+		hdr[3] = (unsigned char)clen;
+		proto_put32(hdr + 4, id);
+		proto_put32(hdr + 8, (uint32_t)n);
+		proto_put32(hdr + 12, crc);
+
+		dynstr_appendn(output, (const char *)hdr, sizeof (hdr));
+		dynstr_appendn(output, command, clen);
+		if (n > 0)
+			dynstr_appendn(output, argument + off, n);
+		off += n;
+	} while (off < alen);
 }
 
 static void
@@ -472,17 +981,100 @@ proto_make_request_v1(const char *command, const char *argument,
 	dynstr_append(output, "\n");
 }
 
+static void
+proto_make_request(mdata_proto_t *mdp, mdata_command_t *mdc,
+    const char *command, const char *argument)
+{
+	size_t alen = argument != NULL ? strlen(argument) : 0;
+	boolean_t lz = B_FALSE;
+
+	/*
+	 * Compress a large payload, unless that would not make it smaller:
+	 */
+	if (mdp->mdp_compress_min > 0 && alen >= mdp->mdp_compress_min &&
+	    mdp->mdp_version != MDPV_VERSION_1) {
+		string_t *packed = dynstr_new_arena(mdc->mdc_arena);
+
+		if (lz_compress(argument, alen, packed) == 0 &&
+		    dynstr_len(packed) < alen) {
+			argument = dynstr_cstr(packed);
+			alen = dynstr_len(packed);
+			lz = B_TRUE;
+		}
+	}
+
+	dynstr_reset(mdc->mdc_request);
+	switch (mdp->mdp_version) {
+	case MDPV_VERSION_1:
+		proto_make_request_v1(command, argument, mdc->mdc_request);
+		break;
+	case MDPV_VERSION_2:
+		proto_make_request_v2(command, argument, alen, lz,
+		    mdc->mdc_request, mdc->mdc_reqid, mdc->mdc_arena);
+		break;
+	case MDPV_VERSION_3:
+		proto_make_request_v3(command, argument, alen, lz,
+		    mdc->mdc_request, mdc->mdc_reqid);
+		break;
+	default:
+		ABORT("unknown protocol version");
+	}
+}
+
+/*
+ * Switch the connection between blocking I/O, as used by proto_execute(),
+ * and non-blocking I/O, as used by the asynchronous engine.  The original
+ * descriptor flags are restored when leaving non-blocking mode.
+ */
+static int
+proto_set_nonblock(mdata_proto_t *mdp, boolean_t on)
+{
+	int fd, flags;
+
+	if (mdp->mdp_async_nonblock == on || mdp->mdp_plat == NULL)
+		return (0);
+
+	fd = plat_fd(mdp->mdp_plat);
+	if (on) {
+		if ((flags = fcntl(fd, F_GETFL)) == -1)
+			return (-1);
+		mdp->mdp_async_oflags = flags;
+		flags |= O_NONBLOCK;
+	} else {
+		flags = mdp->mdp_async_oflags;
+	}
+
+	if (fcntl(fd, F_SETFL, flags) == -1)
+		return (-1);
+
+	mdp->mdp_async_nonblock = on;
+	return (0);
+}
+
 int
 proto_execute(mdata_proto_t *mdp, const char *command, const char *argument,
     mdata_response_t *response, string_t **response_data)
 {
 	mdata_command_t mdc;
+	size_t mark = arena_mark(mdp->mdp_arena);
+
+	/*
+	 * Synchronous requests may not be mixed with outstanding
+	 * asynchronous requests:
+	 */
+	VERIFY0(mdp->mdp_async_queue);
+	VERIFY0(mdp->mdp_async_inflight);
+	(void) proto_set_nonblock(mdp, B_FALSE);
 
 	/*
-	 * Initialise new command structure:
+	 * Initialise new command structure.  Everything but the response,
+	 * which is handed to the caller, comes from the arena.  As a reset
+	 * can run a request of its own while this one is outstanding, we
+	 * release the arena only to where it was when we started:
 	 */
 	bzero(&mdc, sizeof (mdc));
-	mdc.mdc_request = dynstr_new();
+	mdc.mdc_arena = mdp->mdp_arena;
+	mdc.mdc_request = dynstr_new_arena(mdc.mdc_arena);
 	mdc.mdc_response_data = dynstr_new();
 	mdc.mdc_response = MDR_PENDING;
 	mdc.mdc_done = 0;
@@ -494,18 +1086,7 @@ retry:
 	/*
 	 * (Re-)generate request string to send to remote peer:
 	 */
-	dynstr_reset(mdc.mdc_request);
-	switch (mdp->mdp_version) {
-	case MDPV_VERSION_1:
-		proto_make_request_v1(command, argument, mdc.mdc_request);
-		break;
-	case MDPV_VERSION_2:
-		proto_make_request_v2(command, argument, mdc.mdc_request,
-		    mdc.mdc_reqid);
-		break;
-	default:
-		ABORT("unknown protocol version");
-	}
+	proto_make_request(mdp, &mdc, command, argument);
 
 	/*
 	 * Attempt to send the request to the remote peer:
@@ -557,17 +1138,405 @@ retry:
 	 */
 	*response = mdc.mdc_response;
 	*response_data = mdc.mdc_response_data;
-	dynstr_free(mdc.mdc_request);
 	mdp->mdp_command = NULL;
+	arena_release(mdp->mdp_arena, mark);
 	return (0);
 
 bail:
-	dynstr_free(mdc.mdc_request);
 	dynstr_free(mdc.mdc_response_data);
 	mdp->mdp_command = NULL;
+	arena_release(mdp->mdp_arena, mark);
 	return (-1);
 }
 
+static long long
+proto_now_ms(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+
+	return ((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static unsigned int
+proto_async_window(mdata_proto_t *mdp)
+{
+	/*
+	 * Version 1 responses carry no request ID, so only one request may
+	 * be in flight at a time.
+	 */
+	if (mdp->mdp_version == MDPV_VERSION_1)
+		return (1);
+
+	return (mdp->mdp_async_window);
+}
+
+/*
+ * Take an arena for a new asynchronous request from the pool.
+ */
+static arena_t *
+proto_arena_get(mdata_proto_t *mdp)
+{
+	if (mdp->mdp_arena_npool == 0)
+		return (arena_new());
+
+	return (mdp->mdp_arena_pool[--mdp->mdp_arena_npool]);
+}
+
+static void
+proto_async_free(mdata_proto_t *mdp, mdata_command_t *mdc)
+{
+	arena_t *a = mdc->mdc_arena;
+	arena_stats_t stats;
+
+	/*
+	 * The command, its request and its response all live in the arena,
+	 * so there is nothing to free individually.  Keep the arena for the
+	 * next request, unless we already have plenty.
+	 */
+	arena_release(a, 0);
+	if (mdp->mdp_arena_npool >= PROTO_ARENA_POOL_MAX) {
+		arena_stats(a, &stats);
+		stats.as_reserved = 0;
+		arena_stats_add(&mdp->mdp_arena_retired, &stats);
+		arena_free(a);
+		return;
+	}
+
+	mdp->mdp_arena_pool[mdp->mdp_arena_npool++] = a;
+}
+
+/*
+ * Run the completion callback for, and free, every request on a list that
+ * has already been detached from the engine.
+ */
+static void
+proto_async_callback(mdata_proto_t *mdp, mdata_command_t *list, int err)
+{
+	mdata_command_t *mdc;
+
+	while ((mdc = list) != NULL) {
+		list = mdc->mdc_next;
+
+		if (err != 0) {
+			dynstr_reset(mdc->mdc_response_data);
+			mdc->mdc_response = MDR_UNKNOWN;
+		}
+		mdc->mdc_cb(mdp, err, mdc->mdc_response,
+		    mdc->mdc_response_data, mdc->mdc_cbarg);
+		proto_async_free(mdp, mdc);
+	}
+}
+
+/*
+ * Fail every queued and in-flight asynchronous request.  The connection is
+ * left in the error state until proto_async_reset() is called.
+ */
+static void
+proto_async_fail(mdata_proto_t *mdp)
+{
+	mdata_command_t *list = mdp->mdp_async_inflight;
+
+	*mdp->mdp_async_itail = mdp->mdp_async_queue;
+
+	mdp->mdp_async_inflight = NULL;
+	mdp->mdp_async_itail = &mdp->mdp_async_inflight;
+	mdp->mdp_async_ninflight = 0;
+	mdp->mdp_async_queue = NULL;
+	mdp->mdp_async_qtail = &mdp->mdp_async_queue;
+	dynstr_reset(mdp->mdp_async_tx);
+	mdp->mdp_async_txoff = 0;
+	dynstr_reset(mdp->mdp_async_rx);
+	mdp->mdp_v3_hdrlen = 0;
+	dynstr_reset(mdp->mdp_v3_body);
+
+	mdp->mdp_state = MDPS_ERROR;
+
+	proto_async_callback(mdp, list, -1);
+}
+
+/*
+ * Detach every completed request from the in-flight list, then run their
+ * callbacks.  Callbacks may submit further requests.
+ */
+static void
+proto_async_complete(mdata_proto_t *mdp)
+{
+	mdata_command_t **mdcp = &mdp->mdp_async_inflight;
+	mdata_command_t *done = NULL, **donetail = &done;
+	mdata_command_t *mdc;
+
+	while ((mdc = *mdcp) != NULL) {
+		if (!mdc->mdc_done) {
+			mdcp = &mdc->mdc_next;
+			continue;
+		}
+
+		*mdcp = mdc->mdc_next;
+		mdc->mdc_next = NULL;
+		*donetail = mdc;
+		donetail = &mdc->mdc_next;
+		mdp->mdp_async_ninflight--;
+	}
+	mdp->mdp_async_itail = mdcp;
+
+	if (done != NULL && mdp->mdp_async_ninflight > 0)
+		mdp->mdp_state = proto_wait_state(mdp);
+
+	proto_async_callback(mdp, done, 0);
+}
+
+/*
+ * Move queued requests into flight, for as long as the window allows.
+ */
+static void
+proto_async_fill(mdata_proto_t *mdp)
+{
+	mdata_command_t *mdc;
+	long long timeout_ms = proto_recv_timeout(mdp);
+
+	while ((mdc = mdp->mdp_async_queue) != NULL &&
+	    mdp->mdp_async_ninflight < proto_async_window(mdp)) {
+		if ((mdp->mdp_async_queue = mdc->mdc_next) == NULL)
+			mdp->mdp_async_qtail = &mdp->mdp_async_queue;
+		mdc->mdc_next = NULL;
+
+		dynstr_appendn(mdp->mdp_async_tx, dynstr_cstr(mdc->mdc_request),
+		    dynstr_len(mdc->mdc_request));
+		mdc->mdc_deadline = proto_now_ms() + timeout_ms;
+
+		*mdp->mdp_async_itail = mdc;
+		mdp->mdp_async_itail = &mdc->mdc_next;
+		mdp->mdp_async_ninflight++;
+
+		mdp->mdp_state = proto_wait_state(mdp);
+	}
+}
+
+static void
+proto_async_input(mdata_proto_t *mdp, const char *buf, size_t len)
+{
+	const char *nl;
+
+	if (mdp->mdp_version == MDPV_VERSION_3) {
+		if (proto_v3_input(mdp, buf, len) != 0) {
+			proto_async_fail(mdp);
+			return;
+		}
+		proto_async_complete(mdp);
+		return;
+	}
+
+	while (len > 0) {
+		if ((nl = memchr(buf, '\n', len)) == NULL) {
+			dynstr_appendn(mdp->mdp_async_rx, buf, len);
+			return;
+		}
+
+		dynstr_appendn(mdp->mdp_async_rx, buf, (size_t)(nl - buf));
+		len -= (size_t)(nl - buf) + 1;
+		buf = nl + 1;
+
+		/*
+		 * Version 1 responses belong to the oldest (and only)
+		 * request in flight; Version 2 responses are matched by
+		 * request ID.
+		 */
+		mdp->mdp_command = mdp->mdp_version == MDPV_VERSION_1 ?
+		    mdp->mdp_async_inflight : NULL;
+		if (mdp->mdp_command != NULL || mdp->mdp_version ==
+		    MDPV_VERSION_2)
+			process_input(mdp, mdp->mdp_async_rx);
+		mdp->mdp_command = NULL;
+		dynstr_reset(mdp->mdp_async_rx);
+
+		proto_async_complete(mdp);
+	}
+}
+
+int
+proto_async_fd(mdata_proto_t *mdp)
+{
+	return (plat_fd(mdp->mdp_plat));
+}
+
+int
+proto_async_events(mdata_proto_t *mdp)
+{
+	int events = 0;
+
+	if (mdp->mdp_state == MDPS_ERROR)
+		return (0);
+
+	if (mdp->mdp_async_ninflight > 0)
+		events |= PROTO_EV_READ;
+	if (mdp->mdp_async_txoff < dynstr_len(mdp->mdp_async_tx) ||
+	    (mdp->mdp_async_queue != NULL &&
+	    mdp->mdp_async_ninflight < proto_async_window(mdp)))
+		events |= PROTO_EV_WRITE;
+
+	return (events);
+}
+
+/*
+ * Returns the number of milliseconds until the oldest in-flight request
+ * times out, suitable for passing to poll(2), or -1 if nothing is in flight.
+ */
+int
+proto_async_timeout(mdata_proto_t *mdp)
+{
+	long long now;
+
+	if (mdp->mdp_async_inflight == NULL)
+		return (-1);
+
+	now = proto_now_ms();
+	if (mdp->mdp_async_inflight->mdc_deadline <= now)
+		return (0);
+
+	return ((int)(mdp->mdp_async_inflight->mdc_deadline - now));
+}
+
+/*
+ * Set the number of Version 2 requests that may be in flight at once.
+ */
+void
+proto_async_set_window(mdata_proto_t *mdp, unsigned int window)
+{
+	mdp->mdp_async_window = window > 0 ? window : 1;
+}
+
+int
+proto_async_submit(mdata_proto_t *mdp, const char *command,
+    const char *argument, proto_async_cb_t *cb, void *arg)
+{
+	mdata_command_t *mdc;
+	arena_t *a;
+
+	VERIFY(cb != NULL);
+
+	if (mdp->mdp_state == MDPS_ERROR ||
+	    proto_set_nonblock(mdp, B_TRUE) != 0)
+		return (-1);
+
+	a = proto_arena_get(mdp);
+	mdc = arena_zalloc(a, sizeof (*mdc));
+	mdc->mdc_arena = a;
+	mdc->mdc_request = dynstr_new_arena(a);
+	mdc->mdc_response_data = dynstr_new_arena(a);
+	mdc->mdc_response = MDR_PENDING;
+	mdc->mdc_cb = cb;
+	mdc->mdc_cbarg = arg;
+
+	proto_make_request(mdp, mdc, command, argument);
+
+	*mdp->mdp_async_qtail = mdc;
+	mdp->mdp_async_qtail = &mdc->mdc_next;
+
+	return (0);
+}
+
+int
+proto_async_process_readable(mdata_proto_t *mdp)
+{
+	char buf[4096];
+	ssize_t sz;
+	boolean_t first = B_TRUE;
+
+	if (mdp->mdp_state == MDPS_ERROR)
+		return (-1);
+
+	for (;;) {
+		if ((sz = plat_read(mdp->mdp_plat, buf, sizeof (buf))) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			proto_async_fail(mdp);
+			return (-1);
+		}
+
+		if (sz == 0) {
+			/*
+			 * A descriptor that polls readable but yields no
+			 * data has been hung up.
+			 */
+			if (first) {
+				proto_async_fail(mdp);
+				return (-1);
+			}
+			break;
+		}
+		first = B_FALSE;
+
+		proto_async_input(mdp, buf, (size_t)sz);
+		if (mdp->mdp_state == MDPS_ERROR)
+			return (-1);
+	}
+
+	return (0);
+}
+
+int
+proto_async_process_writable(mdata_proto_t *mdp)
+{
+	ssize_t sz;
+
+	if (mdp->mdp_state == MDPS_ERROR)
+		return (-1);
+
+	proto_async_fill(mdp);
+
+	while (mdp->mdp_async_txoff < dynstr_len(mdp->mdp_async_tx)) {
+		if ((sz = plat_write(mdp->mdp_plat,
+		    dynstr_cstr(mdp->mdp_async_tx) + mdp->mdp_async_txoff,
+		    dynstr_len(mdp->mdp_async_tx) - mdp->mdp_async_txoff)) ==
+		    -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return (0);
+			proto_async_fail(mdp);
+			return (-1);
+		}
+		mdp->mdp_async_txoff += (size_t)sz;
+	}
+
+	dynstr_reset(mdp->mdp_async_tx);
+	mdp->mdp_async_txoff = 0;
+
+	return (0);
+}
+
+/*
+ * Fail all outstanding requests if the oldest in-flight request has been
+ * waiting for longer than the receive timeout.
+ */
+int
+proto_async_process_timeout(mdata_proto_t *mdp)
+{
+	if (mdp->mdp_async_inflight != NULL && proto_async_timeout(mdp) == 0) {
+		proto_async_fail(mdp);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Fail any outstanding requests and re-establish the connection to the
+ * host.  This blocks in the same way as proto_init(), and the caller must
+ * obtain a new descriptor with proto_async_fd() afterwards.
+ */
+int
+proto_async_reset(mdata_proto_t *mdp)
+{
+	proto_async_fail(mdp);
+
+	return (proto_reset(mdp));
+}
+
 int
 proto_version(mdata_proto_t *mdp)
 {
@@ -584,13 +1553,109 @@ proto_init(mdata_proto_t **out, const char **errmsg)
 	if ((mdp = calloc(1, sizeof (*mdp))) == NULL)
 		return (-1);
 
+	mdp->mdp_async_qtail = &mdp->mdp_async_queue;
+	mdp->mdp_async_itail = &mdp->mdp_async_inflight;
+	mdp->mdp_async_window = 1;
+	mdp->mdp_async_tx = dynstr_new();
+	mdp->mdp_async_rx = dynstr_new();
+	mdp->mdp_v3_body = dynstr_new();
+	mdp->mdp_arena = arena_new();
+
 	if (proto_reset(mdp) == -1) {
 		*errmsg = mdp->mdp_errmsg;
+		dynstr_free(mdp->mdp_async_tx);
+		dynstr_free(mdp->mdp_async_rx);
+		dynstr_free(mdp->mdp_v3_body);
+		arena_free(mdp->mdp_arena);
 		free(mdp);
 		return (-1);
 	}
 
+	if (getenv(MDATA_ARENA_STATS_ENV) != NULL) {
+		static boolean_t registered = B_FALSE;
+
+		if (!registered && atexit(proto_arena_report_all) == 0)
+			registered = B_TRUE;
+		mdp->mdp_stats_next = proto_stats_list;
+		proto_stats_list = mdp;
+	}
+
 	*out = mdp;
 
 	return (0);
 }
+
+/*
+ * Report on the memory used by the requests made on this connection, across
+ * the synchronous arena and every asynchronous request arena.
+ */
+void
+proto_arena_stats(mdata_proto_t *mdp, arena_stats_t *total)
+{
+	arena_stats_t stats;
+	unsigned int i;
+
+	*total = mdp->mdp_arena_retired;
+
+	arena_stats(mdp->mdp_arena, &stats);
+	arena_stats_add(total, &stats);
+	for (i = 0; i < mdp->mdp_arena_npool; i++) {
+		arena_stats(mdp->mdp_arena_pool[i], &stats);
+		arena_stats_add(total, &stats);
+	}
+}
+
+static void
+proto_arena_report(mdata_proto_t *mdp)
+{
+	mdata_proto_t **mdpp;
+	arena_stats_t stats;
+
+	for (mdpp = &proto_stats_list; *mdpp != NULL;
+	    mdpp = &(*mdpp)->mdp_stats_next) {
+		if (*mdpp == mdp)
+			break;
+	}
+	if (*mdpp == NULL)
+		return;
+	*mdpp = mdp->mdp_stats_next;
+
+	proto_arena_stats(mdp, &stats);
+	(void) fprintf(stderr, "mdata: arena: %llu requests, peak %llu "
+	    "bytes per request, mean peak %llu bytes, %llu heap "
+	    "allocations, %llu bytes reserved\n",
+	    (unsigned long long)stats.as_requests,
+	    (unsigned long long)stats.as_peak_max,
+	    (unsigned long long)(stats.as_requests > 0 ?
+	    stats.as_peak_total / stats.as_requests : 0),
+	    (unsigned long long)stats.as_heap_allocs,
+	    (unsigned long long)stats.as_reserved);
+}
+
+static void
+proto_arena_report_all(void)
+{
+	while (proto_stats_list != NULL)
+		proto_arena_report(proto_stats_list);
+}
+
+void
+proto_fini(mdata_proto_t *mdp)
+{
+	unsigned int i;
+
+	if (mdp == NULL)
+		return;
+
+	proto_async_fail(mdp);
+	proto_arena_report(mdp);
+
+	plat_fini(mdp->mdp_plat);
+	dynstr_free(mdp->mdp_async_tx);
+	dynstr_free(mdp->mdp_async_rx);
+	dynstr_free(mdp->mdp_v3_body);
+	arena_free(mdp->mdp_arena);
+	for (i = 0; i < mdp->mdp_arena_npool; i++)
+		arena_free(mdp->mdp_arena_pool[i]);
+	free(mdp);
+}
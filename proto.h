@@ -16,16 +16,62 @@ typedef enum mdata_response {
 	MDR_SUCCESS,
 	MDR_INVALID_COMMAND,
 	MDR_PENDING,
-	MDR_V2_OK
+	MDR_V2_OK,
+	MDR_V3_OK
 } mdata_response_t;
 
+/*
+ * Set in the environment to ask the host for Version 3 of the protocol,
+ * which carries payloads as binary rather than BASE64-encoded text:
+ */
+#define	MDATA_PROTO_V3_ENV	"MDATA_PROTO_V3"
+
+/*
+ * Set in the environment to ask a Version 2 or Version 3 host to exchange
+ * large payloads compressed.  If set to a number, payloads of fewer bytes
+ * are sent as they are:
+ */
+#define	MDATA_PROTO_COMPRESS_ENV	"MDATA_PROTO_COMPRESS"
+
+/*
+ * Set in the environment to report, on stderr, the memory used by requests
+ * when a connection is closed:
+ */
+#define	MDATA_ARENA_STATS_ENV	"MDATA_ARENA_STATS"
+
 typedef struct mdata_proto mdata_proto_t;
 
 int proto_init(mdata_proto_t **, const char **);
+void proto_fini(mdata_proto_t *);
 int proto_version(mdata_proto_t *);
+void proto_arena_stats(mdata_proto_t *, arena_stats_t *);
 int proto_execute(mdata_proto_t *, const char *, const char *, mdata_response_t *,
     string_t **);
 
+/*
+ * Asynchronous (event loop driven) interface.  The caller polls the
+ * descriptor returned by proto_async_fd() for the events requested by
+ * proto_async_events(), and calls the matching process routine when the
+ * descriptor becomes ready.  Each submitted request completes through its
+ * callback; the response data is only valid for the duration of the call.
+ */
+#define	PROTO_EV_READ	0x1
+#define	PROTO_EV_WRITE	0x2
+
+typedef void proto_async_cb_t(mdata_proto_t *, int, mdata_response_t,
+    string_t *, void *);
+
+int proto_async_fd(mdata_proto_t *);
+int proto_async_events(mdata_proto_t *);
+int proto_async_timeout(mdata_proto_t *);
+void proto_async_set_window(mdata_proto_t *, unsigned int);
+int proto_async_submit(mdata_proto_t *, const char *, const char *,
+    proto_async_cb_t *, void *);
+int proto_async_process_readable(mdata_proto_t *);
+int proto_async_process_writable(mdata_proto_t *);
+int proto_async_process_timeout(mdata_proto_t *);
+int proto_async_reset(mdata_proto_t *);
+
 #ifdef __cplusplus
 }
 #endif
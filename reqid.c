@@ -20,6 +20,13 @@
 
 static int urandom_fd = -1;
 
+/*
+ * Request IDs to be handed out before any random ones, if set by
+ * reqid_replay():
+ */
+static const char *const *replay_ids = NULL;
+static size_t replay_nids = 0;
+
 char *
 reqid(char *buf)
 {
@@ -29,6 +36,13 @@ reqid(char *buf)
 
 	VERIFY(buf != NULL);
 
+	if (replay_nids > 0) {
+		(void) snprintf(buf, REQID_LEN, "%s", *replay_ids);
+		replay_ids++;
+		replay_nids--;
+		return (buf);
+	}
+
 	/*
 	 * If we were able to open it, try and read a random request ID
 	 * from /dev/urandom:
@@ -55,6 +69,19 @@ out:
 	return (buf);
 }
 
+/*
+ * Have reqid() return the given request IDs, in order, before it goes back to
+ * making random ones.  This is for mdata-replay, which must make the same
+ * requests as were recorded in a trace; the IDs must remain valid until they
+ * have all been used.
+ */
+void
+reqid_replay(const char *const *ids, size_t nids)
+{
+	replay_ids = ids;
+	replay_nids = nids;
+}
+
 int
 reqid_init(void)
 {
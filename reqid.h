@@ -10,11 +10,14 @@
 extern "C" {
 #endif
 
+#include <sys/types.h>
+
 #define	REQID_LEN	9
 
 int reqid_init(void);
 void reqid_fini(void);
 char * reqid(char *buf);
+void reqid_replay(const char *const *, size_t);
 
 #ifdef __cplusplus
 }
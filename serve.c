@@ -0,0 +1,239 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * Serve requests read from a stream over a single connection to the metadata
+ * service, so that a shell script that runs us as a coprocess can make any
+ * number of requests for the cost of one process, one acquisition of the
+ * device lock and one negotiation.
+ *
+ * Each request is a command followed by its arguments, and each response a
+ * status followed by its data, with every field terminated by a NUL byte:
+ *
+ *   GET <key>                  SUCCESS <value>
+ *   KEYS                       NOTFOUND <empty>
+ *   PUT <key> <value>          FAILURE <message>
+ *   DELETE <key>
+ *
+ * Requests are served one at a time, in the order in which they arrive, and
+ * each response is flushed as soon as it is complete.  The connection is made
+ * when the first request arrives (so that an idle coprocess does not hold the
+ * device) and is made again if a request cannot be completed; it is closed at
+ * end of input.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "base64.h"
+#include "common.h"
+#include "dynstr.h"
+#include "prefetch.h"
+#include "proto.h"
+#include "serve.h"
+#include "spool.h"
+
+#define	SERVE_MAX_ARGS	2
+
+typedef struct serve_cmd {
+	const char *sc_name;
+	unsigned int sc_nargs;
+	boolean_t sc_needs_v2;
+} serve_cmd_t;
+
+static const serve_cmd_t serve_cmds[] = {
+	{ "GET",	1,	B_FALSE },
+	{ "KEYS",	0,	B_FALSE },
+	{ "PUT",	2,	B_TRUE },
+	{ "DELETE",	1,	B_TRUE },
+	{ NULL,		0,	B_FALSE }
+};
+
+typedef struct serve_field {
+	char *sf_buf;
+	size_t sf_size;
+	size_t sf_len;
+} serve_field_t;
+
+/*
+ * Read one NUL-terminated field.  The last field of the input may instead be
+ * ended by the end of the input.  Returns -1 at the end of the input.
+ */
+static int
+serve_read(FILE *in, serve_field_t *sf)
+{
+	ssize_t n;
+
+	if ((n = getdelim(&sf->sf_buf, &sf->sf_size, '\0', in)) <= 0)
+		return (-1);
+
+	sf->sf_len = (size_t)n;
+	if (sf->sf_buf[sf->sf_len - 1] == '\0')
+		sf->sf_len--;
+	sf->sf_buf[sf->sf_len] = '\0';
+
+	return (0);
+}
+
+static int
+serve_reply(FILE *out, const char *status, const char *data, size_t len)
+{
+	(void) fputs(status, out);
+	(void) fputc('\0', out);
+	(void) fwrite(data, 1, len, out);
+	(void) fputc('\0', out);
+
+	return (fflush(out) == 0 ? 0 : -1);
+}
+
+static int
+serve_reply_msg(FILE *out, const char *fmt, const char *arg)
+{
+	char msg[256];
+
+	(void) snprintf(msg, sizeof (msg), fmt, arg);
+
+	return (serve_reply(out, SERVE_FAILURE, msg, strlen(msg)));
+}
+
+/*
+ * Make one request, and write the response.  If the request could not be
+ * completed, the connection is closed, to be made again for the next.
+ */
+static int
+serve_one(FILE *out, mdata_proto_t **mdpp, const serve_cmd_t *sc,
+    serve_field_t *args)
+{
+	mdata_response_t mdr;
+	string_t *data = NULL, *req = NULL;
+	const char *errmsg = NULL, *argument = NULL;
+	int ret;
+
+	if (*mdpp == NULL && proto_init(mdpp, &errmsg) != 0) {
+		*mdpp = NULL;
+		return (serve_reply_msg(out, "could not initialise protocol: "
+		    "%s", errmsg));
+	}
+
+	if (sc->sc_needs_v2 && proto_version(*mdpp) < 2)
+		return (serve_reply_msg(out, "host does not support %s",
+		    sc->sc_name));
+
+	/*
+	 * Any prefetched value of a key that is written or removed is about to
+	 * be out of date, and a write that is still spooled for it is older
+	 * than this request, and must not be sent after it:
+	 */
+	if (sc->sc_needs_v2) {
+		prefetch_forget(args[0].sf_buf);
+		spool_discard(args[0].sf_buf);
+	}
+
+	if (strcmp(sc->sc_name, "PUT") == 0) {
+		req = dynstr_new();
+		base64_encode(args[0].sf_buf, args[0].sf_len, req);
+		dynstr_appendc(req, ' ');
+		base64_encode(args[1].sf_buf, args[1].sf_len, req);
+		argument = dynstr_cstr(req);
+	} else if (sc->sc_nargs > 0) {
+		argument = args[0].sf_buf;
+	}
+
+	if (proto_execute(*mdpp, sc->sc_name, argument, &mdr, &data) != 0) {
+		proto_fini(*mdpp);
+		*mdpp = NULL;
+		if (req != NULL)
+			dynstr_free(req);
+		return (serve_reply_msg(out, "could not execute %s",
+		    sc->sc_name));
+	}
+	if (req != NULL)
+		dynstr_free(req);
+
+	switch (mdr) {
+	case MDR_SUCCESS:
+		ret = serve_reply(out, SERVE_SUCCESS, dynstr_len(data) > 0 ?
+		    dynstr_cstr(data) : "", dynstr_len(data));
+		break;
+	case MDR_NOTFOUND:
+		ret = serve_reply(out, SERVE_NOTFOUND, "", 0);
+		break;
+	case MDR_UNKNOWN:
+		ret = serve_reply(out, SERVE_FAILURE, dynstr_len(data) > 0 ?
+		    dynstr_cstr(data) : "", dynstr_len(data));
+		break;
+	case MDR_INVALID_COMMAND:
+		ret = serve_reply_msg(out, "host does not support %s",
+		    sc->sc_name);
+		break;
+	default:
+		ABORT("serve_one: UNKNOWN RESPONSE\n");
+		ret = -1;
+	}
+	dynstr_free(data);
+
+	return (ret);
+}
+
+/*
+ * Serve requests from "in" until the end of the input, writing responses to
+ * "out".  Returns -1 if the input ended part way through a request, or the
+ * responses could not be written.
+ */
+int
+serve_run(FILE *in, FILE *out)
+{
+	mdata_proto_t *mdp = NULL;
+	serve_field_t name, args[SERVE_MAX_ARGS];
+	const serve_cmd_t *sc;
+	unsigned int i;
+	int ret = 0;
+
+	bzero(&name, sizeof (name));
+	bzero(args, sizeof (args));
+
+	while (ret == 0 && serve_read(in, &name) == 0) {
+		for (sc = serve_cmds; sc->sc_name != NULL; sc++) {
+			if (strcasecmp(sc->sc_name, name.sf_buf) == 0)
+				break;
+		}
+		if (sc->sc_name == NULL) {
+			ret = serve_reply_msg(out, "unknown command '%s'",
+			    name.sf_buf);
+			continue;
+		}
+
+		for (i = 0; i < sc->sc_nargs; i++) {
+			if (serve_read(in, &args[i]) != 0) {
+				fprintf(stderr, "ERROR: incomplete %s request "
+				    "at end of input\n", sc->sc_name);
+				ret = -1;
+				break;
+			}
+		}
+
+		if (ret == 0)
+			ret = serve_one(out, &mdp, sc, args);
+	}
+
+	if (ret == 0 && ferror(in)) {
+		fprintf(stderr, "ERROR: could not read input: %s\n",
+		    strerror(errno));
+		ret = -1;
+	}
+
+	if (mdp != NULL)
+		proto_fini(mdp);
+	free(name.sf_buf);
+	for (i = 0; i < SERVE_MAX_ARGS; i++)
+		free(args[i].sf_buf);
+
+	return (ret);
+}
@@ -0,0 +1,29 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+#ifndef _SERVE_H
+#define	_SERVE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+
+/*
+ * The status with which each response to a served request begins:
+ */
+#define	SERVE_SUCCESS	"SUCCESS"
+#define	SERVE_NOTFOUND	"NOTFOUND"
+#define	SERVE_FAILURE	"FAILURE"
+
+int serve_run(FILE *, FILE *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SERVE_H */
@@ -0,0 +1,445 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * Cross-process single-flight coalescing of identical GET requests.
+ *
+ * A table of slots is kept in a file in the run directory, which every
+ * client maps shared.  The first process to request a key claims a slot and
+ * becomes the leader for that key: it marks the slot in-flight and holds a
+ * write lock on the slot's byte in the file while it fetches the value.  A
+ * process that arrives for the same key while the fetch is in flight becomes
+ * a follower: it waits for a read lock on the slot, which it obtains once the
+ * leader has published the result (or exited), and then reads the value from
+ * the slot's result file instead of making its own request.
+ *
+ * Record locks are released by the kernel when their owner exits, so a
+ * leader that dies never wedges its followers; they find the slot still
+ * marked in-flight, and fall back to making the request themselves.  Results
+ * are only shared with processes that arrived while the fetch was in flight,
+ * so this never serves a value older than the request that asked for it.
+ *
+ * Each slot counts the followers of its flight.  A leader with none writes
+ * no result file at all, and otherwise the last follower to read the file
+ * removes it, so that values do not linger in the run directory.  A file
+ * left behind by a follower that died is removed when the slot is next
+ * claimed.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "dynstr.h"
+#include "fsutil.h"
+#include "proto.h"
+#include "sflight.h"
+
+#define	SF_TABLE_FILE	"singleflight"
+#define	SF_MAGIC	0x6d646632	/* "mdf2" */
+#define	SF_NSLOTS	64
+#define	SF_KEYLEN	256
+
+typedef enum sf_state {
+	SFS_FREE = 0,
+	SFS_INFLIGHT,
+	SFS_DONE
+} sf_state_t;
+
+typedef struct sf_slot {
+	uint32_t sfs_state;
+	int32_t sfs_response;
+	uint32_t sfs_waiters;
+	uint32_t sfs_pad;
+	uint64_t sfs_gen;
+	uint64_t sfs_length;
+	char sfs_key[SF_KEYLEN];
+} sf_slot_t;
+
+typedef struct sf_table {
+	uint32_t sft_magic;
+	uint32_t sft_nslots;
+	uint64_t sft_gen;
+	sf_slot_t sft_slots[SF_NSLOTS];
+} sf_table_t;
+
+struct sflight {
+	int sf_fd;
+	sf_table_t *sf_table;
+	int sf_slot;
+};
+
+/*
+ * The first byte of the file is locked to serialise access to the table.
+ * Each slot is represented for locking purposes by a single byte beyond
+ * the end of the table itself.
+ */
+#define	SF_TABLE_LOCK_OFF	0
+#define	SF_SLOT_LOCK_OFF(i)	((off_t)sizeof (sf_table_t) + (i))
+
+static int
+sf_lock(int fd, short type, off_t off, boolean_t wait)
+{
+	struct flock l;
+
+	bzero(&l, sizeof (l));
+	l.l_type = type;
+	l.l_whence = SEEK_SET;
+	l.l_start = off;
+	l.l_len = 1;
+
+	while (fcntl(fd, wait ? F_SETLKW : F_SETLK, &l) == -1) {
+		if (errno != EINTR)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Returns B_TRUE if some other process holds a write lock on the slot,
+ * i.e. its leader is still alive.
+ */
+static boolean_t
+sf_slot_held(int fd, int slot)
+{
+	struct flock l;
+
+	bzero(&l, sizeof (l));
+	l.l_type = F_RDLCK;
+	l.l_whence = SEEK_SET;
+	l.l_start = SF_SLOT_LOCK_OFF(slot);
+	l.l_len = 1;
+
+	if (fcntl(fd, F_GETLK, &l) == -1)
+		return (B_FALSE);
+
+	return (l.l_type != F_UNLCK ? B_TRUE : B_FALSE);
+}
+
+static int
+sf_result_path(int slot, char *buf, size_t len)
+{
+	char name[32];
+
+	(void) snprintf(name, sizeof (name), "%s.%d", SF_TABLE_FILE, slot);
+	return (fs_rundir_path(name, buf, len));
+}
+
+static void
+sf_close(sflight_t *sf)
+{
+	if (sf->sf_table != NULL)
+		(void) munmap((void *)sf->sf_table, sizeof (sf_table_t));
+	if (sf->sf_fd != -1)
+		(void) close(sf->sf_fd);
+	free(sf);
+}
+
+static sflight_t *
+sf_open(void)
+{
+	char path[PATH_MAX];
+	sflight_t *sf;
+	struct stat st;
+	void *addr;
+
+	if (fs_rundir_path(SF_TABLE_FILE, path, sizeof (path)) != 0)
+		return (NULL);
+
+	if ((sf = calloc(1, sizeof (*sf))) == NULL)
+		return (NULL);
+	sf->sf_slot = -1;
+
+	/*
+	 * The table names keys, and the results are metadata values, so
+	 * neither should be readable by other users.
+	 */
+	if ((sf->sf_fd = open(path, O_RDWR | O_CREAT, 0600)) == -1)
+		goto bail;
+
+	if (sf_lock(sf->sf_fd, F_WRLCK, SF_TABLE_LOCK_OFF, B_TRUE) != 0)
+		goto bail;
+
+	if (fstat(sf->sf_fd, &st) != 0 ||
+	    (st.st_size < (off_t)sizeof (sf_table_t) &&
+	    ftruncate(sf->sf_fd, (off_t)sizeof (sf_table_t)) != 0))
+		goto unlock;
+
+	if ((addr = mmap(NULL, sizeof (sf_table_t), PROT_READ | PROT_WRITE,
+	    MAP_SHARED, sf->sf_fd, 0)) == MAP_FAILED)
+		goto unlock;
+	sf->sf_table = addr;
+
+	if (sf->sf_table->sft_magic != SF_MAGIC ||
+	    sf->sf_table->sft_nslots != SF_NSLOTS) {
+		bzero(sf->sf_table, sizeof (sf_table_t));
+		sf->sf_table->sft_magic = SF_MAGIC;
+		sf->sf_table->sft_nslots = SF_NSLOTS;
+	}
+
+	/*
+	 * The caller releases the table lock.
+	 */
+	return (sf);
+
+unlock:
+	(void) sf_lock(sf->sf_fd, F_UNLCK, SF_TABLE_LOCK_OFF, B_FALSE);
+bail:
+	sf_close(sf);
+	return (NULL);
+}
+
+/*
+ * Wait for the leader of the given slot to finish, and collect its result.
+ */
+static int
+sf_follow(sflight_t *sf, int slot, uint64_t gen, const char *key,
+    mdata_response_t *mdr, string_t **data)
+{
+	sf_slot_t *sfs = &sf->sf_table->sft_slots[slot];
+	char path[PATH_MAX];
+	string_t *str;
+	int ret = -1;
+
+	if (sf_lock(sf->sf_fd, F_RDLCK, SF_SLOT_LOCK_OFF(slot), B_TRUE) != 0)
+		return (-1);
+
+	/*
+	 * While we hold the read lock, no new leader can claim this slot.
+	 * Accept the result if it is for our key, and from the flight we
+	 * joined or a later one:
+	 */
+	if (sfs->sfs_state != SFS_DONE || sfs->sfs_gen < gen ||
+	    strcmp(sfs->sfs_key, key) != 0)
+		goto out;
+
+	if (sf_result_path(slot, path, sizeof (path)) != 0)
+		goto out;
+
+	str = dynstr_new();
+	dynstr_append(str, "");
+	if (fs_read_file(path, str) != 0 ||
+	    dynstr_len(str) != sfs->sfs_length) {
+		dynstr_free(str);
+		goto out;
+	}
+
+	*mdr = (mdata_response_t)sfs->sfs_response;
+	*data = str;
+	ret = 0;
+
+out:
+	(void) sf_lock(sf->sf_fd, F_UNLCK, SF_SLOT_LOCK_OFF(slot), B_FALSE);
+	return (ret);
+}
+
+/*
+ * Leave the flight we joined, unless the slot has since been claimed for
+ * another.  The last follower out removes the result.
+ */
+static void
+sf_leave(sflight_t *sf, int slot, uint64_t gen)
+{
+	sf_slot_t *sfs = &sf->sf_table->sft_slots[slot];
+	char path[PATH_MAX];
+
+	(void) sf_lock(sf->sf_fd, F_WRLCK, SF_TABLE_LOCK_OFF, B_TRUE);
+	if (sfs->sfs_gen == gen && sfs->sfs_waiters > 0 &&
+	    --sfs->sfs_waiters == 0 &&
+	    sf_result_path(slot, path, sizeof (path)) == 0)
+		(void) unlink(path);
+	(void) sf_lock(sf->sf_fd, F_UNLCK, SF_TABLE_LOCK_OFF, B_FALSE);
+}
+
+/*
+ * Is slot "a" a better choice than slot "b" for a new flight for this key?
+ */
+static boolean_t
+sf_better(const sf_slot_t *a, const sf_slot_t *b, const char *key)
+{
+	if (strcmp(a->sfs_key, key) == 0)
+		return (B_TRUE);
+	if (b->sfs_state == SFS_FREE)
+		return (B_FALSE);
+	if (a->sfs_state == SFS_FREE)
+		return (B_TRUE);
+	return (a->sfs_gen < b->sfs_gen ? B_TRUE : B_FALSE);
+}
+
+sflight_role_t
+sflight_begin(const char *key, sflight_t **sfp, mdata_response_t *mdr,
+    string_t **data)
+{
+	char path[PATH_MAX];
+	sflight_role_t role;
+	sflight_t *sf;
+	sf_table_t *sft;
+	int i, slot = -1;
+	uint64_t gen;
+
+	if (getenv(SFLIGHT_DISABLE_ENV) != NULL || strlen(key) >= SF_KEYLEN)
+		return (SFR_BYPASS);
+
+	if ((sf = sf_open()) == NULL)
+		return (SFR_BYPASS);
+	sft = sf->sf_table;
+
+	/*
+	 * If a live leader is already fetching this key, join its flight:
+	 */
+	for (i = 0; i < SF_NSLOTS; i++) {
+		sf_slot_t *sfs = &sft->sft_slots[i];
+
+		if (sfs->sfs_state != SFS_INFLIGHT ||
+		    strcmp(sfs->sfs_key, key) != 0)
+			continue;
+
+		if (!sf_slot_held(sf->sf_fd, i)) {
+			/*
+			 * The leader exited without publishing a result.
+			 */
+			sfs->sfs_state = SFS_FREE;
+			continue;
+		}
+
+		gen = sfs->sfs_gen;
+		sfs->sfs_waiters++;
+		(void) sf_lock(sf->sf_fd, F_UNLCK, SF_TABLE_LOCK_OFF, B_FALSE);
+
+		role = sf_follow(sf, i, gen, key, mdr, data) == 0 ?
+		    SFR_FOLLOWER : SFR_BYPASS;
+		sf_leave(sf, i, gen);
+		sf_close(sf);
+		return (role);
+	}
+
+	/*
+	 * Otherwise, become the leader.  Prefer a slot last used for this
+	 * key, then a free slot, then the least recently used.  We can only
+	 * claim a slot if no follower is still reading its previous result.
+	 */
+	for (i = 0; i < SF_NSLOTS; i++) {
+		sf_slot_t *sfs = &sft->sft_slots[i];
+
+		if (sfs->sfs_state == SFS_INFLIGHT)
+			continue;
+		if (slot != -1 && !sf_better(sfs, &sft->sft_slots[slot], key))
+			continue;
+		if (sf_lock(sf->sf_fd, F_WRLCK, SF_SLOT_LOCK_OFF(i),
+		    B_FALSE) != 0)
+			continue;
+
+		if (slot != -1) {
+			(void) sf_lock(sf->sf_fd, F_UNLCK,
+			    SF_SLOT_LOCK_OFF(slot), B_FALSE);
+		}
+		slot = i;
+		if (strcmp(sfs->sfs_key, key) == 0)
+			break;
+	}
+
+	if (slot == -1) {
+		(void) sf_lock(sf->sf_fd, F_UNLCK, SF_TABLE_LOCK_OFF, B_FALSE);
+		sf_close(sf);
+		return (SFR_BYPASS);
+	}
+
+	/*
+	 * No follower can still be reading the slot's previous result, so
+	 * remove any that was left behind:
+	 */
+	if (sft->sft_slots[slot].sfs_waiters != 0 &&
+	    sf_result_path(slot, path, sizeof (path)) == 0)
+		(void) unlink(path);
+
+	sft->sft_slots[slot].sfs_state = SFS_INFLIGHT;
+	sft->sft_slots[slot].sfs_gen = ++sft->sft_gen;
+	sft->sft_slots[slot].sfs_waiters = 0;
+	sft->sft_slots[slot].sfs_length = 0;
+	(void) strcpy(sft->sft_slots[slot].sfs_key, key);
+	sf->sf_slot = slot;
+
+	(void) sf_lock(sf->sf_fd, F_UNLCK, SF_TABLE_LOCK_OFF, B_FALSE);
+
+	*sfp = sf;
+	return (SFR_LEADER);
+}
+
+static void
+sf_finish(sflight_t *sf, sf_state_t state)
+{
+	(void) sf_lock(sf->sf_fd, F_WRLCK, SF_TABLE_LOCK_OFF, B_TRUE);
+	sf->sf_table->sft_slots[sf->sf_slot].sfs_state = state;
+	(void) sf_lock(sf->sf_fd, F_UNLCK, SF_TABLE_LOCK_OFF, B_FALSE);
+
+	/*
+	 * Releasing the slot lock wakes any followers:
+	 */
+	(void) sf_lock(sf->sf_fd, F_UNLCK, SF_SLOT_LOCK_OFF(sf->sf_slot),
+	    B_FALSE);
+	sf_close(sf);
+}
+
+/*
+ * Make the leader's result available to any followers.
+ */
+void
+sflight_publish(sflight_t *sf, mdata_response_t mdr, string_t *data)
+{
+	sf_slot_t *sfs = &sf->sf_table->sft_slots[sf->sf_slot];
+	char path[PATH_MAX];
+	size_t len = dynstr_len(data);
+	uint32_t waiters;
+
+	/*
+	 * If nobody has joined the flight there is nothing to publish.  Any
+	 * process that arrives once the slot is no longer in flight makes
+	 * its own request.
+	 */
+	(void) sf_lock(sf->sf_fd, F_WRLCK, SF_TABLE_LOCK_OFF, B_TRUE);
+	if ((waiters = sfs->sfs_waiters) == 0)
+		sfs->sfs_state = SFS_FREE;
+	(void) sf_lock(sf->sf_fd, F_UNLCK, SF_TABLE_LOCK_OFF, B_FALSE);
+	if (waiters == 0) {
+		sflight_abandon(sf);
+		return;
+	}
+
+	/*
+	 * The result need only outlive this process, not a crash:
+	 */
+	if (sf_result_path(sf->sf_slot, path, sizeof (path)) != 0 ||
+	    fs_write_transient(path, len > 0 ? dynstr_cstr(data) : "", len,
+	    0600) != 0) {
+		sflight_abandon(sf);
+		return;
+	}
+
+	sfs->sfs_response = (int32_t)mdr;
+	sfs->sfs_length = len;
+	sf_finish(sf, SFS_DONE);
+}
+
+/*
+ * The leader could not obtain a result; followers will make their own
+ * requests.
+ */
+void
+sflight_abandon(sflight_t *sf)
+{
+	sf_finish(sf, SFS_FREE);
+}
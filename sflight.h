@@ -0,0 +1,39 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+#ifndef _SFLIGHT_H
+#define	_SFLIGHT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dynstr.h"
+#include "proto.h"
+
+/*
+ * Setting this environment variable disables single-flight coalescing:
+ */
+#define	SFLIGHT_DISABLE_ENV	"MDATA_NO_SINGLEFLIGHT"
+
+typedef enum sflight_role {
+	SFR_BYPASS = 1,
+	SFR_LEADER,
+	SFR_FOLLOWER
+} sflight_role_t;
+
+typedef struct sflight sflight_t;
+
+sflight_role_t sflight_begin(const char *, sflight_t **, mdata_response_t *,
+    string_t **);
+void sflight_publish(sflight_t *, mdata_response_t, string_t *);
+void sflight_abandon(sflight_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SFLIGHT_H */
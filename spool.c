@@ -0,0 +1,547 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * A spool of writes that have yet to be sent to the host.
+ *
+ * Each key with a pending write has a file in the spool directory, named for
+ * the key in hexadecimal, that holds the value to write.  A new write to the
+ * key atomically replaces the file, so that only the latest value is ever
+ * sent.  A flusher, of which there is at most one at a time, claims each
+ * entry by renaming it to an in-flight name, and removes it once the host has
+ * accepted the write.  If the write cannot be sent, the entry is put back,
+ * unless it has been replaced by a newer write in the meantime.
+ *
+ *	k.<hex key>		pending write
+ *	i.<hex key>		write being sent by the flusher
+ *	lock			held while writes are being sent
+ *	flusher			held by the background flusher
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "base64.h"
+#include "batch.h"
+#include "common.h"
+#include "dynstr.h"
+#include "fsutil.h"
+#include "proto.h"
+#include "spool.h"
+
+#define	SPOOL_LOCK_FILE		"lock"
+#define	SPOOL_FLUSHER_FILE	"flusher"
+
+/*
+ * Bounds on the interval between attempts to reach the host, in
+ * milliseconds:
+ */
+#define	SPOOL_BACKOFF_MIN	1000
+#define	SPOOL_BACKOFF_MAX	60000
+
+/*
+ * The longest key that can be spooled: its name in hexadecimal, with a
+ * prefix, must fit in a directory entry.
+ */
+#define	SPOOL_KEY_MAX		((NAME_MAX - 2) / 2)
+
+typedef struct spool_flush_state {
+	unsigned int sfs_sent;
+	unsigned int sfs_failed;
+	unsigned int sfs_lost;
+} spool_flush_state_t;
+
+typedef struct spool_item {
+	spool_flush_state_t *si_state;
+	char *si_key;
+	char si_entry[PATH_MAX];
+	char si_inflight[PATH_MAX];
+} spool_item_t;
+
+static int spool_lockfd = -1;
+
+static const char *
+spool_dir(void)
+{
+	const char *dir = getenv(MDATA_SPOOL_ENV);
+
+	return (dir != NULL && dir[0] != '\0' ? dir : MDATA_SPOOL_DEFAULT);
+}
+
+static int
+spool_path(char kind, const char *hex, char *buf, size_t len)
+{
+	if (snprintf(buf, len, "%s/%c.%s", spool_dir(), kind, hex) >=
+	    (int)len) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	return (0);
+}
+
+static int
+spool_hex(const char *key, char *buf, size_t len)
+{
+	if (strlen(key) > SPOOL_KEY_MAX) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	return (fs_hex_name(key, buf, len));
+}
+
+static int
+spool_unhex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+	if (c >= 'a' && c <= 'f')
+		return (c - 'a' + 10);
+	return (-1);
+}
+
+/*
+ * Decode the key from the name of an entry, rejecting anything else that
+ * may be found in the directory.
+ */
+static char *
+spool_unhex(const char *hex)
+{
+	size_t i, len = strlen(hex);
+	char *key;
+
+	if (len == 0 || len % 2 != 0 || (key = malloc(len / 2 + 1)) == NULL)
+		return (NULL);
+
+	for (i = 0; i < len / 2; i++) {
+		int hi = spool_unhex_digit(hex[2 * i]);
+		int lo = spool_unhex_digit(hex[2 * i + 1]);
+
+		if (hi == -1 || lo == -1 || (hi == 0 && lo == 0)) {
+			free(key);
+			return (NULL);
+		}
+		key[i] = (char)(hi << 4 | lo);
+	}
+	key[len / 2] = '\0';
+
+	return (key);
+}
+
+/*
+ * Record a write to be sent later, replacing any that is pending for the same
+ * key.  Returns -1, with errno set, if the write could not be spooled.
+ */
+int
+spool_put(const char *key, const char *value, size_t len)
+{
+	char hex[NAME_MAX + 1], path[PATH_MAX];
+
+	if (spool_hex(key, hex, sizeof (hex)) != 0 ||
+	    spool_path('k', hex, path, sizeof (path)) != 0)
+		return (-1);
+
+	if (mkdir(spool_dir(), 0700) != 0 && errno != EEXIST)
+		return (-1);
+
+	return (fs_write_atomic(path, value, len, 0600));
+}
+
+static int
+spool_lockfile(const char *name, boolean_t wait)
+{
+	char path[PATH_MAX];
+	struct flock l;
+	int fd, e;
+
+	if (snprintf(path, sizeof (path), "%s/%s", spool_dir(), name) >=
+	    (int)sizeof (path)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+		return (-1);
+
+	bzero(&l, sizeof (l));
+	l.l_type = F_WRLCK;
+	l.l_whence = SEEK_SET;
+
+	while (fcntl(fd, wait ? F_SETLKW : F_SETLK, &l) == -1) {
+		if (errno != EINTR) {
+			e = errno;
+			(void) close(fd);
+			errno = e;
+			return (-1);
+		}
+	}
+
+	return (fd);
+}
+
+/*
+ * Take the lock that allows us to send spooled writes.  Returns -1 if another
+ * process is sending them and we did not wait for it.
+ */
+int
+spool_lock(boolean_t wait)
+{
+	VERIFY(spool_lockfd == -1);
+
+	if ((spool_lockfd = spool_lockfile(SPOOL_LOCK_FILE, wait)) == -1)
+		return (-1);
+
+	return (0);
+}
+
+void
+spool_unlock(void)
+{
+	if (spool_lockfd != -1) {
+		VERIFY0(close(spool_lockfd));
+		spool_lockfd = -1;
+	}
+}
+
+/*
+ * Forget any pending write for the key, as it is about to be superseded by
+ * one that is sent directly.  That includes a write that a flusher has
+ * claimed, which it would otherwise put back should the connection fail.
+ */
+void
+spool_discard(const char *key)
+{
+	char hex[NAME_MAX + 1], entry[PATH_MAX], inflight[PATH_MAX];
+	boolean_t locked = B_FALSE;
+
+	if (spool_hex(key, hex, sizeof (hex)) != 0 ||
+	    spool_path('k', hex, entry, sizeof (entry)) != 0 ||
+	    spool_path('i', hex, inflight, sizeof (inflight)) != 0)
+		return;
+
+	/*
+	 * If anything is spooled for the key, a flusher may be sending it
+	 * now.  Wait for it to finish, so that the older value is not sent
+	 * after ours, and so that it cannot be put back once removed:
+	 */
+	if ((access(entry, F_OK) == 0 || access(inflight, F_OK) == 0) &&
+	    spool_lockfd == -1 && spool_lock(B_TRUE) == 0)
+		locked = B_TRUE;
+
+	(void) unlink(entry);
+	(void) unlink(inflight);
+
+	if (locked)
+		spool_unlock();
+}
+
+/*
+ * Return an in-flight entry to the spool, unless a newer write to its key
+ * has been spooled since it was claimed.
+ */
+static void
+spool_restore(const char *inflight, const char *entry)
+{
+	if (link(inflight, entry) == 0 || errno == EEXIST) {
+		(void) unlink(inflight);
+		return;
+	}
+
+	(void) rename(inflight, entry);
+}
+
+/*
+ * Remove the temporary file left behind by a writer that died before it
+ * could rename it into place.
+ */
+static void
+spool_reap_tmp(const char *dir, const char *name)
+{
+	const char *p = strrchr(name, '.');
+	char path[PATH_MAX];
+	long pid;
+
+	if (p == NULL || strstr(name, ".tmp.") == NULL ||
+	    (pid = strtol(p + 1, NULL, 10)) <= 0 ||
+	    kill((pid_t)pid, 0) == 0 || errno != ESRCH)
+		return;
+
+	if (snprintf(path, sizeof (path), "%s/%s", dir, name) <
+	    (int)sizeof (path))
+		(void) unlink(path);
+}
+
+static void
+spool_put_done(int err, mdata_response_t mdr, string_t *data, void *arg)
+{
+	spool_item_t *si = arg;
+	spool_flush_state_t *sfs = si->si_state;
+
+	if (err != 0) {
+		/*
+		 * The write may yet succeed over a new connection.
+		 */
+		sfs->sfs_lost++;
+		spool_restore(si->si_inflight, si->si_entry);
+	} else if (mdr != MDR_SUCCESS) {
+		/*
+		 * The host will not accept this write, so there is no point
+		 * in keeping it.
+		 */
+		fprintf(stderr, "Error putting metadata for key '%s': %s\n",
+		    si->si_key, dynstr_len(data) > 0 ? dynstr_cstr(data) :
+		    "unknown error");
+		sfs->sfs_failed++;
+		(void) unlink(si->si_inflight);
+	} else {
+		sfs->sfs_sent++;
+		(void) unlink(si->si_inflight);
+	}
+
+	free(si->si_key);
+	free(si);
+}
+
+/*
+ * Claim a pending write and queue it to be sent.
+ */
+static void
+spool_submit(mdata_batch_t *mb, spool_flush_state_t *sfs, const char *hex)
+{
+	string_t *value = dynstr_new();
+	string_t *req = dynstr_new();
+	spool_item_t *si;
+
+	if ((si = calloc(1, sizeof (*si))) == NULL)
+		ABORT("spool_submit: could not allocate memory");
+	si->si_state = sfs;
+
+	if ((si->si_key = spool_unhex(hex)) == NULL ||
+	    spool_path('k', hex, si->si_entry, sizeof (si->si_entry)) != 0 ||
+	    spool_path('i', hex, si->si_inflight,
+	    sizeof (si->si_inflight)) != 0 ||
+	    rename(si->si_entry, si->si_inflight) != 0) {
+		free(si->si_key);
+		free(si);
+		goto out;
+	}
+
+	if (fs_read_file(si->si_inflight, value) != 0) {
+		spool_restore(si->si_inflight, si->si_entry);
+		free(si->si_key);
+		free(si);
+		goto out;
+	}
+
+	base64_encode(si->si_key, strlen(si->si_key), req);
+	dynstr_appendc(req, ' ');
+	base64_encode(dynstr_len(value) > 0 ? dynstr_cstr(value) : "",
+	    dynstr_len(value), req);
+
+	batch_submit(mb, "PUT", dynstr_cstr(req), spool_put_done, si);
+
+out:
+	dynstr_free(value);
+	dynstr_free(req);
+}
+
+/*
+ * Send every pending write, as the flusher.  Writes that were in flight when
+ * a previous flusher died are sent first.  Returns the number of writes that
+ * the host accepted and rejected, or -1 if the connection failed before
+ * every write was sent; those that were not are left in the spool.
+ */
+int
+spool_flush(mdata_proto_t *mdp, unsigned int *sent, unsigned int *failed)
+{
+	const char *dir = spool_dir();
+	spool_flush_state_t sfs;
+	mdata_batch_t *mb;
+	struct dirent *de;
+	DIR *d;
+	int pass;
+
+	VERIFY(spool_lockfd != -1);
+
+	bzero(&sfs, sizeof (sfs));
+
+	if (batch_init(&mb, mdp, BATCH_WINDOW) != 0)
+		return (-1);
+
+	for (pass = 0; pass < 2; pass++) {
+		if ((d = opendir(dir)) == NULL) {
+			batch_fini(mb);
+			return (errno == ENOENT ? 0 : -1);
+		}
+
+		while ((de = readdir(d)) != NULL) {
+			char entry[PATH_MAX], inflight[PATH_MAX];
+			const char *hex = de->d_name + 2;
+			char kind = de->d_name[0];
+
+			if ((kind != 'k' && kind != 'i') ||
+			    de->d_name[1] != '.')
+				continue;
+
+			if (strchr(hex, '.') != NULL) {
+				spool_reap_tmp(dir, de->d_name);
+				continue;
+			}
+
+			if (pass == 0 && kind == 'i' && spool_path('i', hex,
+			    inflight, sizeof (inflight)) == 0 &&
+			    spool_path('k', hex, entry, sizeof (entry)) == 0)
+				spool_restore(inflight, entry);
+			else if (pass == 1 && kind == 'k')
+				spool_submit(mb, &sfs, hex);
+		}
+
+		(void) closedir(d);
+	}
+
+	(void) batch_run(mb);
+	batch_fini(mb);
+
+	*sent = sfs.sfs_sent;
+	*failed = sfs.sfs_failed;
+	return (sfs.sfs_lost > 0 ? -1 : 0);
+}
+
+static boolean_t
+spool_pending(void)
+{
+	struct dirent *de;
+	boolean_t found = B_FALSE;
+	DIR *d;
+
+	if ((d = opendir(spool_dir())) == NULL)
+		return (B_FALSE);
+
+	while (!found && (de = readdir(d)) != NULL) {
+		if ((strncmp(de->d_name, "k.", 2) == 0 ||
+		    strncmp(de->d_name, "i.", 2) == 0) &&
+		    strchr(de->d_name + 2, '.') == NULL)
+			found = B_TRUE;
+	}
+
+	(void) closedir(d);
+	return (found);
+}
+
+/*
+ * Flush the spool until it is empty, retrying with backoff while the host
+ * cannot be reached.  There is only one background flusher at a time.  The
+ * connection is not held while we wait to retry, as it may keep other
+ * clients from a shared device, and the lock on sending writes is only held
+ * once we are connected, so that an explicit flush is never held up behind
+ * a flusher that is itself waiting for the host.
+ */
+static void
+spool_flusher(void)
+{
+	mdata_proto_t *mdp;
+	const char *errmsg;
+	unsigned int sent, failed;
+	int backoff = SPOOL_BACKOFF_MIN;
+	int fd, ret;
+
+	/*
+	 * A writer that finds a flusher running assumes that its write will
+	 * be sent, so the flusher must look again once it has stopped.  If
+	 * another takes over in the meantime, that falls to it instead.
+	 */
+	while (spool_pending()) {
+		if ((fd = spool_lockfile(SPOOL_FLUSHER_FILE, B_FALSE)) == -1)
+			return;
+
+		while (spool_pending()) {
+			ret = -1;
+			if (proto_init(&mdp, &errmsg) == 0) {
+				if (proto_version(mdp) < 2) {
+					/*
+					 * The writes are left in the spool,
+					 * from which they may be sent should
+					 * the host come to support PUT.  Our
+					 * stderr is gone, so say why here:
+					 */
+					syslog(LOG_ERR, "host does not "
+					    "support PUT; spooled writes in "
+					    "%s were not sent", spool_dir());
+					proto_fini(mdp);
+					(void) close(fd);
+					return;
+				}
+				if (spool_lock(B_TRUE) == 0) {
+					ret = spool_flush(mdp, &sent, &failed);
+					spool_unlock();
+				}
+				proto_fini(mdp);
+			}
+
+			if (ret == 0) {
+				backoff = SPOOL_BACKOFF_MIN;
+			} else if (spool_pending()) {
+				(void) poll(NULL, 0, backoff);
+				backoff = backoff > SPOOL_BACKOFF_MAX / 2 ?
+				    SPOOL_BACKOFF_MAX : backoff * 2;
+			}
+		}
+
+		(void) close(fd);
+	}
+}
+
+/*
+ * Start a flusher in the background, detached from the caller, unless one is
+ * already running.
+ */
+void
+spool_kick(void)
+{
+	pid_t pid;
+	int fd;
+
+	(void) fflush(NULL);
+
+	if ((pid = fork()) == -1)
+		return;
+
+	if (pid != 0) {
+		while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+			;
+		return;
+	}
+
+	if (setsid() == -1 || fork() != 0)
+		_exit(0);
+
+	if ((fd = open("/dev/null", O_RDWR)) != -1) {
+		(void) dup2(fd, STDIN_FILENO);
+		(void) dup2(fd, STDOUT_FILENO);
+		(void) dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			(void) close(fd);
+	}
+	(void) chdir("/");
+	openlog("mdata-put", LOG_PID, LOG_DAEMON);
+
+	spool_flusher();
+	exit(0);
+}
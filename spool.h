@@ -0,0 +1,38 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+#ifndef _SPOOL_H
+#define	_SPOOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+#include "common.h"
+#include "dynstr.h"
+#include "proto.h"
+
+/*
+ * Directory in which writes are held until they can be sent to the host.
+ * Unlike the run directory, its contents are expected to survive a reboot.
+ */
+#define	MDATA_SPOOL_ENV		"MDATA_SPOOL"
+#define	MDATA_SPOOL_DEFAULT	"/var/spool/mdata-client"
+
+int spool_put(const char *, const char *, size_t);
+void spool_discard(const char *);
+int spool_lock(boolean_t);
+void spool_unlock(void);
+int spool_flush(mdata_proto_t *, unsigned int *, unsigned int *);
+void spool_kick(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SPOOL_H */
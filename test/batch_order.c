@@ -0,0 +1,114 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * Check that the batch scheduler, which lets small requests overtake large
+ * ones, never sends a request for a key ahead of one submitted earlier for
+ * the same key: a large write followed by a small one must leave the small
+ * value in place, while a small write to another key may still go first.
+ *
+ * Usage: batch_order <path to mdata-host>
+ */
+
+#include <sys/types.h>
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "base64.h"
+#include "batch.h"
+#include "common.h"
+#include "dynstr.h"
+#include "proto.h"
+#include "testhost.h"
+
+/*
+ * The size of the value first written to the key, which is large enough
+ * to be delayed behind many smaller requests:
+ */
+#define	LARGE_SIZE	20000
+
+static unsigned int order;
+
+static void
+put_done(int err, mdata_response_t mdr, string_t *data __UNUSED, void *arg)
+{
+	unsigned int *seen = arg;
+
+	if (err != 0 || mdr != MDR_SUCCESS)
+		errx(1, "FAIL: PUT did not succeed");
+	*seen = ++order;
+}
+
+static void
+put(mdata_batch_t *mb, const char *key, const char *value,
+    unsigned int *seen)
+{
+	string_t *req = dynstr_new();
+
+	base64_encode(key, strlen(key), req);
+	dynstr_appendc(req, ' ');
+	base64_encode(value, strlen(value), req);
+	batch_submit(mb, "PUT", dynstr_cstr(req), put_done, seen);
+	dynstr_free(req);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *errmsg = NULL;
+	unsigned int large, small, other;
+	char value[LARGE_SIZE + 1];
+	mdata_response_t mdr;
+	mdata_proto_t *mdp;
+	mdata_batch_t *mb;
+	string_t *data;
+	pid_t host;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <mdata-host>\n", argv[0]);
+		return (2);
+	}
+	testhost_init("batch_order", argv[1]);
+	host = testhost_start();
+
+	if (proto_init(&mdp, &errmsg) != 0)
+		errx(1, "proto_init: %s", errmsg);
+	if (proto_version(mdp) < 2)
+		errx(1, "host does not support PUT");
+
+	(void) memset(value, 'x', LARGE_SIZE);
+	value[LARGE_SIZE] = '\0';
+
+	if (batch_init(&mb, mdp, BATCH_WINDOW) != 0)
+		errx(1, "batch_init failed");
+	put(mb, "k", value, &large);
+	put(mb, "k", "small", &small);
+	put(mb, "other", "small", &other);
+	(void) batch_run(mb);
+	batch_fini(mb);
+
+	if (proto_execute(mdp, "GET", "k", &mdr, &data) != 0 ||
+	    mdr != MDR_SUCCESS)
+		errx(1, "FAIL: could not read back the key");
+	if (strcmp(dynstr_cstr(data), "small") != 0) {
+		errx(1, "FAIL: a later write to the key was overtaken (%u "
+		    "bytes read back)", (unsigned int)dynstr_len(data));
+	}
+	if (!(large < small))
+		errx(1, "FAIL: writes to the key completed out of order");
+	if (!(other < large))
+		errx(1, "FAIL: a write to another key was not scheduled first");
+	dynstr_free(data);
+
+	proto_fini(mdp);
+	testhost_stop(host);
+	testhost_fini();
+
+	printf("PASS: batch_order\n");
+
+	return (0);
+}
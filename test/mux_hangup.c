@@ -0,0 +1,100 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * Check that the I/O thread of a multiplexed handle sleeps, rather than
+ * spinning, once the host has hung up a connection with nothing outstanding,
+ * and that the next request re-establishes the connection.
+ *
+ * Usage: mux_hangup <path to mdata-host>
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <err.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "dynstr.h"
+#include "mux.h"
+#include "proto.h"
+#include "testhost.h"
+
+/*
+ * How long to watch the idle handle, and how much CPU time it may use in
+ * that time, in milliseconds:
+ */
+#define	IDLE_MS		1000
+#define	IDLE_CPU_MS	100
+
+static long long
+cpu_ms(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		err(1, "getrusage");
+
+	return ((long long)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000 +
+	    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000);
+}
+
+static void
+request(mdata_mux_t *mx, const char *what)
+{
+	mdata_response_t mdr;
+	string_t *data;
+
+	if (mux_execute(mx, "KEYS", NULL, &mdr, &data) != 0)
+		errx(1, "KEYS failed %s", what);
+	if (mdr != MDR_SUCCESS && mdr != MDR_NOTFOUND)
+		errx(1, "unexpected response to KEYS %s", what);
+	dynstr_free(data);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *errmsg = NULL;
+	mdata_mux_t *mx;
+	long long used;
+	pid_t host;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <mdata-host>\n", argv[0]);
+		return (2);
+	}
+	testhost_init("mux_hangup", argv[1]);
+
+	host = testhost_start();
+	if (mux_init(&mx, &errmsg) != 0)
+		errx(1, "mux_init: %s", errmsg);
+	request(mx, "before hangup");
+
+	/*
+	 * The host goes away while the handle is idle:
+	 */
+	testhost_stop(host);
+	(void) usleep(100000);
+
+	used = cpu_ms();
+	(void) usleep(IDLE_MS * 1000);
+	used = cpu_ms() - used;
+
+	host = testhost_start();
+	request(mx, "after hangup");
+	mux_fini(mx);
+	testhost_stop(host);
+	testhost_fini();
+
+	if (used > IDLE_CPU_MS) {
+		errx(1, "FAIL: used %lld ms of CPU in %d ms while idle", used,
+		    IDLE_MS);
+	}
+	printf("PASS: mux_hangup (%lld ms of CPU while idle)\n", used);
+
+	return (0);
+}
@@ -0,0 +1,106 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * Support for tests that run against mdata-host.  Each test is given a
+ * private directory, which holds the host's socket and the client's run
+ * directory and spool, and which the environment is pointed at.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fsutil.h"
+#include "plat/unix_common.h"
+#include "proto.h"
+#include "spool.h"
+#include "testhost.h"
+
+static const char *th_host;
+static char th_dir[PATH_MAX - 64];
+static char th_sock[PATH_MAX];
+
+/*
+ * Set up the directory and environment for the named test, which is to run
+ * against the given mdata-host program.
+ */
+void
+testhost_init(const char *name, const char *host)
+{
+	char path[PATH_MAX];
+
+	th_host = host;
+
+	(void) snprintf(th_dir, sizeof (th_dir), "%s/%s.XXXXXX",
+	    getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp", name);
+	if (mkdtemp(th_dir) == NULL)
+		err(1, "mkdtemp");
+	(void) snprintf(th_sock, sizeof (th_sock), "%s/host.sock", th_dir);
+
+	(void) setenv(MDATA_SOCKET_ENV, th_sock, 1);
+	(void) snprintf(path, sizeof (path), "%s/run", th_dir);
+	(void) setenv(MDATA_RUNDIR_ENV, path, 1);
+	(void) snprintf(path, sizeof (path), "%s/spool", th_dir);
+	(void) setenv(MDATA_SPOOL_ENV, path, 1);
+	(void) unsetenv(MDATA_PROTO_V3_ENV);
+	(void) unsetenv(MDATA_PROTO_COMPRESS_ENV);
+	(void) signal(SIGPIPE, SIG_IGN);
+}
+
+/*
+ * Start the host, and wait for it to create its socket.
+ */
+pid_t
+testhost_start(void)
+{
+	struct stat st;
+	pid_t pid;
+	int i;
+
+	(void) unlink(th_sock);
+
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		(void) execl(th_host, th_host, th_sock, (char *)NULL);
+		_exit(127);
+	}
+
+	for (i = 0; i < 500; i++) {
+		if (stat(th_sock, &st) == 0)
+			return (pid);
+		(void) usleep(10000);
+	}
+	errx(1, "host did not create %s", th_sock);
+	return (-1);
+}
+
+void
+testhost_stop(pid_t pid)
+{
+	(void) kill(pid, SIGTERM);
+	(void) waitpid(pid, NULL, 0);
+}
+
+/*
+ * Remove the test's directory and everything in it.
+ */
+void
+testhost_fini(void)
+{
+	char cmd[PATH_MAX + 16];
+
+	(void) snprintf(cmd, sizeof (cmd), "rm -rf '%s'", th_dir);
+	if (system(cmd) != 0)
+		warnx("could not remove %s", th_dir);
+}
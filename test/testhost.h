@@ -0,0 +1,25 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+#ifndef _TESTHOST_H
+#define	_TESTHOST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+void testhost_init(const char *, const char *);
+pid_t testhost_start(void);
+void testhost_stop(pid_t);
+void testhost_fini(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TESTHOST_H */
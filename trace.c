@@ -0,0 +1,278 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+/*
+ * Capture of the traffic between the client and the metadata service, so that
+ * a session seen in the field may be replayed (by mdata-replay) against the
+ * protocol engine at will.
+ *
+ * A trace file begins with TRACE_MAGIC, and holds a record for each
+ * connection made and for each write to or read from it.  A record is a type
+ * byte, the time since the previous record in microseconds and the length of
+ * the data (both as unsigned LEB128 varints), and then the data.  Each record
+ * is written with one call, so that the trace of a process that crashes is
+ * intact up to its last record.
+ *
+ * Each process writes its own file, "mdata.<pid>.trace", in the directory
+ * named by MDATA_CAPTURE; the child of a fork (such as the spool flusher)
+ * starts a file of its own.  When MDATA_CAPTURE is not set, the cost of a
+ * call to trace_capture() is that of taking an uncontended lock.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "dynstr.h"
+#include "fsutil.h"
+#include "trace.h"
+
+/*
+ * The longest encoding of a 64-bit value as a varint:
+ */
+#define	TRACE_VARINT_MAX	10
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static boolean_t trace_checked = B_FALSE;
+static const char *trace_dir = NULL;
+static pid_t trace_pid = -1;
+static int trace_fd = -1;
+static uint64_t trace_last_us;
+
+static uint64_t
+trace_now_us(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+
+	return ((uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000);
+}
+
+static size_t
+trace_put_varint(uint8_t *buf, uint64_t val)
+{
+	size_t n = 0;
+
+	do {
+		buf[n] = val & 0x7f;
+		if ((val >>= 7) != 0)
+			buf[n] |= 0x80;
+		n++;
+	} while (val != 0);
+
+	return (n);
+}
+
+static int
+trace_get_varint(const uint8_t *buf, size_t len, size_t *off, uint64_t *val)
+{
+	unsigned int shift = 0;
+
+	*val = 0;
+	while (*off < len && shift < 64) {
+		uint8_t b = buf[(*off)++];
+
+		*val |= (uint64_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0)
+			return (0);
+		shift += 7;
+	}
+
+	return (-1);
+}
+
+/*
+ * Open the trace file for this process, if capture is enabled and it is not
+ * open already.  Must be called with trace_lock held.
+ */
+static boolean_t
+trace_open(void)
+{
+	char path[PATH_MAX];
+	pid_t pid;
+
+	if (!trace_checked) {
+		trace_checked = B_TRUE;
+		if ((trace_dir = getenv(MDATA_CAPTURE_ENV)) != NULL &&
+		    trace_dir[0] == '\0')
+			trace_dir = NULL;
+	}
+	if (trace_dir == NULL)
+		return (B_FALSE);
+
+	if ((pid = getpid()) == trace_pid)
+		return (trace_fd != -1);
+
+	/*
+	 * Either this is the first record, or we are the child of a process
+	 * that had a trace open, and must not write into its file:
+	 */
+	if (trace_fd != -1)
+		(void) close(trace_fd);
+	trace_pid = pid;
+
+	(void) snprintf(path, sizeof (path), "%s/mdata.%d.trace", trace_dir,
+	    (int)pid);
+	if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+	    O_CLOEXEC, 0600)) == -1) {
+		warn("could not open capture file \"%s\"", path);
+		return (B_FALSE);
+	}
+
+	if (write(trace_fd, TRACE_MAGIC, strlen(TRACE_MAGIC)) !=
+	    (ssize_t)strlen(TRACE_MAGIC)) {
+		warn("could not write capture file \"%s\"", path);
+		(void) close(trace_fd);
+		trace_fd = -1;
+		return (B_FALSE);
+	}
+	trace_last_us = trace_now_us();
+
+	return (B_TRUE);
+}
+
+/*
+ * Record traffic on the connection to the metadata service, if capture is
+ * enabled.  A failure to write the trace disables capture for the rest of
+ * the life of the process, but does not otherwise affect it.
+ */
+void
+trace_capture(trace_type_t type, const char *buf, size_t len)
+{
+	uint8_t hdr[1 + 2 * TRACE_VARINT_MAX];
+	struct iovec iov[2];
+	uint64_t now;
+	size_t hlen = 0;
+	ssize_t sz;
+
+	VERIFY0(pthread_mutex_lock(&trace_lock));
+
+	if (!trace_open())
+		goto out;
+
+	now = trace_now_us();
+	hdr[hlen++] = (uint8_t)type;
+	hlen += trace_put_varint(&hdr[hlen], now - trace_last_us);
+	hlen += trace_put_varint(&hdr[hlen], (uint64_t)len);
+	trace_last_us = now;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hlen;
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+
+	while ((sz = writev(trace_fd, iov, len > 0 ? 2 : 1)) == -1 &&
+	    errno == EINTR)
+		continue;
+	if (sz != (ssize_t)(hlen + len)) {
+		warnx("could not write capture file; capture disabled");
+		(void) close(trace_fd);
+		trace_fd = -1;
+	}
+
+out:
+	VERIFY0(pthread_mutex_unlock(&trace_lock));
+}
+
+/*
+ * Read a trace file in full.  The records refer to the data held in the
+ * trace, and remain valid until trace_fini() is called.
+ */
+int
+trace_load(const char *path, trace_t *t, const char **errmsg)
+{
+	const uint8_t *buf;
+	size_t len, off, nalloc = 0;
+
+	bzero(t, sizeof (*t));
+	t->t_buf = dynstr_new();
+
+	if (fs_read_file(path, t->t_buf) != 0) {
+		*errmsg = "could not read trace file";
+		goto bail;
+	}
+
+	buf = (const uint8_t *)dynstr_cstr(t->t_buf);
+	len = dynstr_len(t->t_buf);
+	off = strlen(TRACE_MAGIC);
+
+	if (len < off || memcmp(buf, TRACE_MAGIC, off) != 0) {
+		*errmsg = "not a trace file";
+		goto bail;
+	}
+
+	while (off < len) {
+		trace_rec_t *tr;
+		trace_type_t type = (trace_type_t)buf[off];
+		uint64_t delta, dlen;
+
+		switch (type) {
+		case TRT_CONNECT:
+		case TRT_SEND:
+		case TRT_RECV:
+		case TRT_RECV_LINE:
+			break;
+		default:
+			*errmsg = "unknown record type in trace file";
+			goto bail;
+		}
+		off++;
+
+		if (trace_get_varint(buf, len, &off, &delta) != 0 ||
+		    trace_get_varint(buf, len, &off, &dlen) != 0 ||
+		    dlen > len - off) {
+			*errmsg = "trace file is truncated";
+			goto bail;
+		}
+
+		if (t->t_nrecs == nalloc) {
+			trace_rec_t *nrecs;
+
+			nalloc = nalloc == 0 ? 64 : nalloc * 2;
+			if ((nrecs = realloc(t->t_recs, nalloc *
+			    sizeof (trace_rec_t))) == NULL) {
+				*errmsg = "could not allocate memory";
+				goto bail;
+			}
+			t->t_recs = nrecs;
+		}
+
+		tr = &t->t_recs[t->t_nrecs++];
+		tr->tr_type = type;
+		tr->tr_delta_us = delta;
+		tr->tr_data = (const char *)&buf[off];
+		tr->tr_len = (size_t)dlen;
+		off += (size_t)dlen;
+	}
+
+	return (0);
+
+bail:
+	trace_fini(t);
+	return (-1);
+}
+
+void
+trace_fini(trace_t *t)
+{
+	if (t->t_buf != NULL)
+		dynstr_free(t->t_buf);
+	free(t->t_recs);
+	bzero(t, sizeof (*t));
+}
@@ -0,0 +1,75 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Copyright (c) 2024 MNX Cloud, Inc.
+ */
+
+#ifndef _TRACE_H
+#define	_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "dynstr.h"
+
+/*
+ * If set in the environment, the name of a directory in which each process
+ * records the traffic on its connections to the metadata service, for later
+ * replay with mdata-replay.
+ */
+#define	MDATA_CAPTURE_ENV	"MDATA_CAPTURE"
+
+#define	TRACE_MAGIC		"MDATA-TRACE 1\n"
+
+typedef enum trace_type {
+	/*
+	 * A connection was made; the record holds the name of the transport
+	 * and its path, separated by a space:
+	 */
+	TRT_CONNECT = 'C',
+
+	/*
+	 * Bytes written to the connection:
+	 */
+	TRT_SEND = 'S',
+
+	/*
+	 * Bytes read from the connection, either as returned by plat_read()
+	 * or as a line returned by plat_recv(), which omits the newline:
+	 */
+	TRT_RECV = 'R',
+	TRT_RECV_LINE = 'L'
+} trace_type_t;
+
+typedef struct trace_rec {
+	trace_type_t tr_type;
+
+	/*
+	 * Microseconds since the previous record (or, for the first, since
+	 * the trace was started):
+	 */
+	uint64_t tr_delta_us;
+
+	const char *tr_data;
+	size_t tr_len;
+} trace_rec_t;
+
+typedef struct trace {
+	string_t *t_buf;
+	trace_rec_t *t_recs;
+	size_t t_nrecs;
+} trace_t;
+
+void trace_capture(trace_type_t, const char *, size_t);
+int trace_load(const char *, trace_t *, const char **);
+void trace_fini(trace_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TRACE_H */